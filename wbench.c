@@ -0,0 +1,238 @@
+#include "wbh.h"
+#include "wemu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* End-to-end benchmark: runs the library against the emulator on a
+   pseudo-terminal, so the whole I/O and parse path is measured, and
+   sweeps the emulator's response latency, line speed and K-line timing.
+   For every combination it reports the time wbh_init() takes, measurement
+   groups and DTC reads per second, the round trip of a group read (median
+   and 99th percentile) and the time a bus scan takes.  Results are printed
+   as a table; with -o they are also written one JSON object per line, to
+   be compared across releases. */
+
+#define INFO(x, y...) fprintf(stderr, "INFO " x "\n", y)
+
+/** addresses scanned */
+#define SCAN_START 0x01
+#define SCAN_END 0x40
+/** devices the default vehicle has in that range */
+#define SCAN_FOUND 3
+
+/** emulator response latencies swept (ms) */
+static const unsigned response_ms[] = { 0, 2, 10 };
+/** emulator line speeds swept: delay per response byte (µs); 1000 is
+    about the speed of a 10400 baud K-line */
+static const unsigned byte_us[] = { 0, 1000 };
+/** K-line block delay and inter-byte times swept; 0/0 means the ECU
+    answers without K-line timing */
+static const struct { uint8_t bdt, ibt; } kline[] = {
+  { 0, 0 }, { 0x0a, 0x01 }, { 0x05, 0x00 },
+};
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+/** one benchmark case */
+typedef struct {
+  unsigned response_ms;
+  unsigned byte_us;
+  uint8_t bdt, ibt;
+
+  /* results */
+  double init_ms;		/**< wbh_init() */
+  double groups_per_s;		/**< measurement group reads */
+  double dtc_per_s;		/**< DTC reads */
+  double p50_us, p99_us;	/**< group read round trip */
+  double scan_ms;		/**< scan of SCAN_START..SCAN_END */
+  int failed;
+} bench_case_t;
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+/** Read a measurement group for a while.
+    @return zero or -1 on error */
+static int bench_groups(wbh_device_t *dev, bench_case_t *c, double secs)
+{
+  wbh_measurement_t data[WBH_MAX_MEASUREMENTS];
+  size_t size = 1024, n = 0;
+  double *rtt = malloc(size * sizeof(double)), start, t, end;
+
+  if (!rtt)
+    return -1;
+  start = now();
+  end = start + secs;
+  do {
+    t = now();
+    if (wbh_read_measurements_into(dev, 1, data, WBH_MAX_MEASUREMENTS) != 4) {
+      free(rtt);
+      return -1;
+    }
+    if (n == size) {
+      double *p = realloc(rtt, (size *= 2) * sizeof(double));
+      if (!p) {
+        free(rtt);
+        return -1;
+      }
+      rtt = p;
+    }
+    rtt[n++] = (now() - t) * 1e6;
+  } while (now() < end);
+
+  c->groups_per_s = n / (now() - start);
+  qsort(rtt, n, sizeof(double), compare_double);
+  c->p50_us = rtt[n / 2];
+  c->p99_us = rtt[n * 99 / 100];
+  free(rtt);
+  return 0;
+}
+
+/** Read the trouble codes for a while.
+    @return zero or -1 on error */
+static int bench_dtc(wbh_device_t *dev, bench_case_t *c, double secs)
+{
+  wbh_dtc_t dtc[WBH_MAX_DTC];
+  double start = now();
+  long n = 0;
+
+  do {
+    if (wbh_get_dtc_into(dev, dtc, WBH_MAX_DTC) != 2)
+      return -1;
+    n++;
+  } while (now() < start + secs);
+  c->dtc_per_s = n / (now() - start);
+  return 0;
+}
+
+static void run_case(bench_case_t *c, double secs)
+{
+  wemu_opts_t opts = { .response_latency_ms = c->response_ms,
+                       .byte_latency_us = c->byte_us };
+  wemu_t *emu = wemu_new(&opts);
+  wbh_interface_t *iface = NULL;
+  wbh_device_t *dev = NULL;
+  uint8_t devices[SCAN_END - SCAN_START];
+  const char *tty;
+  char line[64];
+  double start;
+
+  c->failed = 1;
+  if (!emu)
+    return;
+  wemu_load_default(emu);
+  if (c->bdt || c->ibt) {
+    wemu_parse_line(emu, "timing 01 00 00");
+    snprintf(line, sizeof(line), "bdt %02X", c->bdt);
+    wemu_parse_line(emu, line);
+    snprintf(line, sizeof(line), "ibt %02X", c->ibt);
+    wemu_parse_line(emu, line);
+  }
+  if (!(tty = wemu_open_pty(emu)) || wemu_start(emu) < 0)
+    goto out;
+
+  start = now();
+  if (!(iface = wbh_init(tty)))
+    goto out;
+  c->init_ms = (now() - start) * 1e3;
+
+  if (!(dev = wbh_connect_ms(iface, 0x01, 5000)) ||
+      bench_groups(dev, c, secs) < 0 || bench_dtc(dev, c, secs) < 0)
+    goto out;
+  wbh_disconnect(dev);
+  dev = NULL;
+
+  start = now();
+  if (wbh_scan_devices_into(iface, SCAN_START, SCAN_END, NULL, devices,
+                            sizeof(devices)) != SCAN_FOUND)
+    goto out;
+  c->scan_ms = (now() - start) * 1e3;
+  c->failed = 0;
+
+out:
+  if (c->failed)
+    fprintf(stderr, "case failed: %s\n", wbh_get_error() ? wbh_get_error() : "emulator failed");
+  if (dev)
+    wbh_disconnect(dev);
+  if (iface)
+    wbh_shutdown(iface);
+  wemu_free(emu);
+}
+
+static void print_case(const bench_case_t *c)
+{
+  printf("%5u %6u %4X %4X %8.2f %9.1f %9.1f %9.1f %9.1f %9.1f%s\n",
+         c->response_ms, c->byte_us, c->bdt, c->ibt, c->init_ms,
+         c->groups_per_s, c->dtc_per_s, c->p50_us, c->p99_us, c->scan_ms,
+         c->failed ? " FAILED" : "");
+}
+
+static void write_case(FILE *f, const bench_case_t *c)
+{
+  fprintf(f, "{\"response_latency_ms\":%u,\"byte_latency_us\":%u,\"bdt\":%u,\"ibt\":%u,"
+          "\"init_ms\":%.3f,\"groups_per_s\":%.1f,\"dtc_per_s\":%.1f,"
+          "\"group_p50_us\":%.1f,\"group_p99_us\":%.1f,\"scan_ms\":%.3f,"
+          "\"failed\":%s}\n",
+          c->response_ms, c->byte_us, c->bdt, c->ibt, c->init_ms,
+          c->groups_per_s, c->dtc_per_s, c->p50_us, c->p99_us, c->scan_ms,
+          c->failed ? "true" : "false");
+}
+
+int main(int argc, char **argv)
+{
+  const char *output = NULL;
+  double secs = 0.5;
+  FILE *f = NULL;
+  int failed = 0, c, r, b, k;
+
+  while ((c = getopt(argc, argv, "t:o:")) != -1) {
+    switch (c) {
+      case 't': secs = atof(optarg); break;
+      case 'o': output = optarg; break;
+      default:
+        fprintf(stderr, "usage: %s [-t seconds per measurement] [-o results.jsonl]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (output && !(f = fopen(output, "w"))) {
+    perror(output);
+    return 1;
+  }
+
+  INFO("%d cases, about %.1f s each", (int)(COUNT(response_ms) * COUNT(byte_us) * COUNT(kline)),
+       2 * secs);
+  printf("%5s %6s %4s %4s %8s %9s %9s %9s %9s %9s\n", "resp", "byte", "BDT", "IBT",
+         "init ms", "groups/s", "DTC/s", "p50 us", "p99 us", "scan ms");
+  for (r = 0; r < COUNT(response_ms); r++) {
+    for (b = 0; b < COUNT(byte_us); b++) {
+      for (k = 0; k < COUNT(kline); k++) {
+        bench_case_t bc = { response_ms[r], byte_us[b], kline[k].bdt, kline[k].ibt };
+        run_case(&bc, secs);
+        print_case(&bc);
+        fflush(stdout);
+        if (f)
+          write_case(f, &bc);
+        failed |= bc.failed;
+      }
+    }
+  }
+
+  if (f && fclose(f)) {
+    perror(output);
+    return 1;
+  }
+  return failed;
+}
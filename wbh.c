@@ -1,258 +1,366 @@
 #include <stdlib.h>
-#include <fcntl.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
-#include <termios.h>
-#include <sys/ioctl.h>
 #include <math.h>
 #include "wbh.h"
+#include "wbh_priv.h"
 
-//#define DEBUG
+/** last error of the calling thread */
+static __thread const char *wbh_error = NULL;
+/** interface the last error of the calling thread occurred on */
+static __thread wbh_interface_t *wbh_error_iface = NULL;
 
-#define ERROR(f, p...) fprintf(stderr, "%s: " f, __FUNCTION__, p)
-
-static char *wbh_error = NULL;
-
-/** standard buffer size, saves us from thinking up a suitable number all
-    the time... */
-#define BUFSIZE 255
+void iface_set_error(wbh_interface_t *iface, int code, const char *msg)
+{
+  wbh_error = msg;
+  wbh_error_iface = iface;
+  if (iface) {
+    iface->error = msg;
+    iface->errcode = code;
+    iface->erroff = -1;
+    if (IFACE(iface)->metrics && code > 0 && code < WBH_METRICS_ERRORS)
+      METRIC_ADD(IFACE(iface)->metrics->errors[code], 1);
+  }
+}
 
-/** Convert carriage return to line feed.
-    @param buf data to be converted
-    @param size size of buf
+/** Record a malformed response.
+    @param iface interface the response came from
+    @param erroff position in the response where parsing failed
  */
-static void crtolf(char *buf, size_t size)
+static void parse_error(wbh_interface_t *iface, size_t erroff)
 {
-  int i;
-  for (i = 0; i < size; i++) {
-    if (buf[i] == '\r')
-      buf[i] = '\n';
-  }
+  iface_set_error(iface, ERR_DATA, "malformed response");
+  iface->erroff = erroff;
+  EVENT(iface, WBH_EV_PARSE_ERROR, erroff, NULL, 0);
 }
 
-/** Get response from serial port .
-    @param fd serial port file descriptor
-    @param buf buffer the input data will be written to
-    @param size size of buf
-    @param timeout timeout (seconds) before aborting read
-    @param expect character signaling end of transmission
-    @return number of bytes read or -1 on error
+/** Check whether a response is one of the interface's error replies.
+    @param iface interface the response came from
+    @param buf response text
+    @return zero or negative error code
  */
-static int serial_read(int fd, char *buf, size_t size, int timeout, int expect)
+static int response_error(wbh_interface_t *iface, const char *buf)
 {
-  int rc;
-  int osize = size;
-#ifdef DEBUG
-  char *obuf = buf;
-#endif
-  memset(buf, 0, size); /* just want to make sure that stale
-                           data is not misinterpreted */
-  while (size > 0) {
-    /* check if there is data to read */
-    int bytes;
-    for (; timeout > 0;) {
-      ioctl(fd, FIONREAD, &bytes);
-      if (bytes > 0) break;
-      sleep(1); timeout--;
-    }
-    if (timeout <= 0) {
-      /* read timeout */
-      wbh_error = "timeout reading from serial port";
-      return -ERR_TIMEOUT;
-    }
-    
-    rc = read(fd, buf, bytes > size ? size : bytes);
-    if (rc < 0) {
-      wbh_error = "I/O error reading from serial port";
-      return -ERR_SERIAL;
-    }
-    crtolf(buf, rc);
-    
-    size -= rc;
-    buf += rc;
-
-    /* check for end-of-transmission character */
-    if (expect && rc >= 1 && buf[-1] == expect) {
-#ifdef DEBUG
-      fprintf(stderr, "READ: %s\n", obuf);
-#endif
-      return osize - size;
-    }
+  if (buf[0] == '?') {
+    iface_set_error(iface, ERR_SYNTAX, "command not understood");
+    return -ERR_SYNTAX;
+  }
+  if (!strncmp(buf, "DATA ERROR", 10)) {
+    iface_set_error(iface, ERR_DATA, "device reported a data error");
+    return -ERR_DATA;
+  }
+  if (!strncmp(buf, "ERROR", 5)) {
+    iface_set_error(iface, ERR_DATA, "device reported an error");
+    return -ERR_DATA;
   }
+  return 0;
+}
 
-#ifdef DEBUG
-    fprintf(stderr, "READ: %s\n", obuf);
-#endif
-  return osize;
+static int command_start(wbh_request_t *req)
+{
+  result_cache_command(req->iface, req->dev, req->tx);
+  request_exchange(req, NULL, req->rx, req->rx_size, req->timeout_ms, '>');
+  return 0;
+}
+
+static void command_step(wbh_request_t *req, wbh_request_t *child, int rc)
+{
+  request_finish(req, rc);
 }
 
-/** Wait for "ready" prompt ('>').
-    @param fd serial port file descriptor
-    @param timeout timeout in seconds
-    @return number of bytes read or -1 on error
+/** Prepare a request that sends a command and collects the response.
+    @param req request
+    @param cmd command string, without carriage return
+    @param data response buffer, NULL to use the request's own
+    @param size size of data
+    @param timeout_ms time to wait for the response
+    @return zero or negative error code
  */
-static int wait_for_prompt(int fd, int timeout)
+static int command_request(wbh_request_t *req, const char *cmd, char *data,
+                           size_t size, int timeout_ms)
 {
-  char buf[BUFSIZE];
-  return serial_read(fd, buf, BUFSIZE, timeout, '>');
+  int len = snprintf(req->tx, BUFSIZE, "%s\r", cmd);
+  if (len >= BUFSIZE) {
+    iface_set_error(req->iface, ERR_INVAL, "command too long");
+    return -ERR_INVAL;
+  }
+  req->tx_len = len;
+  req->rx = data ? data : req->rxbuf;
+  req->rx_size = data ? size : BUFSIZE;
+  req->timeout_ms = timeout_ms;
+  req->start = command_start;
+  req->step = command_step;
+  return 0;
 }
 
-/** Send command to serial port.
-    @param fd serial port file descriptor
-    @param buf command buffer
-    @param size size of buf
-    @return number of bytes written or -1 on error
+/** Send a command and wait for the response.
+    @param iface WBH interface handle
+    @param cmd command string, without carriage return
+    @param data response buffer
+    @param size size of data
+    @param timeout_ms time to wait for the response
+    @return number of bytes read or negative error code
  */
-static int serial_write(int fd, char *buf, size_t size)
+static int command_sync(wbh_interface_t *iface, const char *cmd, char *data,
+                        size_t size, int timeout_ms)
 {
+  wbh_request_t req;
   int rc;
-  rc = write(fd, buf, size);
-#ifdef DEBUG
-  char *buf2 = malloc(size);
-  memcpy(buf2, buf, size);
-  crtolf(buf2, size);
-  fprintf(stderr, "WRITE: -%s- (%zd/%d)\n", buf2, size, rc);
-  free(buf2);
-#endif
-  return rc;
+  request_init(&req, iface, NULL);
+  if ((rc = command_request(&req, cmd, data, size, timeout_ms)) < 0)
+    return rc;
+  request_submit(&req);
+  return request_wait(&req);
 }
 
-wbh_interface_t *wbh_init(const char *tty)
+wbh_interface_t *wbh_init_transport(const wbh_transport_t *transport, void *priv,
+                                    int fd, const char *name)
 {
   char buf[2048];
-  wbh_interface_t *handle = calloc(1, sizeof(wbh_interface_t));
-  if (!handle) {
-    wbh_error = "wbh_init: calloc() failed";
-    return NULL;
-  }
-  
-  handle->fd = open(tty, O_RDWR|O_NOCTTY|O_NDELAY);
-  if (handle->fd < 0) {
-    wbh_error = "failed to open TTY";
+  wbh_interface_t *handle = calloc(1, sizeof(iface_t));
+  wbh_metrics_t *metrics = calloc(1, sizeof(wbh_metrics_t));
+  if (!handle || !metrics) {
+    free(handle);
+    free(metrics);
+    transport->close(priv);
+    iface_set_error(NULL, ERR_INVAL, "wbh_init: calloc() failed");
     return NULL;
   }
-  
-  fcntl(handle->fd, F_SETFL, 0);	/* return immediately even if no data to read */
-  
-  /* put TTY in raw mode */
-  struct termios tio;
-  tcgetattr(handle->fd, &tio);
-  cfmakeraw(&tio);
-  tcsetattr(handle->fd, TCSANOW, &tio);
-  
-  tcflush(handle->fd, TCIOFLUSH);	/* flush stale serial buffers */
-    
-  serial_write(handle->fd, "\r", 1);
-  serial_read(handle->fd, buf, 2048, 60, '>');
+  handle->erroff = -1;
+  handle->fd = fd;
+  IFACE(handle)->transport = transport;
+  IFACE(handle)->transport_priv = priv;
+  IFACE(handle)->hangup_flush = 1;
+  IFACE(handle)->metrics = metrics;
+
+  command_sync(handle, "", buf, 2048, 60000);
   
   /* try to elicit an identifying response from WBH interface */
   int i;
   for (i = 0; i < 5; i++) {
-    serial_write(handle->fd, "ATI\r", 4);
-    serial_read(handle->fd, buf, 255, 150, '>');
+    if (i)
+      METRIC_ADD(metrics->cmd[WBH_CMD_ADAPTER].retries, 1);
+    command_sync(handle, "ATI", buf, 255, 150000);
     if (!strncmp("WBH-Diag", buf, 8))
       break;
   }
   if (i == 5) {
     ERROR("no response to ATI: %s", buf);
-    close(handle->fd);
+    transport->close(priv);
+    free(metrics);
     free(handle);
-    wbh_error = "no response to ATI";
+    iface_set_error(NULL, ERR_TIMEOUT, "no response to ATI");
     return NULL;
   }
   
-  handle->name = strdup(tty);
+  handle->name = strdup(name);
   
   return handle;
 }
 
 int wbh_shutdown(wbh_interface_t *iface)
 {
-  close(iface->fd);
+  wbh_cancel_requests(iface);
+  wbh_capture_stop(iface);
+  IFACE(iface)->transport->close(IFACE(iface)->transport_priv);
   free(iface->name);
+  free(IFACE(iface)->metrics);
+  events_free(iface);
+  result_cache_free(iface);
   free(iface);
   return 0;
 }
 
 wbh_device_t *wbh_connect(wbh_interface_t *iface, uint8_t device)
+{
+  return wbh_connect_ms(iface, device, CONNECT_TIMEOUT);
+}
+
+/** connect request states */
+enum {
+  CONN_DIAL,	/**< waiting for the connection */
+  CONN_ABORT,	/**< aborting a dial that timed out */
+  CONN_DRAIN,	/**< discarding what is left of the aborted dial */
+};
+
+static int connect_start(wbh_request_t *req)
 {
   char cmd[10];
-  char *buf = calloc(1, BUFSIZE);
-  if (!buf) {
-    wbh_error = "wbh_connect: calloc() failed";
-    return NULL;
-  }
-  int rc;
-  
   /* dial M for murder^Wmotor */
-  sprintf(cmd, "ATD%02X\r", device);
-  serial_write(iface->fd, cmd, strlen(cmd));
-
+  sprintf(cmd, "ATD%02X", req->arg);
+  req->state = CONN_DIAL;
   /* see if we could connect; takes a while, hence the long timeout */
-  rc = serial_read(iface->fd, buf, BUFSIZE, 100, '>');
+  request_exchange(req, cmd, NULL, 0, req->timeout_ms, '>');
+  return 0;
+}
+
+static void connect_step(wbh_request_t *req, wbh_request_t *child, int rc)
+{
+  wbh_interface_t *iface = req->iface;
+  uint8_t device = req->arg;
+  char *buf = req->rxbuf;
+
+  switch (req->state) {
+    case CONN_ABORT:
+      req->state = CONN_DRAIN;
+      request_drain(req, 20);
+      return;
+    case CONN_DRAIN:
+      IFACE(iface)->transport->flush(IFACE(iface)->transport_priv, WBH_FLUSH_RX);
+      iface_set_error(iface, ERR_TIMEOUT, "failed to connect to device");
+      request_finish(req, -ERR_TIMEOUT);
+      return;
+  }
+
   if (rc < 0) {
     ERROR("failed to connect to device %02X, error code %d: %s\n", device, -rc, buf);
-    wbh_error = "failed to connect to device";
-    goto error;
+    if (rc == -ERR_TIMEOUT) {
+      /* Abort the dial the interface is still busy with. Any character
+         sent to the interface cancels the operation in progress; whatever
+         it still sends after that is discarded. */
+      req->state = CONN_ABORT;
+      request_exchange(req, "", NULL, 0, 2000, '>');
+      return;
+    }
+    iface_set_error(iface, -rc, "failed to connect to device");
+    request_finish(req, rc);
+    return;
   }
   
   /* check for error conditions */
   if (strncmp("ERROR", buf, 5) == 0) {
     ERROR("received ERROR connecting to device %02X\n", device);
-    wbh_error = "received \"ERROR\" trying to connect to device";
-    goto error;
+    iface_set_error(iface, ERR_DATA, "received \"ERROR\" trying to connect to device");
+    request_finish(req, -ERR_DATA);
+    return;
   }
   if (strncmp("CONNECT: ", buf, 9) != 0) {
     ERROR("unexpected response when connecting to device %02X: %s\n", device, buf);
-    wbh_error = "unexpected response when connecting to device";
-    goto error;
+    iface_set_error(iface, ERR_DATA, "unexpected response when connecting to device");
+    request_finish(req, -ERR_DATA);
+    return;
   }
   
   /* successful, fill in the device structure */
   wbh_device_t *handle = calloc(1, sizeof(wbh_device_t));
-  if (!handle) {
-    wbh_error = "wbh_connect: calloc() failed";
-    goto error;
+  char *specs = strdup(buf);
+  if (!handle || !specs) {
+    free(handle);
+    free(specs);
+    iface_set_error(iface, ERR_INVAL, "wbh_connect: calloc() failed");
+    request_finish(req, -ERR_INVAL);
+    return;
   }
   handle->baudrate = buf[9] - '0';
   handle->protocol = buf[11] - '0';
-  handle->specs = buf;
+  handle->specs = specs;
   handle->iface = iface;
   handle->id = device;
-  return handle;
+  req->device = handle;
+  if (IFACE(iface)->result_cache) {
+    /* the connect response carries the identification */
+    char ident[BUFSIZE];
+    wbh_result_cache_invalidate(iface, WBH_RESULT_DTC, device);
+    device_identity(handle, ident, BUFSIZE);
+    result_cache_put_ident(iface, device, ident);
+  }
+  request_finish(req, 0);
+}
+
+void connect_request(wbh_request_t *req, uint8_t device, int timeout_ms)
+{
+  req->arg = device;
+  req->timeout_ms = timeout_ms;
+  req->start = connect_start;
+  req->step = connect_step;
+}
 
-error:
-  free(buf);
-  return NULL;
+wbh_device_t *wbh_connect_ms(wbh_interface_t *iface, uint8_t device,
+                             int timeout_ms)
+{
+  wbh_request_t req;
+  wbh_device_t *dev = NULL;
+  request_init(&req, iface, NULL);
+  connect_request(&req, device, timeout_ms);
+  request_submit(&req);
+  if (request_wait(&req) == 0)
+    dev = wbh_request_device(&req);
+  request_release(&req);
+  return dev;
 }
 
-int wbh_disconnect(wbh_device_t *dev)
+wbh_request_t *wbh_submit_connect(wbh_interface_t *iface, uint8_t device,
+                                  int timeout_ms, wbh_request_cb_t cb, void *ctx)
+{
+  wbh_request_t *req = request_new(iface, NULL, cb, ctx);
+  if (!req)
+    return NULL;
+  connect_request(req, device, timeout_ms);
+  request_submit(req);
+  return req;
+}
+
+static int disconnect_start(wbh_request_t *req)
 {
-  int rc;
   /* hang up and flush serial buffers */
-  serial_write(dev->iface->fd, "ATH\r", 4);
-  if ((rc = wait_for_prompt(dev->iface->fd, 10)) < 0) {
+  request_exchange(req, "ATH", NULL, 0, 10000, '>');
+  return 0;
+}
+
+static void disconnect_step(wbh_request_t *req, wbh_request_t *child, int rc)
+{
+  wbh_device_t *dev = req->dev;
+  if (rc < 0) {
     ERROR("error %d while disconnecting from device %02X\n", -rc, dev->id);
-    return rc;
+    request_finish(req, rc);
+    return;
   }
-  tcflush(dev->iface->fd, TCIOFLUSH);
+  if (IFACE(dev->iface)->hangup_flush)
+    IFACE(dev->iface)->transport->flush(IFACE(dev->iface)->transport_priv, WBH_FLUSH_RX | WBH_FLUSH_TX);
   
   /* free device handle */
   free((void *)(dev->specs));
   free(dev);
+  req->dev = NULL;
   
-  return 0;
+  request_finish(req, 0);
+}
+
+void disconnect_request(wbh_request_t *req)
+{
+  req->start = disconnect_start;
+  req->step = disconnect_step;
+}
+
+int wbh_disconnect(wbh_device_t *dev)
+{
+  wbh_request_t req;
+  request_init(&req, dev->iface, dev);
+  disconnect_request(&req);
+  request_submit(&req);
+  return request_wait(&req);
+}
+
+wbh_request_t *wbh_submit_disconnect(wbh_device_t *dev, wbh_request_cb_t cb,
+                                     void *ctx)
+{
+  wbh_request_t *req = request_new(dev->iface, dev, cb, ctx);
+  if (!req)
+    return NULL;
+  disconnect_request(req);
+  request_submit(req);
+  return req;
 }
 
 int wbh_reset(wbh_interface_t *iface)
 {
+  char buf[BUFSIZE];
   int rc;
   
   /* send ATZ */
-  serial_write(iface->fd, "ATZ\r", 4);
-  if ((rc = wait_for_prompt(iface->fd, 10)) < 0) {
+  if ((rc = command_sync(iface, "ATZ", buf, BUFSIZE, 10000)) < 0) {
     ERROR("error %d while resetting interface %s\n", -rc, iface->name);
     return rc;
   }
@@ -262,22 +370,23 @@ int wbh_reset(wbh_interface_t *iface)
 int wbh_send_command(wbh_device_t *dev, char *cmd, char *data,
                      size_t data_size, int timeout)
 {
+  return wbh_send_command_ms(dev, cmd, data, data_size, timeout * 1000);
+}
+
+int wbh_send_command_ms(wbh_device_t *dev, char *cmd, char *data,
+                        size_t data_size, int timeout_ms)
+{
+  wbh_request_t req;
   int rc;
   
-  /* send command plus carriage return */
-  rc = serial_write(dev->iface->fd, cmd, strlen(cmd));
-  if (rc < 0)
+  /* send command plus carriage return, read response */
+  request_init(&req, dev->iface, dev);
+  if ((rc = command_request(&req, cmd, data, data_size, timeout_ms)) < 0)
     return rc;
-  rc = serial_write(dev->iface->fd, "\r", 1);
-  if (rc < 0)
+  request_submit(&req);
+  if ((rc = request_wait(&req)) < 0)
     return rc;
   
-  /* read response */
-  rc = serial_read(dev->iface->fd, data, data_size, timeout, '>');
-  if (rc < 0)
-    return rc;
-  crtolf(data, rc);
-  
   /* clip trailing '>' */
   if (rc > 0 && data [rc - 1] == '>')
     data[rc - 1] = 0;
@@ -285,48 +394,212 @@ int wbh_send_command(wbh_device_t *dev, char *cmd, char *data,
   return rc;
 }
 
-int wbh_get_analog(wbh_interface_t *iface, uint8_t pin)
+wbh_request_t *wbh_submit_command(wbh_device_t *dev, const char *cmd,
+                                  int timeout_ms, wbh_request_cb_t cb, void *ctx)
 {
-  char buf[BUFSIZE];
-  int rc;
+  wbh_request_t *req = request_new(dev->iface, dev, cb, ctx);
+  if (!req)
+    return NULL;
+  if (command_request(req, cmd, NULL, 0, timeout_ms) < 0) {
+    free(req);
+    return NULL;
+  }
+  request_submit(req);
+  return req;
+}
 
-  /* pins 0..5 are valid */
-  if (pin > 5) {
-    wbh_error = "invalid analog pin";
-    return -ERR_INVAL;
+/** state of a batch request */
+typedef struct {
+  wbh_batch_cmd_t *cmds;	/**< commands, owned by the caller */
+  int count;			/**< number of commands */
+  int next;			/**< command being sent */
+  int ok;			/**< commands answered without error */
+} batch_op_t;
+
+/** Send the current command of a batch. */
+static void batch_send(wbh_request_t *req)
+{
+  batch_op_t *op = req->op;
+  wbh_batch_cmd_t *c = &op->cmds[op->next];
+  result_cache_command(req->iface, req->dev, c->cmd);
+  request_exchange(req, c->cmd, c->response, c->size, c->timeout_ms, '>');
+}
+
+static int batch_start(wbh_request_t *req)
+{
+  batch_send(req);
+  return 0;
+}
+
+static void batch_step(wbh_request_t *req, wbh_request_t *child, int rc)
+{
+  batch_op_t *op = req->op;
+  wbh_batch_cmd_t *c = &op->cmds[op->next];
+  int i, err;
+
+  if (rc > 0 && c->response[rc - 1] == '>') {
+    /* clip trailing '>', as wbh_send_command() does */
+    c->response[rc - 1] = 0;
+    if ((err = response_error(req->iface, c->response)) < 0)
+      rc = err;
   }
+  c->status = rc;
+  if (rc >= 0)
+    op->ok++;
 
-  sprintf(buf, "ATA%d\r", pin);
-  serial_write(iface->fd, buf, strlen(buf));
+  if (rc == -ERR_TIMEOUT || rc == -ERR_SERIAL) {
+    /* the adapter is still busy or gone; don't send the rest */
+    for (i = op->next + 1; i < op->count; i++)
+      op->cmds[i].status = rc;
+    request_finish(req, op->ok);
+    return;
+  }
+  if (++op->next == op->count) {
+    request_finish(req, op->ok);
+    return;
+  }
+  /* straight on with the next command, no trip back to the caller */
+  batch_send(req);
+}
 
-  rc = serial_read(iface->fd, buf, BUFSIZE, 3, '>');
-  if (rc < 0)
-    return rc;
-  
-  return atoi(buf);	/* FIXME: untested, is this really a decimal value? */
+static void batch_cleanup(wbh_request_t *req)
+{
+  free(req->op);
+  req->op = NULL;
 }
 
-/** get BDT or IBT as desired */
-static int wbh_get_xxt(wbh_interface_t *iface, const char *which_t)
+/** Prepare a batch request.
+    @return zero or negative error code
+ */
+static int batch_request(wbh_request_t *req, wbh_batch_cmd_t *cmds, int count)
 {
-  char buf[BUFSIZE];
+  batch_op_t *op;
+  int i;
+
+  if (count <= 0) {
+    iface_set_error(req->iface, ERR_INVAL, "invalid batch parameters");
+    return -ERR_INVAL;
+  }
+  for (i = 0; i < count; i++) {
+    if (!cmds[i].response || cmds[i].size < 2 || strlen(cmds[i].cmd) >= BUFSIZE - 1) {
+      iface_set_error(req->iface, ERR_INVAL, "invalid batch command");
+      return -ERR_INVAL;
+    }
+  }
+  op = calloc(1, sizeof(batch_op_t));
+  if (!op) {
+    iface_set_error(req->iface, ERR_INVAL, "batch_request: calloc() failed");
+    return -ERR_INVAL;
+  }
+  for (i = 0; i < count; i++)
+    cmds[i].status = -ERR_SERIAL;	/* not sent (yet) */
+  op->cmds = cmds;
+  op->count = count;
+  req->op = op;
+  req->start = batch_start;
+  req->step = batch_step;
+  req->cleanup = batch_cleanup;
+  return 0;
+}
+
+int wbh_send_batch(wbh_device_t *dev, wbh_batch_cmd_t *cmds, int count)
+{
+  wbh_request_t req;
   int rc;
-  sprintf(buf, "AT%s?\r", which_t);
-  serial_write(iface->fd, buf, strlen(buf));
-  rc = serial_read(iface->fd, buf, BUFSIZE, 3, '>');
-  if (rc < 0)
+  request_init(&req, dev->iface, dev);
+  if ((rc = batch_request(&req, cmds, count)) < 0)
     return rc;
-  
-  return strtol(buf, NULL, 16);	/* FIXME: untested, is this really a hex value? */
+  request_submit(&req);
+  rc = request_wait(&req);
+  request_release(&req);
+  return rc;
+}
+
+wbh_request_t *wbh_submit_batch(wbh_device_t *dev, wbh_batch_cmd_t *cmds, int count,
+                                wbh_request_cb_t cb, void *ctx)
+{
+  wbh_request_t *req = request_new(dev->iface, dev, cb, ctx);
+  if (!req)
+    return NULL;
+  if (batch_request(req, cmds, count) < 0) {
+    free(req);
+    return NULL;
+  }
+  request_submit(req);
+  return req;
+}
+
+static int value_start(wbh_request_t *req)
+{
+  int value = result_cache_get_value(req->iface, req->state, req->arg);
+  if (value >= 0) {
+    request_finish(req, value);
+    return 0;
+  }
+  request_exchange(req, NULL, NULL, 0, 3000, '>');
+  return 0;
+}
+
+static void value_step(wbh_request_t *req, wbh_request_t *child, int rc)
+{
+  char *end;
+  long value;
+
+  if (rc < 0) {
+    request_finish(req, rc);
+    return;
+  }
+  if (req->state == WBH_RESULT_TIMING)
+    value = strtol(req->rxbuf, &end, 16);	/* FIXME: untested, is this really a hex value? */
+  else
+    value = strtol(req->rxbuf, &end, 10);	/* FIXME: untested, is this really a decimal value? */
+  /* only keep what looks like an answer, not "?" */
+  if (end != req->rxbuf)
+    result_cache_put_value(req->iface, req->state, req->arg, value);
+  request_finish(req, value);
+}
+
+/** Read an adapter value, through the result cache.
+    @param iface WBH interface handle
+    @param kind WBH_RESULT_TIMING or WBH_RESULT_ANALOG
+    @param key RESULT_BDT or RESULT_IBT, or analog pin
+    @param cmd command querying the value
+    @return value or negative error code
+ */
+static int value_sync(wbh_interface_t *iface, int kind, int key, const char *cmd)
+{
+  wbh_request_t req;
+  request_init(&req, iface, NULL);
+  req.tx_len = snprintf(req.tx, BUFSIZE, "%s\r", cmd);
+  req.state = kind;
+  req.arg = key;
+  req.start = value_start;
+  req.step = value_step;
+  request_submit(&req);
+  return request_wait(&req);
+}
+
+int wbh_get_analog(wbh_interface_t *iface, uint8_t pin)
+{
+  char buf[BUFSIZE];
+
+  /* pins 0..5 are valid */
+  if (pin > 5) {
+    iface_set_error(iface, ERR_INVAL, "invalid analog pin");
+    return -ERR_INVAL;
+  }
+
+  sprintf(buf, "ATA%d", pin);
+  return value_sync(iface, WBH_RESULT_ANALOG, pin, buf);
 }
 
 int wbh_get_bdt(wbh_interface_t *iface)
 {
-  return wbh_get_xxt(iface, "BDT");
+  return value_sync(iface, WBH_RESULT_TIMING, RESULT_BDT, "ATBDT?");
 }
 int wbh_get_ibt(wbh_interface_t *iface)
 {
-  return wbh_get_xxt(iface, "IBT");
+  return value_sync(iface, WBH_RESULT_TIMING, RESULT_IBT, "ATIBT?");
 }
 
 /** set BDT or IBT as desired */
@@ -334,9 +607,8 @@ static int wbh_set_xxt (wbh_interface_t *iface, uint8_t xxt, const char *which_t
 {
   char buf[BUFSIZE];
   int rc;
-  sprintf(buf, "AT%s%02X\r", which_t, xxt);
-  serial_write(iface->fd, buf, strlen(buf));
-  if ((rc = wait_for_prompt(iface->fd, 3)) < 0)
+  sprintf(buf, "AT%s%02X", which_t, xxt);
+  if ((rc = command_sync(iface, buf, buf, BUFSIZE, 3000)) < 0)
     return rc;
   return 0;
 }
@@ -355,93 +627,196 @@ const char *wbh_get_error(void)
   return wbh_error;
 }
 
+wbh_interface_t *wbh_get_error_iface(void)
+{
+  return wbh_error_iface;
+}
+
+const char *wbh_iface_error(wbh_interface_t *iface)
+{
+  return iface->error;
+}
+
+int wbh_iface_errcode(wbh_interface_t *iface)
+{
+  return iface->errcode;
+}
+
+void wbh_iface_clear_error(wbh_interface_t *iface)
+{
+  iface->error = NULL;
+  iface->errcode = 0;
+  iface->erroff = -1;
+}
+
+int wbh_iface_error_offset(wbh_interface_t *iface)
+{
+  return iface->erroff;
+}
+
+void wbh_set_decode_cache(wbh_interface_t *iface, wbh_decode_cache_t *cache)
+{
+  IFACE(iface)->decode_cache = cache;
+}
+
 int wbh_force_baud_rate(wbh_interface_t *iface, wbh_baudrate_t baudrate)
 {
   char buf[BUFSIZE];
   int rc;
   if (baudrate < BAUD_AUTO || baudrate > BAUD_10400) {
-    wbh_error = "invalid baud rate";
+    iface_set_error(iface, ERR_INVAL, "invalid baud rate");
     return -ERR_INVAL;
   }
-  sprintf(buf, "ATN%d\r", baudrate);
-  serial_write(iface->fd, buf, strlen(buf));
-  if ((rc = wait_for_prompt(iface->fd, 3)) < 0) {
+  sprintf(buf, "ATN%d", baudrate);
+  if ((rc = command_sync(iface, buf, buf, BUFSIZE, 3000)) < 0) {
     return rc;
   }
   return 0;
 }
 
-wbh_dtc_t *wbh_get_dtc(wbh_device_t *dev)
+static int dtc_start(wbh_request_t *req)
 {
-  char buf[BUFSIZE];
+  int count = result_cache_get_dtc(req->iface, req->dev->id, req->dtc);
+  if (count >= 0) {
+    req->count = count;
+    memset(&req->dtc[count], 0, sizeof(wbh_dtc_t));
+    request_finish(req, count);
+    return 0;
+  }
+  request_exchange(req, "02", NULL, 0, 100000, '>');
+  return 0;
+}
+
+static void dtc_step(wbh_request_t *req, wbh_request_t *child, int rc)
+{
+  size_t erroff;
+  if (rc < 0 || (rc = response_error(req->iface, req->rxbuf)) < 0) {
+    request_finish(req, rc);
+    return;
+  }
+  rc = wbh_parse_dtc(req->rxbuf, req->rx_len, req->dtc, WBH_MAX_DTC, &erroff);
+  if (rc < 0) {
+    parse_error(req->iface, erroff);
+    request_finish(req, rc);
+    return;
+  }
+  req->count = rc < WBH_MAX_DTC ? rc : WBH_MAX_DTC;
+  req->dtc[req->count].error_code = 0;
+  req->dtc[req->count].status_code = 0;
+  result_cache_put_dtc(req->iface, req->dev->id, req->dtc, req->count);
+  request_finish(req, req->count);
+}
+
+/** Prepare a request reading the DTC list. */
+static void dtc_request(wbh_request_t *req)
+{
+  req->start = dtc_start;
+  req->step = dtc_step;
+}
+
+int wbh_get_dtc_into(wbh_device_t *dev, wbh_dtc_t *dtc, int max)
+{
+  wbh_request_t req;
   int rc;
-  serial_write(dev->iface->fd, "02\r", 3);
-  if ((rc = serial_read(dev->iface->fd, buf, BUFSIZE, 100, '>')) < 0)
+  request_init(&req, dev->iface, dev);
+  dtc_request(&req);
+  request_submit(&req);
+  if ((rc = request_wait(&req)) < 0)
+    return rc;
+  memcpy(dtc, req.dtc, (rc < max ? rc : max) * sizeof(wbh_dtc_t));
+  return rc;
+}
+
+wbh_dtc_t *wbh_get_dtc(wbh_device_t *dev)
+{
+  wbh_dtc_t *list = malloc((WBH_MAX_DTC + 1) * sizeof(wbh_dtc_t));
+  int count;
+  if (!list) {
+    iface_set_error(dev->iface, ERR_INVAL, "wbh_get_dtc: malloc() failed");
+    return NULL;
+  }
+  if ((count = wbh_get_dtc_into(dev, list, WBH_MAX_DTC)) < 0) {
+    free(list);
     return NULL;
-  uint16_t error;
-  uint8_t status;
-  wbh_dtc_t *list = NULL;
-  int list_size = 0;
-  char *bbuf = buf;
-  while (sscanf(bbuf, "%04hX %02hhX\n", &error, &status) == 2) {
-    list = realloc(list, (list_size + 1) * sizeof(wbh_dtc_t));
-    list[list_size].error_code = error;
-    list[list_size].status_code = status;
-    list_size++;
-    bbuf += 8;
-  }
-  list = realloc(list, (list_size + 1) * sizeof(wbh_dtc_t));
-  list[list_size].error_code = 0;
-  list[list_size].status_code = 0;
+  }
+  memset(&list[count], 0, sizeof(wbh_dtc_t));
   return list;
 }
 
+wbh_request_t *wbh_submit_get_dtc(wbh_device_t *dev, wbh_request_cb_t cb, void *ctx)
+{
+  wbh_request_t *req = request_new(dev->iface, dev, cb, ctx);
+  if (!req)
+    return NULL;
+  dtc_request(req);
+  request_submit(req);
+  return req;
+}
+
 void wbh_free_dtc(wbh_dtc_t *dtc)
 {
   free(dtc);
 }
 
-uint8_t *wbh_scan_devices(wbh_interface_t *iface, uint8_t start, uint8_t end)
-{
-  uint8_t i;
-  uint8_t *devices = NULL;
-  int device_count = 0;
-  for (i = start; i != end; i++) {
-#ifdef DEBUG
-    fprintf(stderr, "trying device %02X... ", i);
-#endif
-    wbh_device_t *dev;
-    dev = wbh_connect(iface, i);
-    if (dev) {
-#ifdef DEBUG
-      fprintf(stderr, "success!\n");
-#endif
-      devices = realloc(devices, device_count + 1);
-      devices[device_count] = i;
-      device_count++;
-      wbh_disconnect(dev);
-    }
-#ifdef DEBUG
-    else {
-      fprintf(stderr, "failed\n");
-    }
-#endif
+static int ident_start(wbh_request_t *req)
+{
+  int len = result_cache_get_ident(req->iface, req->dev->id, req->rxbuf);
+  if (len >= 0) {
+    request_finish(req, len);
+    return 0;
   }
-  devices = realloc(devices, device_count + 1);
-  devices[device_count] = 0;
-  return devices;
+  request_exchange(req, "00", NULL, 0, 30000, '>');
+  return 0;
+}
+
+static void ident_step(wbh_request_t *req, wbh_request_t *child, int rc)
+{
+  if (rc < 0 || (rc = response_error(req->iface, req->rxbuf)) < 0) {
+    request_finish(req, rc);
+    return;
+  }
+  /* clip the prompt and line ends */
+  while (req->rx_len && strchr("\n> ", req->rxbuf[req->rx_len - 1]))
+    req->rxbuf[--req->rx_len] = 0;
+  result_cache_put_ident(req->iface, req->dev->id, req->rxbuf);
+  request_finish(req, req->rx_len);
+}
+
+/** Prepare a request reading the controller identification. */
+static void ident_request(wbh_request_t *req)
+{
+  req->start = ident_start;
+  req->step = ident_step;
+}
+
+int wbh_get_ident(wbh_device_t *dev, char *ident, size_t size)
+{
+  wbh_request_t req;
+  int rc;
+  request_init(&req, dev->iface, dev);
+  ident_request(&req);
+  request_submit(&req);
+  if ((rc = request_wait(&req)) < 0)
+    return rc;
+  snprintf(ident, size, "%s", req.rxbuf);
+  return rc;
 }
 
-void wbh_free_devices(uint8_t *devices)
+wbh_request_t *wbh_submit_get_ident(wbh_device_t *dev, wbh_request_cb_t cb, void *ctx)
 {
-  free(devices);
+  wbh_request_t *req = request_new(dev->iface, dev, cb, ctx);
+  if (!req)
+    return NULL;
+  ident_request(req);
+  request_submit(req);
+  return req;
 }
 
 int wbh_actuator_diagnosis(wbh_device_t *dev)
 {
   char buf[BUFSIZE];
   int rc;
-  if ((rc = wbh_send_command(dev, "03", buf, BUFSIZE, 30)) < 0)
+  if ((rc = wbh_send_command_ms(dev, "03", buf, BUFSIZE, 30000)) < 0)
     return rc;
   if (!strncmp("END", buf, 3))
     return 0;
@@ -464,182 +839,333 @@ static void form_ ## name (uint8_t a, uint8_t b, wbh_measurement_t *data, uint8_
 
 /* The various formulas as defined int the WBH-Diag Pro datasheet */
 def_form(unknown, 0, UNIT_UNKNOWN)
-def_form(1, .2 * a * b, UNIT_RPM)
-def_form(2, a * .002 * b, UNIT_PERCENT)
-def_form(3, .002 * a * b, UNIT_DEG)
-def_form(4, fabs(b - 127.0) * .01 * a, UNIT_UNKNOWN /* FIXME */)
-def_form(5, a * (b - 100.0) * .1, UNIT_CELSIUS)
-def_form(6, .001 * a * b, UNIT_VOLT)
-def_form(7, .01 * a * b, UNIT_KMH)
-def_form(8, .1 * a * b, UNIT_NONE)
-def_form(9, (b - 127.0) * .02 * a, UNIT_DEG)
-def_form(10, b, UNIT_NONE /* FIXME: "cold"/"warm" */)
-def_form(11, .0001 * a * (b - 128.0) + 1, UNIT_NONE)
-def_form(12, .001 * a * b, UNIT_OHM)
-def_form(13, (b - 127.0) * .001 * a, UNIT_MILLIMETER)
-def_form(14, .005 * a * b, UNIT_BAR)
-def_form(15, .01 * a * b, UNIT_MILLISECOND)
-def_form(16, 0, UNIT_BITFIELD)
-def_form(17, 0, UNIT_CHARS)
-def_form(18, .04 * a * b, UNIT_MILLIBAR)
-def_form(19, a * b * .01, UNIT_LITER)
-def_form(20, a * (b - 128.0) / 128.0, UNIT_PERCENT)
-def_form(21, .001 * a * b, UNIT_VOLT)
-def_form(22, .001 * a * b, UNIT_MILLISECOND)
-def_form(23, b / 256.0 * a, UNIT_PERCENT)
-def_form(24, .001 * a * b, UNIT_AMPERE)
-def_form(25, b * 1.421 + a / 182.0, UNIT_UNKNOWN /* FIXME: g/s? */)
-def_form(26, b - a, UNIT_UNKNOWN /* FIXME: celsius? coulomb? */)
-def_form(27, fabs(b - 128.0) * .01 * a, UNIT_UNKNOWN /* FIXME: ATDC/BTDC? */)
-def_form(28, b - a, UNIT_NONE)
-def_form(29, b < a, UNIT_UNKNOWN /* FIXME: 1./2. Kennfeld? */)
-def_form(30, b / 12.0 * a, UNIT_DEG_KW)
-def_form(31, b / 2560.0 * a, UNIT_CELSIUS)
-def_form(32, (b > 128) ? (b - 256.0) : b, UNIT_NONE)
-def_form(33, a == 0 ? (100.0 * b) : (100.0 * b) / a, UNIT_PERCENT)
-def_form(34, (b - 128.0) * .01 * a, UNIT_KW)
-def_form(35, .01 * a * b, UNIT_LITERS_PER_HOUR)
-def_form(36, a * 2560.0 + b * 10.0, UNIT_KM)
-def_form(38, (b - 128.0) * .001 * a, UNIT_DEG_KW)
-def_form(39, b / 256.0 * a, UNIT_MILLIGRAMS_PER_HOUR)
-def_form(40, b * .01 + (25.5 * a) - 400, UNIT_AMPERE)
-def_form(41, b + a * 255.0, UNIT_AMPERE_HOUR)
-def_form(42, b * .1 + (25.5 * a) - 400, UNIT_UNKNOWN /* FIXME: Kw == kW? */)
-def_form(43, b * .1 + (25.5 * a), UNIT_VOLT)
-def_form(44, 0, UNIT_TIME)
-def_form(45, .1 * a * b / 100.0, UNIT_NONE)
-def_form(46, (a * b - 3200.0) * .0027, UNIT_DEG_KW)
-def_form(47, (b - 128.0) * a, UNIT_MILLISECOND)
-def_form(48, b + a * 255.0, UNIT_NONE)
-def_form(49, (b / 4.0) * .1 * a, UNIT_MILLIGRAMS_PER_HOUR)
-def_form(50, a == 0 ? (b - 128.0) / .01 : (b - 128.0) / (.01 * a), UNIT_MILLIBAR)
-def_form(51, ((b - 128.0) / 255.0) * a, UNIT_MILLIGRAMS_PER_HOUR)
-def_form(52, b * .02 * a - a, UNIT_NM)
-def_form(53, (b - 128.0) * 1.4222 + .006 * a, UNIT_GS)
-def_form(54, a * 256.0 + b, UNIT_NONE)
-def_form(55, a * b / 200.0, UNIT_SECOND)
-def_form(56, a * 256.0 + b, UNIT_UNKNOWN /* FIXME: WSC? */)
-def_form(57, a * 256.0 + b + 65536.0, UNIT_UNKNOWN /* FIXME: WSC? */)
-def_form(58, b > 128 ? 1.0225 * (256.0 - b) : 1.0225 * b, UNIT_UNKNOWN /* FIXME: \s? */)
-def_form(59, (a * 256.0 + b) / 32768.0, UNIT_NONE)
-def_form(60, (a * 256.0 + b) * .01, UNIT_SECOND)
-def_form(61, a == 0 ? (b - 128.0) : (b - 128.0) / a, UNIT_NONE)
-def_form(62, .256 * a * b, UNIT_UNKNOWN /* FIXME: (capital) S? */)
-def_form(63, 0, UNIT_CHARS /* FIXME: with a question mark? */)
-def_form(64, a + b, UNIT_OHM)
-def_form(65, .01 * a * (b - 127.0), UNIT_MILLIMETER)
-def_form(66, (a * b) / 511.12, UNIT_VOLT)
-def_form(67, (640.0 * a) + b * 2.5, UNIT_DEG)
-def_form(68, (256.0 * a + b) / 7.365, UNIT_DEG_PER_SECOND)
-def_form(69, (256.0 * a + b) * .3254, UNIT_BAR)
-def_form(70, (256.0 * a + b) * .192, UNIT_METERS_PER_SECOND_SQUARED)
+#define FORMULA(name, formula, eunit) def_form(name, formula, eunit)
+#include "wbh_formulas.h"
+#undef FORMULA
 
 #undef def_form
 
 /** array of implementations of the various formulas */
 static formula_func_t formulas[] = {
-  form_unknown,
-  form_1,
-  form_2,
-  form_3,
-  form_4,
-  form_5,
-  form_6,
-  form_7,
-  form_8,
-  form_9,
-  form_10,
-  form_11,
-  form_12,
-  form_13,
-  form_14,
-  form_15,
-  form_16,
-  form_17,
-  form_18,
-  form_19,
-  form_20,
-  form_21,
-  form_22,
-  form_23,
-  form_24,
-  form_25,
-  form_26,
-  form_27,
-  form_28,
-  form_29,
-  form_30,
-  form_31,
-  form_32,
-  form_33,
-  form_34,
-  form_35,
-  form_36,
-  form_unknown,
-  form_38,
-  form_39,
-  form_40,
-  form_41,
-  form_42,
-  form_43,
-  form_44,
-  form_45,
-  form_46,
-  form_47,
-  form_48,
-  form_49,
-  form_50,
-  form_51,
-  form_52,
-  form_53,
-  form_54,
-  form_55,
-  form_56,
-  form_57,
-  form_58,
-  form_59,
-  form_60,
-  form_61,
-  form_62,
-  form_63,
-  form_64,
-  form_65,
-  form_66,
-  form_67,
-  form_68,
-  form_69,
-  form_70,
+  [0] = form_unknown,
+  [37] = form_unknown,
+#define FORMULA(name, formula, eunit) [name] = form_ ## name,
+#include "wbh_formulas.h"
+#undef FORMULA
 };
 
-wbh_measurement_t *wbh_read_measurements(wbh_device_t *dev, uint8_t group)
+void wbh_decode_measurement(const wbh_raw_measurement_t *raw, wbh_measurement_t *data)
 {
-  wbh_measurement_t *data = NULL;
-  int data_count = 0;
-  char buf[BUFSIZE];
+  uint8_t formula = raw->formula;
+  if (formula < sizeof(formulas) / sizeof(formula_func_t))
+    formulas[formula](raw->a, raw->b, data, formula);
+  else
+    form_unknown(raw->a, raw->b, data, formula);
+}
+
+int parse_raw_measurements(wbh_interface_t *iface, const char *buf, size_t len,
+                           wbh_raw_measurement_t *raw, int max)
+{
+  size_t erroff;
+  int count;
+  if ((count = response_error(iface, buf)) < 0)
+    return count;
+  if (buf[0] > '4') {
+    iface_set_error(iface, ERR_DATA, "parsing of this device's response not implemented yet");
+    return -ERR_DATA;
+  }
+  if (max > WBH_MAX_MEASUREMENTS)
+    max = WBH_MAX_MEASUREMENTS;
+  count = wbh_parse_measurements(buf, len, raw, max, &erroff);
+  if (count < 0) {
+    parse_error(iface, erroff);
+    return count;
+  }
+  return count > max ? max : count;
+}
+
+int parse_measurements(wbh_interface_t *iface, uint8_t group, const char *buf,
+                       size_t len, wbh_measurement_t *data, int max)
+{
+  wbh_raw_measurement_t raw[WBH_MAX_MEASUREMENTS];
+  int count, i;
+  if ((count = parse_raw_measurements(iface, buf, len, raw, max)) < 0)
+    return count;
+  if (IFACE(iface)->decode_cache)
+    wbh_decode_cached_group(IFACE(iface)->decode_cache, group, raw, count, data);
+  else {
+    for (i = 0; i < count; i++)
+      wbh_decode_measurement(&raw[i], &data[i]);
+  }
+  return count;
+}
+
+static int measurement_start(wbh_request_t *req)
+{
+  char cmd[5];
+  sprintf(cmd, "08%02X", req->arg);
+  request_exchange(req, cmd, NULL, 0, 30000, '>');
+  return 0;
+}
+
+static void measurement_step(wbh_request_t *req, wbh_request_t *child, int rc)
+{
+  if (rc < 0) {
+    request_finish(req, rc);
+    return;
+  }
+  rc = parse_measurements(req->iface, req->arg, req->rxbuf, req->rx_len, req->data,
+                          WBH_MAX_MEASUREMENTS);
+  if (rc < 0) {
+    request_finish(req, rc);
+    return;
+  }
+  req->count = rc;
+  memset(&req->data[rc], 0, sizeof(wbh_measurement_t));
+  request_finish(req, rc);
+}
+
+/** Prepare a request reading a measurement group. */
+static void measurement_request(wbh_request_t *req, uint8_t group)
+{
+  req->arg = group;
+  req->start = measurement_start;
+  req->step = measurement_step;
+}
+
+int wbh_read_measurements_into(wbh_device_t *dev, uint8_t group,
+                               wbh_measurement_t *data, int max)
+{
+  wbh_request_t req;
   int rc;
-  sprintf(buf, "08%02X", group);
-  if ((rc = wbh_send_command(dev, buf, buf, BUFSIZE, 30)) < 0)
+  request_init(&req, dev->iface, dev);
+  measurement_request(&req, group);
+  request_submit(&req);
+  if ((rc = request_wait(&req)) < 0)
+    return rc;
+  memcpy(data, req.data, (rc < max ? rc : max) * sizeof(wbh_measurement_t));
+  return rc;
+}
+
+wbh_measurement_t *wbh_read_measurements(wbh_device_t *dev, uint8_t group)
+{
+  wbh_measurement_t *data = malloc((WBH_MAX_MEASUREMENTS + 1) * sizeof(wbh_measurement_t));
+  int count;
+  if (!data) {
+    iface_set_error(dev->iface, ERR_INVAL, "wbh_read_measurements: malloc() failed");
     return NULL;
-  if (buf[0] > '4') {
-    wbh_error = "parsing of this device's response not implemented yet";
+  }
+  if ((count = wbh_read_measurements_into(dev, group, data, WBH_MAX_MEASUREMENTS)) < 0) {
+    free(data);
     return NULL;
   }
-  char *bbuf = buf;
-  uint8_t formula, a, b;
-  while (sscanf(bbuf, "%02hhX %02hhX %02hhX\n", &formula, &a, &b) == 3) {
-    data = realloc(data, (data_count + 1) * sizeof(wbh_measurement_t));
-    if (formula < sizeof(formulas) / sizeof(formula_func_t))
-      formulas[formula](a, b, &data[data_count], formula);
-    else
-      form_unknown(a, b, &data[data_count], formula);
-    data_count++;
-    bbuf += 9;
-  }
-  data = realloc(data, (data_count + 1) * sizeof(wbh_measurement_t));
-  memset(&data[data_count], 0, sizeof(wbh_measurement_t));
+  memset(&data[count], 0, sizeof(wbh_measurement_t));
   return data;
 }
 
+void wbh_free_measurements(wbh_measurement_t *data)
+{
+  free(data);
+}
+
+wbh_request_t *wbh_submit_read_measurements(wbh_device_t *dev, uint8_t group,
+                                            wbh_request_cb_t cb, void *ctx)
+{
+  wbh_request_t *req = request_new(dev->iface, dev, cb, ctx);
+  if (!req)
+    return NULL;
+  measurement_request(req, group);
+  request_submit(req);
+  return req;
+}
+
+/** state of a streaming request */
+typedef struct {
+  uint8_t *groups;		/**< groups to cycle through */
+  int group_count;
+  int next;			/**< index of the group requested next */
+  char buf[2][BUFSIZE];		/**< response buffers, one being received
+                                     while the other is decoded */
+  int cur;			/**< buffer receiving the outstanding response */
+  int stopping;			/**< draining the last request in flight */
+  int samples;			/**< callbacks made so far */
+  int error;			/**< error to report once drained */
+  wbh_stream_cb_t cb;
+  wbh_delta_t *delta;		/**< change detector, if streaming changes */
+  wbh_change_cb_t change_cb;
+  wbh_change_t changes[WBH_MAX_MEASUREMENTS];
+  void *ctx;
+} stream_op_t;
+
+/** Request the next group of the stream into the current buffer. */
+static void stream_next(wbh_request_t *req)
+{
+  stream_op_t *op = req->op;
+  char cmd[5];
+  sprintf(cmd, "08%02X", op->groups[op->next]);
+  request_exchange(req, cmd, op->buf[op->cur], BUFSIZE, 30000, '>');
+}
+
+static int stream_start(wbh_request_t *req)
+{
+  stream_next(req);
+  return 0;
+}
+
+static void stream_step(wbh_request_t *req, wbh_request_t *child, int rc)
+{
+  stream_op_t *op = req->op;
+  wbh_measurement_t *data = req->data;
+
+  if (rc < 0) {
+    request_finish(req, rc);
+    return;
+  }
+  if (op->stopping) {
+    /* the request in flight has been drained */
+    request_finish(req, op->error ? op->error : op->samples);
+    return;
+  }
+
+  /* the line is idle now; get the next request going before spending any
+     time on decoding the one we just received */
+  const char *buf = op->buf[op->cur];
+  int group = op->groups[op->next];
+  op->next = (op->next + 1) % op->group_count;
+  op->cur = !op->cur;
+  stream_next(req);
+
+  if (op->delta) {
+    wbh_raw_measurement_t raw[WBH_MAX_MEASUREMENTS];
+    int keyframe, count;
+    if ((count = parse_raw_measurements(req->iface, buf, rc, raw, WBH_MAX_MEASUREMENTS)) < 0 ||
+        (count = delta_apply(op->delta, IFACE(req->iface)->decode_cache, group, raw, count,
+                             op->changes, &keyframe)) < 0) {
+      op->stopping = 1;
+      op->error = count;
+      return;
+    }
+    op->samples++;
+    if (op->change_cb(req->dev, group, op->changes, count, keyframe, op->ctx))
+      op->stopping = 1;
+    return;
+  }
+
+  int count = parse_measurements(req->iface, group, buf, rc, data, WBH_MAX_MEASUREMENTS);
+  if (count < 0) {
+    op->stopping = 1;
+    op->error = count;
+    return;
+  }
+  memset(&data[count], 0, sizeof(wbh_measurement_t));
+  req->count = count;
+  op->samples++;
+  if (op->cb(req->dev, group, data, count, op->ctx))
+    op->stopping = 1;
+}
+
+static void stream_cleanup(wbh_request_t *req)
+{
+  stream_op_t *op = req->op;
+  free(op->groups);
+  free(op);
+  req->op = NULL;
+}
+
+/** Prepare a streaming request.
+    @return zero or negative error code
+ */
+static int stream_request(wbh_request_t *req, const uint8_t *groups,
+                          int group_count, wbh_stream_cb_t cb,
+                          wbh_delta_t *delta, wbh_change_cb_t change_cb, void *ctx)
+{
+  stream_op_t *op;
+  if (group_count <= 0 || (delta ? !change_cb : !cb)) {
+    iface_set_error(req->iface, ERR_INVAL, "invalid stream parameters");
+    return -ERR_INVAL;
+  }
+  op = calloc(1, sizeof(stream_op_t));
+  if (!op || !(op->groups = malloc(group_count))) {
+    free(op);
+    iface_set_error(req->iface, ERR_INVAL, "stream_request: malloc() failed");
+    return -ERR_INVAL;
+  }
+  memcpy(op->groups, groups, group_count);
+  op->group_count = group_count;
+  op->cb = cb;
+  op->delta = delta;
+  op->change_cb = change_cb;
+  op->ctx = ctx;
+  req->op = op;
+  req->start = stream_start;
+  req->step = stream_step;
+  req->cleanup = stream_cleanup;
+  return 0;
+}
+
+int wbh_stream_measurements(wbh_device_t *dev, const uint8_t *groups,
+                            int group_count, wbh_stream_cb_t cb, void *ctx)
+{
+  wbh_request_t req;
+  int rc;
+  request_init(&req, dev->iface, dev);
+  if ((rc = stream_request(&req, groups, group_count, cb, NULL, NULL, ctx)) < 0)
+    return rc;
+  request_submit(&req);
+  rc = request_wait(&req);
+  request_release(&req);
+  return rc;
+}
+
+wbh_request_t *wbh_submit_stream_measurements(wbh_device_t *dev,
+                                              const uint8_t *groups,
+                                              int group_count,
+                                              wbh_stream_cb_t scb,
+                                              wbh_request_cb_t cb, void *ctx)
+{
+  wbh_request_t *req = request_new(dev->iface, dev, cb, ctx);
+  if (!req)
+    return NULL;
+  if (stream_request(req, groups, group_count, scb, NULL, NULL, ctx) < 0) {
+    free(req);
+    return NULL;
+  }
+  request_submit(req);
+  return req;
+}
+
+int wbh_stream_changes(wbh_device_t *dev, const uint8_t *groups,
+                       int group_count, wbh_delta_t *delta,
+                       wbh_change_cb_t cb, void *ctx)
+{
+  wbh_request_t req;
+  int rc;
+  request_init(&req, dev->iface, dev);
+  if ((rc = stream_request(&req, groups, group_count, NULL, delta, cb, ctx)) < 0)
+    return rc;
+  request_submit(&req);
+  rc = request_wait(&req);
+  request_release(&req);
+  return rc;
+}
+
+wbh_request_t *wbh_submit_stream_changes(wbh_device_t *dev,
+                                         const uint8_t *groups,
+                                         int group_count, wbh_delta_t *delta,
+                                         wbh_change_cb_t scb,
+                                         wbh_request_cb_t cb, void *ctx)
+{
+  wbh_request_t *req = request_new(dev->iface, dev, cb, ctx);
+  if (!req)
+    return NULL;
+  if (stream_request(req, groups, group_count, NULL, delta, scb, ctx) < 0) {
+    free(req);
+    return NULL;
+  }
+  request_submit(req);
+  return req;
+}
+
 /** human-readable names of units */
 static const char *unit_names[] = {
   [UNIT_ENDOFLIST] = "(end of list)",
@@ -1,4 +1,8 @@
+#ifndef WBH_H
+#define WBH_H
+
 #include <stdint.h>
+#include <stdio.h>
 #include <unistd.h>
 
 #ifdef __cplusplus
@@ -20,10 +24,47 @@ typedef enum {
   PROT_KW2000,     /**< KW2000 (aka KW2089) */
 } wbh_protocol_t;
 
-/** WBH interface state */
+/** asynchronous operation (opaque), see wbh_process() */
+typedef struct wbh_request wbh_request_t;
+
+/** transport queues, see wbh_transport_t.flush */
+enum {
+  WBH_FLUSH_RX = 1,	/**< data received but not read */
+  WBH_FLUSH_TX = 2,	/**< data written but not sent */
+};
+
+/** transport operations
+    A transport carries the bytes between the library and the adapter; the
+    default is the serial port opened by wbh_init().  Every operation gets
+    the private data passed to wbh_init_transport().
+ */
+typedef struct {
+  /** read up to size bytes; must not block, but fail with errno set to
+      EAGAIN if nothing is available */
+  ssize_t (*read)(void *priv, void *buf, size_t size);
+  /** write up to size bytes; must not block, but fail with errno set to
+      EAGAIN or write less if the data cannot be taken yet */
+  ssize_t (*write)(void *priv, const void *buf, size_t size);
+  /** discard pending data in the given queues (WBH_FLUSH_*) */
+  void (*flush)(void *priv, int queues);
+  /** release the transport */
+  void (*close)(void *priv);
+} wbh_transport_t;
+
+/** WBH interface state
+    Distinct interfaces may be used from different threads at the same
+    time; a single interface must only be used by one thread at a time.
+    Only the library creates interfaces, and keeps more state of its own
+    behind the fields below.
+ */
 typedef struct {
-  int fd;		/**< serial device file descriptor */
+  int fd;		/**< file descriptor to poll, -1 if the transport is
+                             always ready */
   char *name;	/**< serial device file name */
+  const char *error;	/**< description of the last error on this interface */
+  int errcode;		/**< code (ERR_*) of the last error on this interface */
+  int erroff;		/**< position in the response where parsing failed
+                             with the last error, -1 if not applicable */
 } wbh_interface_t;
 
 /** Baud rates */
@@ -77,11 +118,165 @@ int wbh_get_ibt(wbh_interface_t *iface);
  */
 int wbh_set_ibt(wbh_interface_t *iface, uint8_t ibt);
 
+/** timing tuner options */
+typedef struct {
+  uint8_t group;		/**< measurement group to read, 0 for group 1 */
+  int samples;			/**< reads per setting, 0 for 5 */
+  int margin;			/**< added to the shortest stable times (ms),
+				     up to the initial ones */
+  const char *cache_path;	/**< key file of settings found per ECU, NULL
+				     to disable */
+} wbh_tune_opts_t;
+
+/** timing tuner result */
+typedef struct {
+  uint8_t bdt, ibt;		/**< settings chosen (ms) */
+  uint8_t initial_bdt, initial_ibt;	/**< settings found (ms) */
+  double latency_ms;		/**< mean group read time at bdt/ibt (ms) */
+  double initial_latency_ms;	/**< mean group read time before tuning
+				     (ms), 0 if a cached setting was used */
+  int reads;			/**< group reads made */
+  int errors;			/**< group reads that failed */
+  int cached;			/**< setting came from the cache file */
+} wbh_tune_result_t;
+
+/** find the shortest block delay and inter-byte times a device copes with
+    Reads a measurement group repeatedly while stepping BDT, then IBT,
+    down from their current values, and sets the shortest ones at which
+    every read succeeded; reads that time out or fail mark a setting as
+    unstable, and the line is recovered before the next one is tried.
+    With a cache file, a setting found for the same
+    ECU before is only confirmed.  On failure, the initial times are
+    restored.
+    @param dev diagnostic device handle
+    @param opts tuning options, NULL for the defaults
+    @param result receives the outcome
+    @return zero or negative error code
+ */
+int wbh_autotune(wbh_device_t *dev, const wbh_tune_opts_t *opts,
+                 wbh_tune_result_t *result);
+
 /** initialize WBH interface
     @param tty serial device name
     @return WBH interface handle or NULL on error
  */
 wbh_interface_t *wbh_init(const char *tty);
+
+/** flow control, see wbh_init_opts_t */
+enum {
+  WBH_FLOW_NONE = 0,	/**< no flow control */
+  WBH_FLOW_RTSCTS,	/**< hardware flow control */
+  WBH_FLOW_XONXOFF,	/**< software flow control */
+};
+
+/** low latency mode, see wbh_init_opts_t */
+enum {
+  WBH_LOW_LATENCY_OFF = 0,	/**< leave the driver setting alone */
+  WBH_LOW_LATENCY_TRY,		/**< enable if the driver supports it */
+  WBH_LOW_LATENCY_REQUIRE,	/**< fail if the driver does not support it */
+};
+
+/** when to discard pending serial data, see wbh_init_opts_t */
+enum {
+  WBH_FLUSH_ON_OPEN = 1,	/**< when the port is opened */
+  WBH_FLUSH_ON_HANGUP = 2,	/**< after disconnecting from a device */
+  WBH_FLUSH_NEVER = 4,		/**< neither */
+};
+
+/** serial port settings
+    All-zero is what wbh_init() does: the port is put in raw mode at the
+    speed it is set to, without flow control, and flushed when opened and
+    after every hang-up.
+ */
+typedef struct {
+  int baud;		/**< host baud rate (e.g. 115200), 0 to leave as is */
+  uint8_t vmin;		/**< VMIN, 0 for 1 if vtime is 0 as well; values
+			     above 1 are taken as 1, since the library polls
+			     the port and poll() would not report a reply
+			     shorter than VMIN bytes */
+  uint8_t vtime;	/**< VTIME (1/10 s), as vmin */
+  int low_latency;	/**< WBH_LOW_LATENCY_*: ask the driver to pass on
+			     received data at once (Linux ASYNC_LOW_LATENCY);
+			     USB serial converters otherwise add several ms
+			     to every response */
+  int flow;		/**< WBH_FLOW_* */
+  int flush;		/**< WBH_FLUSH_* flags, 0 for ON_OPEN | ON_HANGUP */
+} wbh_init_opts_t;
+
+/** initialize WBH interface, with serial port settings
+    @param tty serial device name
+    @param opts serial port settings, NULL for the behavior of wbh_init()
+    @return WBH interface handle or NULL on error
+ */
+wbh_interface_t *wbh_init_opts(const char *tty, const wbh_init_opts_t *opts);
+
+/** initialize a WBH interface attached through a custom transport
+    Performs the same handshake as wbh_init().
+    @param transport transport operations
+    @param priv transport private data; the transport is closed when the
+                interface is shut down or if initialization fails
+    @param fd file descriptor that becomes readable or writable when the
+              transport does, or -1 if the transport never has to be
+              waited for
+    @param name name of the interface, for messages
+    @return WBH interface handle or NULL on error
+ */
+wbh_interface_t *wbh_init_transport(const wbh_transport_t *transport, void *priv,
+                                    int fd, const char *name);
+
+/** script for the in-memory transport (opaque)
+    The in-memory transport stands in for an adapter: it answers every
+    command with the response scripted for it, without any system calls.
+    The script is searched from the entry after the last one used, so a
+    recorded session replays in order while a script with one entry per
+    command answers any sequence of them.  Unknown commands are answered
+    with "?", ATI with an identification if the script has none.
+ */
+typedef struct wbh_memory wbh_memory_t;
+
+/** in-memory transport operations, private data is a wbh_memory_t */
+extern const wbh_transport_t wbh_memory_transport;
+
+/** create an empty script for the in-memory transport
+    @return script handle or NULL on error
+ */
+wbh_memory_t *wbh_memory_new(void);
+
+/** free a script
+    Must not be used by an interface any more.
+    @param mem script handle, may be NULL
+ */
+void wbh_memory_free(wbh_memory_t *mem);
+
+/** add an exchange to a script
+    @param mem script handle
+    @param cmd command, without the carriage return
+    @param response response as the adapter sends it, usually lines ending
+                    in a carriage return followed by ">"
+    @return zero or negative error code
+ */
+int wbh_memory_add(wbh_memory_t *mem, const char *cmd, const char *response);
+
+/** add the exchanges recorded in a trace to a script, see
+    wbh_capture_start()
+    @param mem script handle
+    @param path trace file name
+    @return number of exchanges added or negative error code
+ */
+int wbh_memory_load_trace(wbh_memory_t *mem, const char *path);
+
+/** number of commands that were not in the script
+    @param mem script handle
+    @return count, not counting empty commands
+ */
+unsigned long wbh_memory_unmatched(wbh_memory_t *mem);
+
+/** initialize a WBH interface on the in-memory transport
+    The script is not freed when the interface is shut down.
+    @param mem script handle
+    @return WBH interface handle or NULL on error
+ */
+wbh_interface_t *wbh_init_memory(wbh_memory_t *mem);
 /** shut down WBH interface
     @param iface WBH interface handle
     @return zero or negative error code
@@ -94,6 +289,14 @@ int wbh_shutdown(wbh_interface_t* iface);
     @return WBH device handle or NULL on error
  */
 wbh_device_t *wbh_connect(wbh_interface_t *iface, uint8_t device);
+/** connect to diagnostic device, millisecond timeout
+    @param iface WBH interface handle
+    @param device device ID
+    @param timeout_ms time to wait for the connection to be established (ms)
+    @return WBH device handle or NULL on error
+ */
+wbh_device_t *wbh_connect_ms(wbh_interface_t *iface, uint8_t device,
+                             int timeout_ms);
 /** disconnect from diagnostic device
     @param dev WBH device handle
     @return zero or negative error code
@@ -118,34 +321,129 @@ int wbh_reset(wbh_interface_t *iface);
     @param cmd command string
     @param data response buffer
     @param data_size size of response buffer
-    @param timeout time to wait for data
+    @param timeout time to wait for data (seconds)
     @return bytes read or negative error code
  */
 int wbh_send_command(wbh_device_t *dev, char *cmd, char *data,
                      size_t data_size, int timeout);
+/** send a custom command to the diagnostic device, millisecond timeout
+    @param dev diagnostic device handle
+    @param cmd command string
+    @param data response buffer
+    @param data_size size of response buffer
+    @param timeout_ms time to wait for data (ms)
+    @return bytes read or negative error code
+ */
+int wbh_send_command_ms(wbh_device_t *dev, char *cmd, char *data,
+                        size_t data_size, int timeout_ms);
+
+/** command of a batch, see wbh_send_batch() */
+typedef struct {
+  const char *cmd;		/**< command string */
+  char *response;		/**< response buffer */
+  size_t size;			/**< size of response, at least 2 */
+  int timeout_ms;		/**< time to wait for the response (ms) */
+  int status;			/**< set to the number of bytes read, or a
+				     negative error code: -ERR_SYNTAX or
+				     -ERR_DATA if the adapter answered with an
+				     error, -ERR_TIMEOUT or -ERR_SERIAL if it
+				     failed, or was not sent because one
+				     before it failed */
+} wbh_batch_cmd_t;
+
+/** send several commands to a diagnostic device, one after the other
+    Each command is sent as soon as the response to the previous one is
+    complete, without returning to the caller in between.  Responses are
+    stored as by wbh_send_command_ms().  An error reply does not stop the
+    batch; a timeout or I/O error does, as the adapter is then in no state
+    to take more commands.
+    @param dev diagnostic device handle
+    @param cmds commands; status is filled in for every one
+    @param count number of elements in cmds
+    @return number of commands answered without error, or negative error
+            code if the batch could not be started
+ */
+int wbh_send_batch(wbh_device_t *dev, wbh_batch_cmd_t *cmds, int count);
 
 /** retrieve a human-readable description of the last error
+    The last error is tracked per thread.
     @return error string
  */
 const char *wbh_get_error(void);
 
+/** retrieve the interface the calling thread's last error occurred on
+    @return WBH interface handle, NULL if the error was not tied to an
+            interface (e.g. a failed wbh_init())
+ */
+wbh_interface_t *wbh_get_error_iface(void);
+
+/** retrieve a human-readable description of the last error on an interface
+    @param iface WBH interface handle
+    @return error string, NULL if there was no error
+ */
+const char *wbh_iface_error(wbh_interface_t *iface);
+
+/** retrieve the code of the last error on an interface
+    @param iface WBH interface handle
+    @return error code (ERR_*), zero if there was no error
+ */
+int wbh_iface_errcode(wbh_interface_t *iface);
+
+/** forget the last error on an interface
+    @param iface WBH interface handle
+ */
+void wbh_iface_clear_error(wbh_interface_t *iface);
+
+/** retrieve where a malformed response failed to parse
+    @param iface WBH interface handle
+    @return offset into the response of the first character that did not
+            fit, -1 if the last error was not a parse error
+ */
+int wbh_iface_error_offset(wbh_interface_t *iface);
+
 /** diagnostic trouble code (DTC) structure */
 typedef struct {
   uint16_t error_code;	/**< error code */
   uint8_t status_code;	/**< status code (cause of error) */
 } wbh_dtc_t;
 
+/** most DTCs a device can report in one response */
+#define WBH_MAX_DTC 31
+
 /** retrieve diagnostic error code (DTC) list
     @param dev diagnostic device handle
     @return pointer to wbh_error_code array, NULL on error
  */
 wbh_dtc_t *wbh_get_dtc(wbh_device_t *dev);
 
+/** retrieve diagnostic error code (DTC) list into a caller-provided array
+    Like snprintf(), returns the number of DTCs the device reported even if
+    that is more than fit into dtc; only the first max of them are stored.
+    No terminating entry is written.  An array of WBH_MAX_DTC elements is
+    always large enough.
+    @param dev diagnostic device handle
+    @param dtc array receiving the DTCs
+    @param max number of elements in dtc
+    @return number of DTCs reported or negative error code
+ */
+int wbh_get_dtc_into(wbh_device_t *dev, wbh_dtc_t *dtc, int max);
+
 /** free DTC array
     @param dtc pointer to DTC array
  */
 void wbh_free_dtc(wbh_dtc_t *dtc);
 
+/** read the controller identification (command 00)
+    The text is what the device sends after the connect parameters in
+    wbh_device_t.specs; with a result cache (wbh_result_cache_enable()),
+    it is taken from the connect response without another exchange.
+    @param dev diagnostic device handle
+    @param ident buffer receiving the identification, NUL-terminated
+    @param size size of ident
+    @return length of the identification or negative error code
+ */
+int wbh_get_ident(wbh_device_t *dev, char *ident, size_t size);
+
 /** scan for devices
     Scans for active devices by trying to connect to them one by one.
     @param iface WBH interface handle
@@ -155,6 +453,48 @@ void wbh_free_dtc(wbh_dtc_t *dtc);
  */
 uint8_t *wbh_scan_devices(wbh_interface_t *iface, uint8_t start, uint8_t end);
 
+/** device scan options */
+typedef struct {
+  int probe_timeout_ms;		/**< time to wait for an unknown address to
+                                     answer (ms), 0 for the wbh_connect()
+                                     default */
+  int verify_timeout_ms;	/**< time to wait for an address known from
+                                     the cache (ms), 0 for the default */
+  int likely_first;		/**< probe well-known VAG controller
+                                     addresses before all others */
+  const char *cache_path;	/**< scan cache file, NULL to disable */
+} wbh_scan_opts_t;
+
+/** scan for devices, with options
+    Like wbh_scan_devices(), but absent addresses can be given up on
+    quickly and the addresses of common controllers can be probed first.
+    With a cache file, the first device that answers identifies the
+    vehicle; if it was scanned before, only the addresses found back then
+    are verified.
+    @param iface WBH interface handle
+    @param start first device ID to scan
+    @param end device ID after the last one to scan
+    @param opts scan options, NULL for the behavior of wbh_scan_devices()
+    @return zero-terminated array of active device IDs in ascending order
+ */
+uint8_t *wbh_scan_devices_opts(wbh_interface_t *iface, uint8_t start, uint8_t end,
+                               const wbh_scan_opts_t *opts);
+
+/** scan for devices into a caller-provided array
+    Like snprintf(), returns the number of active devices found even if
+    that is more than fit into devices; only the first max of them (in
+    ascending order) are stored.  No terminating zero is written.
+    @param iface WBH interface handle
+    @param start first device ID to scan
+    @param end device ID after the last one to scan
+    @param opts scan options, NULL for the behavior of wbh_scan_devices()
+    @param devices array receiving the device IDs
+    @param max number of elements in devices
+    @return number of active devices or negative error code
+ */
+int wbh_scan_devices_into(wbh_interface_t *iface, uint8_t start, uint8_t end,
+                          const wbh_scan_opts_t *opts, uint8_t *devices, int max);
+
 /** free scanned devices array
     @param devices pointer to device array
  */
@@ -208,8 +548,1210 @@ typedef struct {
   uint8_t raw[3];	/**< raw data used to calculate the value */
 } wbh_measurement_t;
 
+/** undecoded measurement as sent by the device */
+typedef struct {
+  uint8_t formula;	/**< formula number */
+  uint8_t a;		/**< first value byte */
+  uint8_t b;		/**< second value byte */
+} wbh_raw_measurement_t;
+
+/** most measurements a device can report for one group */
+#define WBH_MAX_MEASUREMENTS 28
+
+/** read a measurement group
+    @param dev diagnostic device handle
+    @param group measurement group
+    @return array of measurements terminated by an UNIT_ENDOFLIST entry, to
+            be released with wbh_free_measurements(); NULL on error
+ */
 wbh_measurement_t *wbh_read_measurements(wbh_device_t *dev, uint8_t group);
 
+/** read a measurement group into a caller-provided array
+    Like snprintf(), returns the number of measurements the device reported
+    even if that is more than fit into data; only the first max of them
+    are stored.  No terminating entry is written.  An array of
+    WBH_MAX_MEASUREMENTS elements is always large enough.
+    @param dev diagnostic device handle
+    @param group measurement group
+    @param data array receiving the measurements
+    @param max number of elements in data
+    @return number of measurements reported or negative error code
+ */
+int wbh_read_measurements_into(wbh_device_t *dev, uint8_t group,
+                               wbh_measurement_t *data, int max);
+
+/** free measurement array
+    @param data pointer to measurement array
+ */
+void wbh_free_measurements(wbh_measurement_t *data);
+
+/** parse a DTC list response
+    The response consists of one "XXXX YY" line (error code, status code
+    in hex) per DTC.  Fields may be separated by any number of blanks,
+    lines may end in LF, CR or CRLF, and parsing stops at the '>' prompt,
+    a NUL character or after len characters.  Like snprintf(), returns the
+    number of DTCs in the response even if only the first max are stored.
+    @param text response text
+    @param len length of text
+    @param dtc array receiving the DTCs
+    @param max number of elements in dtc
+    @param erroff receives the offset of the first offending character if
+                  the response is malformed, may be NULL
+    @return number of DTCs or -ERR_DATA if the response is malformed
+ */
+int wbh_parse_dtc(const char *text, size_t len, wbh_dtc_t *dtc, int max,
+                  size_t *erroff);
+
+/** parse a measurement group response
+    Like wbh_parse_dtc(), for responses of one "FF AA BB" line (formula,
+    value bytes in hex) per measurement.  The values are not decoded.
+    @param text response text
+    @param len length of text
+    @param raw array receiving the measurements
+    @param max number of elements in raw
+    @param erroff receives the offset of the first offending character if
+                  the response is malformed, may be NULL
+    @return number of measurements or -ERR_DATA if the response is malformed
+ */
+int wbh_parse_measurements(const char *text, size_t len,
+                           wbh_raw_measurement_t *raw, int max, size_t *erroff);
+
+/** decode a raw measurement
+    @param raw measurement as sent by the device
+    @param data receives the decoded measurement
+ */
+void wbh_decode_measurement(const wbh_raw_measurement_t *raw, wbh_measurement_t *data);
+
+/** decode many raw measurements at once
+    Produces the same values as wbh_decode_measurement(), bit for bit, but
+    writes them to separate value and unit arrays.  Large inputs, such as
+    archived logs, decode considerably faster if they use a single formula
+    or mix formulas in no particular order; a short repeating pattern of
+    formulas decodes about as fast as with wbh_decode_measurement().
+    @param raw measurements as sent by the device
+    @param count number of elements in raw
+    @param values array of count elements receiving the values
+    @param units array of count elements receiving the units, may be NULL
+ */
+void wbh_decode_batch(const wbh_raw_measurement_t *raw, size_t count,
+                      float *values, wbh_unit_t *units);
+
+/** cache of measurement lookup tables (opaque)
+    Within a measurement group, a channel's formula and first value byte
+    (a) hardly ever change; only the second byte (b) does.  The cache keeps
+    a 256-entry table of values for each (formula, a) pair, filled in as
+    values are decoded, so repeated readings are decoded with a lookup.  A
+    cache must only be used by one thread at a time.
+
+    Interfaces decode without a cache unless one is set with
+    wbh_set_decode_cache().  Where floating point is cheap, a group read
+    in fixed order decodes about as fast without the cache, since the
+    branches on the formula predict well; the cache pays off when groups
+    of different shapes are mixed, and on CPUs that do floating point in
+    software.  It should hold a table for every channel read: a smaller
+    cache keeps part of them and decodes the rest without a table, which
+    is slower than no cache at all.  Measure with wmicrobench before
+    turning it on.
+ */
+typedef struct wbh_decode_cache wbh_decode_cache_t;
+
+/** default number of tables in a decode cache (1 KB each) */
+#define WBH_DECODE_CACHE_DEFAULT 64
+
+/** decode cache statistics */
+typedef struct {
+  unsigned long hits;		/**< values found in a table */
+  unsigned long misses;		/**< values that had to be computed */
+  unsigned long evictions;	/**< tables dropped to make room */
+  int tables;			/**< tables currently held */
+} wbh_decode_cache_stats_t;
+
+/** create a decode cache
+    @param max_tables most tables kept; a table not used for a while is
+                      recycled when another is needed.  0 for the default.
+    @return cache handle or NULL on error
+ */
+wbh_decode_cache_t *wbh_decode_cache_new(int max_tables);
+
+/** destroy a decode cache
+    @param cache cache handle, may be NULL
+ */
+void wbh_decode_cache_free(wbh_decode_cache_t *cache);
+
+/** decode a raw measurement through a cache
+    Gives the same result as wbh_decode_measurement().
+    @param cache cache handle
+    @param raw measurement as sent by the device
+    @param data receives the decoded measurement
+ */
+void wbh_decode_cached(wbh_decode_cache_t *cache, const wbh_raw_measurement_t *raw,
+                       wbh_measurement_t *data);
+
+/** decode a measurement group through a cache
+    The cache remembers the table each channel of the group used last, so
+    a group read again is decoded without searching for tables.  Gives the
+    same result as wbh_decode_measurement() on each element.
+    @param cache cache handle
+    @param group measurement group the values were read from
+    @param raw measurements as sent by the device
+    @param count number of elements in raw, at most WBH_MAX_MEASUREMENTS
+    @param data array of count elements receiving the decoded measurements
+ */
+void wbh_decode_cached_group(wbh_decode_cache_t *cache, uint8_t group,
+                             const wbh_raw_measurement_t *raw, int count,
+                             wbh_measurement_t *data);
+
+/** retrieve decode cache statistics
+    @param cache cache handle
+    @param stats receives the statistics
+ */
+void wbh_decode_cache_get_stats(wbh_decode_cache_t *cache,
+                                wbh_decode_cache_stats_t *stats);
+
+/** reset the hit, miss and eviction counters of a decode cache
+    @param cache cache handle
+ */
+void wbh_decode_cache_reset_stats(wbh_decode_cache_t *cache);
+
+/** decode the measurements read on an interface through a cache
+    Applies to wbh_read_measurements(), wbh_stream_measurements() and their
+    variants.  The cache is not freed with the interface.
+    @param iface WBH interface handle
+    @param cache cache handle, NULL to decode without a cache
+ */
+void wbh_set_decode_cache(wbh_interface_t *iface, wbh_decode_cache_t *cache);
+
+/** measurement stream callback
+    @param dev diagnostic device handle
+    @param group measurement group the sample belongs to
+    @param data decoded measurements, terminated by an UNIT_ENDOFLIST entry;
+                only valid for the duration of the call
+    @param count number of measurements in data
+    @param ctx user context passed to wbh_stream_measurements()
+    @return zero to continue streaming, non-zero to stop
+ */
+typedef int (*wbh_stream_cb_t)(wbh_device_t *dev, uint8_t group,
+                               const wbh_measurement_t *data, int count,
+                               void *ctx);
+
+/** continuously read measurement groups
+    Cycles through the given groups, requesting the next one as soon as
+    the device is ready and decoding the previous response while the next
+    one is on the wire.  No memory is allocated per sample.
+    @param dev diagnostic device handle
+    @param groups measurement groups to cycle through
+    @param group_count number of elements in groups
+    @param cb function called with every sample
+    @param ctx user context passed to cb
+    @return number of samples delivered or negative error code
+ */
+int wbh_stream_measurements(wbh_device_t *dev, const uint8_t *groups,
+                            int group_count, wbh_stream_cb_t cb, void *ctx);
+
+/** change detection state (opaque)
+    Passes on only the channels of a measurement group that changed since
+    the last sample.  Channels whose raw bytes did not change are not even
+    decoded; changed ones can be held back if their value stays within a
+    deadband.  Every keyframe_interval samples of a group, and whenever a
+    group comes back with a different number of channels, all channels
+    are passed on (a keyframe), so that a consumer that missed something
+    catches up.  A change detector must only be used by one thread at a
+    time.
+ */
+typedef struct wbh_delta wbh_delta_t;
+
+/** changed channel, see wbh_delta_apply() */
+typedef struct {
+  uint8_t channel;		/**< position of the channel in the group */
+  wbh_measurement_t data;	/**< decoded measurement */
+} wbh_change_t;
+
+/** change detection statistics */
+typedef struct {
+  unsigned long samples;	/**< samples examined */
+  unsigned long keyframes;	/**< samples passed on in full */
+  unsigned long channels;	/**< channels examined */
+  unsigned long skipped;	/**< channels not decoded, raw bytes unchanged */
+  unsigned long decoded;	/**< channels decoded */
+  unsigned long suppressed;	/**< decoded, but within the deadband */
+  unsigned long emitted;	/**< channels passed on */
+} wbh_delta_stats_t;
+
+/** create a change detector
+    @param keyframe_interval pass every group on in full every so many of
+                             its samples, 0 for never (only the first
+                             sample of each group is a keyframe then)
+    @return change detector handle or NULL on error
+ */
+wbh_delta_t *wbh_delta_new(int keyframe_interval);
+
+/** destroy a change detector
+    @param delta change detector handle, may be NULL
+ */
+void wbh_delta_free(wbh_delta_t *delta);
+
+/** set the deadband of a channel
+    A changed value is only passed on if it differs from the value last
+    passed on by more than this.  The default is 0: every change.
+    @param delta change detector handle
+    @param group measurement group
+    @param channel position of the channel in the group, -1 for all
+    @param deadband threshold, in the unit of the measurement
+    @return zero or negative error code
+ */
+int wbh_delta_set_deadband(wbh_delta_t *delta, uint8_t group, int channel,
+                           float deadband);
+
+/** forget the previous samples, so the next sample of every group is a
+    keyframe
+    @param delta change detector handle
+ */
+void wbh_delta_reset(wbh_delta_t *delta);
+
+/** find the channels of a sample that changed
+    @param delta change detector handle
+    @param group measurement group the sample belongs to
+    @param raw measurements as sent by the device
+    @param count number of elements in raw
+    @param changes array of count elements receiving the changed channels,
+                   in channel order
+    @param keyframe set to 1 if all channels were passed on, 0 otherwise;
+                    may be NULL
+    @return number of changed channels or negative error code
+ */
+int wbh_delta_apply(wbh_delta_t *delta, uint8_t group,
+                    const wbh_raw_measurement_t *raw, int count,
+                    wbh_change_t *changes, int *keyframe);
+
+/** retrieve change detection statistics
+    @param delta change detector handle
+    @param stats receives the statistics
+ */
+void wbh_delta_get_stats(wbh_delta_t *delta, wbh_delta_stats_t *stats);
+
+/** change stream callback
+    @param dev diagnostic device handle
+    @param group measurement group the sample belongs to
+    @param changes channels that changed; only valid for the duration of
+                   the call
+    @param count number of elements in changes, 0 if nothing changed
+    @param keyframe all channels of the group are included
+    @param ctx user context passed to wbh_stream_changes()
+    @return zero to continue streaming, non-zero to stop
+ */
+typedef int (*wbh_change_cb_t)(wbh_device_t *dev, uint8_t group,
+                               const wbh_change_t *changes, int count,
+                               int keyframe, void *ctx);
+
+/** continuously read measurement groups, passing on only what changed
+    Like wbh_stream_measurements(), but every sample goes through a change
+    detector; the callback is still called for every sample, so that it
+    can stop the stream, but usually with few or no changes.  The
+    interface's decode cache is used for the channels that are decoded.
+    @param dev diagnostic device handle
+    @param groups measurement groups to cycle through
+    @param group_count number of elements in groups
+    @param delta change detector
+    @param cb function called with every sample
+    @param ctx user context passed to cb
+    @return number of samples delivered or negative error code
+ */
+int wbh_stream_changes(wbh_device_t *dev, const uint8_t *groups,
+                       int group_count, wbh_delta_t *delta,
+                       wbh_change_cb_t cb, void *ctx);
+
+/** measurement group scheduler (opaque)
+    Reads measurement groups at individual rates: groups with a target
+    rate are read when they are due, most overdue first; groups without
+    one share the remaining line time by priority.  When the line cannot
+    keep up with the targets, all rated groups fall behind alike, which
+    the statistics show.
+ */
+typedef struct wbh_sched wbh_sched_t;
+
+/** per-group scheduler statistics, see wbh_sched_get_stats() */
+typedef struct {
+  uint8_t group;		/**< measurement group */
+  double target_hz;		/**< target rate, 0 for as fast as possible */
+  double achieved_hz;		/**< samples per second in the current run,
+                                     or over the whole of the last one */
+  unsigned long samples;	/**< samples read */
+  unsigned long late;		/**< samples requested more than one period
+                                     after they were due */
+  double exchange_ms;		/**< mean time a read of the group takes */
+} wbh_sched_stats_t;
+
+/** create a measurement group scheduler
+    @param dev diagnostic device handle
+    @return scheduler handle or NULL on error
+ */
+wbh_sched_t *wbh_sched_new(wbh_device_t *dev);
+
+/** destroy a scheduler
+    @param sched scheduler handle, may be NULL
+ */
+void wbh_sched_free(wbh_sched_t *sched);
+
+/** add a group to a scheduler, or change its settings
+    @param sched scheduler handle
+    @param group measurement group
+    @param rate_hz target rate, 0 to read the group as often as the line
+                   time left over by the rated groups allows
+    @param priority at least 1; groups without a target rate get line time
+                    in proportion to it, and of rated groups due at the
+                    same time, the higher priority goes first
+    @return zero or negative error code
+ */
+int wbh_sched_add(wbh_sched_t *sched, uint8_t group, double rate_hz, int priority);
+
+/** read the scheduled groups until the callback asks to stop
+    Like wbh_stream_measurements(), the next group is requested before the
+    previous one is decoded.  The statistics are reset when the run starts.
+    @param sched scheduler handle
+    @param cb function called with every sample
+    @param ctx user context passed to cb
+    @return number of samples delivered or negative error code
+ */
+int wbh_sched_run(wbh_sched_t *sched, wbh_stream_cb_t cb, void *ctx);
+
+/** retrieve scheduler statistics
+    May be called from the sample callback.
+    @param sched scheduler handle
+    @param stats array receiving one entry per group, in the order the
+                 groups were added
+    @param max number of elements in stats
+    @return number of groups
+ */
+int wbh_sched_get_stats(wbh_sched_t *sched, wbh_sched_stats_t *stats, int max);
+
+/** get the share of line time the target rates need
+    Computed from the target rates and the measured time per read.
+    @param sched scheduler handle
+    @return load; above 1 the line is oversubscribed
+ */
+double wbh_sched_load(wbh_sched_t *sched);
+
+/** pool of diagnostic sessions on an interface (opaque)
+    The adapter talks to one controller at a time.  A pool keeps the
+    controller last asked for connected, so that asking for it again
+    returns the open device handle instead of dialing it again, which
+    takes seconds.  While a pool has a session open, the interface must
+    not be used to connect, disconnect or scan directly.
+ */
+typedef struct wbh_pool wbh_pool_t;
+
+/** default longest quiet time before a pooled session is checked (ms) */
+#define WBH_POOL_KEEPALIVE 2000
+
+/** session pool statistics */
+typedef struct {
+  unsigned long connects;	/**< controllers dialed */
+  unsigned long reused;		/**< requests served by the open session,
+				     i.e. connects avoided */
+  unsigned long switches;	/**< sessions closed to dial another
+				     controller */
+  unsigned long keepalives;	/**< keep-alive requests sent */
+  unsigned long lost;		/**< sessions found dead by a keep-alive */
+} wbh_pool_stats_t;
+
+/** create a session pool
+    @param iface WBH interface handle
+    @param keepalive_ms longest time a session may be quiet before it is
+                        checked, 0 for WBH_POOL_KEEPALIVE
+    @return pool handle or NULL on error
+ */
+wbh_pool_t *wbh_pool_new(wbh_interface_t *iface, int keepalive_ms);
+
+/** close the open session and free a session pool
+    @param pool pool handle, may be NULL
+ */
+void wbh_pool_free(wbh_pool_t *pool);
+
+/** get a session with a diagnostic device
+    Returns the open session if it is with the same device, checking it
+    first if it has been quiet for the keep-alive interval.  Otherwise the
+    open session is closed and the device dialed.  The handle belongs to
+    the pool and must not be passed to wbh_disconnect(); it stays valid
+    until the next call to any wbh_pool_*() function.
+    @param pool pool handle
+    @param device device ID
+    @param timeout_ms time to wait for a new connection (ms)
+    @return WBH device handle or NULL on error
+ */
+wbh_device_t *wbh_pool_get(wbh_pool_t *pool, uint8_t device, int timeout_ms);
+
+/** close the open session, if any
+    @param pool pool handle
+    @return zero or negative error code
+ */
+int wbh_pool_close(wbh_pool_t *pool);
+
+/** keep the open session alive
+    Sends a keep-alive request if the session has been quiet for the
+    keep-alive interval, nothing otherwise.  Call at least as often as
+    wbh_pool_timeout() says.
+    @param pool pool handle
+    @return zero, or negative error code if the session has been lost
+ */
+int wbh_pool_keepalive(wbh_pool_t *pool);
+
+/** get the time until wbh_pool_keepalive() has something to do
+    @param pool pool handle
+    @return time in ms, -1 if no session is open
+ */
+int wbh_pool_timeout(wbh_pool_t *pool);
+
+/** retrieve session pool statistics
+    @param pool pool handle
+    @param stats receives the statistics
+ */
+void wbh_pool_get_stats(wbh_pool_t *pool, wbh_pool_stats_t *stats);
+
+/** command types metrics are kept for, by the command sent */
+enum {
+  WBH_CMD_CONNECT = 0,	/**< ATD, connecting to a device */
+  WBH_CMD_DTC,		/**< 02, reading trouble codes */
+  WBH_CMD_MEASUREMENTS,	/**< 08xx, reading a measurement group */
+  WBH_CMD_ACTUATOR,	/**< 03, actuator test steps */
+  WBH_CMD_ADAPTER,	/**< any other AT command, handled by the adapter */
+  WBH_CMD_OTHER,	/**< any other device command */
+  WBH_CMD_TYPES
+};
+
+/** number of latency histogram buckets, see wbh_metrics_bucket_us */
+#define WBH_METRICS_BUCKETS 17
+/** size of wbh_metrics_t.errors: one counter per ERR_* code */
+#define WBH_METRICS_ERRORS (ERR_INVAL + 1)
+
+/** upper bounds (µs) of the latency histogram buckets; the last bucket
+    has no bound */
+extern const uint64_t wbh_metrics_bucket_us[WBH_METRICS_BUCKETS - 1];
+
+/** counters of one command type */
+typedef struct {
+  uint64_t exchanges;		/**< commands sent and answered or failed */
+  uint64_t timeouts;		/**< exchanges that timed out */
+  uint64_t io_errors;		/**< exchanges failed by a transport error */
+  uint64_t rejected;		/**< answered with "?", "ERROR" or
+                                     "DATA ERROR" */
+  uint64_t retries;		/**< commands the library sent again */
+  uint64_t bytes_out;		/**< bytes written */
+  uint64_t bytes_in;		/**< bytes read, including discarded ones */
+  uint64_t latency_us;		/**< total time from sending the command
+                                     to the end of the exchange */
+  uint64_t latency[WBH_METRICS_BUCKETS];	/**< exchanges by duration,
+                                                     see wbh_metrics_bucket_us */
+} wbh_cmd_metrics_t;
+
+/** interface metrics
+    Every interface counts its exchanges by command type from the moment
+    it is initialized.  Counting is a few additions per exchange, no
+    locks; wbh_get_metrics() may be called from any thread.
+ */
+typedef struct wbh_metrics {
+  wbh_cmd_metrics_t cmd[WBH_CMD_TYPES];	/**< by WBH_CMD_* */
+  uint64_t errors[WBH_METRICS_ERRORS];	/**< errors reported, by ERR_* code */
+} wbh_metrics_t;
+
+/** take a snapshot of an interface's metrics
+    @param iface WBH interface handle
+    @param metrics receives the counters
+ */
+void wbh_get_metrics(wbh_interface_t *iface, wbh_metrics_t *metrics);
+
+/** reset an interface's metrics to zero
+    Must be called on the thread using the interface.
+    @param iface WBH interface handle
+ */
+void wbh_reset_metrics(wbh_interface_t *iface);
+
+/** format metrics in the Prometheus text exposition format
+    Each interface's series are labelled with its name.
+    @param ifaces WBH interface handles
+    @param count number of interfaces
+    @param buf buffer receiving the text, NUL-terminated
+    @param size size of buf
+    @return length of the complete text; if it is size or more, the text
+            has been truncated and a buffer of that length plus one is
+            needed
+ */
+size_t wbh_metrics_export(wbh_interface_t **ifaces, int count, char *buf,
+                          size_t size);
+
+/** kinds of results kept by an interface's result cache */
+enum {
+  WBH_RESULT_DTC = 0,	/**< DTC lists, by device: wbh_get_dtc() and
+                             variants */
+  WBH_RESULT_IDENT,	/**< controller identifications, by device:
+                             wbh_get_ident() */
+  WBH_RESULT_TIMING,	/**< adapter timing: wbh_get_bdt(), wbh_get_ibt() */
+  WBH_RESULT_ANALOG,	/**< analog inputs, by pin: wbh_get_analog() */
+  WBH_RESULT_KINDS
+};
+
+/** default time results are kept (ms), by WBH_RESULT_* */
+#define WBH_RESULT_TTL_DTC 5000
+#define WBH_RESULT_TTL_IDENT 600000
+#define WBH_RESULT_TTL_TIMING 60000
+#define WBH_RESULT_TTL_ANALOG 1000
+
+/** result cache statistics */
+typedef struct {
+  uint64_t hits[WBH_RESULT_KINDS];	/**< answered from the cache, by
+                                             WBH_RESULT_* */
+  uint64_t misses[WBH_RESULT_KINDS];	/**< not cached or expired, by
+                                             WBH_RESULT_* */
+  uint64_t invalidations;		/**< results dropped before they
+                                             expired */
+} wbh_result_cache_stats_t;
+
+/** keep the results of slow, rarely changing queries on an interface
+    DTC lists, controller identifications, adapter timing and analog
+    readings are answered from memory, without an exchange, for as long
+    as they are younger than the time to live of their kind.  Lookups
+    happen in queue order, so a query submitted after a command sees the
+    command's effect.  Results are dropped automatically when a command
+    sent with wbh_send_command() and variants may have changed them:
+    device commands other than 00, 02 and 08xx drop the device's DTC
+    list; ATZ and setting the BDT or IBT drop the adapter timing.
+    Connecting to a device drops its DTC list and takes its
+    identification from the connect response.  Anything else that changes
+    a result, such as another program using the ECU, calls for
+    wbh_result_cache_invalidate().
+    May be called again to change the times to live; must be called on
+    the thread using the interface.
+    @param iface WBH interface handle
+    @param ttl_ms time to live (ms) by WBH_RESULT_*, zero or negative not
+                  to cache a kind; NULL for the WBH_RESULT_TTL_* defaults
+    @return zero or negative error code
+ */
+int wbh_result_cache_enable(wbh_interface_t *iface, const int *ttl_ms);
+
+/** stop caching results and drop those kept
+    The statistics are kept.  Must be called on the thread using the
+    interface.
+    @param iface WBH interface handle
+ */
+void wbh_result_cache_disable(wbh_interface_t *iface);
+
+/** drop cached results
+    Must be called on the thread using the interface.
+    @param iface WBH interface handle
+    @param kind WBH_RESULT_*, -1 for all kinds
+    @param key device ID (DTC, identification) or pin (analog), -1 for
+               all; ignored for the adapter timing
+ */
+void wbh_result_cache_invalidate(wbh_interface_t *iface, int kind, int key);
+
+/** retrieve result cache statistics
+    May be called from any thread.
+    @param iface WBH interface handle
+    @param stats receives the statistics, all zero if the cache has never
+                 been enabled
+ */
+void wbh_result_cache_get_stats(wbh_interface_t *iface,
+                                wbh_result_cache_stats_t *stats);
+
+/** reset the result cache statistics to zero
+    Must be called on the thread using the interface.
+    @param iface WBH interface handle
+ */
+void wbh_result_cache_reset_stats(wbh_interface_t *iface);
+
+/** group of WBH interfaces operated concurrently (opaque) */
+typedef struct wbh_group wbh_group_t;
+
+/** job run on every interface of a group
+    @param iface WBH interface handle
+    @param idx index of iface within the group
+    @param ctx user context passed to wbh_group_run()
+ */
+typedef void (*wbh_group_job_t)(wbh_interface_t *iface, int idx, void *ctx);
+
+/** per-interface result of a group operation */
+typedef struct {
+  wbh_interface_t *iface;	/**< interface the result belongs to */
+  int status;			/**< zero or negative error code */
+  const char *error;		/**< error description if status is negative */
+  uint8_t *devices;		/**< devices found by wbh_group_scan() */
+  wbh_dtc_t *dtc;		/**< DTCs read by wbh_group_get_dtc() */
+  wbh_measurement_t *measurements;	/**< values read by
+                                             wbh_group_read_measurements() */
+} wbh_group_result_t;
+
+/** create an interface group
+    Each interface is only ever used by one worker thread at a time, so
+    the total duration of a group operation is that of the slowest
+    interface.
+    @param ifaces array of WBH interface handles
+    @param count number of elements in ifaces
+    @param threads number of worker threads, zero for one per interface
+    @return group handle or NULL on error
+ */
+wbh_group_t *wbh_group_new(wbh_interface_t **ifaces, int count, int threads);
+
+/** stop the worker threads and free an interface group
+    The member interfaces are not shut down.
+    @param group group handle
+ */
+void wbh_group_free(wbh_group_t *group);
+
+/** number of interfaces in a group
+    @param group group handle
+    @return interface count
+ */
+int wbh_group_size(wbh_group_t *group);
+
+/** run a job on all interfaces of a group concurrently
+    Returns when the job has finished on every interface.
+    @param group group handle
+    @param job function to run for each interface
+    @param ctx user context passed to job
+ */
+void wbh_group_run(wbh_group_t *group, wbh_group_job_t job, void *ctx);
+
+/** scan for devices on all interfaces of a group
+    @param group group handle
+    @param start first device ID to scan
+    @param end last device ID to scan
+    @param results array of wbh_group_size() results
+    @return number of interfaces that failed
+ */
+int wbh_group_scan(wbh_group_t *group, uint8_t start, uint8_t end,
+                   wbh_group_result_t *results);
+
+/** read DTCs of one device on all interfaces of a group
+    @param group group handle
+    @param device device ID
+    @param results array of wbh_group_size() results
+    @return number of interfaces that failed
+ */
+int wbh_group_get_dtc(wbh_group_t *group, uint8_t device,
+                      wbh_group_result_t *results);
+
+/** read a measurement group of one device on all interfaces of a group
+    @param group group handle
+    @param device device ID
+    @param mgroup measurement group
+    @param results array of wbh_group_size() results
+    @return number of interfaces that failed
+ */
+int wbh_group_read_measurements(wbh_group_t *group, uint8_t device,
+                                uint8_t mgroup, wbh_group_result_t *results);
+
+/** free the data held by group results
+    @param group group handle
+    @param results array of wbh_group_size() results
+ */
+void wbh_group_free_results(wbh_group_t *group, wbh_group_result_t *results);
+
+/** direction of a captured chunk of data */
+enum {
+  WBH_TRACE_TX = 0,	/**< sent to the interface */
+  WBH_TRACE_RX = 1,	/**< received from the interface */
+};
+
+/** start capturing the raw data exchanged with an interface
+    Every chunk written to or read from the serial port is recorded with
+    its direction and a monotonic timestamp.  Records are handed to a
+    writer thread, so capturing does not delay the exchanges; if the
+    writer cannot keep up, records are dropped.
+    @param iface WBH interface handle
+    @param path trace file name, an existing file is overwritten
+    @return zero or negative error code
+ */
+int wbh_capture_start(wbh_interface_t *iface, const char *path);
+
+/** stop capturing and close the trace file
+    Called by wbh_shutdown() if capturing is still on.
+    @param iface WBH interface handle
+    @return number of records dropped, or negative error code if the trace
+            file could not be written
+ */
+long wbh_capture_stop(wbh_interface_t *iface);
+
+/** trace file opened for reading (opaque) */
+typedef struct wbh_trace wbh_trace_t;
+
+/** captured chunk of data */
+typedef struct {
+  uint64_t timestamp_ns;	/**< monotonic clock when captured (ns) */
+  int direction;		/**< WBH_TRACE_TX or WBH_TRACE_RX */
+  const uint8_t *data;		/**< raw bytes, valid until the trace is
+				     closed */
+  size_t len;			/**< number of bytes */
+} wbh_trace_record_t;
+
+/** open a trace file written by wbh_capture_start()
+    The file is mapped into memory; records are not copied.
+    @param path trace file name
+    @return trace handle or NULL on error
+ */
+wbh_trace_t *wbh_trace_open(const char *path);
+
+/** get the next record of a trace
+    A record cut short at the end of the file is treated as the end of
+    the trace.
+    @param trace trace handle
+    @param rec receives the record
+    @return 1 if a record was read, 0 at the end of the trace, negative
+            error code if the trace is corrupt
+ */
+int wbh_trace_next(wbh_trace_t *trace, wbh_trace_record_t *rec);
+
+/** go back to the first record of a trace
+    @param trace trace handle
+ */
+void wbh_trace_rewind(wbh_trace_t *trace);
+
+/** close a trace file
+    @param trace trace handle, may be NULL
+ */
+void wbh_trace_close(wbh_trace_t *trace);
+
+/** measurement log being written (opaque)
+    Samples are stored by channel (device, group and position in the
+    group), the timestamps and the formula and value bytes of each in a
+    column of their own, and compressed in blocks.  A logger must only be
+    used by one thread at a time.
+ */
+typedef struct wbh_logger wbh_logger_t;
+
+/** measurement logger statistics */
+typedef struct {
+  unsigned long samples;	/**< channel samples appended */
+  unsigned long blocks;		/**< blocks written */
+  unsigned long dropped;	/**< channel samples dropped because the
+                                     writer could not keep up */
+  uint64_t bytes;		/**< size of the log file so far */
+} wbh_logger_stats_t;
+
+/** create a measurement log
+    Samples are collected in memory and handed to a writer thread in
+    blocks, which compresses and writes them; an append never waits for
+    the disk.  If the writer cannot keep up, blocks are dropped.
+    @param path log file name, an existing file is overwritten
+    @return logger handle or NULL on error
+ */
+wbh_logger_t *wbh_logger_create(const char *path);
+
+/** append a sample of a measurement group to a log
+    The timestamps of a channel never go backwards; one earlier than the
+    channel's latest is logged as the latest.
+    @param log logger handle
+    @param device device ID
+    @param group measurement group
+    @param timestamp_ns time of the sample (ns), 0 for now (real-time
+                        clock)
+    @param raw measurements as sent by the device
+    @param count number of elements in raw
+    @return zero or negative error code
+ */
+int wbh_logger_append(wbh_logger_t *log, uint8_t device, uint8_t group,
+                      uint64_t timestamp_ns, const wbh_raw_measurement_t *raw,
+                      int count);
+
+/** append a decoded sample of a measurement group to a log
+    Like wbh_logger_append(), taking the raw bytes of decoded
+    measurements, as a wbh_stream_cb_t gets them.
+    @param log logger handle
+    @param device device ID
+    @param group measurement group
+    @param timestamp_ns time of the sample (ns), 0 for now
+    @param data measurements
+    @param count number of elements in data
+    @return zero or negative error code
+ */
+int wbh_logger_append_measurements(wbh_logger_t *log, uint8_t device,
+                                   uint8_t group, uint64_t timestamp_ns,
+                                   const wbh_measurement_t *data, int count);
+
+/** write out all samples appended so far
+    Waits for the writer thread.  Blocks that are not full are written
+    as they are, so flushing often makes the log larger.
+    @param log logger handle
+    @return zero or negative error code
+ */
+int wbh_logger_flush(wbh_logger_t *log);
+
+/** retrieve measurement logger statistics
+    @param log logger handle
+    @param stats receives the statistics
+ */
+void wbh_logger_get_stats(wbh_logger_t *log, wbh_logger_stats_t *stats);
+
+/** write out all samples, add the block index and close a log
+    @param log logger handle, may be NULL
+    @return number of channel samples dropped, or negative error code if
+            the log file could not be written
+ */
+long wbh_logger_close(wbh_logger_t *log);
+
+/** measurement log opened for reading (opaque) */
+typedef struct wbh_log wbh_log_t;
+
+/** channel found in a measurement log */
+typedef struct {
+  uint8_t device;
+  uint8_t group;
+  uint8_t channel;		/**< position of the channel in the group */
+  unsigned long blocks;
+  unsigned long samples;
+  uint64_t first_ns;		/**< timestamp of the first sample */
+  uint64_t last_ns;		/**< timestamp of the last sample */
+} wbh_log_series_t;
+
+/** sample read from a measurement log */
+typedef struct {
+  uint64_t timestamp_ns;
+  uint8_t device;
+  uint8_t group;
+  uint8_t channel;		/**< position of the channel in the group */
+  wbh_measurement_t data;	/**< decoded measurement */
+} wbh_log_sample_t;
+
+/** function called with every sample found by wbh_log_query()
+    @param sample the sample, valid during the call
+    @param ctx user context
+    @return zero to go on, nonzero to stop the query
+ */
+typedef int (*wbh_log_cb_t)(const wbh_log_sample_t *sample, void *ctx);
+
+/** open a log written by wbh_logger_create()
+    The file is mapped into memory.  A log that was not closed, because
+    the program writing it crashed, can be read up to the last block
+    written.
+    @param path log file name
+    @return log handle or NULL on error
+ */
+wbh_log_t *wbh_log_open(const char *path);
+
+/** list the channels in a log
+    @param log log handle
+    @param series array receiving the channels, ordered by device, group
+                  and channel
+    @param max number of elements in series
+    @return number of channels in the log, which may be more than max
+ */
+int wbh_log_series(wbh_log_t *log, wbh_log_series_t *series, int max);
+
+/** read the samples of a time range from a log
+    Only the blocks overlapping the range are decoded.  Samples are
+    delivered channel by channel, ordered by device, group and channel,
+    each channel's in time order.
+    @param log log handle
+    @param device device ID, -1 for all
+    @param group measurement group, -1 for all
+    @param channel position of the channel in the group, -1 for all
+    @param from_ns start of the range (ns)
+    @param to_ns end of the range (ns), inclusive
+    @param cb function called with every sample
+    @param ctx user context passed to cb
+    @return number of samples delivered or negative error code
+ */
+long wbh_log_query(wbh_log_t *log, int device, int group, int channel,
+                   uint64_t from_ns, uint64_t to_ns, wbh_log_cb_t cb, void *ctx);
+
+/** close a log
+    @param log log handle, may be NULL
+ */
+void wbh_log_close(wbh_log_t *log);
+
+/** debug event types, see wbh_event_t */
+enum {
+  WBH_EV_WRITE = 0,	/**< data written; value: bytes */
+  WBH_EV_READ,		/**< data read; value: bytes */
+  WBH_EV_PROMPT,	/**< response complete; value: response length */
+  WBH_EV_TIMEOUT,	/**< response timed out; value: bytes received */
+  WBH_EV_PARSE_ERROR,	/**< malformed response; value: position of the
+                             error */
+  WBH_EV_PROBE,		/**< scan probed an address; value: device ID,
+                             data: "found" or "failed" */
+};
+
+/** data bytes kept per debug event; longer data is cut short */
+#define WBH_EVENT_DATA 48
+
+/** debug event */
+typedef struct {
+  uint64_t seq;			/**< number of the event, counting from 0 */
+  uint64_t timestamp_ns;	/**< monotonic clock (ns) */
+  int type;			/**< WBH_EV_* */
+  int value;			/**< meaning depends on type */
+  int len;			/**< bytes in data */
+  char data[WBH_EVENT_DATA];	/**< raw bytes, not NUL-terminated */
+} wbh_event_t;
+
+/** start recording debug events on an interface
+    Events go into a fixed-size ring in memory, the oldest being
+    overwritten when it is full.  Recording takes no locks and makes no
+    system calls other than reading the clock, and while it is off, costs
+    a single test per I/O operation; it can be switched on and off at any
+    time, from any thread.
+    @param iface WBH interface handle
+    @param size number of events the ring holds, rounded up to a power of
+                two; 0 for 1024.  Ignored if the ring exists already.
+    @return zero or negative error code
+ */
+int wbh_events_enable(wbh_interface_t *iface, int size);
+
+/** stop recording debug events
+    The ring is kept, so events recorded so far can still be read.
+    @param iface WBH interface handle
+ */
+void wbh_events_disable(wbh_interface_t *iface);
+
+/** take recorded debug events out of the ring
+    Meant for a single consumer, e.g. a thread that writes them to a log;
+    may run concurrently with the I/O on the interface.
+    @param iface WBH interface handle
+    @param events array receiving events, oldest first
+    @param max size of events
+    @return number of events stored in events
+ */
+int wbh_events_read(wbh_interface_t *iface, wbh_event_t *events, int max);
+
+/** get the number of debug events overwritten before they were read
+    @param iface WBH interface handle
+    @return number of events lost
+ */
+unsigned long wbh_events_lost(wbh_interface_t *iface);
+
+/** print the debug events currently in the ring, one per line
+    Does not take them out of the ring.
+    @param iface WBH interface handle
+    @param f stream to print to
+    @return number of events printed
+ */
+int wbh_events_dump(wbh_interface_t *iface, FILE *f);
+
+/** completion callback of an asynchronous operation
+    Called from wbh_process() (or from a blocking call on the same
+    interface) once the operation has finished.  The request is freed when
+    the callback returns; results must be copied out of it.
+    @param req finished request
+    @param ctx user context passed when submitting the request
+ */
+typedef void (*wbh_request_cb_t)(wbh_request_t *req, void *ctx);
+
+/** get the file descriptor to watch for an interface
+    @param iface WBH interface handle
+    @return file descriptor for poll(), select(), epoll etc., or -1 if the
+            interface's transport never has to be waited for; then call
+            wbh_process() with POLLIN | POLLOUT whenever wbh_get_events()
+            is non-zero
+ */
+int wbh_get_fd(wbh_interface_t *iface);
+
+/** get the events to wait for on an interface
+    @param iface WBH interface handle
+    @return poll() event mask, zero if nothing is pending
+ */
+short wbh_get_events(wbh_interface_t *iface);
+
+/** get the time until wbh_process() must be called even if no events
+    occur
+    @param iface WBH interface handle
+    @return timeout in ms, -1 if nothing is pending
+ */
+int wbh_get_timeout(wbh_interface_t *iface);
+
+/** advance the pending operations of an interface
+    Never blocks.  Completion callbacks are called from here.
+    @param iface WBH interface handle
+    @param revents events returned by poll() for the interface's file
+                   descriptor, zero on timeout
+    @return number of operations still pending
+ */
+int wbh_process(wbh_interface_t *iface, short revents);
+
+/** abort all pending operations of an interface
+    Their completion callbacks are called with status -ERR_SERIAL.
+    @param iface WBH interface handle
+ */
+void wbh_cancel_requests(wbh_interface_t *iface);
+
+/** start connecting to a diagnostic device
+    The device handle can be taken from the finished request with
+    wbh_request_device().
+    @param iface WBH interface handle
+    @param device device ID
+    @param timeout_ms time to wait for the device to answer (ms)
+    @param cb completion callback
+    @param ctx user context passed to cb
+    @return request or NULL on error
+ */
+wbh_request_t *wbh_submit_connect(wbh_interface_t *iface, uint8_t device,
+                                  int timeout_ms, wbh_request_cb_t cb, void *ctx);
+
+/** start disconnecting from a diagnostic device
+    The device handle is freed once the request has finished successfully.
+    @param dev diagnostic device handle
+    @param cb completion callback
+    @param ctx user context passed to cb
+    @return request or NULL on error
+ */
+wbh_request_t *wbh_submit_disconnect(wbh_device_t *dev, wbh_request_cb_t cb,
+                                     void *ctx);
+
+/** start sending a raw command
+    The response can be read with wbh_request_response().
+    @param dev diagnostic device handle
+    @param cmd command string
+    @param timeout_ms time to wait for the response (ms)
+    @param cb completion callback
+    @param ctx user context passed to cb
+    @return request or NULL on error
+ */
+wbh_request_t *wbh_submit_command(wbh_device_t *dev, const char *cmd,
+                                  int timeout_ms, wbh_request_cb_t cb, void *ctx);
+
+/** start sending several commands, see wbh_send_batch()
+    The request status is the number of commands answered without error.
+    @param dev diagnostic device handle
+    @param cmds commands, must stay valid until the request has finished
+    @param count number of elements in cmds
+    @param cb completion callback
+    @param ctx user context passed to cb
+    @return request or NULL on error
+ */
+wbh_request_t *wbh_submit_batch(wbh_device_t *dev, wbh_batch_cmd_t *cmds, int count,
+                                wbh_request_cb_t cb, void *ctx);
+
+/** start reading the DTC list
+    The DTCs can be read with wbh_request_dtc().
+    @param dev diagnostic device handle
+    @param cb completion callback
+    @param ctx user context passed to cb
+    @return request or NULL on error
+ */
+wbh_request_t *wbh_submit_get_dtc(wbh_device_t *dev, wbh_request_cb_t cb, void *ctx);
+
+/** start reading the controller identification, see wbh_get_ident()
+    The identification can be read with wbh_request_response().
+    @param dev diagnostic device handle
+    @param cb completion callback
+    @param ctx user context passed to cb
+    @return request or NULL on error
+ */
+wbh_request_t *wbh_submit_get_ident(wbh_device_t *dev, wbh_request_cb_t cb, void *ctx);
+
+/** start reading a measurement group
+    The measurements can be read with wbh_request_measurements().
+    @param dev diagnostic device handle
+    @param group measurement group
+    @param cb completion callback
+    @param ctx user context passed to cb
+    @return request or NULL on error
+ */
+wbh_request_t *wbh_submit_read_measurements(wbh_device_t *dev, uint8_t group,
+                                            wbh_request_cb_t cb, void *ctx);
+
+/** start streaming measurement groups, see wbh_stream_measurements()
+    @param dev diagnostic device handle
+    @param groups measurement groups to cycle through
+    @param group_count number of elements in groups
+    @param scb function called with every sample
+    @param cb completion callback
+    @param ctx user context passed to scb and cb
+    @return request or NULL on error
+ */
+wbh_request_t *wbh_submit_stream_measurements(wbh_device_t *dev,
+                                              const uint8_t *groups,
+                                              int group_count,
+                                              wbh_stream_cb_t scb,
+                                              wbh_request_cb_t cb, void *ctx);
+
+/** start streaming changes, see wbh_stream_changes()
+    @param dev diagnostic device handle
+    @param groups measurement groups to cycle through
+    @param group_count number of elements in groups
+    @param delta change detector
+    @param scb function called with every sample
+    @param cb completion callback
+    @param ctx user context passed to scb and cb
+    @return request or NULL on error
+ */
+wbh_request_t *wbh_submit_stream_changes(wbh_device_t *dev,
+                                         const uint8_t *groups,
+                                         int group_count, wbh_delta_t *delta,
+                                         wbh_change_cb_t scb,
+                                         wbh_request_cb_t cb, void *ctx);
+
+/** start a scheduler run, see wbh_sched_run()
+    @param sched scheduler handle
+    @param scb function called with every sample
+    @param cb completion callback
+    @param ctx user context passed to scb and cb
+    @return request or NULL on error
+ */
+wbh_request_t *wbh_submit_sched(wbh_sched_t *sched, wbh_stream_cb_t scb,
+                                wbh_request_cb_t cb, void *ctx);
+
+/** start scanning for devices, see wbh_scan_devices_opts()
+    The addresses found can be read with wbh_request_devices().
+    @param iface WBH interface handle
+    @param start first device ID
+    @param end device ID after the last one
+    @param opts scan options, NULL for defaults
+    @param cb completion callback
+    @param ctx user context passed to cb
+    @return request or NULL on error
+ */
+wbh_request_t *wbh_submit_scan(wbh_interface_t *iface, uint8_t start, uint8_t end,
+                               const wbh_scan_opts_t *opts,
+                               wbh_request_cb_t cb, void *ctx);
+
+/** get the result of a finished request
+    @param req request
+    @return non-negative value or negative error code
+ */
+int wbh_request_status(wbh_request_t *req);
+
+/** get the interface a request ran on
+    @param req request
+    @return WBH interface handle
+ */
+wbh_interface_t *wbh_request_iface(wbh_request_t *req);
+
+/** get the response to a command request
+    @param req request
+    @return response text
+ */
+const char *wbh_request_response(wbh_request_t *req);
+
+/** take the device handle from a finished connect request
+    @param req request
+    @return diagnostic device handle, to be released with wbh_disconnect(),
+            or NULL
+ */
+wbh_device_t *wbh_request_device(wbh_request_t *req);
+
+/** get the DTCs read by a request
+    @param req request
+    @param count receives the number of DTCs, may be NULL
+    @return DTC list terminated by a zero entry, valid until the request
+            is freed
+ */
+const wbh_dtc_t *wbh_request_dtc(wbh_request_t *req, int *count);
+
+/** get the measurements read by a request
+    @param req request
+    @param count receives the number of measurements, may be NULL
+    @return measurements terminated by an UNIT_ENDOFLIST entry, valid until
+            the request is freed
+ */
+const wbh_measurement_t *wbh_request_measurements(wbh_request_t *req, int *count);
+
+/** get the devices found by a scan request
+    @param req request
+    @return zero-terminated list of device IDs, valid until the request is
+            freed
+ */
+const uint8_t *wbh_request_devices(wbh_request_t *req);
+
 #ifdef __cplusplus
 }
 #endif
+
+#endif
@@ -0,0 +1,289 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "wbh.h"
+#include "wbh_priv.h"
+
+/* Result cache.
+   Only the thread driving the interface looks results up, stores and
+   drops them; the lookups are made by the requests' start functions, so
+   they happen in queue order.  The statistics are counted like the
+   interface metrics, so other threads can take snapshots.  DTC lists and
+   identifications are allocated per device the first time one is kept,
+   which keeps an enabled cache small on an interface only talking to a
+   few devices. */
+
+/** number of analog pins */
+#define ANALOG_PINS 6
+
+/** state common to all entries */
+typedef struct {
+  int64_t time;			/**< monotonic time (ms) the result was kept */
+  int valid;			/**< entry holds a result */
+} entry_t;
+
+typedef struct {
+  entry_t e;
+  int count;			/**< number of DTCs */
+  wbh_dtc_t dtc[WBH_MAX_DTC];
+} dtc_entry_t;
+
+typedef struct {
+  entry_t e;
+  char text[BUFSIZE];		/**< identification, NUL-terminated */
+} ident_entry_t;
+
+typedef struct {
+  entry_t e;
+  int value;
+} value_entry_t;
+
+struct wbh_result_cache {
+  int enabled;			/**< results are being kept */
+  int ttl_ms[WBH_RESULT_KINDS];	/**< time to live by WBH_RESULT_*, not
+                                     cached if zero or negative */
+  wbh_result_cache_stats_t stats;
+  dtc_entry_t *dtc[256];	/**< by device ID */
+  ident_entry_t *ident[256];	/**< by device ID */
+  value_entry_t timing[2];	/**< by RESULT_BDT/RESULT_IBT */
+  value_entry_t analog[ANALOG_PINS];	/**< by pin */
+};
+
+static const int default_ttl[WBH_RESULT_KINDS] = {
+  WBH_RESULT_TTL_DTC, WBH_RESULT_TTL_IDENT, WBH_RESULT_TTL_TIMING,
+  WBH_RESULT_TTL_ANALOG,
+};
+
+int wbh_result_cache_enable(wbh_interface_t *iface, const int *ttl_ms)
+{
+  struct wbh_result_cache *c = IFACE(iface)->result_cache;
+
+  if (!c) {
+    if (!(c = calloc(1, sizeof(struct wbh_result_cache)))) {
+      iface_set_error(iface, ERR_INVAL, "wbh_result_cache_enable: calloc() failed");
+      return -ERR_INVAL;
+    }
+    /* wbh_result_cache_get_stats() may be looking from another thread */
+    __atomic_store_n(&IFACE(iface)->result_cache, c, __ATOMIC_RELEASE);
+  }
+  memcpy(c->ttl_ms, ttl_ms ? ttl_ms : default_ttl, sizeof(c->ttl_ms));
+  c->enabled = 1;
+  return 0;
+}
+
+void wbh_result_cache_disable(wbh_interface_t *iface)
+{
+  if (!IFACE(iface)->result_cache)
+    return;
+  wbh_result_cache_invalidate(iface, -1, -1);
+  IFACE(iface)->result_cache->enabled = 0;
+}
+
+/** Get the interface's cache if it keeps results of a kind. */
+static struct wbh_result_cache *cache_for(wbh_interface_t *iface, int kind)
+{
+  struct wbh_result_cache *c = IFACE(iface)->result_cache;
+  return c && c->enabled && c->ttl_ms[kind] > 0 ? c : NULL;
+}
+
+/** Check whether an entry can answer a query, counting the lookup.
+    @param e entry, NULL if none has been allocated
+    @return non-zero if the entry holds a result young enough
+ */
+static int entry_fresh(struct wbh_result_cache *c, int kind, const entry_t *e)
+{
+  if (e && e->valid && now_ms() - e->time < c->ttl_ms[kind]) {
+    METRIC_ADD(c->stats.hits[kind], 1);
+    return 1;
+  }
+  METRIC_ADD(c->stats.misses[kind], 1);
+  return 0;
+}
+
+static void entry_store(entry_t *e)
+{
+  e->time = now_ms();
+  e->valid = 1;
+}
+
+/** Drop an entry's result; only those that had not expired yet count as
+    invalidations. */
+static void entry_drop(struct wbh_result_cache *c, int kind, entry_t *e)
+{
+  if (!e || !e->valid)
+    return;
+  e->valid = 0;
+  if (now_ms() - e->time < c->ttl_ms[kind])
+    METRIC_ADD(c->stats.invalidations, 1);
+}
+
+int result_cache_get_dtc(wbh_interface_t *iface, uint8_t device, wbh_dtc_t *dtc)
+{
+  struct wbh_result_cache *c = cache_for(iface, WBH_RESULT_DTC);
+  dtc_entry_t *d;
+  if (!c || !entry_fresh(c, WBH_RESULT_DTC, (d = c->dtc[device]) ? &d->e : NULL))
+    return -1;
+  memcpy(dtc, d->dtc, d->count * sizeof(wbh_dtc_t));
+  return d->count;
+}
+
+void result_cache_put_dtc(wbh_interface_t *iface, uint8_t device,
+                          const wbh_dtc_t *dtc, int count)
+{
+  struct wbh_result_cache *c = cache_for(iface, WBH_RESULT_DTC);
+  dtc_entry_t *d;
+  if (!c || count < 0 || count > WBH_MAX_DTC)
+    return;
+  /* not being able to cache is not an error */
+  if (!(d = c->dtc[device]) && !(d = c->dtc[device] = malloc(sizeof(dtc_entry_t))))
+    return;
+  memcpy(d->dtc, dtc, count * sizeof(wbh_dtc_t));
+  d->count = count;
+  entry_store(&d->e);
+}
+
+int result_cache_get_ident(wbh_interface_t *iface, uint8_t device, char *ident)
+{
+  struct wbh_result_cache *c = cache_for(iface, WBH_RESULT_IDENT);
+  ident_entry_t *d;
+  if (!c || !entry_fresh(c, WBH_RESULT_IDENT, (d = c->ident[device]) ? &d->e : NULL))
+    return -1;
+  strcpy(ident, d->text);
+  return strlen(ident);
+}
+
+void result_cache_put_ident(wbh_interface_t *iface, uint8_t device,
+                            const char *ident)
+{
+  struct wbh_result_cache *c = cache_for(iface, WBH_RESULT_IDENT);
+  ident_entry_t *d;
+  if (!c)
+    return;
+  if (!(d = c->ident[device]) && !(d = c->ident[device] = malloc(sizeof(ident_entry_t))))
+    return;
+  snprintf(d->text, BUFSIZE, "%s", ident);
+  entry_store(&d->e);
+}
+
+/** Find an adapter value's entry.
+    @return entry or NULL if the key is out of range */
+static value_entry_t *value_entry(struct wbh_result_cache *c, int kind, int key)
+{
+  if (kind == WBH_RESULT_TIMING && key >= RESULT_BDT && key <= RESULT_IBT)
+    return &c->timing[key];
+  if (kind == WBH_RESULT_ANALOG && key >= 0 && key < ANALOG_PINS)
+    return &c->analog[key];
+  return NULL;
+}
+
+int result_cache_get_value(wbh_interface_t *iface, int kind, int key)
+{
+  struct wbh_result_cache *c = cache_for(iface, kind);
+  value_entry_t *v;
+  if (!c || !(v = value_entry(c, kind, key)) || !entry_fresh(c, kind, &v->e))
+    return -1;
+  return v->value;
+}
+
+void result_cache_put_value(wbh_interface_t *iface, int kind, int key, int value)
+{
+  struct wbh_result_cache *c = cache_for(iface, kind);
+  value_entry_t *v;
+  if (!c || value < 0 || !(v = value_entry(c, kind, key)))
+    return;
+  v->value = value;
+  entry_store(&v->e);
+}
+
+/** Check whether a device command only reads: identification (00), DTCs
+    (02) or a measurement group (08xx).
+    @param cmd command, possibly followed by a carriage return */
+static int command_reads(const char *cmd)
+{
+  if (!strncmp(cmd, "08", 2))
+    return 1;
+  return cmd[0] == '0' && (cmd[1] == '0' || cmd[1] == '2') &&
+         (!cmd[2] || cmd[2] == '\r');
+}
+
+void result_cache_command(wbh_interface_t *iface, wbh_device_t *dev, const char *cmd)
+{
+  struct wbh_result_cache *c = IFACE(iface)->result_cache;
+  int i;
+
+  if (!c || !c->enabled)
+    return;
+  if (!strncmp(cmd, "AT", 2)) {
+    /* resetting the adapter or setting a delay time */
+    if (!strncmp(cmd, "ATZ", 3) ||
+        ((!strncmp(cmd, "ATBDT", 5) || !strncmp(cmd, "ATIBT", 5)) && cmd[5] != '?')) {
+      for (i = RESULT_BDT; i <= RESULT_IBT; i++)
+        entry_drop(c, WBH_RESULT_TIMING, &c->timing[i].e);
+    }
+    return;
+  }
+  /* clearing DTCs, actuator tests, basic settings, adaptation... */
+  if (dev && !command_reads(cmd) && c->dtc[dev->id])
+    entry_drop(c, WBH_RESULT_DTC, &c->dtc[dev->id]->e);
+}
+
+void wbh_result_cache_invalidate(wbh_interface_t *iface, int kind, int key)
+{
+  struct wbh_result_cache *c = IFACE(iface)->result_cache;
+  int i;
+
+  if (!c)
+    return;
+  for (i = 0; i < 256; i++) {
+    if (key >= 0 && i != key)
+      continue;
+    if ((kind < 0 || kind == WBH_RESULT_DTC) && c->dtc[i])
+      entry_drop(c, WBH_RESULT_DTC, &c->dtc[i]->e);
+    if ((kind < 0 || kind == WBH_RESULT_IDENT) && c->ident[i])
+      entry_drop(c, WBH_RESULT_IDENT, &c->ident[i]->e);
+    if ((kind < 0 || kind == WBH_RESULT_ANALOG) && i < ANALOG_PINS)
+      entry_drop(c, WBH_RESULT_ANALOG, &c->analog[i].e);
+  }
+  if (kind < 0 || kind == WBH_RESULT_TIMING) {
+    for (i = RESULT_BDT; i <= RESULT_IBT; i++)
+      entry_drop(c, WBH_RESULT_TIMING, &c->timing[i].e);
+  }
+}
+
+void wbh_result_cache_get_stats(wbh_interface_t *iface,
+                                wbh_result_cache_stats_t *stats)
+{
+  struct wbh_result_cache *c = __atomic_load_n(&IFACE(iface)->result_cache, __ATOMIC_ACQUIRE);
+  const uint64_t *src;
+  uint64_t *dst = (uint64_t *)stats;
+  size_t i;
+
+  memset(stats, 0, sizeof(wbh_result_cache_stats_t));
+  if (!c)
+    return;
+  /* nothing but counters in there */
+  src = (const uint64_t *)&c->stats;
+  for (i = 0; i < sizeof(wbh_result_cache_stats_t) / sizeof(uint64_t); i++)
+    dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+void wbh_result_cache_reset_stats(wbh_interface_t *iface)
+{
+  if (IFACE(iface)->result_cache)
+    memset(&IFACE(iface)->result_cache->stats, 0, sizeof(wbh_result_cache_stats_t));
+}
+
+void result_cache_free(wbh_interface_t *iface)
+{
+  struct wbh_result_cache *c = IFACE(iface)->result_cache;
+  int i;
+
+  if (!c)
+    return;
+  for (i = 0; i < 256; i++) {
+    free(c->dtc[i]);
+    free(c->ident[i]);
+  }
+  free(c);
+  IFACE(iface)->result_cache = NULL;
+}
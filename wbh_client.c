@@ -0,0 +1,241 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "wbh.h"
+#include "wbh_priv.h"
+#include "wbh_client.h"
+
+/* Client of the adapter daemon, see wbhd.c.
+   Every call sends one request and waits for its reply. */
+
+struct wbh_client {
+  int fd;			/**< socket connected to the daemon */
+  uint32_t id;			/**< number of the last request */
+  char error[WBHD_MAX_PAYLOAD + 1];	/**< error message of the last
+                                             failed request */
+};
+
+wbh_client_t *wbh_client_open(const char *path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  wbh_client_t *client;
+
+  if (!path)
+    path = WBHD_SOCKET;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    iface_set_error(NULL, ERR_INVAL, "wbh_client_open: socket path too long");
+    return NULL;
+  }
+  strcpy(addr.sun_path, path);
+  if (!(client = calloc(1, sizeof(wbh_client_t)))) {
+    iface_set_error(NULL, ERR_INVAL, "wbh_client_open: calloc() failed");
+    return NULL;
+  }
+  client->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (client->fd < 0 || connect(client->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    if (client->fd >= 0)
+      close(client->fd);
+    free(client);
+    iface_set_error(NULL, ERR_SERIAL, "wbh_client_open: cannot connect to daemon");
+    return NULL;
+  }
+  return client;
+}
+
+void wbh_client_close(wbh_client_t *client)
+{
+  if (!client)
+    return;
+  close(client->fd);
+  free(client);
+}
+
+/** Read exactly len bytes.
+    @return zero or -1 on error or end of file */
+static int client_read(wbh_client_t *client, void *buf, size_t len)
+{
+  ssize_t rc;
+  while (len) {
+    rc = read(client->fd, buf, len);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc <= 0)
+      return -1;
+    buf = (char *)buf + rc;
+    len -= rc;
+  }
+  return 0;
+}
+
+/** Send a request and wait for the reply.
+    @param data request payload, may be NULL
+    @param len bytes in data
+    @param reply buffer of WBHD_MAX_PAYLOAD bytes receiving the reply
+                 payload, may be NULL
+    @param reply_len receives the bytes in reply, may be NULL
+    @return reply status */
+static int client_call(wbh_client_t *client, int type, int iface, uint8_t device,
+                       uint8_t arg, uint8_t arg2, const void *data, size_t len,
+                       void *reply, size_t *reply_len)
+{
+  wbhd_msg_t msg = { .len = len, .id = ++client->id, .type = type, .iface = iface,
+                     .device = device, .arg = arg, .arg2 = arg2 };
+  struct iovec iov[2] = { { &msg, sizeof(msg) }, { (void *)data, len } };
+  struct msghdr mh = { .msg_iov = iov, .msg_iovlen = len ? 2 : 1 };
+  char buf[WBHD_MAX_PAYLOAD];
+  ssize_t rc;
+
+  if (iface < 0 || iface > 255 || len > WBHD_MAX_PAYLOAD) {
+    iface_set_error(NULL, ERR_INVAL, "wbh_client: invalid parameter");
+    return -ERR_INVAL;
+  }
+  /* requests are small enough to go out in one piece */
+  do
+    rc = sendmsg(client->fd, &mh, MSG_NOSIGNAL);
+  while (rc < 0 && errno == EINTR);
+  if (rc != sizeof(msg) + len)
+    goto lost;
+
+  /* only the last request can be outstanding, but skip anything else */
+  do {
+    if (client_read(client, &msg, sizeof(msg)) < 0 || msg.len > WBHD_MAX_PAYLOAD ||
+        client_read(client, buf, msg.len) < 0)
+      goto lost;
+  } while (msg.id != client->id);
+
+  if (msg.status < 0) {
+    memcpy(client->error, buf, msg.len);
+    client->error[msg.len] = 0;
+    if (msg.status < -ERR_INVAL)
+      msg.status = -ERR_INVAL;
+    iface_set_error(NULL, -msg.status, client->error);
+    return msg.status;
+  }
+  if (reply)
+    memcpy(reply, buf, msg.len);
+  if (reply_len)
+    *reply_len = msg.len;
+  return msg.status;
+
+lost:
+  iface_set_error(NULL, ERR_SERIAL, "wbh_client: connection to daemon lost");
+  return -ERR_SERIAL;
+}
+
+int wbh_client_read_measurements_into(wbh_client_t *client, int iface,
+                                      uint8_t device, uint8_t group,
+                                      wbh_measurement_t *data, int max)
+{
+  uint8_t raw[WBHD_MAX_PAYLOAD];
+  size_t len;
+  int rc, i;
+
+  rc = client_call(client, WBHD_MEASUREMENTS, iface, device, group, 0, NULL, 0, raw, &len);
+  for (i = 0; i < rc && i < max && 3 * i + 2 < len; i++)
+    wbh_decode_measurement((const wbh_raw_measurement_t *)&raw[3 * i], &data[i]);
+  return rc;
+}
+
+int wbh_client_get_dtc_into(wbh_client_t *client, int iface, uint8_t device,
+                            wbh_dtc_t *dtc, int max)
+{
+  uint8_t buf[WBHD_MAX_PAYLOAD];
+  size_t len;
+  int rc, i;
+
+  rc = client_call(client, WBHD_DTC, iface, device, 0, 0, NULL, 0, buf, &len);
+  for (i = 0; i < rc && i < max && 3 * i + 2 < len; i++) {
+    memcpy(&dtc[i].error_code, &buf[3 * i], sizeof(uint16_t));
+    dtc[i].status_code = buf[3 * i + 2];
+  }
+  return rc;
+}
+
+/** Copy a text reply into a caller's buffer. */
+static int client_text(int rc, const char *buf, size_t len, char *out, size_t size)
+{
+  if (rc < 0)
+    return rc;
+  if (size) {
+    if (len >= size)
+      len = size - 1;
+    memcpy(out, buf, len);
+    out[len] = 0;
+  }
+  return rc;
+}
+
+int wbh_client_get_specs(wbh_client_t *client, int iface, uint8_t device,
+                         char *specs, size_t size)
+{
+  char buf[WBHD_MAX_PAYLOAD];
+  size_t len = 0;
+  int rc = client_call(client, WBHD_SPECS, iface, device, 0, 0, NULL, 0, buf, &len);
+  return client_text(rc, buf, len, specs, size);
+}
+
+int wbh_client_send_command(wbh_client_t *client, int iface, uint8_t device,
+                            const char *cmd, char *data, size_t data_size)
+{
+  char buf[WBHD_MAX_PAYLOAD];
+  size_t len = 0;
+  int rc = client_call(client, WBHD_COMMAND, iface, device, 0, 0, cmd, strlen(cmd),
+                       buf, &len);
+  return client_text(rc, buf, len, data, data_size);
+}
+
+int wbh_client_scan_devices_into(wbh_client_t *client, int iface, uint8_t start,
+                                 uint8_t end, uint8_t *devices, int max)
+{
+  uint8_t buf[WBHD_MAX_PAYLOAD];
+  size_t len;
+  int rc = client_call(client, WBHD_SCAN, iface, 0, start, end, NULL, 0, buf, &len);
+  if (rc > 0)
+    memcpy(devices, buf, rc < max ? rc : max);
+  return rc;
+}
+
+int wbh_client_get_analog(wbh_client_t *client, int iface, uint8_t pin)
+{
+  return client_call(client, WBHD_ANALOG, iface, 0, pin, 0, NULL, 0, NULL, NULL);
+}
+
+int wbh_client_get_bdt(wbh_client_t *client, int iface)
+{
+  return client_call(client, WBHD_GET_BDT, iface, 0, 0, 0, NULL, 0, NULL, NULL);
+}
+
+int wbh_client_set_bdt(wbh_client_t *client, int iface, uint8_t bdt)
+{
+  return client_call(client, WBHD_SET_BDT, iface, 0, bdt, 0, NULL, 0, NULL, NULL);
+}
+
+int wbh_client_get_ibt(wbh_client_t *client, int iface)
+{
+  return client_call(client, WBHD_GET_IBT, iface, 0, 0, 0, NULL, 0, NULL, NULL);
+}
+
+int wbh_client_set_ibt(wbh_client_t *client, int iface, uint8_t ibt)
+{
+  return client_call(client, WBHD_SET_IBT, iface, 0, ibt, 0, NULL, 0, NULL, NULL);
+}
+
+int wbh_client_get_stats(wbh_client_t *client, int iface, wbhd_stats_t *stats)
+{
+  uint8_t buf[WBHD_MAX_PAYLOAD];
+  size_t len;
+  int rc = client_call(client, WBHD_STATS, iface, 0, 0, 0, NULL, 0, buf, &len);
+  if (rc < 0)
+    return rc;
+  if (len != sizeof(wbhd_stats_t)) {
+    iface_set_error(NULL, ERR_DATA, "wbh_client_get_stats: malformed reply");
+    return -ERR_DATA;
+  }
+  memcpy(stats, buf, sizeof(wbhd_stats_t));
+  return 0;
+}
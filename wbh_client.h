@@ -0,0 +1,201 @@
+#ifndef WBH_CLIENT_H
+#define WBH_CLIENT_H
+
+#include <stdint.h>
+#include "wbh.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Client of the wbhd adapter daemon.
+    wbhd owns one or more adapters and lets several programs use them at
+    the same time over a Unix-domain socket.  The calls below mirror those
+    of wbh.h, with a connection to the daemon and the number of the
+    adapter (counting from 0, in the order given to wbhd) in place of the
+    interface handle, and a device ID in place of the device handle: the
+    daemon connects to a device when it is asked for and hangs up once it
+    has not been used for a while.  Reads that several clients ask for at
+    the same time are answered by a single exchange.
+ */
+
+/** socket wbhd listens on unless told otherwise */
+#define WBHD_SOCKET "/tmp/wbhd.sock"
+
+/** largest payload of a message */
+#define WBHD_MAX_PAYLOAD 256
+
+/** request types */
+enum {
+  WBHD_MEASUREMENTS = 1,	/**< read group arg of device; reply: formula,
+                                     a and b byte of each measurement */
+  WBHD_DTC,			/**< read the DTCs of device; reply: error code
+                                     (uint16_t) and status byte of each */
+  WBHD_SPECS,			/**< identification of device; reply: text */
+  WBHD_COMMAND,			/**< send the command in the payload to device;
+                                     reply: response text */
+  WBHD_SCAN,			/**< scan devices arg to arg2 - 1; reply: IDs */
+  WBHD_ANALOG,			/**< read analog pin arg */
+  WBHD_GET_BDT,			/**< read the block delay time */
+  WBHD_SET_BDT,			/**< set the block delay time to arg */
+  WBHD_GET_IBT,			/**< read the inter-byte time */
+  WBHD_SET_IBT,			/**< set the inter-byte time to arg */
+  WBHD_STATS,			/**< daemon statistics; reply: wbhd_stats_t */
+  WBHD_TYPES
+};
+
+/** message header
+    A request is answered by a message with the same id and type.  All
+    values are in the byte order of the host; the socket is local.
+ */
+typedef struct {
+  uint32_t len;			/**< payload bytes after the header */
+  uint32_t id;			/**< chosen by the client, echoed in the reply */
+  uint8_t type;			/**< WBHD_* */
+  uint8_t iface;		/**< number of the adapter */
+  uint8_t device;		/**< device ID */
+  uint8_t arg;			/**< see the request types */
+  uint8_t arg2;
+  uint8_t reserved[3];
+  int32_t status;		/**< reply: result as returned by the wbh.h
+                                     call, or negative error code; the
+                                     payload is the error message then */
+} wbhd_msg_t;
+
+/** daemon statistics of one adapter */
+typedef struct {
+  uint64_t requests;		/**< requests received */
+  uint64_t coalesced;		/**< requests answered by another one's
+                                     exchange */
+  uint64_t operations;		/**< operations run on the adapter */
+  uint64_t errors;		/**< operations that failed */
+  uint64_t connects;		/**< connections made to devices */
+} wbhd_stats_t;
+
+/** connection to the daemon (opaque)
+    A connection must only be used by one thread at a time.
+ */
+typedef struct wbh_client wbh_client_t;
+
+/** connect to the daemon
+    @param path socket, NULL for WBHD_SOCKET
+    @return connection handle or NULL on error
+ */
+wbh_client_t *wbh_client_open(const char *path);
+
+/** close a connection to the daemon
+    @param client connection handle, may be NULL
+ */
+void wbh_client_close(wbh_client_t *client);
+
+/** read a measurement group, see wbh_read_measurements_into()
+    The values are decoded by the client.
+    @param client connection handle
+    @param iface number of the adapter
+    @param device device ID
+    @param group measurement group
+    @param data array receiving the measurements
+    @param max number of elements in data
+    @return number of measurements reported or negative error code
+ */
+int wbh_client_read_measurements_into(wbh_client_t *client, int iface,
+                                      uint8_t device, uint8_t group,
+                                      wbh_measurement_t *data, int max);
+
+/** read the DTC list, see wbh_get_dtc_into()
+    @param client connection handle
+    @param iface number of the adapter
+    @param device device ID
+    @param dtc array receiving the DTCs
+    @param max number of elements in dtc
+    @return number of DTCs reported or negative error code
+ */
+int wbh_client_get_dtc_into(wbh_client_t *client, int iface, uint8_t device,
+                            wbh_dtc_t *dtc, int max);
+
+/** get the identification a device sends on connect, see
+    wbh_device_t.specs
+    @param client connection handle
+    @param iface number of the adapter
+    @param device device ID
+    @param specs buffer receiving the text, NUL-terminated
+    @param size size of specs
+    @return length of the text or negative error code
+ */
+int wbh_client_get_specs(wbh_client_t *client, int iface, uint8_t device,
+                         char *specs, size_t size);
+
+/** send a custom command to a device, see wbh_send_command_ms()
+    Commands are never coalesced.
+    @param client connection handle
+    @param iface number of the adapter
+    @param device device ID
+    @param cmd command string
+    @param data response buffer, NUL-terminated
+    @param data_size size of data
+    @return bytes read or negative error code
+ */
+int wbh_client_send_command(wbh_client_t *client, int iface, uint8_t device,
+                            const char *cmd, char *data, size_t data_size);
+
+/** scan for devices, see wbh_scan_devices_into()
+    @param client connection handle
+    @param iface number of the adapter
+    @param start first device ID
+    @param end device ID after the last one
+    @param devices array receiving the device IDs
+    @param max number of elements in devices
+    @return number of active devices or negative error code
+ */
+int wbh_client_scan_devices_into(wbh_client_t *client, int iface, uint8_t start,
+                                 uint8_t end, uint8_t *devices, int max);
+
+/** read analog value pin 0..5, see wbh_get_analog()
+    @param client connection handle
+    @param iface number of the adapter
+    @param pin pin number
+    @return analog value or negative error code
+ */
+int wbh_client_get_analog(wbh_client_t *client, int iface, uint8_t pin);
+
+/** read block delay time, see wbh_get_bdt()
+    @param client connection handle
+    @param iface number of the adapter
+    @return block delay time in ms or negative error code
+ */
+int wbh_client_get_bdt(wbh_client_t *client, int iface);
+/** set block delay time, see wbh_set_bdt()
+    @param client connection handle
+    @param iface number of the adapter
+    @param bdt block delay time (ms)
+    @return zero or negative error code
+ */
+int wbh_client_set_bdt(wbh_client_t *client, int iface, uint8_t bdt);
+
+/** read inter-byte time, see wbh_get_ibt()
+    @param client connection handle
+    @param iface number of the adapter
+    @return inter-byte delay in ms or negative error code
+ */
+int wbh_client_get_ibt(wbh_client_t *client, int iface);
+/** set inter-byte time, see wbh_set_ibt()
+    @param client connection handle
+    @param iface number of the adapter
+    @param ibt inter-byte delay time (ms)
+    @return zero or negative error code
+ */
+int wbh_client_set_ibt(wbh_client_t *client, int iface, uint8_t ibt);
+
+/** retrieve the daemon's statistics of an adapter
+    @param client connection handle
+    @param iface number of the adapter
+    @param stats receives the statistics
+    @return zero or negative error code
+ */
+int wbh_client_get_stats(wbh_client_t *client, int iface, wbhd_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
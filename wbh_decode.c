@@ -0,0 +1,401 @@
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "wbh.h"
+#include "wbh_priv.h"
+
+/* Batch decoder for raw measurements.
+   The formula expressions are the ones wbh_decode_measurement() uses,
+   evaluated the same way, so the results are identical; but each formula
+   runs as a plain loop over contiguous byte arrays that the compiler can
+   vectorize, rather than as one indirect call per triplet.  To that end,
+   the triplets of a chunk are grouped by formula, decoded formula by
+   formula and put back in their original order, using a counting sort.
+
+   Grouping only pays where it takes the place of branches the CPU cannot
+   predict, or where the whole chunk uses one formula and needs no grouping
+   at all.  Logs of the same measurement groups read over and over repeat
+   the same short pattern of formulas, which the CPU predicts perfectly;
+   sorting or striding those by formula costs more than the vector loops
+   save, so they are decoded one triplet at a time. */
+
+/** triplets handled per pass; keeps the scratch arrays on the stack and in
+    the L1 cache */
+#define CHUNK 1024
+
+/** longest repeating pattern of formulas recognized */
+#define MAX_PERIOD 32
+
+/** decode a run of triplets that all use the same formula */
+typedef void (*decode_run_t)(const uint8_t *as, const uint8_t *bs, float *out, int n);
+
+#define FORMULA(name, formula, eunit) \
+static void decode_ ## name (const uint8_t *as, const uint8_t *bs, float *out, int n) \
+{ \
+  int i; \
+  for (i = 0; i < n; i++) { \
+    uint8_t a = as[i], b = bs[i]; \
+    (void)a; (void)b; \
+    out[i] = formula; \
+  } \
+}
+#include "wbh_formulas.h"
+#undef FORMULA
+
+static void decode_unknown(const uint8_t *as, const uint8_t *bs, float *out, int n)
+{
+  int i;
+  for (i = 0; i < n; i++)
+    out[i] = 0;
+}
+
+/** decoders indexed by formula */
+static const decode_run_t decoders[256] = {
+  [0 ... 255] = decode_unknown,
+#define FORMULA(name, formula, eunit) [name] = decode_ ## name,
+#include "wbh_formulas.h"
+#undef FORMULA
+};
+
+/** units indexed by formula */
+static const wbh_unit_t units[256] = {
+  [0 ... 255] = UNIT_UNKNOWN,
+#define FORMULA(name, formula, eunit) [name] = eunit,
+#include "wbh_formulas.h"
+#undef FORMULA
+};
+
+/** Find the period of the formulas in a chunk.
+    @param max longest period of interest
+    @return smallest p <= max so that every triplet uses the same formula
+            as the one p places before it, 0 if there is none */
+static int find_period(const wbh_raw_measurement_t *raw, int n, int max)
+{
+  int p, i;
+  for (p = 1; p <= max && p < n; p++) {
+    if (raw[p].formula != raw[0].formula)
+      continue;
+    for (i = p; i < n && raw[i].formula == raw[i - p].formula; i++)
+      ;
+    if (i == n)
+      return p;
+  }
+  return n <= max ? n : 0;
+}
+
+/** Decode a chunk whose triplets all use the same formula. */
+static void decode_uniform(const wbh_raw_measurement_t *raw, int n,
+                           float *values, wbh_unit_t *unit)
+{
+  uint8_t as[CHUNK], bs[CHUNK];
+  int f = raw[0].formula;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    as[i] = raw[i].a;
+    bs[i] = raw[i].b;
+  }
+  decoders[f](as, bs, values, n);
+  if (unit) {
+    for (i = 0; i < n; i++)
+      unit[i] = units[f];
+  }
+}
+
+/** Decode a chunk one triplet at a time. */
+static void decode_each(const wbh_raw_measurement_t *raw, int n,
+                        float *values, wbh_unit_t *unit)
+{
+  wbh_measurement_t m;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    wbh_decode_measurement(&raw[i], &m);
+    values[i] = m.value;
+    if (unit)
+      unit[i] = m.unit;
+  }
+}
+
+/** Decode a chunk with an irregular mix of formulas by sorting it. */
+static void decode_sorted(const wbh_raw_measurement_t *raw, int n,
+                          float *values, wbh_unit_t *unit)
+{
+  uint16_t start[257] = { 0 };
+  uint16_t idx[CHUNK];
+  uint8_t as[CHUNK], bs[CHUNK];
+  float out[CHUNK];
+  int i, f;
+
+  for (i = 0; i < n; i++)
+    start[raw[i].formula + 1]++;
+  for (f = 0; f < 256; f++)
+    start[f + 1] += start[f];
+  for (i = 0; i < n; i++) {
+    f = raw[i].formula;
+    int p = start[f]++;
+    idx[p] = i;
+    as[p] = raw[i].a;
+    bs[p] = raw[i].b;
+    if (unit)
+      unit[i] = units[f];
+  }
+
+  /* one tight loop per formula present; start[f] now is where formula
+     f + 1 begins */
+  for (f = 0; f < 256; f++) {
+    int begin = f ? start[f - 1] : 0;
+    if (start[f] > begin)
+      decoders[f](as + begin, bs + begin, out + begin, start[f] - begin);
+  }
+
+  for (i = 0; i < n; i++)
+    values[idx[i]] = out[i];
+}
+
+void wbh_decode_batch(const wbh_raw_measurement_t *raw, size_t count,
+                      float *values, wbh_unit_t *unit)
+{
+  size_t i, n;
+
+  for (i = 0; i < count; i += n) {
+    n = count - i < CHUNK ? count - i : CHUNK;
+    if (find_period(raw + i, n, 1) == 1)
+      decode_uniform(raw + i, n, values + i, unit ? unit + i : NULL);
+    /* a pattern only has to be seen to choose between the other two; both
+       decode any chunk correctly */
+    else if (find_period(raw + i, n < 4 * MAX_PERIOD ? n : 4 * MAX_PERIOD, MAX_PERIOD))
+      decode_each(raw + i, n, values + i, unit ? unit + i : NULL);
+    else
+      decode_sorted(raw + i, n, values + i, unit ? unit + i : NULL);
+  }
+}
+
+/* Decode cache.
+   A channel of a measurement group keeps its formula and its first byte
+   (a) from one reading to the next, so the cache keeps a table of values
+   indexed by the second byte (b) for every (formula, a) pair seen.  Entries
+   are filled in on first use.  Tables are found through a small hash table,
+   and the table last used at each channel of each group is remembered, so
+   decoding a group that has not changed shape takes one compare per value.
+
+   When all tables are in use, a value that has no table is decoded without
+   one, and every few such values a clock hand moves one table ahead: a
+   table used since the hand last passed gets another round, one that was
+   not is recycled.  Unlike least recently used eviction, this keeps part
+   of a working set larger than the cache instead of recycling every table
+   just before its next use, and it costs nothing per value found. */
+
+/** values decoded without a table per step of the clock hand */
+#define CLOCK_PACE 4
+
+/** lookup table for one (formula, a) pair */
+typedef struct {
+  uint16_t key;			/**< formula << 8 | a */
+  int16_t chain;		/**< next table in the same hash bucket, -1 if none */
+  wbh_unit_t unit;
+  uint8_t used;			/**< used since the clock hand last passed */
+  uint64_t valid[4];		/**< entries of value[] filled in */
+  float value[256];		/**< value for each b */
+} lut_t;
+
+struct wbh_decode_cache {
+  int max;			/**< most tables kept */
+  int count;			/**< tables in use */
+  int mask;			/**< hash buckets - 1 */
+  int hand;			/**< next table considered for recycling */
+  unsigned skip;		/**< values decoded without a table */
+  int16_t *bucket;		/**< first table per hash bucket, -1 if none */
+  int16_t *last;		/**< table last used per group and channel, -1 if none */
+  lut_t *lut;			/**< tables */
+  wbh_decode_cache_stats_t stats;
+};
+
+wbh_decode_cache_t *wbh_decode_cache_new(int max_tables)
+{
+  wbh_decode_cache_t *cache;
+  int buckets = 1, i;
+
+  if (max_tables <= 0)
+    max_tables = WBH_DECODE_CACHE_DEFAULT;
+  if (max_tables > 4096)
+    max_tables = 4096;
+  while (buckets < max_tables * 2)
+    buckets <<= 1;
+
+  cache = calloc(1, sizeof(wbh_decode_cache_t));
+  if (!cache)
+    return NULL;
+  cache->bucket = malloc(buckets * sizeof(int16_t));
+  cache->last = malloc(256 * WBH_MAX_MEASUREMENTS * sizeof(int16_t));
+  cache->lut = malloc(max_tables * sizeof(lut_t));
+  if (!cache->bucket || !cache->last || !cache->lut) {
+    wbh_decode_cache_free(cache);
+    return NULL;
+  }
+  cache->max = max_tables;
+  cache->mask = buckets - 1;
+  for (i = 0; i < buckets; i++)
+    cache->bucket[i] = -1;
+  for (i = 0; i < 256 * WBH_MAX_MEASUREMENTS; i++)
+    cache->last[i] = -1;
+  return cache;
+}
+
+void wbh_decode_cache_free(wbh_decode_cache_t *cache)
+{
+  if (!cache)
+    return;
+  free(cache->bucket);
+  free(cache->last);
+  free(cache->lut);
+  free(cache);
+}
+
+static inline int lut_hash(wbh_decode_cache_t *cache, uint16_t key)
+{
+  return (key * 40503u >> 8) & cache->mask;
+}
+
+/** Remove a table from its hash chain. */
+static void hash_unlink(wbh_decode_cache_t *cache, int i)
+{
+  int16_t *p = &cache->bucket[lut_hash(cache, cache->lut[i].key)];
+  while (*p != i)
+    p = &cache->lut[*p].chain;
+  *p = cache->lut[i].chain;
+}
+
+/** Find the table for a key, setting up an empty one if there is none.
+    @return index of the table, -1 if none could be freed */
+static int lut_find(wbh_decode_cache_t *cache, uint16_t key)
+{
+  int h = lut_hash(cache, key);
+  lut_t *t;
+  int i;
+
+  for (i = cache->bucket[h]; i >= 0; i = cache->lut[i].chain) {
+    if (cache->lut[i].key == key)
+      return i;
+  }
+
+  if (cache->count < cache->max)
+    i = cache->count++;
+  else {
+    if (++cache->skip & (CLOCK_PACE - 1))
+      return -1;
+    i = cache->hand;
+    cache->hand = (i + 1) % cache->max;
+    if (cache->lut[i].used) {
+      cache->lut[i].used = 0;
+      return -1;
+    }
+    hash_unlink(cache, i);
+    cache->stats.evictions++;
+  }
+  t = &cache->lut[i];
+  t->key = key;
+  t->unit = units[key >> 8];
+  t->used = 1;
+  memset(t->valid, 0, sizeof(t->valid));
+  t->chain = cache->bucket[h];
+  cache->bucket[h] = i;
+  return i;
+}
+
+/** Decode a value through a table, filling in the entry if needed.
+    @param i index of the table, -1 to decode without one */
+static inline void lut_decode(wbh_decode_cache_t *cache, int i,
+                              const wbh_raw_measurement_t *raw, wbh_measurement_t *data)
+{
+  uint8_t b = raw->b;
+  lut_t *t;
+
+  if (i < 0) {
+    cache->stats.misses++;
+    wbh_decode_measurement(raw, data);
+    return;
+  }
+  t = &cache->lut[i];
+  if (!t->used)
+    t->used = 1;
+  if (t->valid[b >> 6] & 1ULL << (b & 63)) {
+    cache->stats.hits++;
+    data->value = t->value[b];
+    data->unit = t->unit;
+    data->raw[0] = raw->formula;
+    data->raw[1] = raw->a;
+    data->raw[2] = b;
+    return;
+  }
+  cache->stats.misses++;
+  wbh_decode_measurement(raw, data);
+  t->value[b] = data->value;
+  t->valid[b >> 6] |= 1ULL << (b & 63);
+}
+
+void wbh_decode_cached(wbh_decode_cache_t *cache, const wbh_raw_measurement_t *raw,
+                       wbh_measurement_t *data)
+{
+  lut_decode(cache, lut_find(cache, raw->formula << 8 | raw->a), raw, data);
+}
+
+void decode_cached_channel(wbh_decode_cache_t *cache, uint8_t group, int channel,
+                           const wbh_raw_measurement_t *raw, wbh_measurement_t *data)
+{
+  uint16_t key = raw->formula << 8 | raw->a;
+  int16_t *last = &cache->last[group * WBH_MAX_MEASUREMENTS + channel];
+  int i = *last;
+
+  /* the table may have been recycled for another key since */
+  if (i < 0 || cache->lut[i].key != key)
+    *last = i = lut_find(cache, key);
+  lut_decode(cache, i, raw, data);
+}
+
+void wbh_decode_cached_group(wbh_decode_cache_t *cache, uint8_t group,
+                             const wbh_raw_measurement_t *raw, int count,
+                             wbh_measurement_t *data)
+{
+  const int16_t *last = &cache->last[group * WBH_MAX_MEASUREMENTS];
+  lut_t *lut = cache->lut;
+  unsigned long hits = 0;
+  int i;
+
+  if (count > WBH_MAX_MEASUREMENTS)
+    count = WBH_MAX_MEASUREMENTS;
+  /* the usual case inline, with everything in locals: the stores to
+     data->raw[] may alias anything, which would force the compiler to
+     reload the cache's fields after each value */
+  for (i = 0; i < count; i++) {
+    uint16_t key = raw[i].formula << 8 | raw[i].a;
+    uint8_t b = raw[i].b;
+    lut_t *t = last[i] >= 0 ? &lut[last[i]] : NULL;
+    if (t && t->key == key && t->valid[b >> 6] & 1ULL << (b & 63)) {
+      if (!t->used)
+        t->used = 1;
+      data[i].value = t->value[b];
+      data[i].unit = t->unit;
+      data[i].raw[0] = raw[i].formula;
+      data[i].raw[1] = raw[i].a;
+      data[i].raw[2] = b;
+      hits++;
+    }
+    else
+      decode_cached_channel(cache, group, i, &raw[i], &data[i]);
+  }
+  cache->stats.hits += hits;
+}
+
+void wbh_decode_cache_get_stats(wbh_decode_cache_t *cache,
+                                wbh_decode_cache_stats_t *stats)
+{
+  *stats = cache->stats;
+  stats->tables = cache->count;
+}
+
+void wbh_decode_cache_reset_stats(wbh_decode_cache_t *cache)
+{
+  memset(&cache->stats, 0, sizeof(cache->stats));
+}
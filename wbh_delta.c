@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "wbh.h"
+#include "wbh_priv.h"
+
+/* Change detection.
+   For every group, the raw bytes of the last sample and the values last
+   passed on are kept.  A channel whose raw bytes are the same as last
+   time is skipped without being decoded; one that did change is decoded
+   and passed on unless its value stays within the channel's deadband of
+   the value last passed on.  Comparing against the value passed on, not
+   the previous sample, keeps a slow drift from hiding inside the
+   deadband forever. */
+
+/** change detection state of one group */
+typedef struct {
+  int count;			/**< channels in the last sample, -1 if none yet */
+  unsigned long samples;	/**< samples since the last keyframe */
+  wbh_raw_measurement_t raw[WBH_MAX_MEASUREMENTS];	/**< last sample */
+  float value[WBH_MAX_MEASUREMENTS];	/**< values last passed on */
+  wbh_unit_t unit[WBH_MAX_MEASUREMENTS];
+  float deadband[WBH_MAX_MEASUREMENTS];
+} delta_group_t;
+
+struct wbh_delta {
+  int keyframe_interval;
+  delta_group_t *groups[256];
+  wbh_delta_stats_t stats;
+};
+
+wbh_delta_t *wbh_delta_new(int keyframe_interval)
+{
+  wbh_delta_t *delta = calloc(1, sizeof(wbh_delta_t));
+  if (!delta) {
+    iface_set_error(NULL, ERR_INVAL, "wbh_delta_new: calloc() failed");
+    return NULL;
+  }
+  delta->keyframe_interval = keyframe_interval > 0 ? keyframe_interval : 0;
+  return delta;
+}
+
+void wbh_delta_free(wbh_delta_t *delta)
+{
+  int i;
+  if (!delta)
+    return;
+  for (i = 0; i < 256; i++)
+    free(delta->groups[i]);
+  free(delta);
+}
+
+/** Get the state of a group, creating it if need be. */
+static delta_group_t *delta_group(wbh_delta_t *delta, uint8_t group)
+{
+  delta_group_t *g = delta->groups[group];
+  if (!g) {
+    if (!(g = calloc(1, sizeof(delta_group_t)))) {
+      iface_set_error(NULL, ERR_INVAL, "wbh_delta: calloc() failed");
+      return NULL;
+    }
+    g->count = -1;
+    delta->groups[group] = g;
+  }
+  return g;
+}
+
+int wbh_delta_set_deadband(wbh_delta_t *delta, uint8_t group, int channel,
+                           float deadband)
+{
+  delta_group_t *g;
+  int i;
+
+  if (channel >= WBH_MAX_MEASUREMENTS || deadband < 0) {
+    iface_set_error(NULL, ERR_INVAL, "wbh_delta_set_deadband: invalid channel or deadband");
+    return -ERR_INVAL;
+  }
+  if (!(g = delta_group(delta, group)))
+    return -ERR_INVAL;
+  for (i = 0; i < WBH_MAX_MEASUREMENTS; i++) {
+    if (channel < 0 || i == channel)
+      g->deadband[i] = deadband;
+  }
+  return 0;
+}
+
+void wbh_delta_reset(wbh_delta_t *delta)
+{
+  int i;
+  for (i = 0; i < 256; i++) {
+    if (delta->groups[i])
+      delta->groups[i]->count = -1;
+  }
+}
+
+int delta_apply(wbh_delta_t *delta, wbh_decode_cache_t *cache, uint8_t group,
+                const wbh_raw_measurement_t *raw, int count,
+                wbh_change_t *changes, int *keyframe)
+{
+  delta_group_t *g = delta_group(delta, group);
+  wbh_measurement_t m;
+  int i, n = 0, key;
+
+  if (!g)
+    return -ERR_INVAL;
+  if (count > WBH_MAX_MEASUREMENTS)
+    count = WBH_MAX_MEASUREMENTS;
+
+  /* a group that changed shape starts over */
+  key = g->count != count ||
+        (delta->keyframe_interval && g->samples >= delta->keyframe_interval);
+  if (key)
+    g->samples = 0;
+  g->samples++;
+  g->count = count;
+
+  /* most of the time, nothing at all has changed */
+  if (!key && !memcmp(raw, g->raw, count * sizeof(wbh_raw_measurement_t))) {
+    delta->stats.samples++;
+    delta->stats.channels += count;
+    delta->stats.skipped += count;
+    if (keyframe)
+      *keyframe = 0;
+    return 0;
+  }
+
+  for (i = 0; i < count; i++) {
+    if (!key && raw[i].formula == g->raw[i].formula && raw[i].a == g->raw[i].a &&
+        raw[i].b == g->raw[i].b) {
+      delta->stats.skipped++;
+      continue;
+    }
+    g->raw[i] = raw[i];
+    if (cache)
+      decode_cached_channel(cache, group, i, &raw[i], &m);
+    else
+      wbh_decode_measurement(&raw[i], &m);
+    delta->stats.decoded++;
+    if (!key && m.unit == g->unit[i] && fabsf(m.value - g->value[i]) <= g->deadband[i]) {
+      delta->stats.suppressed++;
+      continue;
+    }
+    g->value[i] = m.value;
+    g->unit[i] = m.unit;
+    changes[n].channel = i;
+    changes[n].data = m;
+    n++;
+  }
+
+  delta->stats.samples++;
+  delta->stats.channels += count;
+  delta->stats.emitted += n;
+  if (key)
+    delta->stats.keyframes++;
+  if (keyframe)
+    *keyframe = key;
+  return n;
+}
+
+int wbh_delta_apply(wbh_delta_t *delta, uint8_t group,
+                    const wbh_raw_measurement_t *raw, int count,
+                    wbh_change_t *changes, int *keyframe)
+{
+  return delta_apply(delta, NULL, group, raw, count, changes, keyframe);
+}
+
+void wbh_delta_get_stats(wbh_delta_t *delta, wbh_delta_stats_t *stats)
+{
+  *stats = delta->stats;
+}
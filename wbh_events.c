@@ -0,0 +1,193 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "wbh.h"
+#include "wbh_priv.h"
+
+/* Debug event ring.
+   The I/O code is the only writer; it never waits for readers and simply
+   overwrites the oldest event when the ring is full.  Every slot carries
+   a sequence word that is odd while the slot is being written and
+   2 * (event number + 1) once it is complete; a reader copies the event
+   and then checks that the word has not changed, which tells it whether
+   the writer lapped it in the meantime. */
+
+/** default number of events in the ring */
+#define EVENTS_DEFAULT 1024
+
+typedef struct {
+  uint64_t seq;			/**< see above */
+  wbh_event_t ev;
+} event_slot_t;
+
+struct wbh_events {
+  int enabled;			/**< events are being recorded */
+  uint64_t mask;		/**< slots - 1 */
+  uint64_t head;		/**< events recorded so far */
+  uint64_t tail;		/**< events taken out by wbh_events_read() */
+  unsigned long lost;		/**< events overwritten before being read */
+  event_slot_t *slots;
+};
+
+int wbh_events_enable(wbh_interface_t *iface, int size)
+{
+  struct wbh_events *ev = __atomic_load_n(&IFACE(iface)->events, __ATOMIC_ACQUIRE);
+  uint64_t slots = 1;
+
+  if (!ev) {
+    if (size <= 0)
+      size = EVENTS_DEFAULT;
+    while (slots < size)
+      slots <<= 1;
+    ev = calloc(1, sizeof(struct wbh_events));
+    if (!ev || !(ev->slots = calloc(slots, sizeof(event_slot_t)))) {
+      free(ev);
+      iface_set_error(iface, ERR_INVAL, "wbh_events_enable: calloc() failed");
+      return -ERR_INVAL;
+    }
+    ev->mask = slots - 1;
+    /* publish the ring only once it is set up; should two threads race
+       to enable, the loser's ring is dropped */
+    struct wbh_events *expected = NULL;
+    if (!__atomic_compare_exchange_n(&IFACE(iface)->events, &expected, ev, 0,
+                                     __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+      free(ev->slots);
+      free(ev);
+      ev = expected;
+    }
+  }
+  __atomic_store_n(&ev->enabled, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+void wbh_events_disable(wbh_interface_t *iface)
+{
+  struct wbh_events *ev = __atomic_load_n(&IFACE(iface)->events, __ATOMIC_ACQUIRE);
+  if (ev)
+    __atomic_store_n(&ev->enabled, 0, __ATOMIC_RELAXED);
+}
+
+void events_free(wbh_interface_t *iface)
+{
+  if (!IFACE(iface)->events)
+    return;
+  free(IFACE(iface)->events->slots);
+  free(IFACE(iface)->events);
+  IFACE(iface)->events = NULL;
+}
+
+void event_record(wbh_interface_t *iface, int type, int value,
+                  const void *data, size_t len)
+{
+  struct wbh_events *ev = IFACE(iface)->events;
+  struct timespec ts;
+  event_slot_t *slot;
+  uint64_t n;
+
+  if (!__atomic_load_n(&ev->enabled, __ATOMIC_RELAXED))
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  n = ev->head;
+  slot = &ev->slots[n & ev->mask];
+
+  __atomic_store_n(&slot->seq, 2 * n + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  slot->ev.seq = n;
+  slot->ev.timestamp_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  slot->ev.type = type;
+  slot->ev.value = value;
+  if (len > WBH_EVENT_DATA)
+    len = WBH_EVENT_DATA;
+  slot->ev.len = len;
+  if (len)
+    memcpy(slot->ev.data, data, len);
+  __atomic_store_n(&slot->seq, 2 * n + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&ev->head, n + 1, __ATOMIC_RELEASE);
+}
+
+/** Copy event number n out of the ring.
+    @return 1 if copied, 0 if it has been overwritten */
+static int event_copy(struct wbh_events *ev, uint64_t n, wbh_event_t *out)
+{
+  event_slot_t *slot = &ev->slots[n & ev->mask];
+  uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+  if (seq != 2 * n + 2)
+    return 0;
+  memcpy(out, &slot->ev, sizeof(wbh_event_t));
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq;
+}
+
+int wbh_events_read(wbh_interface_t *iface, wbh_event_t *events, int max)
+{
+  struct wbh_events *ev = __atomic_load_n(&IFACE(iface)->events, __ATOMIC_ACQUIRE);
+  uint64_t head;
+  int count = 0;
+
+  if (!ev)
+    return 0;
+  head = __atomic_load_n(&ev->head, __ATOMIC_ACQUIRE);
+  while (count < max && ev->tail < head) {
+    if (head - ev->tail > ev->mask + 1) {
+      ev->lost += head - ev->tail - (ev->mask + 1);
+      ev->tail = head - (ev->mask + 1);
+    }
+    if (event_copy(ev, ev->tail, &events[count]))
+      count++;
+    else
+      ev->lost++;
+    ev->tail++;
+  }
+  return count;
+}
+
+unsigned long wbh_events_lost(wbh_interface_t *iface)
+{
+  struct wbh_events *ev = __atomic_load_n(&IFACE(iface)->events, __ATOMIC_ACQUIRE);
+  return ev ? ev->lost : 0;
+}
+
+/** event type names, by WBH_EV_* */
+static const char *event_names[] = {
+  "write", "read", "prompt", "timeout", "parse-error", "probe",
+};
+
+int wbh_events_dump(wbh_interface_t *iface, FILE *f)
+{
+  struct wbh_events *ev = __atomic_load_n(&IFACE(iface)->events, __ATOMIC_ACQUIRE);
+  uint64_t head, n;
+  wbh_event_t e;
+  int count = 0, i;
+
+  if (!ev)
+    return 0;
+  head = __atomic_load_n(&ev->head, __ATOMIC_ACQUIRE);
+  n = head > ev->mask + 1 ? head - (ev->mask + 1) : 0;
+  for (; n < head; n++) {
+    if (!event_copy(ev, n, &e))
+      continue;
+    fprintf(f, "%llu %llu.%09llu %s %d ", (unsigned long long)e.seq,
+            (unsigned long long)(e.timestamp_ns / 1000000000),
+            (unsigned long long)(e.timestamp_ns % 1000000000),
+            e.type < sizeof(event_names) / sizeof(event_names[0]) ? event_names[e.type] : "?",
+            e.value);
+    for (i = 0; i < e.len; i++) {
+      unsigned char c = e.data[i];
+      if (c == '\r')
+        fputs("\\r", f);
+      else if (c == '\n')
+        fputs("\\n", f);
+      else if (c == '\\')
+        fputs("\\\\", f);
+      else if (c >= 0x20 && c < 0x7f)
+        fputc(c, f);
+      else
+        fprintf(f, "\\x%02x", c);
+    }
+    fputc('\n', f);
+    count++;
+  }
+  return count;
+}
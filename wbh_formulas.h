@@ -0,0 +1,75 @@
+/* The various formulas as defined int the WBH-Diag Pro datasheet.
+   Included with FORMULA(number, value expression in a and b, unit) defined
+   to generate code for each formula; the expressions are evaluated with
+   the raw bytes a and b as uint8_t.  Formulas not listed here (0, 37) are
+   unknown. */
+
+FORMULA(1, .2 * a * b, UNIT_RPM)
+FORMULA(2, a * .002 * b, UNIT_PERCENT)
+FORMULA(3, .002 * a * b, UNIT_DEG)
+FORMULA(4, fabs(b - 127.0) * .01 * a, UNIT_UNKNOWN /* FIXME */)
+FORMULA(5, a * (b - 100.0) * .1, UNIT_CELSIUS)
+FORMULA(6, .001 * a * b, UNIT_VOLT)
+FORMULA(7, .01 * a * b, UNIT_KMH)
+FORMULA(8, .1 * a * b, UNIT_NONE)
+FORMULA(9, (b - 127.0) * .02 * a, UNIT_DEG)
+FORMULA(10, b, UNIT_NONE /* FIXME: "cold"/"warm" */)
+FORMULA(11, .0001 * a * (b - 128.0) + 1, UNIT_NONE)
+FORMULA(12, .001 * a * b, UNIT_OHM)
+FORMULA(13, (b - 127.0) * .001 * a, UNIT_MILLIMETER)
+FORMULA(14, .005 * a * b, UNIT_BAR)
+FORMULA(15, .01 * a * b, UNIT_MILLISECOND)
+FORMULA(16, 0, UNIT_BITFIELD)
+FORMULA(17, 0, UNIT_CHARS)
+FORMULA(18, .04 * a * b, UNIT_MILLIBAR)
+FORMULA(19, a * b * .01, UNIT_LITER)
+FORMULA(20, a * (b - 128.0) / 128.0, UNIT_PERCENT)
+FORMULA(21, .001 * a * b, UNIT_VOLT)
+FORMULA(22, .001 * a * b, UNIT_MILLISECOND)
+FORMULA(23, b / 256.0 * a, UNIT_PERCENT)
+FORMULA(24, .001 * a * b, UNIT_AMPERE)
+FORMULA(25, b * 1.421 + a / 182.0, UNIT_UNKNOWN /* FIXME: g/s? */)
+FORMULA(26, b - a, UNIT_UNKNOWN /* FIXME: celsius? coulomb? */)
+FORMULA(27, fabs(b - 128.0) * .01 * a, UNIT_UNKNOWN /* FIXME: ATDC/BTDC? */)
+FORMULA(28, b - a, UNIT_NONE)
+FORMULA(29, b < a, UNIT_UNKNOWN /* FIXME: 1./2. Kennfeld? */)
+FORMULA(30, b / 12.0 * a, UNIT_DEG_KW)
+FORMULA(31, b / 2560.0 * a, UNIT_CELSIUS)
+FORMULA(32, (b > 128) ? (b - 256.0) : b, UNIT_NONE)
+FORMULA(33, a == 0 ? (100.0 * b) : (100.0 * b) / a, UNIT_PERCENT)
+FORMULA(34, (b - 128.0) * .01 * a, UNIT_KW)
+FORMULA(35, .01 * a * b, UNIT_LITERS_PER_HOUR)
+FORMULA(36, a * 2560.0 + b * 10.0, UNIT_KM)
+FORMULA(38, (b - 128.0) * .001 * a, UNIT_DEG_KW)
+FORMULA(39, b / 256.0 * a, UNIT_MILLIGRAMS_PER_HOUR)
+FORMULA(40, b * .01 + (25.5 * a) - 400, UNIT_AMPERE)
+FORMULA(41, b + a * 255.0, UNIT_AMPERE_HOUR)
+FORMULA(42, b * .1 + (25.5 * a) - 400, UNIT_UNKNOWN /* FIXME: Kw == kW? */)
+FORMULA(43, b * .1 + (25.5 * a), UNIT_VOLT)
+FORMULA(44, 0, UNIT_TIME)
+FORMULA(45, .1 * a * b / 100.0, UNIT_NONE)
+FORMULA(46, (a * b - 3200.0) * .0027, UNIT_DEG_KW)
+FORMULA(47, (b - 128.0) * a, UNIT_MILLISECOND)
+FORMULA(48, b + a * 255.0, UNIT_NONE)
+FORMULA(49, (b / 4.0) * .1 * a, UNIT_MILLIGRAMS_PER_HOUR)
+FORMULA(50, a == 0 ? (b - 128.0) / .01 : (b - 128.0) / (.01 * a), UNIT_MILLIBAR)
+FORMULA(51, ((b - 128.0) / 255.0) * a, UNIT_MILLIGRAMS_PER_HOUR)
+FORMULA(52, b * .02 * a - a, UNIT_NM)
+FORMULA(53, (b - 128.0) * 1.4222 + .006 * a, UNIT_GS)
+FORMULA(54, a * 256.0 + b, UNIT_NONE)
+FORMULA(55, a * b / 200.0, UNIT_SECOND)
+FORMULA(56, a * 256.0 + b, UNIT_UNKNOWN /* FIXME: WSC? */)
+FORMULA(57, a * 256.0 + b + 65536.0, UNIT_UNKNOWN /* FIXME: WSC? */)
+FORMULA(58, b > 128 ? 1.0225 * (256.0 - b) : 1.0225 * b, UNIT_UNKNOWN /* FIXME: \s? */)
+FORMULA(59, (a * 256.0 + b) / 32768.0, UNIT_NONE)
+FORMULA(60, (a * 256.0 + b) * .01, UNIT_SECOND)
+FORMULA(61, a == 0 ? (b - 128.0) : (b - 128.0) / a, UNIT_NONE)
+FORMULA(62, .256 * a * b, UNIT_UNKNOWN /* FIXME: (capital) S? */)
+FORMULA(63, 0, UNIT_CHARS /* FIXME: with a question mark? */)
+FORMULA(64, a + b, UNIT_OHM)
+FORMULA(65, .01 * a * (b - 127.0), UNIT_MILLIMETER)
+FORMULA(66, (a * b) / 511.12, UNIT_VOLT)
+FORMULA(67, (640.0 * a) + b * 2.5, UNIT_DEG)
+FORMULA(68, (256.0 * a + b) / 7.365, UNIT_DEG_PER_SECOND)
+FORMULA(69, (256.0 * a + b) * .3254, UNIT_BAR)
+FORMULA(70, (256.0 * a + b) * .192, UNIT_METERS_PER_SECOND_SQUARED)
@@ -0,0 +1,228 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "wbh.h"
+
+struct wbh_group {
+  wbh_interface_t **ifaces;	/**< member interfaces */
+  int count;			/**< number of member interfaces */
+  pthread_t *threads;		/**< worker pool */
+  int nthreads;			/**< number of workers */
+  pthread_mutex_t lock;
+  pthread_cond_t work;		/**< signals workers that a job is ready */
+  pthread_cond_t done;		/**< signals the caller that a job is done */
+  wbh_group_job_t job;		/**< job being run */
+  void *ctx;			/**< job context */
+  int next;			/**< next interface to hand to a worker */
+  int pending;			/**< interfaces not yet finished */
+  int shutdown;			/**< tells the workers to exit */
+};
+
+static void *group_worker(void *arg)
+{
+  wbh_group_t *group = arg;
+  int idx;
+
+  pthread_mutex_lock(&group->lock);
+  for (;;) {
+    while (!group->shutdown && group->next >= group->count)
+      pthread_cond_wait(&group->work, &group->lock);
+    if (group->shutdown)
+      break;
+    idx = group->next++;
+    pthread_mutex_unlock(&group->lock);
+
+    group->job(group->ifaces[idx], idx, group->ctx);
+
+    pthread_mutex_lock(&group->lock);
+    if (--group->pending == 0)
+      pthread_cond_signal(&group->done);
+  }
+  pthread_mutex_unlock(&group->lock);
+  return NULL;
+}
+
+wbh_group_t *wbh_group_new(wbh_interface_t **ifaces, int count, int threads)
+{
+  wbh_group_t *group;
+  int i;
+
+  if (count <= 0)
+    return NULL;
+  if (threads <= 0 || threads > count)
+    threads = count;
+
+  group = calloc(1, sizeof(wbh_group_t));
+  if (!group)
+    return NULL;
+  group->ifaces = malloc(count * sizeof(wbh_interface_t *));
+  group->threads = calloc(threads, sizeof(pthread_t));
+  if (!group->ifaces || !group->threads)
+    goto error;
+  memcpy(group->ifaces, ifaces, count * sizeof(wbh_interface_t *));
+  group->count = count;
+  group->next = count;	/* nothing to do yet */
+  pthread_mutex_init(&group->lock, NULL);
+  pthread_cond_init(&group->work, NULL);
+  pthread_cond_init(&group->done, NULL);
+
+  for (i = 0; i < threads; i++) {
+    if (pthread_create(&group->threads[i], NULL, group_worker, group) != 0)
+      break;
+    group->nthreads++;
+  }
+  if (group->nthreads == 0) {
+    wbh_group_free(group);
+    return NULL;
+  }
+  return group;
+
+error:
+  free(group->ifaces);
+  free(group->threads);
+  free(group);
+  return NULL;
+}
+
+void wbh_group_free(wbh_group_t *group)
+{
+  int i;
+  pthread_mutex_lock(&group->lock);
+  group->shutdown = 1;
+  pthread_cond_broadcast(&group->work);
+  pthread_mutex_unlock(&group->lock);
+  for (i = 0; i < group->nthreads; i++)
+    pthread_join(group->threads[i], NULL);
+  pthread_mutex_destroy(&group->lock);
+  pthread_cond_destroy(&group->work);
+  pthread_cond_destroy(&group->done);
+  free(group->ifaces);
+  free(group->threads);
+  free(group);
+}
+
+int wbh_group_size(wbh_group_t *group)
+{
+  return group->count;
+}
+
+void wbh_group_run(wbh_group_t *group, wbh_group_job_t job, void *ctx)
+{
+  pthread_mutex_lock(&group->lock);
+  group->job = job;
+  group->ctx = ctx;
+  group->pending = group->count;
+  group->next = 0;
+  pthread_cond_broadcast(&group->work);
+  while (group->pending > 0)
+    pthread_cond_wait(&group->done, &group->lock);
+  pthread_mutex_unlock(&group->lock);
+}
+
+/** parameters shared by the canned group jobs */
+typedef struct {
+  wbh_group_result_t *results;
+  uint8_t start, end;		/**< scan range */
+  uint8_t device;		/**< device to talk to */
+  uint8_t group;		/**< measurement group */
+} group_op_t;
+
+/** record the outcome of a job in its result slot */
+static void set_status(wbh_group_result_t *res, int status)
+{
+  res->status = status;
+  res->error = NULL;
+  if (status < 0) {
+    if (wbh_iface_errcode(res->iface))
+      res->status = -wbh_iface_errcode(res->iface);
+    res->error = wbh_iface_error(res->iface);
+  }
+}
+
+static void scan_job(wbh_interface_t *iface, int idx, void *ctx)
+{
+  group_op_t *op = ctx;
+  wbh_group_result_t *res = &op->results[idx];
+  wbh_iface_clear_error(iface);
+  res->devices = wbh_scan_devices(iface, op->start, op->end);
+  set_status(res, res->devices ? 0 : -ERR_SERIAL);
+}
+
+static void dtc_job(wbh_interface_t *iface, int idx, void *ctx)
+{
+  group_op_t *op = ctx;
+  wbh_group_result_t *res = &op->results[idx];
+  wbh_iface_clear_error(iface);
+  wbh_device_t *dev = wbh_connect(iface, op->device);
+  if (!dev) {
+    set_status(res, -ERR_SERIAL);
+    return;
+  }
+  res->dtc = wbh_get_dtc(dev);
+  set_status(res, res->dtc ? 0 : -ERR_DATA);
+  wbh_disconnect(dev);
+}
+
+static void measurement_job(wbh_interface_t *iface, int idx, void *ctx)
+{
+  group_op_t *op = ctx;
+  wbh_group_result_t *res = &op->results[idx];
+  wbh_iface_clear_error(iface);
+  wbh_device_t *dev = wbh_connect(iface, op->device);
+  if (!dev) {
+    set_status(res, -ERR_SERIAL);
+    return;
+  }
+  res->measurements = wbh_read_measurements(dev, op->group);
+  set_status(res, res->measurements ? 0 : -ERR_DATA);
+  wbh_disconnect(dev);
+}
+
+/** clear the result array and run one of the canned jobs */
+static int group_op(wbh_group_t *group, wbh_group_job_t job, group_op_t *op)
+{
+  int i, failed = 0;
+  memset(op->results, 0, group->count * sizeof(wbh_group_result_t));
+  for (i = 0; i < group->count; i++)
+    op->results[i].iface = group->ifaces[i];
+  wbh_group_run(group, job, op);
+  for (i = 0; i < group->count; i++) {
+    if (op->results[i].status < 0)
+      failed++;
+  }
+  return failed;
+}
+
+int wbh_group_scan(wbh_group_t *group, uint8_t start, uint8_t end,
+                   wbh_group_result_t *results)
+{
+  group_op_t op = { .results = results, .start = start, .end = end };
+  return group_op(group, scan_job, &op);
+}
+
+int wbh_group_get_dtc(wbh_group_t *group, uint8_t device,
+                      wbh_group_result_t *results)
+{
+  group_op_t op = { .results = results, .device = device };
+  return group_op(group, dtc_job, &op);
+}
+
+int wbh_group_read_measurements(wbh_group_t *group, uint8_t device,
+                                uint8_t mgroup, wbh_group_result_t *results)
+{
+  group_op_t op = { .results = results, .device = device, .group = mgroup };
+  return group_op(group, measurement_job, &op);
+}
+
+void wbh_group_free_results(wbh_group_t *group, wbh_group_result_t *results)
+{
+  int i;
+  for (i = 0; i < group->count; i++) {
+    wbh_free_devices(results[i].devices);
+    wbh_free_dtc(results[i].dtc);
+    wbh_free_measurements(results[i].measurements);
+    results[i].devices = NULL;
+    results[i].dtc = NULL;
+    results[i].measurements = NULL;
+  }
+}
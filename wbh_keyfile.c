@@ -0,0 +1,64 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "wbh_priv.h"
+
+/** longest line we handle in a key file */
+#define LINESIZE 512
+
+int keyfile_lookup(const char *path, const char *key, char *value, size_t size)
+{
+  char line[LINESIZE];
+  size_t klen = strlen(key);
+  int rc = -1;
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return -1;
+  while (fgets(line, LINESIZE, fp)) {
+    if (strncmp(line, key, klen) || line[klen] != '\t')
+      continue;
+    line[strcspn(line, "\n")] = 0;
+    snprintf(value, size, "%s", line + klen + 1);
+    rc = 0;
+    break;
+  }
+  fclose(fp);
+  return rc;
+}
+
+int keyfile_store(const char *path, const char *key, const char *value)
+{
+  char line[LINESIZE];
+  char *tmp;
+  size_t klen = strlen(key);
+  FILE *in, *out;
+
+  tmp = malloc(strlen(path) + 5);
+  if (!tmp)
+    return -1;
+  sprintf(tmp, "%s.new", path);
+  out = fopen(tmp, "w");
+  if (!out) {
+    free(tmp);
+    return -1;
+  }
+
+  /* copy all other entries, then append ours */
+  if ((in = fopen(path, "r"))) {
+    while (fgets(line, LINESIZE, in)) {
+      if (!strncmp(line, key, klen) && line[klen] == '\t')
+        continue;
+      fputs(line, out);
+    }
+    fclose(in);
+  }
+  fprintf(out, "%s\t%s\n", key, value);
+
+  if (fclose(out) != 0 || rename(tmp, path) != 0) {
+    remove(tmp);
+    free(tmp);
+    return -1;
+  }
+  free(tmp);
+  return 0;
+}
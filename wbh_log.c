@@ -0,0 +1,864 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "wbh.h"
+#include "wbh_priv.h"
+
+/* Columnar measurement log.
+   A log file starts with a header:
+
+     char magic[8]        "WBHLOG\0\0"
+     uint32_t version     1
+     uint32_t byteorder   0x01020304 in the byte order of the writer
+
+   followed by blocks holding up to LOG_BLOCK samples of one channel (one
+   device, group and channel position) each:
+
+     log_block_t          see below
+     timestamps           count - 1 zigzag varints: how much the interval
+                          to the previous sample differs from the interval
+                          before (delta of delta)
+     formula, a, b        one column each, run-length encoded (PackBits)
+     padding              zeros to a multiple of 8 bytes
+
+   Closing the log appends an index of the blocks and a trailer:
+
+     log_index_t[count]   one entry per block
+     uint64_t index       offset of the index
+     uint64_t count       number of index entries
+     char magic[8]        "WBHINDEX"
+
+   A log without a trailer, as a writer that crashed leaves behind, can
+   still be read; the index is then rebuilt by walking the blocks.
+
+   Appending a sample only copies it into the channel's current block.  A
+   full block is handed to a writer thread that encodes it and writes it
+   to the file, so neither the encoding nor a slow disk delays the
+   acquisition loop.  If the writer falls more than LOG_QUEUE blocks
+   behind, blocks are dropped and counted. */
+
+#define LOG_MAGIC "WBHLOG\0\0"
+#define LOG_VERSION 1
+#define LOG_BYTEORDER 0x01020304
+#define LOG_BLOCK_MAGIC 0x4b4c4257
+#define LOG_INDEX_MAGIC "WBHINDEX"
+
+/** samples per block */
+#define LOG_BLOCK 1024
+/** full blocks waiting for the writer thread before blocks are dropped */
+#define LOG_QUEUE 256
+/** buckets in the channel hash table */
+#define LOG_HASH 256
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteorder;
+} log_header_t;
+
+typedef struct {
+  uint32_t magic;		/**< LOG_BLOCK_MAGIC */
+  uint32_t size;		/**< bytes in the columns, without padding */
+  uint8_t device;
+  uint8_t group;
+  uint8_t channel;
+  uint8_t reserved;
+  uint32_t count;		/**< samples */
+  uint64_t first;		/**< timestamp of the first sample (ns) */
+  uint64_t last;		/**< timestamp of the last sample (ns) */
+  uint32_t column[4];		/**< bytes in the timestamp, formula, a and b
+                                     columns */
+} log_block_t;
+
+typedef struct {
+  uint64_t offset;		/**< position of the block in the file */
+  uint64_t first;		/**< timestamp of the first sample (ns) */
+  uint64_t last;		/**< timestamp of the last sample (ns) */
+  uint32_t count;		/**< samples */
+  uint8_t device;
+  uint8_t group;
+  uint8_t channel;
+  uint8_t reserved;
+} log_index_t;
+
+typedef struct {
+  uint64_t index;
+  uint64_t count;
+  char magic[8];
+} log_trailer_t;
+
+/** space a block with size bytes of columns takes up in the file */
+#define BLOCK_SIZE(size) (sizeof(log_block_t) + (((size) + 7) & ~(size_t)7))
+
+/** largest block: delta-of-delta varints take 10 bytes at most, a run
+    length encoded column one control byte per 128 bytes */
+#define BLOCK_MAX BLOCK_SIZE((LOG_BLOCK - 1) * 10 + 3 * (LOG_BLOCK + LOG_BLOCK / 128 + 1))
+
+/** samples of one channel, not written yet */
+typedef struct log_chunk {
+  struct log_chunk *next;	/**< next in the queue or the spare list */
+  uint8_t device;
+  uint8_t group;
+  uint8_t channel;
+  int count;
+  uint64_t ts[LOG_BLOCK];
+  wbh_raw_measurement_t raw[LOG_BLOCK];
+} log_chunk_t;
+
+/** channel being logged */
+typedef struct log_series {
+  struct log_series *next;	/**< hash chain */
+  uint32_t key;			/**< device, group and channel */
+  uint64_t last;		/**< latest timestamp */
+  log_chunk_t *chunk;		/**< samples collected, NULL if none */
+} log_series_t;
+
+struct wbh_logger {
+  int fd;			/**< log file */
+  pthread_t thread;		/**< writer */
+  pthread_mutex_t lock;
+  pthread_cond_t wake;		/**< signals the writer that there is work */
+  pthread_cond_t idle;		/**< signals that the queue has been written */
+  log_series_t *hash[LOG_HASH];
+  log_chunk_t *queue;		/**< full blocks for the writer, oldest first */
+  log_chunk_t **queue_tail;
+  int queued;			/**< blocks in the queue */
+  int busy;			/**< the writer is working on a block */
+  log_chunk_t *spare;		/**< blocks written, to be reused */
+  int stop;			/**< tells the writer to finish */
+  int error;			/**< writing to the file failed */
+  wbh_logger_stats_t stats;
+
+  /* owned by the writer thread */
+  uint8_t *buf;			/**< block being encoded */
+  uint64_t offset;		/**< end of the file */
+  log_index_t *index;
+  size_t index_count;
+  size_t index_size;
+};
+
+static uint8_t *put_varint(uint8_t *p, uint64_t v)
+{
+  while (v >= 0x80) {
+    *p++ = v | 0x80;
+    v >>= 7;
+  }
+  *p++ = v;
+  return p;
+}
+
+/** @return position after the varint, NULL if it is cut short */
+static const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+  int shift;
+  *v = 0;
+  for (shift = 0; p < end && shift < 64; shift += 7) {
+    *v |= (uint64_t)(*p & 0x7f) << shift;
+    if (!(*p++ & 0x80))
+      return p;
+  }
+  return NULL;
+}
+
+/** Run-length encode a column (PackBits): a control byte n below 128 is
+    followed by n + 1 literal bytes, one of 128 or more by a single byte
+    that is repeated n - 125 times. */
+static uint8_t *put_column(uint8_t *p, const uint8_t *col, int count)
+{
+  int i = 0, start, run;
+
+  while (i < count) {
+    for (run = 1; i + run < count && run < 130 && col[i + run] == col[i]; run++)
+      ;
+    if (run >= 3) {
+      *p++ = run + 125;
+      *p++ = col[i];
+      i += run;
+      continue;
+    }
+    /* literals, up to the next run of three */
+    for (start = i; i < count && i - start < 128; i++) {
+      if (i + 2 < count && col[i] == col[i + 1] && col[i] == col[i + 2])
+        break;
+    }
+    *p++ = i - start - 1;
+    memcpy(p, col + start, i - start);
+    p += i - start;
+  }
+  return p;
+}
+
+/** Decode a run-length encoded column.
+    @return zero, or -1 if it does not decode to exactly count bytes */
+static int get_column(const uint8_t *p, const uint8_t *end, uint8_t *col, int count)
+{
+  int i = 0, n;
+
+  while (p < end) {
+    n = *p++;
+    if (n < 128) {
+      if (++n > end - p || n > count - i)
+        return -1;
+      memcpy(col + i, p, n);
+      p += n;
+    }
+    else {
+      if (p == end || (n -= 125) > count - i)
+        return -1;
+      memset(col + i, *p++, n);
+    }
+    i += n;
+  }
+  return i == count ? 0 : -1;
+}
+
+static uint64_t logger_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Encode a block and append it to the file.
+    @return zero or -1 on error */
+static int logger_write_block(struct wbh_logger *log, const log_chunk_t *c)
+{
+  log_block_t *hdr = (log_block_t *)log->buf;
+  uint8_t *start = log->buf + sizeof(log_block_t), *p = start, *q;
+  uint8_t col[LOG_BLOCK];
+  uint64_t delta, prev = 0;
+  size_t size, len;
+  ssize_t rc;
+  int i;
+
+  memset(hdr, 0, sizeof(log_block_t));
+  hdr->magic = LOG_BLOCK_MAGIC;
+  hdr->device = c->device;
+  hdr->group = c->group;
+  hdr->channel = c->channel;
+  hdr->count = c->count;
+  hdr->first = c->ts[0];
+  hdr->last = c->ts[c->count - 1];
+
+  /* sampled at a steady rate, the intervals hardly change */
+  for (i = 1; i < c->count; i++) {
+    int64_t dod;
+    delta = c->ts[i] - c->ts[i - 1];
+    dod = delta - prev;
+    p = put_varint(p, ((uint64_t)dod << 1) ^ (uint64_t)(dod >> 63));
+    prev = delta;
+  }
+  hdr->column[0] = p - start;
+
+  for (i = 0; i < c->count; i++)
+    col[i] = c->raw[i].formula;
+  q = p;
+  p = put_column(p, col, c->count);
+  hdr->column[1] = p - q;
+  for (i = 0; i < c->count; i++)
+    col[i] = c->raw[i].a;
+  q = p;
+  p = put_column(p, col, c->count);
+  hdr->column[2] = p - q;
+  for (i = 0; i < c->count; i++)
+    col[i] = c->raw[i].b;
+  q = p;
+  p = put_column(p, col, c->count);
+  hdr->column[3] = p - q;
+
+  hdr->size = p - start;
+  size = BLOCK_SIZE(hdr->size);
+  memset(p, 0, log->buf + size - p);
+
+  if (log->index_count == log->index_size) {
+    size_t n = log->index_size ? log->index_size * 2 : 256;
+    log_index_t *index = realloc(log->index, n * sizeof(log_index_t));
+    if (!index)
+      return -1;
+    log->index = index;
+    log->index_size = n;
+  }
+
+  for (p = log->buf, len = size; len; ) {
+    rc = write(log->fd, p, len);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc <= 0)
+      return -1;
+    p += rc;
+    len -= rc;
+  }
+
+  log_index_t *e = &log->index[log->index_count++];
+  memset(e, 0, sizeof(log_index_t));
+  e->offset = log->offset;
+  e->first = hdr->first;
+  e->last = hdr->last;
+  e->count = hdr->count;
+  e->device = hdr->device;
+  e->group = hdr->group;
+  e->channel = hdr->channel;
+  log->offset += size;
+  return 0;
+}
+
+static void *logger_writer(void *arg)
+{
+  struct wbh_logger *log = arg;
+  log_chunk_t *c;
+  int rc;
+
+  pthread_mutex_lock(&log->lock);
+  for (;;) {
+    while (!log->stop && !log->queue)
+      pthread_cond_wait(&log->wake, &log->lock);
+    if (!log->queue)
+      break;
+    c = log->queue;
+    if (!(log->queue = c->next))
+      log->queue_tail = &log->queue;
+    log->queued--;
+    log->busy = 1;
+    pthread_mutex_unlock(&log->lock);
+
+    /* after an error, keep consuming so that the appends are not stalled */
+    rc = log->error ? 0 : logger_write_block(log, c);
+
+    pthread_mutex_lock(&log->lock);
+    if (rc < 0)
+      log->error = 1;
+    else if (!log->error) {
+      log->stats.blocks++;
+      log->stats.bytes = log->offset;
+    }
+    c->next = log->spare;
+    log->spare = c;
+    log->busy = 0;
+    if (!log->queue)
+      pthread_cond_broadcast(&log->idle);
+  }
+  pthread_mutex_unlock(&log->lock);
+  return NULL;
+}
+
+/** Queue a block for writing, lock held.
+    @param force queue it even if the writer is behind
+    @return zero, or -1 if the block was dropped */
+static int logger_queue(struct wbh_logger *log, log_chunk_t *c, int force)
+{
+  if (!force && log->queued >= LOG_QUEUE) {
+    log->stats.dropped += c->count;
+    return -1;
+  }
+  c->next = NULL;
+  *log->queue_tail = c;
+  log->queue_tail = &c->next;
+  log->queued++;
+  pthread_cond_signal(&log->wake);
+  return 0;
+}
+
+/** Hand a full block to the writer and get an empty one in exchange.
+    @param full full block, NULL for none
+    @return empty block or NULL if out of memory */
+static log_chunk_t *logger_swap(struct wbh_logger *log, log_chunk_t *full)
+{
+  log_chunk_t *c = NULL;
+
+  pthread_mutex_lock(&log->lock);
+  if (full && logger_queue(log, full, 0) < 0)
+    c = full;
+  else if ((c = log->spare))
+    log->spare = c->next;
+  pthread_mutex_unlock(&log->lock);
+  if (!c && !(c = malloc(sizeof(log_chunk_t))))
+    return NULL;
+  c->count = 0;
+  return c;
+}
+
+/** Find the state of a channel, creating it if need be. */
+static log_series_t *logger_series(struct wbh_logger *log, uint8_t device,
+                                   uint8_t group, uint8_t channel)
+{
+  uint32_t key = device << 16 | group << 8 | channel;
+  log_series_t **head = &log->hash[(key * 2654435761u) >> 24 & (LOG_HASH - 1)];
+  log_series_t *s;
+
+  for (s = *head; s; s = s->next) {
+    if (s->key == key)
+      return s;
+  }
+  if (!(s = calloc(1, sizeof(log_series_t))))
+    return NULL;
+  s->key = key;
+  s->next = *head;
+  *head = s;
+  return s;
+}
+
+wbh_logger_t *wbh_logger_create(const char *path)
+{
+  struct wbh_logger *log;
+  log_header_t hdr = { LOG_MAGIC, LOG_VERSION, LOG_BYTEORDER };
+
+  log = calloc(1, sizeof(struct wbh_logger));
+  if (!log || !(log->buf = malloc(BLOCK_MAX))) {
+    free(log);
+    iface_set_error(NULL, ERR_INVAL, "wbh_logger_create: malloc() failed");
+    return NULL;
+  }
+  log->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (log->fd < 0 || write(log->fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+    iface_set_error(NULL, ERR_INVAL, "wbh_logger_create: cannot create log file");
+    goto fail;
+  }
+  log->offset = sizeof(hdr);
+  log->stats.bytes = log->offset;
+  log->queue_tail = &log->queue;
+  pthread_mutex_init(&log->lock, NULL);
+  pthread_cond_init(&log->wake, NULL);
+  pthread_cond_init(&log->idle, NULL);
+  if (pthread_create(&log->thread, NULL, logger_writer, log)) {
+    pthread_mutex_destroy(&log->lock);
+    pthread_cond_destroy(&log->wake);
+    pthread_cond_destroy(&log->idle);
+    iface_set_error(NULL, ERR_INVAL, "wbh_logger_create: cannot start writer thread");
+    goto fail;
+  }
+  return log;
+
+fail:
+  if (log->fd >= 0)
+    close(log->fd);
+  free(log->buf);
+  free(log);
+  return NULL;
+}
+
+int wbh_logger_append(wbh_logger_t *log, uint8_t device, uint8_t group,
+                      uint64_t timestamp_ns, const wbh_raw_measurement_t *raw,
+                      int count)
+{
+  log_series_t *s;
+  log_chunk_t *c;
+  int i;
+
+  if (__atomic_load_n(&log->error, __ATOMIC_RELAXED)) {
+    iface_set_error(NULL, ERR_SERIAL, "wbh_logger_append: error writing log file");
+    return -ERR_SERIAL;
+  }
+  if (!timestamp_ns)
+    timestamp_ns = logger_now();
+  for (i = 0; i < count; i++) {
+    if (!(s = logger_series(log, device, group, i)) ||
+        (!s->chunk && !(s->chunk = logger_swap(log, NULL)))) {
+      iface_set_error(NULL, ERR_INVAL, "wbh_logger_append: malloc() failed");
+      return -ERR_INVAL;
+    }
+    c = s->chunk;
+    if (!c->count) {
+      c->device = device;
+      c->group = group;
+      c->channel = i;
+    }
+    /* the columns need the timestamps of a channel in order */
+    if (timestamp_ns > s->last)
+      s->last = timestamp_ns;
+    c->ts[c->count] = s->last;
+    c->raw[c->count] = raw[i];
+    if (++c->count == LOG_BLOCK)
+      s->chunk = logger_swap(log, c);
+  }
+  METRIC_ADD(log->stats.samples, count);
+  return 0;
+}
+
+int wbh_logger_append_measurements(wbh_logger_t *log, uint8_t device,
+                                   uint8_t group, uint64_t timestamp_ns,
+                                   const wbh_measurement_t *data, int count)
+{
+  wbh_raw_measurement_t raw[WBH_MAX_MEASUREMENTS];
+  int i;
+
+  if (count > WBH_MAX_MEASUREMENTS)
+    count = WBH_MAX_MEASUREMENTS;
+  for (i = 0; i < count; i++) {
+    raw[i].formula = data[i].raw[0];
+    raw[i].a = data[i].raw[1];
+    raw[i].b = data[i].raw[2];
+  }
+  return wbh_logger_append(log, device, group, timestamp_ns, raw, count);
+}
+
+int wbh_logger_flush(wbh_logger_t *log)
+{
+  log_series_t *s;
+  int i, error;
+
+  pthread_mutex_lock(&log->lock);
+  for (i = 0; i < LOG_HASH; i++) {
+    for (s = log->hash[i]; s; s = s->next) {
+      if (s->chunk && s->chunk->count) {
+        logger_queue(log, s->chunk, 1);
+        s->chunk = NULL;
+      }
+    }
+  }
+  while (log->queue || log->busy)
+    pthread_cond_wait(&log->idle, &log->lock);
+  error = log->error;
+  pthread_mutex_unlock(&log->lock);
+  if (error) {
+    iface_set_error(NULL, ERR_SERIAL, "wbh_logger_flush: error writing log file");
+    return -ERR_SERIAL;
+  }
+  return 0;
+}
+
+void wbh_logger_get_stats(wbh_logger_t *log, wbh_logger_stats_t *stats)
+{
+  pthread_mutex_lock(&log->lock);
+  *stats = log->stats;
+  pthread_mutex_unlock(&log->lock);
+}
+
+long wbh_logger_close(wbh_logger_t *log)
+{
+  log_trailer_t trailer = { 0, 0, LOG_INDEX_MAGIC };
+  log_series_t *s, *next;
+  log_chunk_t *c;
+  long rc;
+  int i;
+
+  if (!log)
+    return 0;
+  wbh_logger_flush(log);
+  pthread_mutex_lock(&log->lock);
+  log->stop = 1;
+  pthread_cond_signal(&log->wake);
+  pthread_mutex_unlock(&log->lock);
+  pthread_join(log->thread, NULL);
+
+  if (!log->error) {
+    size_t len = log->index_count * sizeof(log_index_t);
+    trailer.index = log->offset;
+    trailer.count = log->index_count;
+    if ((len && write(log->fd, log->index, len) != len) ||
+        write(log->fd, &trailer, sizeof(trailer)) != sizeof(trailer))
+      log->error = 1;
+  }
+  if (close(log->fd) < 0)
+    log->error = 1;
+  rc = log->stats.dropped;
+  if (log->error) {
+    iface_set_error(NULL, ERR_SERIAL, "wbh_logger_close: error writing log file");
+    rc = -ERR_SERIAL;
+  }
+
+  for (i = 0; i < LOG_HASH; i++) {
+    for (s = log->hash[i]; s; s = next) {
+      next = s->next;
+      free(s->chunk);
+      free(s);
+    }
+  }
+  while ((c = log->spare)) {
+    log->spare = c->next;
+    free(c);
+  }
+  pthread_mutex_destroy(&log->lock);
+  pthread_cond_destroy(&log->wake);
+  pthread_cond_destroy(&log->idle);
+  free(log->index);
+  free(log->buf);
+  free(log);
+  return rc;
+}
+
+struct wbh_log {
+  const uint8_t *map;		/**< mapped log file */
+  size_t size;			/**< size of the mapping */
+  log_index_t *index;		/**< blocks, by channel and time */
+  size_t count;			/**< entries in index */
+
+  /* block being decoded */
+  uint64_t ts[LOG_BLOCK];
+  wbh_raw_measurement_t raw[LOG_BLOCK];
+  float values[LOG_BLOCK];
+  wbh_unit_t units[LOG_BLOCK];
+};
+
+/** key an index entry is sorted by */
+#define INDEX_KEY(e) ((uint32_t)(e)->device << 16 | (e)->group << 8 | (e)->channel)
+
+static int compare_index(const void *a, const void *b)
+{
+  const log_index_t *x = a, *y = b;
+  if (INDEX_KEY(x) != INDEX_KEY(y))
+    return INDEX_KEY(x) < INDEX_KEY(y) ? -1 : 1;
+  return x->first < y->first ? -1 : x->first > y->first;
+}
+
+/** Rebuild the index of a log that has no trailer.
+    @return zero or -1 if out of memory */
+static int log_scan(struct wbh_log *log)
+{
+  size_t off = sizeof(log_header_t), size = 0;
+  log_block_t hdr;
+
+  /* a block cut short is what a writer that crashed leaves behind; treat
+     it as the end of the log */
+  while (log->size - off >= sizeof(log_block_t)) {
+    memcpy(&hdr, log->map + off, sizeof(hdr));
+    if (hdr.magic != LOG_BLOCK_MAGIC || !hdr.count || hdr.count > LOG_BLOCK ||
+        log->size - off - sizeof(log_block_t) < hdr.size)
+      break;
+    if (log->count == size) {
+      log_index_t *index = realloc(log->index, (size = size ? size * 2 : 256) * sizeof(log_index_t));
+      if (!index)
+        return -1;
+      log->index = index;
+    }
+    log_index_t *e = &log->index[log->count++];
+    memset(e, 0, sizeof(log_index_t));
+    e->offset = off;
+    e->first = hdr.first;
+    e->last = hdr.last;
+    e->count = hdr.count;
+    e->device = hdr.device;
+    e->group = hdr.group;
+    e->channel = hdr.channel;
+    off += BLOCK_SIZE(hdr.size);
+    if (off > log->size)
+      break;
+  }
+  return 0;
+}
+
+wbh_log_t *wbh_log_open(const char *path)
+{
+  struct wbh_log *log;
+  const log_header_t *hdr;
+  log_trailer_t trailer;
+  struct stat st;
+  void *map;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    iface_set_error(NULL, ERR_INVAL, "wbh_log_open: cannot open log file");
+    return NULL;
+  }
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(log_header_t)) {
+    close(fd);
+    iface_set_error(NULL, ERR_DATA, "wbh_log_open: not a log file");
+    return NULL;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    iface_set_error(NULL, ERR_INVAL, "wbh_log_open: mmap() failed");
+    return NULL;
+  }
+
+  hdr = map;
+  if (memcmp(hdr->magic, LOG_MAGIC, sizeof(hdr->magic)) ||
+      hdr->version != LOG_VERSION || hdr->byteorder != LOG_BYTEORDER) {
+    munmap(map, st.st_size);
+    iface_set_error(NULL, ERR_DATA, "wbh_log_open: not a log file or unsupported version");
+    return NULL;
+  }
+
+  log = calloc(1, sizeof(struct wbh_log));
+  if (!log) {
+    munmap(map, st.st_size);
+    iface_set_error(NULL, ERR_INVAL, "wbh_log_open: calloc() failed");
+    return NULL;
+  }
+  log->map = map;
+  log->size = st.st_size;
+
+  if (log->size >= sizeof(log_header_t) + sizeof(log_trailer_t)) {
+    memcpy(&trailer, log->map + log->size - sizeof(trailer), sizeof(trailer));
+    if (!memcmp(trailer.magic, LOG_INDEX_MAGIC, sizeof(trailer.magic)) &&
+        trailer.index >= sizeof(log_header_t) &&
+        trailer.index <= log->size - sizeof(trailer) &&
+        (log->size - sizeof(trailer) - trailer.index) % sizeof(log_index_t) == 0 &&
+        trailer.count == (log->size - sizeof(trailer) - trailer.index) / sizeof(log_index_t)) {
+      log->count = trailer.count;
+      if (log->count && !(log->index = malloc(log->count * sizeof(log_index_t)))) {
+        wbh_log_close(log);
+        iface_set_error(NULL, ERR_INVAL, "wbh_log_open: malloc() failed");
+        return NULL;
+      }
+      memcpy(log->index, log->map + trailer.index, log->count * sizeof(log_index_t));
+    }
+    else
+      trailer.index = 0;
+  }
+  else
+    trailer.index = 0;
+  if (!trailer.index && log_scan(log) < 0) {
+    wbh_log_close(log);
+    iface_set_error(NULL, ERR_INVAL, "wbh_log_open: realloc() failed");
+    return NULL;
+  }
+
+  qsort(log->index, log->count, sizeof(log_index_t), compare_index);
+  return log;
+}
+
+void wbh_log_close(wbh_log_t *log)
+{
+  if (!log)
+    return;
+  munmap((void *)log->map, log->size);
+  free(log->index);
+  free(log);
+}
+
+int wbh_log_series(wbh_log_t *log, wbh_log_series_t *series, int max)
+{
+  const log_index_t *e;
+  size_t i;
+  int n = -1;
+
+  for (i = 0; i < log->count; i++) {
+    e = &log->index[i];
+    if (!i || INDEX_KEY(e) != INDEX_KEY(e - 1)) {
+      if (++n < max) {
+        series[n].device = e->device;
+        series[n].group = e->group;
+        series[n].channel = e->channel;
+        series[n].blocks = 0;
+        series[n].samples = 0;
+        series[n].first_ns = e->first;
+      }
+    }
+    if (n < max) {
+      series[n].blocks++;
+      series[n].samples += e->count;
+      series[n].last_ns = e->last;
+    }
+  }
+  return n + 1;
+}
+
+/** Decode the block an index entry refers to into log->ts and log->raw.
+    @return zero or negative error code */
+static int log_decode(struct wbh_log *log, const log_index_t *e)
+{
+  const uint8_t *p, *end;
+  uint8_t col[LOG_BLOCK];
+  uint64_t v, delta = 0;
+  log_block_t hdr;
+  int i;
+
+  if (e->offset > log->size || log->size - e->offset < sizeof(log_block_t))
+    goto corrupt;
+  memcpy(&hdr, log->map + e->offset, sizeof(hdr));
+  if (hdr.magic != LOG_BLOCK_MAGIC || hdr.count != e->count || !hdr.count ||
+      hdr.count > LOG_BLOCK || log->size - e->offset - sizeof(log_block_t) < hdr.size ||
+      (uint64_t)hdr.column[0] + hdr.column[1] + hdr.column[2] + hdr.column[3] != hdr.size)
+    goto corrupt;
+
+  p = log->map + e->offset + sizeof(log_block_t);
+  end = p + hdr.column[0];
+  log->ts[0] = hdr.first;
+  for (i = 1; i < hdr.count; i++) {
+    if (!(p = get_varint(p, end, &v)))
+      goto corrupt;
+    delta += (v >> 1) ^ -(v & 1);
+    log->ts[i] = log->ts[i - 1] + delta;
+  }
+  if (p != end)
+    goto corrupt;
+
+  if (get_column(p, end += hdr.column[1], col, hdr.count) < 0)
+    goto corrupt;
+  for (i = 0; i < hdr.count; i++)
+    log->raw[i].formula = col[i];
+  p = end;
+  if (get_column(p, end += hdr.column[2], col, hdr.count) < 0)
+    goto corrupt;
+  for (i = 0; i < hdr.count; i++)
+    log->raw[i].a = col[i];
+  p = end;
+  if (get_column(p, end += hdr.column[3], col, hdr.count) < 0)
+    goto corrupt;
+  for (i = 0; i < hdr.count; i++)
+    log->raw[i].b = col[i];
+  return 0;
+
+corrupt:
+  iface_set_error(NULL, ERR_DATA, "wbh_log_query: corrupt block");
+  return -ERR_DATA;
+}
+
+long wbh_log_query(wbh_log_t *log, int device, int group, int channel,
+                   uint64_t from_ns, uint64_t to_ns, wbh_log_cb_t cb, void *ctx)
+{
+  const log_index_t *e;
+  wbh_log_sample_t s;
+  size_t i = 0, lo, hi;
+  uint32_t key = 0;
+  long samples = 0;
+  int single = device >= 0 && group >= 0 && channel >= 0, k, first, last, rc;
+
+  /* for a single channel, skip straight to the first block that ends
+     within the range */
+  if (single) {
+    key = device << 16 | group << 8 | channel;
+    for (lo = 0, hi = log->count; lo < hi; ) {
+      size_t mid = (lo + hi) / 2;
+      e = &log->index[mid];
+      if (INDEX_KEY(e) < key || (INDEX_KEY(e) == key && e->last < from_ns))
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    i = lo;
+  }
+
+  for (; i < log->count; i++) {
+    e = &log->index[i];
+    if (single && INDEX_KEY(e) != key)
+      break;
+    if ((device >= 0 && e->device != device) || (group >= 0 && e->group != group) ||
+        (channel >= 0 && e->channel != channel) || e->last < from_ns || e->first > to_ns)
+      continue;
+    if ((rc = log_decode(log, e)) < 0)
+      return rc;
+
+    /* timestamps are in order within a block */
+    for (first = 0; first < e->count && log->ts[first] < from_ns; first++)
+      ;
+    for (last = first; last < e->count && log->ts[last] <= to_ns; last++)
+      ;
+    wbh_decode_batch(&log->raw[first], last - first, &log->values[first], &log->units[first]);
+
+    s.device = e->device;
+    s.group = e->group;
+    s.channel = e->channel;
+    for (k = first; k < last; k++) {
+      s.timestamp_ns = log->ts[k];
+      s.data.value = log->values[k];
+      s.data.unit = log->units[k];
+      s.data.raw[0] = log->raw[k].formula;
+      s.data.raw[1] = log->raw[k].a;
+      s.data.raw[2] = log->raw[k].b;
+      samples++;
+      if (cb(&s, ctx))
+        return samples;
+    }
+  }
+  return samples;
+}
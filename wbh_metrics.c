@@ -0,0 +1,204 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "wbh.h"
+#include "wbh_priv.h"
+
+/* Per-interface metrics.
+   The counters are only ever written by the thread driving the interface,
+   so an increment is a plain load and store; making both relaxed atomic
+   accesses is enough for a monitoring thread to read them without torn
+   values, and costs nothing on the I/O path. */
+
+const uint64_t wbh_metrics_bucket_us[WBH_METRICS_BUCKETS - 1] = {
+  100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000,
+  500000, 1000000, 2000000, 5000000, 10000000,
+};
+
+/** command type names, by WBH_CMD_* */
+static const char *cmd_names[WBH_CMD_TYPES] = {
+  "connect", "dtc", "measurements", "actuator", "adapter", "other",
+};
+
+/** error code names, by ERR_* */
+static const char *error_names[WBH_METRICS_ERRORS] = {
+  NULL, "syntax", "data", "timeout", "serial", "inval",
+};
+
+int metrics_cmd_type(const char *cmd)
+{
+  if (!strncmp(cmd, "ATD", 3))
+    return WBH_CMD_CONNECT;
+  if (!strncmp(cmd, "AT", 2) || cmd[0] == '\r' || !cmd[0])
+    return WBH_CMD_ADAPTER;
+  if (!strncmp(cmd, "02", 2) && (cmd[2] == '\r' || !cmd[2]))
+    return WBH_CMD_DTC;
+  if (!strncmp(cmd, "08", 2))
+    return WBH_CMD_MEASUREMENTS;
+  if (!strncmp(cmd, "03", 2) && (cmd[2] == '\r' || !cmd[2]))
+    return WBH_CMD_ACTUATOR;
+  return WBH_CMD_OTHER;
+}
+
+void metrics_exchange(wbh_interface_t *iface, int type, int64_t us, int rc,
+                      const char *response)
+{
+  wbh_cmd_metrics_t *m = &IFACE(iface)->metrics->cmd[type];
+  int i;
+
+  for (i = 0; i < WBH_METRICS_BUCKETS - 1 && us > wbh_metrics_bucket_us[i]; i++)
+    ;
+  METRIC_ADD(m->latency[i], 1);
+  METRIC_ADD(m->latency_us, us);
+  METRIC_ADD(m->exchanges, 1);
+  if (rc == -ERR_TIMEOUT)
+    METRIC_ADD(m->timeouts, 1);
+  else if (rc < 0)
+    METRIC_ADD(m->io_errors, 1);
+  else if (response[0] == '?' || !strncmp(response, "ERROR", 5) ||
+           !strncmp(response, "DATA ERROR", 10))
+    METRIC_ADD(m->rejected, 1);
+}
+
+void wbh_get_metrics(wbh_interface_t *iface, wbh_metrics_t *metrics)
+{
+  const uint64_t *src = (const uint64_t *)IFACE(iface)->metrics;
+  uint64_t *dst = (uint64_t *)metrics;
+  size_t i;
+
+  /* nothing but counters in there */
+  for (i = 0; i < sizeof(wbh_metrics_t) / sizeof(uint64_t); i++)
+    dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+void wbh_reset_metrics(wbh_interface_t *iface)
+{
+  memset(IFACE(iface)->metrics, 0, sizeof(wbh_metrics_t));
+}
+
+/** text being exported */
+typedef struct {
+  char *buf;
+  size_t size;
+  size_t len;			/**< length of the complete text so far */
+} export_t;
+
+static void out(export_t *e, const char *fmt, ...)
+{
+  va_list ap;
+  int rc;
+
+  va_start(ap, fmt);
+  rc = vsnprintf(e->len < e->size ? e->buf + e->len : NULL,
+                 e->len < e->size ? e->size - e->len : 0, fmt, ap);
+  va_end(ap);
+  if (rc > 0)
+    e->len += rc;
+}
+
+/** Write an interface name as a label value, escaped. */
+static void out_label(export_t *e, const char *name)
+{
+  for (; *name; name++) {
+    if (*name == '\\' || *name == '"')
+      out(e, "\\%c", *name);
+    else if (*name == '\n')
+      out(e, "\\n");
+    else
+      out(e, "%c", *name);
+  }
+}
+
+/** Write one counter for every interface and command type.
+    @param offset offset of the counter in wbh_cmd_metrics_t */
+static void out_counter(export_t *e, const wbh_metrics_t *m,
+                        wbh_interface_t **ifaces, int count, const char *name,
+                        const char *help, size_t offset)
+{
+  int i, t;
+
+  out(e, "# HELP wbh_%s %s\n# TYPE wbh_%s counter\n", name, help, name);
+  for (i = 0; i < count; i++) {
+    for (t = 0; t < WBH_CMD_TYPES; t++) {
+      out(e, "wbh_%s{interface=\"", name);
+      out_label(e, ifaces[i]->name);
+      out(e, "\",command=\"%s\"} %llu\n", cmd_names[t],
+          (unsigned long long)*(const uint64_t *)((const char *)&m[i].cmd[t] + offset));
+    }
+  }
+}
+
+size_t wbh_metrics_export(wbh_interface_t **ifaces, int count, char *buf,
+                          size_t size)
+{
+  export_t e = { buf, size, 0 };
+  wbh_metrics_t *m;
+  uint64_t cumulative;
+  int i, t, b;
+
+  if (size)
+    buf[0] = 0;
+  if (count <= 0)
+    return 0;
+  if (!(m = malloc(count * sizeof(wbh_metrics_t)))) {
+    iface_set_error(NULL, ERR_INVAL, "wbh_metrics_export: malloc() failed");
+    return 0;
+  }
+  for (i = 0; i < count; i++)
+    wbh_get_metrics(ifaces[i], &m[i]);
+
+  out_counter(&e, m, ifaces, count, "exchanges_total", "Commands sent.",
+              offsetof(wbh_cmd_metrics_t, exchanges));
+  out_counter(&e, m, ifaces, count, "timeouts_total", "Commands that timed out.",
+              offsetof(wbh_cmd_metrics_t, timeouts));
+  out_counter(&e, m, ifaces, count, "io_errors_total", "Commands failed by a transport error.",
+              offsetof(wbh_cmd_metrics_t, io_errors));
+  out_counter(&e, m, ifaces, count, "rejected_total", "Commands answered with an error reply.",
+              offsetof(wbh_cmd_metrics_t, rejected));
+  out_counter(&e, m, ifaces, count, "retries_total", "Commands sent again.",
+              offsetof(wbh_cmd_metrics_t, retries));
+  out_counter(&e, m, ifaces, count, "sent_bytes_total", "Bytes written.",
+              offsetof(wbh_cmd_metrics_t, bytes_out));
+  out_counter(&e, m, ifaces, count, "received_bytes_total", "Bytes read.",
+              offsetof(wbh_cmd_metrics_t, bytes_in));
+
+  out(&e, "# HELP wbh_exchange_duration_seconds Command round trip time.\n"
+          "# TYPE wbh_exchange_duration_seconds histogram\n");
+  for (i = 0; i < count; i++) {
+    for (t = 0; t < WBH_CMD_TYPES; t++) {
+      const wbh_cmd_metrics_t *c = &m[i].cmd[t];
+      cumulative = 0;
+      for (b = 0; b < WBH_METRICS_BUCKETS; b++) {
+        cumulative += c->latency[b];
+        out(&e, "wbh_exchange_duration_seconds_bucket{interface=\"");
+        out_label(&e, ifaces[i]->name);
+        if (b < WBH_METRICS_BUCKETS - 1)
+          out(&e, "\",command=\"%s\",le=\"%g\"} %llu\n", cmd_names[t],
+              wbh_metrics_bucket_us[b] * 1e-6, (unsigned long long)cumulative);
+        else
+          out(&e, "\",command=\"%s\",le=\"+Inf\"} %llu\n", cmd_names[t],
+              (unsigned long long)cumulative);
+      }
+      out(&e, "wbh_exchange_duration_seconds_sum{interface=\"");
+      out_label(&e, ifaces[i]->name);
+      out(&e, "\",command=\"%s\"} %.6f\n", cmd_names[t], c->latency_us * 1e-6);
+      out(&e, "wbh_exchange_duration_seconds_count{interface=\"");
+      out_label(&e, ifaces[i]->name);
+      out(&e, "\",command=\"%s\"} %llu\n", cmd_names[t], (unsigned long long)cumulative);
+    }
+  }
+
+  out(&e, "# HELP wbh_errors_total Errors reported, by error code.\n"
+          "# TYPE wbh_errors_total counter\n");
+  for (i = 0; i < count; i++) {
+    for (t = 1; t < WBH_METRICS_ERRORS; t++) {
+      out(&e, "wbh_errors_total{interface=\"");
+      out_label(&e, ifaces[i]->name);
+      out(&e, "\",code=\"%s\"} %llu\n", error_names[t], (unsigned long long)m[i].errors[t]);
+    }
+  }
+
+  free(m);
+  return e.len;
+}
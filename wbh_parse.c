@@ -0,0 +1,158 @@
+#include <stddef.h>
+#include "wbh.h"
+
+/* Tokenizer for the hex tables the WBH-Diag Pro sends in response to the
+   DTC and measurement commands.  Every character is looked at exactly once;
+   hex digits are decoded through a table, so the result does not depend on
+   the locale and no scanf() is involved. */
+
+/** hex digit values plus one, zero for characters that are not hex digits */
+static const uint8_t hexdigit[256] = {
+  ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+  ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+  ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+  ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+};
+
+/** character classes */
+enum {
+  C_OTHER = 0,
+  C_BLANK,	/**< separates fields */
+  C_EOL,	/**< ends a line */
+  C_END,	/**< ends the response */
+};
+
+static const uint8_t charclass[256] = {
+  [' '] = C_BLANK, ['\t'] = C_BLANK,
+  ['\n'] = C_EOL, ['\r'] = C_EOL,
+  ['>'] = C_END, [0] = C_END,
+};
+
+/** tokenizer state */
+typedef struct {
+  const uint8_t *p;	/**< next character */
+  const uint8_t *start;	/**< beginning of the response */
+  const uint8_t *end;	/**< end of the response */
+} tok_t;
+
+/** Look at the next character without consuming it.
+    @return character class, C_END at the end of the buffer */
+static inline int tok_class(tok_t *t)
+{
+  return t->p < t->end ? charclass[*t->p] : C_END;
+}
+
+/** Decode a hex field of exactly digits characters.
+    @return value or -1 if the field is malformed */
+static inline long tok_hex(tok_t *t, int digits)
+{
+  long value = 0;
+  int d;
+  while (digits--) {
+    if (t->p >= t->end || !(d = hexdigit[*t->p]))
+      return -1;
+    value = (value << 4) | (d - 1);
+    t->p++;
+  }
+  /* a field must not be followed directly by another hex digit */
+  if (t->p < t->end && hexdigit[*t->p])
+    return -1;
+  return value;
+}
+
+/** Skip the blanks between two fields; there must be at least one.
+    @return zero or -1 if the fields are not separated */
+static inline int tok_separator(tok_t *t)
+{
+  if (tok_class(t) != C_BLANK)
+    return -1;
+  do
+    t->p++;
+  while (tok_class(t) == C_BLANK);
+  return 0;
+}
+
+/** Finish a line: trailing blanks, then a line break or the end of the
+    response.
+    @return zero or -1 if there is more on the line */
+static inline int tok_eol(tok_t *t)
+{
+  while (tok_class(t) == C_BLANK)
+    t->p++;
+  switch (tok_class(t)) {
+    case C_EOL:
+      t->p++;
+      return 0;
+    case C_END:
+      return 0;
+  }
+  return -1;
+}
+
+/** Skip empty lines and blanks before the next line.
+    @return non-zero if there is another line */
+static inline int tok_next_line(tok_t *t)
+{
+  int c;
+  while ((c = tok_class(t)) == C_BLANK || c == C_EOL)
+    t->p++;
+  return c != C_END;
+}
+
+static void tok_init(tok_t *t, const char *text, size_t len)
+{
+  t->start = t->p = (const uint8_t *)text;
+  t->end = t->start + len;
+}
+
+/** Report a syntax error at the current position. */
+static int tok_error(tok_t *t, size_t *erroff)
+{
+  if (erroff)
+    *erroff = t->p - t->start;
+  return -ERR_DATA;
+}
+
+int wbh_parse_dtc(const char *text, size_t len, wbh_dtc_t *dtc, int max,
+                  size_t *erroff)
+{
+  tok_t t;
+  int count = 0;
+  long code, status;
+
+  tok_init(&t, text, len);
+  while (tok_next_line(&t)) {
+    if ((code = tok_hex(&t, 4)) < 0 || tok_separator(&t) ||
+        (status = tok_hex(&t, 2)) < 0 || tok_eol(&t))
+      return tok_error(&t, erroff);
+    if (count < max) {
+      dtc[count].error_code = code;
+      dtc[count].status_code = status;
+    }
+    count++;
+  }
+  return count;
+}
+
+int wbh_parse_measurements(const char *text, size_t len,
+                           wbh_raw_measurement_t *raw, int max, size_t *erroff)
+{
+  tok_t t;
+  int count = 0;
+  long formula, a, b;
+
+  tok_init(&t, text, len);
+  while (tok_next_line(&t)) {
+    if ((formula = tok_hex(&t, 2)) < 0 || tok_separator(&t) ||
+        (a = tok_hex(&t, 2)) < 0 || tok_separator(&t) ||
+        (b = tok_hex(&t, 2)) < 0 || tok_eol(&t))
+      return tok_error(&t, erroff);
+    if (count < max) {
+      raw[count].formula = formula;
+      raw[count].a = a;
+      raw[count].b = b;
+    }
+    count++;
+  }
+  return count;
+}
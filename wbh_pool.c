@@ -0,0 +1,132 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "wbh.h"
+#include "wbh_priv.h"
+
+/* Session pool.
+   The adapter talks to one controller at a time, and dialing one takes
+   seconds (the 5 baud init alone is two).  The pool keeps the controller
+   last asked for connected and hands out the same device handle as long
+   as callers ask for the same address.  A session that has been quiet for
+   the keep-alive interval is checked with a harmless identification
+   request before it is used again; if it has died, it is redialed. */
+
+struct wbh_pool {
+  wbh_interface_t *iface;
+  wbh_device_t *dev;		/**< current session, NULL if none */
+  int keepalive_ms;		/**< longest quiet time before a check */
+  wbh_pool_stats_t stats;
+};
+
+/** command sent to keep a session alive: ECU identification, which every
+    controller answers and which changes nothing */
+#define KEEPALIVE_CMD "00"
+#define KEEPALIVE_TIMEOUT 5000
+
+wbh_pool_t *wbh_pool_new(wbh_interface_t *iface, int keepalive_ms)
+{
+  wbh_pool_t *pool = calloc(1, sizeof(wbh_pool_t));
+  if (!pool) {
+    iface_set_error(iface, ERR_INVAL, "wbh_pool_new: calloc() failed");
+    return NULL;
+  }
+  pool->iface = iface;
+  pool->keepalive_ms = keepalive_ms > 0 ? keepalive_ms : WBH_POOL_KEEPALIVE;
+  return pool;
+}
+
+/** Drop the current session without talking to the adapter. */
+static void pool_forget(wbh_pool_t *pool)
+{
+  free((void *)pool->dev->specs);
+  free(pool->dev);
+  pool->dev = NULL;
+}
+
+int wbh_pool_close(wbh_pool_t *pool)
+{
+  int rc;
+  if (!pool->dev)
+    return 0;
+  if ((rc = wbh_disconnect(pool->dev)) < 0) {
+    /* the adapter is in an unknown state; the handle is useless anyway */
+    pool_forget(pool);
+    return rc;
+  }
+  pool->dev = NULL;
+  return 0;
+}
+
+void wbh_pool_free(wbh_pool_t *pool)
+{
+  if (!pool)
+    return;
+  wbh_pool_close(pool);
+  free(pool);
+}
+
+/** Send keep-alive traffic.
+    @return zero if the session is alive, negative error code if it has
+            been lost (it is dropped then) */
+static int pool_ping(wbh_pool_t *pool)
+{
+  char buf[BUFSIZE];
+  int rc;
+
+  pool->stats.keepalives++;
+  rc = wbh_send_command_ms(pool->dev, KEEPALIVE_CMD, buf, sizeof(buf), KEEPALIVE_TIMEOUT);
+  if (rc >= 0 && (!strncmp(buf, "ERROR", 5) || buf[0] == '?'))
+    rc = -ERR_DATA;
+  if (rc < 0) {
+    pool->stats.lost++;
+    wbh_pool_close(pool);
+    return rc;
+  }
+  return 0;
+}
+
+/** Check whether the session has been quiet for too long. */
+static int pool_idle(wbh_pool_t *pool)
+{
+  return now_ms() - IFACE(pool->iface)->last_exchange >= pool->keepalive_ms;
+}
+
+wbh_device_t *wbh_pool_get(wbh_pool_t *pool, uint8_t device, int timeout_ms)
+{
+  if (pool->dev && pool->dev->id == device) {
+    if (!pool_idle(pool) || pool_ping(pool) == 0) {
+      pool->stats.reused++;
+      return pool->dev;
+    }
+  }
+  else if (pool->dev) {
+    pool->stats.switches++;
+    wbh_pool_close(pool);
+  }
+
+  pool->stats.connects++;
+  pool->dev = wbh_connect_ms(pool->iface, device, timeout_ms);
+  return pool->dev;
+}
+
+int wbh_pool_keepalive(wbh_pool_t *pool)
+{
+  if (!pool->dev || !pool_idle(pool))
+    return 0;
+  return pool_ping(pool);
+}
+
+int wbh_pool_timeout(wbh_pool_t *pool)
+{
+  int64_t remaining;
+  if (!pool->dev)
+    return -1;
+  remaining = IFACE(pool->iface)->last_exchange + pool->keepalive_ms - now_ms();
+  return remaining > 0 ? remaining : 0;
+}
+
+void wbh_pool_get_stats(wbh_pool_t *pool, wbh_pool_stats_t *stats)
+{
+  *stats = pool->stats;
+}
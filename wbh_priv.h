@@ -0,0 +1,350 @@
+/* Internal definitions shared by the modules of libwbh.
+   Not part of the public API. */
+
+#include <stddef.h>
+#include "wbh.h"
+
+/** standard buffer size, saves us from thinking up a suitable number all
+    the time... */
+#define BUFSIZE 255
+
+#if WBH_MAX_DTC != BUFSIZE / 8 || WBH_MAX_MEASUREMENTS != BUFSIZE / 9
+#error WBH_MAX_DTC and WBH_MAX_MEASUREMENTS must match BUFSIZE
+#endif
+
+/** default time to wait for a connection to a diagnostic device (ms) */
+#define CONNECT_TIMEOUT 100000
+
+#define ERROR(f, p...) fprintf(stderr, "%s: " f, __FUNCTION__, p)
+
+/** Interface state the library keeps to itself.
+    The public wbh_interface_t comes first; the handles callers are given
+    point to it, and IFACE() gets from one back to the whole. */
+typedef struct {
+  wbh_interface_t pub;
+  int hangup_flush;		/**< discard pending data after hanging up */
+  int64_t last_exchange;	/**< monotonic time (ms) the last exchange
+                                     finished successfully */
+  int rx_idle;			/**< the transport had nothing to read when
+                                     last asked, and nothing has been
+                                     written since */
+  const wbh_transport_t *transport;	/**< transport operations */
+  void *transport_priv;		/**< transport private data */
+  wbh_request_t *requests;	/**< queue of pending operations */
+  struct wbh_decode_cache *decode_cache;	/**< measurement lookup tables, if any */
+  struct wbh_capture *capture;	/**< raw session capture, if any */
+  struct wbh_metrics *metrics;	/**< command counters, see wbh_get_metrics() */
+  struct wbh_events *events;	/**< debug event ring, if ever enabled */
+  struct wbh_result_cache *result_cache;	/**< query results, if ever
+                                                 enabled; see
+                                                 wbh_result_cache_enable() */
+} iface_t;
+
+/** library side of an interface handle */
+#define IFACE(iface) ((iface_t *)(iface))
+
+/** Record an error.
+    The error is stored with the interface it occurred on, so sessions on
+    separate threads do not see each other's errors, and as the calling
+    thread's last error for wbh_get_error().
+    @param iface interface the error occurred on, NULL if none
+    @param code error code (ERR_*)
+    @param msg human-readable description
+ */
+void iface_set_error(wbh_interface_t *iface, int code, const char *msg);
+
+/** Record a chunk of data in the interface's capture, see
+    wbh_capture_start().  Only call if IFACE(iface)->capture is set.
+    @param iface interface the data was exchanged on
+    @param direction WBH_TRACE_TX or WBH_TRACE_RX
+    @param data raw bytes
+    @param len number of bytes
+ */
+void capture_record(wbh_interface_t *iface, int direction, const void *data, size_t len);
+
+/** Record a debug event (see wbh_events_enable()).  Only call if
+    IFACE(iface)->events is set; use EVENT().
+    @param iface interface the event occurred on
+    @param type WBH_EV_*
+    @param value meaning depends on type
+    @param data bytes to keep with the event, NULL if none
+    @param len number of bytes in data
+ */
+void event_record(wbh_interface_t *iface, int type, int value,
+                  const void *data, size_t len);
+
+/** Record a debug event if the interface has an event ring. */
+#define EVENT(iface, type, value, data, len) do { \
+    if (__builtin_expect(__atomic_load_n(&IFACE(iface)->events, __ATOMIC_ACQUIRE) != NULL, 0)) \
+      event_record(iface, type, value, data, len); \
+  } while (0)
+
+/** Free an interface's debug event ring. */
+void events_free(wbh_interface_t *iface);
+
+/** keys of the adapter timing in the result cache */
+enum {
+  RESULT_BDT = 0,
+  RESULT_IBT,
+};
+
+/** Look up a DTC list in the interface's result cache.
+    @param iface WBH interface handle
+    @param device device ID
+    @param dtc array of WBH_MAX_DTC elements receiving the DTCs
+    @return number of DTCs, -1 if not cached
+ */
+int result_cache_get_dtc(wbh_interface_t *iface, uint8_t device, wbh_dtc_t *dtc);
+
+/** Keep a DTC list in the interface's result cache, if it has one. */
+void result_cache_put_dtc(wbh_interface_t *iface, uint8_t device,
+                          const wbh_dtc_t *dtc, int count);
+
+/** Look up a controller identification in the interface's result cache.
+    @param iface WBH interface handle
+    @param device device ID
+    @param ident buffer of BUFSIZE bytes receiving the identification
+    @return length of the identification, -1 if not cached
+ */
+int result_cache_get_ident(wbh_interface_t *iface, uint8_t device, char *ident);
+
+/** Keep a controller identification in the interface's result cache, if
+    it has one. */
+void result_cache_put_ident(wbh_interface_t *iface, uint8_t device,
+                            const char *ident);
+
+/** Look up an adapter value in the interface's result cache.
+    @param iface WBH interface handle
+    @param kind WBH_RESULT_TIMING or WBH_RESULT_ANALOG
+    @param key RESULT_BDT or RESULT_IBT, or analog pin
+    @return value, -1 if not cached
+ */
+int result_cache_get_value(wbh_interface_t *iface, int kind, int key);
+
+/** Keep a non-negative adapter value in the interface's result cache, if
+    it has one. */
+void result_cache_put_value(wbh_interface_t *iface, int kind, int key, int value);
+
+/** Drop the cached results a command is about to change.
+    @param iface WBH interface handle
+    @param dev device the command is sent to, NULL for adapter commands
+    @param cmd command as sent
+ */
+void result_cache_command(wbh_interface_t *iface, wbh_device_t *dev, const char *cmd);
+
+/** Free an interface's result cache. */
+void result_cache_free(wbh_interface_t *iface);
+
+/** Add to an interface metrics counter (see wbh_metrics_t).  Counters
+    are only written by the thread driving the interface; relaxed atomic
+    accesses let other threads take snapshots without locking. */
+#define METRIC_ADD(counter, n) \
+  __atomic_store_n(&(counter), __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (n), \
+                   __ATOMIC_RELAXED)
+
+/** Classify a command for the metrics.
+    @param cmd command as sent
+    @return WBH_CMD_*
+ */
+int metrics_cmd_type(const char *cmd);
+
+/** Count a finished exchange.
+    @param iface interface the exchange ran on
+    @param type command type (WBH_CMD_*)
+    @param us duration (µs)
+    @param rc exchange result
+    @param response response received, if rc is not negative
+ */
+void metrics_exchange(wbh_interface_t *iface, int type, int64_t us, int rc,
+                      const char *response);
+
+/** Get current time from the monotonic clock.
+    @return milliseconds since some unspecified starting point
+ */
+int64_t now_ms(void);
+
+/** state of a request's serial exchange */
+enum {
+  XS_IDLE = 0,	/**< no exchange in progress */
+  XS_WRITE,	/**< command is being written */
+  XS_READ,	/**< waiting for the response */
+  XS_DONE,	/**< exchange finished, step function not called yet */
+};
+
+/** A request: one public operation (connect, command, scan...) advancing
+    through a state machine driven by wbh_process().
+    Requests are queued per interface, and only the request at the head of
+    the queue talks to the interface.  A request progresses either by
+    running serial exchanges (send a command, collect the response up to an
+    expected character) or by pushing child requests in front of itself.
+    Whenever an exchange or a child finishes, the request's step function
+    decides what to do next; eventually it calls request_finish().
+ */
+struct wbh_request {
+  wbh_interface_t *iface;	/**< interface the request runs on */
+  wbh_device_t *dev;		/**< device the request addresses, if any */
+  struct wbh_request *next;	/**< next request in the queue */
+  struct wbh_request *parent;	/**< request waiting for this one, if any */
+
+  /** called when the request reaches the head of the queue; must start an
+      exchange, push a child, finish the request or return a negative
+      error code */
+  int (*start)(struct wbh_request *req);
+  /** called when an exchange (child == NULL) or a child request finished
+      with result rc */
+  void (*step)(struct wbh_request *req, struct wbh_request *child, int rc);
+  /** releases type-specific state */
+  void (*cleanup)(struct wbh_request *req);
+  wbh_request_cb_t cb;		/**< completion callback */
+  void *ctx;			/**< completion callback context */
+
+  int started;			/**< start function has been called */
+  int done;			/**< request has finished */
+  int allocated;		/**< request is heap-allocated and freed when
+                                     finished */
+  int status;			/**< result, negative error code on failure */
+
+  /* exchange in progress */
+  int xstate;			/**< XS_* */
+  int xrc;			/**< exchange result */
+  char tx[BUFSIZE];		/**< data to send */
+  size_t tx_len, tx_off;
+  char *rx;			/**< receive buffer */
+  size_t rx_size, rx_len;
+  int expect;			/**< character ending the response */
+  int quiet_ms;			/**< if non-zero, read until the line has
+                                     been quiet for this long instead */
+  int64_t deadline;		/**< monotonic time the exchange times out */
+  int xtype;			/**< command type for the metrics */
+  int64_t xstart;		/**< monotonic time (µs) the exchange started */
+
+  /* parameters and results */
+  int state;			/**< type-specific state machine state */
+  uint8_t arg;			/**< device ID or measurement group */
+  int timeout_ms;		/**< response timeout */
+  char rxbuf[BUFSIZE];		/**< default receive buffer */
+  wbh_device_t *device;		/**< connected device */
+  int count;			/**< number of DTCs or measurements */
+  wbh_dtc_t dtc[WBH_MAX_DTC + 1];
+  wbh_measurement_t data[WBH_MAX_MEASUREMENTS + 1];
+  uint8_t *devices;		/**< scan result */
+  void *op;			/**< type-specific state */
+};
+
+/** Prepare a request.
+    @param req request to initialize
+    @param iface interface the request will run on
+    @param dev device the request addresses, or NULL
+ */
+void request_init(wbh_request_t *req, wbh_interface_t *iface, wbh_device_t *dev);
+
+/** Allocate a request that is freed once it has finished.
+    @return request or NULL on error
+ */
+wbh_request_t *request_new(wbh_interface_t *iface, wbh_device_t *dev,
+                           wbh_request_cb_t cb, void *ctx);
+
+/** Append a request to its interface's queue. */
+void request_submit(wbh_request_t *req);
+
+/** Queue a child request to run before its parent continues.
+    The parent's step function is called with the child when it finishes;
+    heap-allocated children are freed afterwards. */
+void request_push(wbh_request_t *parent, wbh_request_t *child);
+
+/** Start a serial exchange on the request at the head of the queue.
+    The command is written before the function returns, as far as the
+    port takes it.
+    @param req request
+    @param cmd command to send, a carriage return is appended; NULL if
+               req->tx has been filled in already
+    @param rx receive buffer, NULL for req->rxbuf
+    @param rx_size size of rx
+    @param timeout_ms time to wait for the response
+    @param expect character ending the response
+ */
+void request_exchange(wbh_request_t *req, const char *cmd, char *rx,
+                      size_t rx_size, int timeout_ms, int expect);
+
+/** Start discarding input until the line has been quiet for a while. */
+void request_drain(wbh_request_t *req, int quiet_ms);
+
+/** Finish a request, passing its result on to the parent or the
+    completion callback. */
+void request_finish(wbh_request_t *req, int status);
+
+/** Block until a submitted request has finished.
+    @return request status
+ */
+int request_wait(wbh_request_t *req);
+
+/** Release the results and state of a finished request that is not
+    heap-allocated. */
+void request_release(wbh_request_t *req);
+
+/** Prepare a connect request (see wbh_submit_connect()). */
+void connect_request(wbh_request_t *req, uint8_t device, int timeout_ms);
+
+/** Prepare a disconnect request (see wbh_submit_disconnect()). */
+void disconnect_request(wbh_request_t *req);
+
+/** Decode a measurement group response into a caller-provided array,
+    through the interface's decode cache if it has one.
+    @param iface WBH interface handle, for error reporting
+    @param group measurement group the response belongs to
+    @param buf response text as returned by the device
+    @param len length of buf
+    @param data array receiving the measurements
+    @param max number of elements in data
+    @return number of measurements decoded or negative error code
+ */
+int parse_measurements(wbh_interface_t *iface, uint8_t group, const char *buf,
+                       size_t len, wbh_measurement_t *data, int max);
+
+/** Parse a measurement group response without decoding it.
+    Arguments as parse_measurements(), without the group.
+    @return number of measurements or negative error code
+ */
+int parse_raw_measurements(wbh_interface_t *iface, const char *buf, size_t len,
+                           wbh_raw_measurement_t *raw, int max);
+
+/** Decode one channel of a measurement group through a decode cache, as
+    wbh_decode_cached_group() does for each element. */
+void decode_cached_channel(wbh_decode_cache_t *cache, uint8_t group, int channel,
+                           const wbh_raw_measurement_t *raw, wbh_measurement_t *data);
+
+/** wbh_delta_apply(), decoding through a decode cache.
+    @param cache decode cache, NULL for none
+ */
+int delta_apply(wbh_delta_t *delta, wbh_decode_cache_t *cache, uint8_t group,
+                const wbh_raw_measurement_t *raw, int count,
+                wbh_change_t *changes, int *keyframe);
+
+/** Extract the identification part of a device's specs string, suitable
+    as a key file key: part number and description, without the connect
+    parameters.
+    @param dev connected device
+    @param ident buffer receiving the identification
+    @param size size of ident
+ */
+void device_identity(wbh_device_t *dev, char *ident, size_t size);
+
+/** Look up a value in a key file.
+    Key files are text files with one "key<TAB>value" entry per line, used
+    to persist per-vehicle and per-ECU data between runs.
+    @param path key file name
+    @param key key to look up, must not contain tabs or newlines
+    @param value buffer the value will be written to
+    @param size size of value
+    @return zero if found, -1 if not found or on error
+ */
+int keyfile_lookup(const char *path, const char *key, char *value, size_t size);
+
+/** Add or replace an entry in a key file.
+    The file is rewritten atomically.
+    @param path key file name
+    @param key key to store, must not contain tabs or newlines
+    @param value value to store, must not contain newlines
+    @return zero or -1 on error
+ */
+int keyfile_store(const char *path, const char *key, const char *value);
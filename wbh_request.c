@@ -0,0 +1,427 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include "wbh.h"
+#include "wbh_priv.h"
+
+int64_t now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** Get current time from the monotonic clock, in microseconds. */
+static int64_t now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/** Convert carriage return to line feed.
+    @param buf data to be converted
+    @param size size of buf
+ */
+static void crtolf(char *buf, size_t size)
+{
+  int i;
+  for (i = 0; i < size; i++) {
+    if (buf[i] == '\r')
+      buf[i] = '\n';
+  }
+}
+
+void request_init(wbh_request_t *req, wbh_interface_t *iface, wbh_device_t *dev)
+{
+  memset(req, 0, offsetof(wbh_request_t, rxbuf));
+  req->iface = iface;
+  req->dev = dev;
+  req->rxbuf[0] = 0;
+  req->device = NULL;
+  req->count = 0;
+  req->devices = NULL;
+  req->op = NULL;
+}
+
+wbh_request_t *request_new(wbh_interface_t *iface, wbh_device_t *dev,
+                           wbh_request_cb_t cb, void *ctx)
+{
+  wbh_request_t *req = malloc(sizeof(wbh_request_t));
+  if (!req) {
+    iface_set_error(iface, ERR_INVAL, "request_new: malloc() failed");
+    return NULL;
+  }
+  request_init(req, iface, dev);
+  req->allocated = 1;
+  req->cb = cb;
+  req->ctx = ctx;
+  return req;
+}
+
+void request_submit(wbh_request_t *req)
+{
+  wbh_request_t **p;
+  for (p = &IFACE(req->iface)->requests; *p; p = &(*p)->next)
+    ;
+  req->next = NULL;
+  *p = req;
+}
+
+void request_push(wbh_request_t *parent, wbh_request_t *child)
+{
+  wbh_request_t **p;
+  for (p = &IFACE(parent->iface)->requests; *p && *p != parent; p = &(*p)->next)
+    ;
+  child->parent = parent;
+  child->next = *p;
+  *p = child;
+}
+
+/** Remove a request from its interface's queue. */
+static void unlink_request(wbh_request_t *req)
+{
+  wbh_request_t **p;
+  for (p = &IFACE(req->iface)->requests; *p; p = &(*p)->next) {
+    if (*p == req) {
+      *p = req->next;
+      break;
+    }
+  }
+  req->next = NULL;
+}
+
+void request_release(wbh_request_t *req)
+{
+  if (req->cleanup)
+    req->cleanup(req);
+  req->cleanup = NULL;
+  if (req->device) {
+    /* nobody took the device handle */
+    free((void *)req->device->specs);
+    free(req->device);
+    req->device = NULL;
+  }
+  free(req->devices);
+  req->devices = NULL;
+}
+
+void request_finish(wbh_request_t *req, int status)
+{
+  unlink_request(req);
+  req->status = status;
+  req->done = 1;
+  req->xstate = XS_IDLE;
+  if (req->parent)
+    req->parent->step(req->parent, req, status);
+  else if (req->cb)
+    req->cb(req, req->ctx);
+  if (req->allocated) {
+    request_release(req);
+    free(req);
+  }
+}
+
+static void do_write(wbh_request_t *req);
+
+void request_exchange(wbh_request_t *req, const char *cmd, char *rx,
+                      size_t rx_size, int timeout_ms, int expect)
+{
+  if (cmd) {
+    int len = snprintf(req->tx, BUFSIZE, "%s\r", cmd);
+    req->tx_len = len < BUFSIZE ? len : BUFSIZE - 1;
+  }
+  req->tx[req->tx_len] = 0;
+  req->xtype = metrics_cmd_type(req->tx);
+  req->xstart = now_us();
+  req->tx_off = 0;
+  req->rx = rx ? rx : req->rxbuf;
+  req->rx_size = rx ? rx_size : BUFSIZE;
+  req->rx_len = 0;
+  memset(req->rx, 0, req->rx_size);	/* just want to make sure that stale
+                                           data is not misinterpreted */
+  req->expect = expect;
+  req->quiet_ms = 0;
+  req->deadline = now_ms() + timeout_ms;
+  req->xstate = XS_WRITE;
+  /* a request at the head of the queue owns the line: send right away,
+     so a step function can put the next command on the wire before it
+     gets busy with the response it was handed */
+  if (IFACE(req->iface)->requests == req)
+    do_write(req);
+}
+
+void request_drain(wbh_request_t *req, int quiet_ms)
+{
+  req->tx_len = req->tx_off = 0;
+  req->rx = req->rxbuf;
+  req->rx_size = BUFSIZE;
+  req->rx_len = 0;
+  req->expect = 0;
+  req->quiet_ms = quiet_ms;
+  req->deadline = now_ms() + quiet_ms;
+  req->xstate = XS_READ;
+}
+
+/** Conclude the exchange in progress; the step function is called from
+    pump() so that it never runs nested inside the I/O code. */
+static void exchange_done(wbh_request_t *req, int rc)
+{
+  if (rc >= 0)
+    IFACE(req->iface)->last_exchange = now_ms();
+  if (!req->quiet_ms)
+    metrics_exchange(req->iface, req->xtype, now_us() - req->xstart, rc, req->rx);
+  req->xrc = rc;
+  req->xstate = XS_DONE;
+}
+
+/** Send as much of the pending command as the serial port takes. */
+static void do_write(wbh_request_t *req)
+{
+  while (req->tx_off < req->tx_len) {
+    ssize_t rc = IFACE(req->iface)->transport->write(IFACE(req->iface)->transport_priv, req->tx + req->tx_off,
+                                              req->tx_len - req->tx_off);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc < 0 && errno == EAGAIN)
+      return;
+    if (rc <= 0) {
+      iface_set_error(req->iface, ERR_SERIAL, "I/O error writing to serial port");
+      exchange_done(req, -ERR_SERIAL);
+      return;
+    }
+    METRIC_ADD(IFACE(req->iface)->metrics->cmd[req->xtype].bytes_out, rc);
+    if (IFACE(req->iface)->capture)
+      capture_record(req->iface, WBH_TRACE_TX, req->tx + req->tx_off, rc);
+    EVENT(req->iface, WBH_EV_WRITE, rc, req->tx + req->tx_off, rc);
+    req->tx_off += rc;
+    IFACE(req->iface)->rx_idle = 0;
+  }
+  req->xstate = XS_READ;
+}
+
+/** Collect whatever response data has arrived. */
+static void do_read(wbh_request_t *req)
+{
+  while (req->xstate == XS_READ) {
+    char *buf = req->rx + req->rx_len;
+    size_t size = req->rx_size - req->rx_len;
+    ssize_t rc;
+    char *end;
+
+    if (size == 0) {
+      if (req->quiet_ms) {
+        /* draining, we don't care about the data */
+        req->rx_len = 0;
+        continue;
+      }
+      exchange_done(req, req->rx_len);
+      break;
+    }
+    rc = IFACE(req->iface)->transport->read(IFACE(req->iface)->transport_priv, buf, size);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc < 0 && errno == EAGAIN) {
+      IFACE(req->iface)->rx_idle = 1;
+      break;
+    }
+    if (rc <= 0) {
+      iface_set_error(req->iface, ERR_SERIAL, "I/O error reading from serial port");
+      exchange_done(req, -ERR_SERIAL);
+      break;
+    }
+    IFACE(req->iface)->rx_idle = 0;
+    METRIC_ADD(IFACE(req->iface)->metrics->cmd[req->xtype].bytes_in, rc);
+    if (IFACE(req->iface)->capture)
+      capture_record(req->iface, WBH_TRACE_RX, buf, rc);
+    EVENT(req->iface, WBH_EV_READ, rc, buf, rc);
+    crtolf(buf, rc);
+    req->rx_len += rc;
+
+    if (req->quiet_ms) {
+      req->deadline = now_ms() + req->quiet_ms;
+      continue;
+    }
+    /* check for end-of-transmission character */
+    if (req->expect && (end = memchr(buf, req->expect, rc))) {
+      req->rx_len = end + 1 - req->rx;
+      EVENT(req->iface, WBH_EV_PROMPT, req->rx_len, req->rx, req->rx_len);
+      exchange_done(req, req->rx_len);
+    }
+  }
+}
+
+/** Check whether the exchange in progress has run out of time. */
+static void check_deadline(wbh_request_t *req)
+{
+  if ((req->xstate != XS_READ && req->xstate != XS_WRITE) || now_ms() < req->deadline)
+    return;
+  if (req->quiet_ms) {
+    exchange_done(req, req->rx_len);
+    return;
+  }
+  /* read timeout */
+  EVENT(req->iface, WBH_EV_TIMEOUT, req->rx_len, req->rx, req->rx_len);
+  iface_set_error(req->iface, ERR_TIMEOUT, "timeout reading from serial port");
+  exchange_done(req, -ERR_TIMEOUT);
+}
+
+/** Make as much progress as possible without waiting. */
+static void pump(wbh_interface_t *iface)
+{
+  wbh_request_t *req;
+  int rc;
+
+  while ((req = IFACE(iface)->requests)) {
+    if (!req->started) {
+      req->started = 1;
+      if ((rc = req->start(req)) < 0)
+        request_finish(req, rc);
+      continue;
+    }
+    if (req->xstate == XS_WRITE)
+      do_write(req);
+    if (req->xstate == XS_DONE) {
+      req->xstate = XS_IDLE;
+      req->step(req, NULL, req->xrc);
+      continue;
+    }
+    break;
+  }
+}
+
+int wbh_get_fd(wbh_interface_t *iface)
+{
+  return iface->fd;
+}
+
+short wbh_get_events(wbh_interface_t *iface)
+{
+  wbh_request_t *req = IFACE(iface)->requests;
+  if (!req)
+    return 0;
+  if (req->xstate == XS_READ)
+    return POLLIN;
+  /* not started yet or command pending: wbh_process() has work to do as
+     soon as the port is writable */
+  return POLLOUT;
+}
+
+int wbh_get_timeout(wbh_interface_t *iface)
+{
+  wbh_request_t *req = IFACE(iface)->requests;
+  int64_t remaining;
+  if (!req)
+    return -1;
+  if (req->xstate != XS_READ && req->xstate != XS_WRITE)
+    return 0;
+  remaining = req->deadline - now_ms();
+  return remaining > 0 ? remaining : 0;
+}
+
+int wbh_process(wbh_interface_t *iface, short revents)
+{
+  wbh_request_t *req = IFACE(iface)->requests;
+  int pending = 0;
+
+  if (req && req->xstate == XS_READ) {
+    if (revents & (POLLIN | POLLHUP))
+      do_read(req);
+    else if (revents & (POLLERR | POLLNVAL)) {
+      iface_set_error(iface, ERR_SERIAL, "I/O error polling serial port");
+      exchange_done(req, -ERR_SERIAL);
+    }
+  }
+  if (req)
+    check_deadline(req);
+  pump(iface);
+
+  for (req = IFACE(iface)->requests; req; req = req->next)
+    pending++;
+  return pending;
+}
+
+int request_wait(wbh_request_t *req)
+{
+  wbh_interface_t *iface = req->iface;
+  wbh_request_t *head;
+  int rc;
+
+  wbh_process(iface, 0);
+  while (!req->done) {
+    if (iface->fd < 0) {
+      /* nothing to poll, the transport is always ready; so once it has
+         nothing left to read, nothing more comes until the next command
+         goes out.  A drain sits out its quiet time, a read could only
+         time out and does so right away. */
+      wbh_process(iface, POLLIN | POLLOUT);
+      head = IFACE(iface)->requests;
+      if (!req->done && IFACE(iface)->rx_idle && head && head->xstate == XS_READ) {
+        if (head->quiet_ms)
+          poll(NULL, 0, wbh_get_timeout(iface));
+        else
+          head->deadline = now_ms();
+      }
+      continue;
+    }
+    struct pollfd pfd = { .fd = iface->fd, .events = wbh_get_events(iface) };
+    rc = poll(&pfd, 1, wbh_get_timeout(iface));
+    if (rc < 0 && errno == EINTR)
+      continue;
+    wbh_process(iface, rc < 0 ? POLLERR : rc > 0 ? pfd.revents : 0);
+  }
+  return req->status;
+}
+
+void wbh_cancel_requests(wbh_interface_t *iface)
+{
+  while (IFACE(iface)->requests) {
+    iface_set_error(iface, ERR_SERIAL, "request cancelled");
+    request_finish(IFACE(iface)->requests, -ERR_SERIAL);
+  }
+}
+
+int wbh_request_status(wbh_request_t *req)
+{
+  return req->status;
+}
+
+wbh_interface_t *wbh_request_iface(wbh_request_t *req)
+{
+  return req->iface;
+}
+
+const char *wbh_request_response(wbh_request_t *req)
+{
+  return req->rx ? req->rx : req->rxbuf;
+}
+
+wbh_device_t *wbh_request_device(wbh_request_t *req)
+{
+  wbh_device_t *dev = req->device;
+  req->device = NULL;
+  return dev;
+}
+
+const wbh_dtc_t *wbh_request_dtc(wbh_request_t *req, int *count)
+{
+  if (count)
+    *count = req->count;
+  return req->dtc;
+}
+
+const wbh_measurement_t *wbh_request_measurements(wbh_request_t *req, int *count)
+{
+  if (count)
+    *count = req->count;
+  return req->data;
+}
+
+const uint8_t *wbh_request_devices(wbh_request_t *req)
+{
+  return req->devices;
+}
@@ -0,0 +1,377 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "wbh.h"
+#include "wbh_priv.h"
+
+
+/** Addresses of the most common VAG controllers, most likely first:
+    engine, transmission, ABS, HVAC, airbag, instruments, gateway, central
+    locking, radio, steering wheel, central electrics, immobilizer,
+    interior monitoring, comfort system, navigation, engine II. */
+static const uint8_t likely_addresses[] = {
+  0x01, 0x02, 0x03, 0x08, 0x15, 0x17, 0x19, 0x35,
+  0x56, 0x16, 0x09, 0x25, 0x45, 0x46, 0x37, 0x11,
+};
+
+/** Check whether an address lies within a scan range.
+    As with wbh_scan_devices(), end is exclusive and the range may wrap. */
+static int in_range(uint8_t id, uint8_t start, uint8_t end)
+{
+  return (uint8_t)(id - start) < (uint8_t)(end - start);
+}
+
+/** Build the order in which addresses are probed.
+    @param order array of 256 elements receiving the addresses
+    @return number of addresses to probe
+ */
+static int scan_order(uint8_t start, uint8_t end, int likely_first, uint8_t *order)
+{
+  uint8_t queued[256] = { 0 };
+  int i, n = 0;
+  uint8_t id;
+
+  if (likely_first) {
+    for (i = 0; i < sizeof(likely_addresses); i++) {
+      id = likely_addresses[i];
+      if (in_range(id, start, end)) {
+        order[n++] = id;
+        queued[id] = 1;
+      }
+    }
+  }
+  for (id = start; id != end; id++) {
+    if (!queued[id])
+      order[n++] = id;
+  }
+  return n;
+}
+
+void device_identity(wbh_device_t *dev, char *ident, size_t size)
+{
+  const char *specs = dev->specs;
+  char *p;
+  if (strlen(specs) > 13)
+    specs += 13;	/* skip "CONNECT: b p " */
+  snprintf(ident, size, "%s", specs);
+  ident[strcspn(ident, "\n>")] = 0;
+  for (p = ident; *p; p++) {
+    if (*p == '\t')
+      *p = ' ';
+  }
+}
+
+/** Parse a scan cache entry ("SS EE: id id ...").
+    @param range receives the start and end of the cached scan
+    @param ids array of 256 elements receiving the cached addresses
+    @return number of addresses, or -1 if the entry does not cover the
+            requested range
+ */
+static int parse_cache_entry(const char *value, uint8_t start, uint8_t end,
+                             uint8_t *range, uint8_t *ids)
+{
+  unsigned cstart, cend, id;
+  int n = 0, off;
+  if (sscanf(value, "%2x %2x:%n", &cstart, &cend, &off) != 2)
+    return -1;
+  /* the cached scan must have covered everything we are asked for */
+  if ((uint8_t)(start - cstart) + (uint8_t)(end - start) > (uint8_t)(cend - cstart))
+    return -1;
+  range[0] = cstart;
+  range[1] = cend;
+  value += off;
+  while (n < 256 && sscanf(value, " %2x%n", &id, &off) == 1) {
+    ids[n++] = id;
+    value += off;
+  }
+  return n;
+}
+
+static int cmp_id(const void *a, const void *b)
+{
+  return *(const uint8_t *)a - *(const uint8_t *)b;
+}
+
+/** scan request phases */
+enum {
+  SCAN_PROBE,		/**< probing addresses in scan order */
+  SCAN_VERIFY,		/**< checking addresses known from the cache */
+};
+
+/** state of a scan request */
+typedef struct {
+  int phase;			/**< SCAN_* */
+  uint8_t start, end;		/**< scan range */
+  uint8_t order[256];		/**< addresses in the order they are probed */
+  int n, i;			/**< number of addresses, next to probe */
+  uint8_t found[256];		/**< addresses that answered */
+  int nfound;
+  uint8_t cached[256];		/**< addresses known from the cache */
+  int ncached, j;		/**< number of cached addresses (-1 if none),
+                                     next to verify */
+  int verified;			/**< cached addresses confirmed so far */
+  int stale;			/**< cache entry needs rewriting */
+  uint8_t range[2];		/**< scan range recorded in the cache */
+  uint8_t probing;		/**< address of the probe in progress */
+  int disconnecting;		/**< probe is hanging up */
+  int probe_timeout, verify_timeout;
+  int likely_first;
+  char *cache_path;
+  char ident[256];		/**< identity of the first device found */
+  wbh_request_t child;		/**< connect or disconnect of the probe in
+                                     progress */
+} scan_op_t;
+
+/** Queue a connect attempt in front of the scan. */
+static void scan_probe(wbh_request_t *req, uint8_t id, int timeout_ms)
+{
+  scan_op_t *op = req->op;
+  op->probing = id;
+  op->disconnecting = 0;
+  request_init(&op->child, req->iface, NULL);
+  connect_request(&op->child, id, timeout_ms);
+  request_push(req, &op->child);
+}
+
+/** Look the vehicle up in the scan cache once the first device has been
+    found; if we have seen it before, only the addresses known to be
+    present are checked. */
+static void scan_check_cache(scan_op_t *op)
+{
+  char value[1024];
+  if (!op->cache_path || !op->ident[0] ||
+      keyfile_lookup(op->cache_path, op->ident, value, sizeof(value)) ||
+      (op->ncached = parse_cache_entry(value, op->start, op->end,
+                                       op->range, op->cached)) < 0)
+    return;
+  op->stale = 0;
+  op->phase = SCAN_VERIFY;
+  op->j = 0;
+  op->verified = 0;
+}
+
+/** Sort the result, update the cache and finish the request. */
+static void scan_done(wbh_request_t *req)
+{
+  scan_op_t *op = req->op;
+  char value[1024];
+  int i;
+
+  qsort(op->found, op->nfound, 1, cmp_id);
+
+  if (op->cache_path && op->ident[0] && op->stale) {
+    /* a fresh scan replaces the entry, a failed verification merely
+       removes the missing devices from it */
+    const uint8_t *ids = op->ncached < 0 ? op->found : op->cached;
+    int count = op->ncached < 0 ? op->nfound : op->ncached;
+    int len = snprintf(value, sizeof(value), "%02X %02X:", op->range[0], op->range[1]);
+    for (i = 0; i < count; i++)
+      len += snprintf(value + len, sizeof(value) - len, " %02X", ids[i]);
+    keyfile_store(op->cache_path, op->ident, value);
+  }
+
+  if (req->allocated) {
+    /* results of blocking scans are copied out of op->found instead */
+    req->devices = malloc(op->nfound + 1);
+    if (!req->devices) {
+      iface_set_error(req->iface, ERR_INVAL, "wbh_submit_scan: malloc() failed");
+      request_finish(req, -ERR_INVAL);
+      return;
+    }
+    memcpy(req->devices, op->found, op->nfound);
+    req->devices[op->nfound] = 0;
+  }
+  request_finish(req, op->nfound);
+}
+
+/** Start the next probe, or finish if there is nothing left to do. */
+static void scan_advance(wbh_request_t *req)
+{
+  scan_op_t *op = req->op;
+
+  if (op->phase == SCAN_VERIFY) {
+    while (op->j < op->ncached) {
+      uint8_t id = op->cached[op->j];
+      if (id == op->found[0] || !in_range(id, op->start, op->end)) {
+        op->cached[op->verified++] = id;
+        op->j++;
+        continue;
+      }
+      scan_probe(req, id, op->verify_timeout);
+      return;
+    }
+    op->ncached = op->verified;
+    scan_done(req);
+    return;
+  }
+
+  if (op->i < op->n) {
+    scan_probe(req, op->order[op->i], op->probe_timeout);
+    return;
+  }
+  scan_done(req);
+}
+
+/** Note the outcome of a probe. */
+static void scan_result(scan_op_t *op, int present)
+{
+  if (op->phase == SCAN_VERIFY) {
+    if (present)
+      op->cached[op->verified++] = op->found[op->nfound++] = op->probing;
+    else
+      op->stale = 1;	/* device has gone away */
+    op->j++;
+    return;
+  }
+  op->i++;
+  if (present) {
+    op->found[op->nfound++] = op->probing;
+    if (op->nfound == 1)
+      scan_check_cache(op);
+  }
+}
+
+static int scan_start(wbh_request_t *req)
+{
+  scan_advance(req);
+  return 0;
+}
+
+static void scan_step(wbh_request_t *req, wbh_request_t *child, int rc)
+{
+  scan_op_t *op = req->op;
+  wbh_device_t *dev;
+
+  if (rc == -ERR_SERIAL) {
+    /* the interface is gone or the scan has been cancelled */
+    if (op->disconnecting && child->dev) {
+      free((void *)child->dev->specs);
+      free(child->dev);
+    }
+    request_finish(req, rc);
+    return;
+  }
+  if (op->disconnecting) {
+    if (rc < 0 && child->dev) {
+      free((void *)child->dev->specs);
+      free(child->dev);
+    }
+    scan_advance(req);
+    return;
+  }
+
+  dev = wbh_request_device(child);
+  if (!dev) {
+    EVENT(req->iface, WBH_EV_PROBE, op->probing, "failed", 6);
+    scan_result(op, 0);
+    scan_advance(req);
+    return;
+  }
+  EVENT(req->iface, WBH_EV_PROBE, op->probing, "found", 5);
+  if (op->phase == SCAN_PROBE && op->nfound == 0)
+    device_identity(dev, op->ident, sizeof(op->ident));
+  scan_result(op, 1);
+
+  /* hang up before probing the next address */
+  op->disconnecting = 1;
+  request_init(&op->child, req->iface, dev);
+  disconnect_request(&op->child);
+  request_push(req, &op->child);
+}
+
+static void scan_cleanup(wbh_request_t *req)
+{
+  scan_op_t *op = req->op;
+  free(op->cache_path);
+  free(op);
+  req->op = NULL;
+}
+
+/** Prepare a scan request.
+    @return zero or negative error code
+ */
+static int scan_request(wbh_request_t *req, uint8_t start, uint8_t end,
+                        const wbh_scan_opts_t *opts)
+{
+  static const wbh_scan_opts_t defaults = { 0 };
+  scan_op_t *op;
+
+  if (!opts)
+    opts = &defaults;
+  op = calloc(1, sizeof(scan_op_t));
+  if (!op || (opts->cache_path && !(op->cache_path = strdup(opts->cache_path)))) {
+    free(op);
+    iface_set_error(req->iface, ERR_INVAL, "scan_request: calloc() failed");
+    return -ERR_INVAL;
+  }
+  op->start = op->range[0] = start;
+  op->end = op->range[1] = end;
+  op->probe_timeout = opts->probe_timeout_ms > 0 ? opts->probe_timeout_ms : CONNECT_TIMEOUT;
+  op->verify_timeout = opts->verify_timeout_ms > 0 ? opts->verify_timeout_ms : CONNECT_TIMEOUT;
+  op->n = scan_order(start, end, opts->likely_first, op->order);
+  op->ncached = -1;
+  op->stale = 1;
+  req->op = op;
+  req->start = scan_start;
+  req->step = scan_step;
+  req->cleanup = scan_cleanup;
+  return 0;
+}
+
+int wbh_scan_devices_into(wbh_interface_t *iface, uint8_t start, uint8_t end,
+                          const wbh_scan_opts_t *opts, uint8_t *devices, int max)
+{
+  wbh_request_t req;
+  int rc;
+
+  request_init(&req, iface, NULL);
+  if ((rc = scan_request(&req, start, end, opts)) < 0)
+    return rc;
+  request_submit(&req);
+  if ((rc = request_wait(&req)) >= 0)
+    memcpy(devices, ((scan_op_t *)req.op)->found, rc < max ? rc : max);
+  request_release(&req);
+  return rc;
+}
+
+uint8_t *wbh_scan_devices_opts(wbh_interface_t *iface, uint8_t start, uint8_t end,
+                               const wbh_scan_opts_t *opts)
+{
+  uint8_t *devices = malloc(257);
+  int count;
+  if (!devices) {
+    iface_set_error(iface, ERR_INVAL, "wbh_scan_devices: malloc() failed");
+    return NULL;
+  }
+  if ((count = wbh_scan_devices_into(iface, start, end, opts, devices, 256)) < 0) {
+    free(devices);
+    return NULL;
+  }
+  devices[count] = 0;
+  return devices;
+}
+
+wbh_request_t *wbh_submit_scan(wbh_interface_t *iface, uint8_t start, uint8_t end,
+                               const wbh_scan_opts_t *opts,
+                               wbh_request_cb_t cb, void *ctx)
+{
+  wbh_request_t *req = request_new(iface, NULL, cb, ctx);
+  if (!req)
+    return NULL;
+  if (scan_request(req, start, end, opts) < 0) {
+    free(req);
+    return NULL;
+  }
+  request_submit(req);
+  return req;
+}
+
+uint8_t *wbh_scan_devices(wbh_interface_t *iface, uint8_t start, uint8_t end)
+{
+  return wbh_scan_devices_opts(iface, start, end, NULL);
+}
+
+void wbh_free_devices(uint8_t *devices)
+{
+  free(devices);
+}
@@ -0,0 +1,348 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "wbh.h"
+#include "wbh_priv.h"
+
+/* Measurement group scheduler.
+   Groups with a target rate are read earliest deadline first: each has a
+   time it is due next, advanced by its period whenever it is requested,
+   and whichever group has been due the longest goes next.  A group that
+   falls behind does not try to make up for the samples it missed, so an
+   oversubscribed line degrades every rated group instead of locking the
+   others out.  Groups without a target rate get the line time left over,
+   shared in proportion to their priorities (stride scheduling).  If
+   nothing is due and there is nothing to fill in with, the scheduler
+   waits for the next deadline. */
+
+/** scheduled group */
+typedef struct {
+  uint8_t group;
+  double rate;			/**< target rate (Hz), 0 for as fast as possible */
+  int priority;
+  int64_t period;		/**< 1 / rate (µs), 0 if no target rate */
+  int64_t due;			/**< monotonic time (µs) the group is due next */
+  double pass;			/**< stride scheduling position */
+  unsigned long samples;
+  unsigned long late;
+  int64_t busy;			/**< total time spent reading the group (µs) */
+} sched_group_t;
+
+struct wbh_sched {
+  wbh_device_t *dev;
+  sched_group_t *groups;
+  int count;
+  int64_t started;		/**< monotonic time (µs) the run started */
+  int64_t stopped;		/**< monotonic time (µs) the run ended, 0 while
+                                     it is going */
+};
+
+/** state of a scheduler run */
+typedef struct {
+  wbh_sched_t *sched;
+  char buf[2][BUFSIZE];		/**< response buffers, one being received
+                                     while the other is decoded */
+  int cur;			/**< buffer receiving the outstanding response */
+  int pending;			/**< group being read, -1 if waiting */
+  int64_t requested;		/**< monotonic time (µs) it was requested */
+  int stopping;			/**< draining the last request in flight */
+  int samples;			/**< callbacks made so far */
+  int error;			/**< error to report once drained */
+  wbh_stream_cb_t cb;
+  void *ctx;
+} sched_op_t;
+
+/** longest time to wait for a deadline in one go (ms) */
+#define SCHED_MAX_WAIT 1000
+
+static int64_t sched_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+wbh_sched_t *wbh_sched_new(wbh_device_t *dev)
+{
+  wbh_sched_t *sched = calloc(1, sizeof(wbh_sched_t));
+  if (!sched) {
+    iface_set_error(dev->iface, ERR_INVAL, "wbh_sched_new: calloc() failed");
+    return NULL;
+  }
+  sched->dev = dev;
+  return sched;
+}
+
+void wbh_sched_free(wbh_sched_t *sched)
+{
+  if (!sched)
+    return;
+  free(sched->groups);
+  free(sched);
+}
+
+int wbh_sched_add(wbh_sched_t *sched, uint8_t group, double rate_hz, int priority)
+{
+  sched_group_t *g;
+  int i;
+
+  if (rate_hz < 0 || priority < 1) {
+    iface_set_error(sched->dev->iface, ERR_INVAL, "wbh_sched_add: invalid rate or priority");
+    return -ERR_INVAL;
+  }
+  for (i = 0; i < sched->count && sched->groups[i].group != group; i++)
+    ;
+  if (i == sched->count) {
+    g = realloc(sched->groups, (sched->count + 1) * sizeof(sched_group_t));
+    if (!g) {
+      iface_set_error(sched->dev->iface, ERR_INVAL, "wbh_sched_add: realloc() failed");
+      return -ERR_INVAL;
+    }
+    sched->groups = g;
+    sched->count++;
+  }
+  g = &sched->groups[i];
+  memset(g, 0, sizeof(sched_group_t));
+  g->group = group;
+  g->rate = rate_hz;
+  g->priority = priority;
+  g->period = rate_hz > 0 ? 1e6 / rate_hz : 0;
+  return 0;
+}
+
+/** Decide which group to read next.
+    @param now current time (µs)
+    @param wait receives the time until the next group is due (µs) if
+                there is nothing to read now
+    @return index of the group or -1 */
+static int sched_pick(wbh_sched_t *sched, int64_t now, int64_t *wait)
+{
+  sched_group_t *g, *b;
+  int64_t next = -1;
+  int i, best = -1;
+
+  for (i = 0; i < sched->count; i++) {
+    g = &sched->groups[i];
+    if (!g->period)
+      continue;
+    if (g->due > now) {
+      if (next < 0 || g->due < next)
+        next = g->due;
+      continue;
+    }
+    b = best >= 0 ? &sched->groups[best] : NULL;
+    if (!b || g->due < b->due || (g->due == b->due && g->priority > b->priority))
+      best = i;
+  }
+  if (best >= 0)
+    return best;
+
+  for (i = 0; i < sched->count; i++) {
+    g = &sched->groups[i];
+    if (g->period)
+      continue;
+    b = best >= 0 ? &sched->groups[best] : NULL;
+    if (!b || g->pass < b->pass || (g->pass == b->pass && g->priority > b->priority))
+      best = i;
+  }
+  if (best < 0)
+    *wait = next - now;
+  return best;
+}
+
+/** Request the next group, or wait until one is due. */
+static void sched_next(wbh_request_t *req)
+{
+  sched_op_t *op = req->op;
+  wbh_sched_t *sched = op->sched;
+  int64_t now = sched_now(), wait;
+  sched_group_t *g;
+  char cmd[5];
+
+  op->pending = sched_pick(sched, now, &wait);
+  if (op->pending < 0) {
+    /* nothing due: listen to the quiet line until something is */
+    wait = (wait + 999) / 1000;
+    request_drain(req, wait < 1 ? 1 : wait > SCHED_MAX_WAIT ? SCHED_MAX_WAIT : wait);
+    return;
+  }
+
+  g = &sched->groups[op->pending];
+  if (g->period) {
+    if (now - g->due > g->period)
+      g->late++;
+    g->due += g->period;
+    /* do not try to catch up on missed samples */
+    if (g->due < now)
+      g->due = now;
+  }
+  else
+    g->pass += 1.0 / g->priority;
+  op->requested = now;
+  sprintf(cmd, "08%02X", g->group);
+  request_exchange(req, cmd, op->buf[op->cur], BUFSIZE, 30000, '>');
+}
+
+static int sched_start(wbh_request_t *req)
+{
+  sched_op_t *op = req->op;
+  wbh_sched_t *sched = op->sched;
+  int64_t now = sched_now();
+  int i;
+
+  sched->started = now;
+  sched->stopped = 0;
+  for (i = 0; i < sched->count; i++) {
+    sched->groups[i].due = now;
+    sched->groups[i].pass = 0;
+    sched->groups[i].samples = 0;
+    sched->groups[i].late = 0;
+    sched->groups[i].busy = 0;
+  }
+  sched_next(req);
+  return 0;
+}
+
+/** End a run, keeping its duration for the statistics. */
+static void sched_finish(wbh_request_t *req, int rc)
+{
+  sched_op_t *op = req->op;
+  op->sched->stopped = sched_now();
+  request_finish(req, rc);
+}
+
+static void sched_step(wbh_request_t *req, wbh_request_t *child, int rc)
+{
+  sched_op_t *op = req->op;
+  wbh_measurement_t *data = req->data;
+  sched_group_t *g;
+
+  if (rc < 0) {
+    sched_finish(req, rc);
+    return;
+  }
+  if (op->stopping) {
+    /* the request in flight has been drained */
+    sched_finish(req, op->error ? op->error : op->samples);
+    return;
+  }
+  if (op->pending < 0) {
+    /* done waiting */
+    sched_next(req);
+    return;
+  }
+
+  /* as with streaming, get the next request going before decoding */
+  const char *buf = op->buf[op->cur];
+  g = &op->sched->groups[op->pending];
+  g->busy += sched_now() - op->requested;
+  g->samples++;
+  op->cur = !op->cur;
+  sched_next(req);
+
+  int count = parse_measurements(req->iface, g->group, buf, rc, data, WBH_MAX_MEASUREMENTS);
+  if (count < 0) {
+    op->stopping = 1;
+    op->error = count;
+    return;
+  }
+  memset(&data[count], 0, sizeof(wbh_measurement_t));
+  req->count = count;
+  op->samples++;
+  if (op->cb(req->dev, g->group, data, count, op->ctx))
+    op->stopping = 1;
+}
+
+static void sched_cleanup(wbh_request_t *req)
+{
+  sched_op_t *op = req->op;
+  /* cancelled runs end without a step */
+  if (!op->sched->stopped)
+    op->sched->stopped = sched_now();
+  free(req->op);
+  req->op = NULL;
+}
+
+/** Prepare a scheduler run.
+    @return zero or negative error code
+ */
+static int sched_request(wbh_request_t *req, wbh_sched_t *sched,
+                         wbh_stream_cb_t cb, void *ctx)
+{
+  sched_op_t *op;
+  if (!sched->count || !cb) {
+    iface_set_error(req->iface, ERR_INVAL, "invalid scheduler parameters");
+    return -ERR_INVAL;
+  }
+  if (!(op = calloc(1, sizeof(sched_op_t)))) {
+    iface_set_error(req->iface, ERR_INVAL, "sched_request: calloc() failed");
+    return -ERR_INVAL;
+  }
+  op->sched = sched;
+  op->cb = cb;
+  op->ctx = ctx;
+  req->op = op;
+  req->start = sched_start;
+  req->step = sched_step;
+  req->cleanup = sched_cleanup;
+  return 0;
+}
+
+int wbh_sched_run(wbh_sched_t *sched, wbh_stream_cb_t cb, void *ctx)
+{
+  wbh_request_t req;
+  int rc;
+  request_init(&req, sched->dev->iface, sched->dev);
+  if ((rc = sched_request(&req, sched, cb, ctx)) < 0)
+    return rc;
+  request_submit(&req);
+  rc = request_wait(&req);
+  request_release(&req);
+  return rc;
+}
+
+wbh_request_t *wbh_submit_sched(wbh_sched_t *sched, wbh_stream_cb_t scb,
+                                wbh_request_cb_t cb, void *ctx)
+{
+  wbh_request_t *req = request_new(sched->dev->iface, sched->dev, cb, ctx);
+  if (!req)
+    return NULL;
+  if (sched_request(req, sched, scb, ctx) < 0) {
+    free(req);
+    return NULL;
+  }
+  request_submit(req);
+  return req;
+}
+
+int wbh_sched_get_stats(wbh_sched_t *sched, wbh_sched_stats_t *stats, int max)
+{
+  int64_t end = sched->stopped ? sched->stopped : sched_now();
+  double elapsed = (end - sched->started) * 1e-6;
+  int i;
+
+  for (i = 0; i < sched->count && i < max; i++) {
+    sched_group_t *g = &sched->groups[i];
+    stats[i].group = g->group;
+    stats[i].target_hz = g->rate;
+    stats[i].achieved_hz = sched->started && elapsed > 0 ? g->samples / elapsed : 0;
+    stats[i].samples = g->samples;
+    stats[i].late = g->late;
+    stats[i].exchange_ms = g->samples ? g->busy * 1e-3 / g->samples : 0;
+  }
+  return sched->count;
+}
+
+double wbh_sched_load(wbh_sched_t *sched)
+{
+  double load = 0;
+  int i;
+
+  for (i = 0; i < sched->count; i++) {
+    sched_group_t *g = &sched->groups[i];
+    if (g->period && g->samples)
+      load += g->rate * g->busy * 1e-6 / g->samples;
+  }
+  return load;
+}
@@ -0,0 +1,303 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "wbh.h"
+#include "wbh_priv.h"
+
+/* Raw session capture.
+   A trace file starts with a header:
+
+     char magic[8]        "WBHTRACE"
+     uint32_t version     1
+     uint32_t byteorder   0x01020304 in the byte order of the writer
+
+   followed by one record per chunk of data written to or read from the
+   interface:
+
+     uint64_t timestamp   monotonic clock (ns)
+     uint32_t len         number of data bytes
+     uint8_t direction    WBH_TRACE_TX or WBH_TRACE_RX
+     uint8_t reserved[3]
+     uint8_t data[len]    padded with zeros to a multiple of 8 bytes
+
+   The I/O code only copies records into a ring buffer; a writer thread
+   appends them to the file, so a slow disk never delays an exchange.  If
+   the writer falls behind and the ring fills up, records are dropped and
+   counted. */
+
+#define TRACE_MAGIC "WBHTRACE"
+#define TRACE_VERSION 1
+#define TRACE_BYTEORDER 0x01020304
+
+/** size of the ring buffer between the I/O code and the writer thread */
+#define CAPTURE_RING (1 << 20)
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteorder;
+} trace_header_t;
+
+typedef struct {
+  uint64_t timestamp;
+  uint32_t len;
+  uint8_t direction;
+  uint8_t reserved[3];
+} trace_record_t;
+
+/** space a record with len data bytes takes up in the file */
+#define RECORD_SIZE(len) (sizeof(trace_record_t) + (((len) + 7) & ~(size_t)7))
+
+struct wbh_capture {
+  int fd;			/**< trace file */
+  pthread_t thread;		/**< writer */
+  pthread_mutex_t lock;
+  pthread_cond_t wake;		/**< signals the writer that there is work */
+  uint8_t *ring;		/**< records not written yet */
+  uint64_t head;		/**< bytes put into the ring so far */
+  uint64_t tail;		/**< bytes written to the file so far */
+  int stop;			/**< tells the writer to finish */
+  int error;			/**< writing to the file failed */
+  unsigned long dropped;	/**< records that did not fit into the ring */
+};
+
+/** Copy data into the ring buffer at a given stream position. */
+static void ring_put(struct wbh_capture *cap, uint64_t pos, const void *data, size_t len)
+{
+  size_t off = pos % CAPTURE_RING;
+  size_t first = len < CAPTURE_RING - off ? len : CAPTURE_RING - off;
+  memcpy(cap->ring + off, data, first);
+  memcpy(cap->ring, (const uint8_t *)data + first, len - first);
+}
+
+static void *capture_writer(void *arg)
+{
+  struct wbh_capture *cap = arg;
+  uint64_t head, tail;
+  size_t off, len;
+  ssize_t rc;
+
+  pthread_mutex_lock(&cap->lock);
+  for (;;) {
+    while (!cap->stop && cap->head == cap->tail)
+      pthread_cond_wait(&cap->wake, &cap->lock);
+    if (cap->head == cap->tail)
+      break;
+    head = cap->head;
+    tail = cap->tail;
+    pthread_mutex_unlock(&cap->lock);
+
+    /* write up to the end of the ring at most; the rest next time round */
+    off = tail % CAPTURE_RING;
+    len = head - tail < CAPTURE_RING - off ? head - tail : CAPTURE_RING - off;
+    while (len && !cap->error) {
+      rc = write(cap->fd, cap->ring + off, len);
+      if (rc < 0 && errno == EINTR)
+        continue;
+      if (rc <= 0) {
+        cap->error = 1;
+        break;
+      }
+      off += rc;
+      len -= rc;
+      tail += rc;
+    }
+
+    pthread_mutex_lock(&cap->lock);
+    /* after an error, keep consuming so that the I/O code is not stalled */
+    cap->tail = cap->error ? head : tail;
+  }
+  pthread_mutex_unlock(&cap->lock);
+  return NULL;
+}
+
+void capture_record(wbh_interface_t *iface, int direction, const void *data, size_t len)
+{
+  struct wbh_capture *cap = IFACE(iface)->capture;
+  static const uint8_t zeros[8];
+  trace_record_t rec;
+  struct timespec ts;
+  size_t size = RECORD_SIZE(len);
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  rec.timestamp = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  rec.len = len;
+  rec.direction = direction;
+  memset(rec.reserved, 0, sizeof(rec.reserved));
+
+  pthread_mutex_lock(&cap->lock);
+  if (cap->head - cap->tail + size > CAPTURE_RING) {
+    cap->dropped++;
+    pthread_mutex_unlock(&cap->lock);
+    return;
+  }
+  ring_put(cap, cap->head, &rec, sizeof(rec));
+  ring_put(cap, cap->head + sizeof(rec), data, len);
+  ring_put(cap, cap->head + sizeof(rec) + len, zeros, size - sizeof(rec) - len);
+  cap->head += size;
+  pthread_cond_signal(&cap->wake);
+  pthread_mutex_unlock(&cap->lock);
+}
+
+int wbh_capture_start(wbh_interface_t *iface, const char *path)
+{
+  struct wbh_capture *cap;
+  trace_header_t hdr = { TRACE_MAGIC, TRACE_VERSION, TRACE_BYTEORDER };
+
+  if (IFACE(iface)->capture) {
+    iface_set_error(iface, ERR_INVAL, "wbh_capture_start: already capturing");
+    return -ERR_INVAL;
+  }
+  cap = calloc(1, sizeof(struct wbh_capture));
+  if (!cap || !(cap->ring = malloc(CAPTURE_RING))) {
+    free(cap);
+    iface_set_error(iface, ERR_INVAL, "wbh_capture_start: malloc() failed");
+    return -ERR_INVAL;
+  }
+  cap->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (cap->fd < 0 || write(cap->fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+    iface_set_error(iface, ERR_INVAL, "wbh_capture_start: cannot create trace file");
+    goto fail;
+  }
+  pthread_mutex_init(&cap->lock, NULL);
+  pthread_cond_init(&cap->wake, NULL);
+  if (pthread_create(&cap->thread, NULL, capture_writer, cap)) {
+    pthread_mutex_destroy(&cap->lock);
+    pthread_cond_destroy(&cap->wake);
+    iface_set_error(iface, ERR_INVAL, "wbh_capture_start: cannot start writer thread");
+    goto fail;
+  }
+  IFACE(iface)->capture = cap;
+  return 0;
+
+fail:
+  if (cap->fd >= 0)
+    close(cap->fd);
+  free(cap->ring);
+  free(cap);
+  return -ERR_INVAL;
+}
+
+long wbh_capture_stop(wbh_interface_t *iface)
+{
+  struct wbh_capture *cap = IFACE(iface)->capture;
+  long rc;
+
+  if (!cap)
+    return 0;
+  IFACE(iface)->capture = NULL;
+  pthread_mutex_lock(&cap->lock);
+  cap->stop = 1;
+  pthread_cond_signal(&cap->wake);
+  pthread_mutex_unlock(&cap->lock);
+  pthread_join(cap->thread, NULL);
+
+  rc = cap->dropped;
+  if (close(cap->fd) < 0)
+    cap->error = 1;
+  if (cap->error) {
+    iface_set_error(iface, ERR_SERIAL, "wbh_capture_stop: error writing trace file");
+    rc = -ERR_SERIAL;
+  }
+  pthread_mutex_destroy(&cap->lock);
+  pthread_cond_destroy(&cap->wake);
+  free(cap->ring);
+  free(cap);
+  return rc;
+}
+
+struct wbh_trace {
+  const uint8_t *map;		/**< mapped trace file */
+  size_t size;			/**< size of the mapping */
+  size_t off;			/**< next record */
+};
+
+wbh_trace_t *wbh_trace_open(const char *path)
+{
+  struct wbh_trace *trace;
+  const trace_header_t *hdr;
+  struct stat st;
+  void *map;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    iface_set_error(NULL, ERR_INVAL, "wbh_trace_open: cannot open trace file");
+    return NULL;
+  }
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(trace_header_t)) {
+    close(fd);
+    iface_set_error(NULL, ERR_DATA, "wbh_trace_open: not a trace file");
+    return NULL;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    iface_set_error(NULL, ERR_INVAL, "wbh_trace_open: mmap() failed");
+    return NULL;
+  }
+
+  hdr = map;
+  if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) ||
+      hdr->version != TRACE_VERSION || hdr->byteorder != TRACE_BYTEORDER) {
+    munmap(map, st.st_size);
+    iface_set_error(NULL, ERR_DATA, "wbh_trace_open: not a trace file or unsupported version");
+    return NULL;
+  }
+
+  trace = malloc(sizeof(struct wbh_trace));
+  if (!trace) {
+    munmap(map, st.st_size);
+    iface_set_error(NULL, ERR_INVAL, "wbh_trace_open: malloc() failed");
+    return NULL;
+  }
+  trace->map = map;
+  trace->size = st.st_size;
+  trace->off = sizeof(trace_header_t);
+  return trace;
+}
+
+int wbh_trace_next(wbh_trace_t *trace, wbh_trace_record_t *rec)
+{
+  trace_record_t hdr;
+
+  /* a record cut short is what a session that crashed leaves behind; treat
+     it as the end of the trace */
+  if (trace->size - trace->off < sizeof(trace_record_t))
+    return 0;
+  memcpy(&hdr, trace->map + trace->off, sizeof(hdr));
+  if (trace->size - trace->off - sizeof(trace_record_t) < hdr.len)
+    return 0;
+  if (hdr.direction != WBH_TRACE_TX && hdr.direction != WBH_TRACE_RX) {
+    iface_set_error(NULL, ERR_DATA, "wbh_trace_next: corrupt record");
+    return -ERR_DATA;
+  }
+
+  rec->timestamp_ns = hdr.timestamp;
+  rec->direction = hdr.direction;
+  rec->data = trace->map + trace->off + sizeof(trace_record_t);
+  rec->len = hdr.len;
+  trace->off += RECORD_SIZE(hdr.len);
+  if (trace->off > trace->size)
+    trace->off = trace->size;
+  return 1;
+}
+
+void wbh_trace_rewind(wbh_trace_t *trace)
+{
+  trace->off = sizeof(trace_header_t);
+}
+
+void wbh_trace_close(wbh_trace_t *trace)
+{
+  if (!trace)
+    return;
+  munmap((void *)trace->map, trace->size);
+  free(trace);
+}
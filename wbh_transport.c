@@ -0,0 +1,402 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
+#include "wbh.h"
+#include "wbh_priv.h"
+
+/* Transports: the serial port the adapter is normally attached to, and an
+   in-memory stand-in that answers commands from a script. */
+
+/** serial transport state */
+typedef struct {
+  int fd;
+} serial_t;
+
+static ssize_t serial_read(void *priv, void *buf, size_t size)
+{
+  return read(((serial_t *)priv)->fd, buf, size);
+}
+
+static ssize_t serial_write(void *priv, const void *buf, size_t size)
+{
+  return write(((serial_t *)priv)->fd, buf, size);
+}
+
+static void serial_flush(void *priv, int queues)
+{
+  serial_t *s = priv;
+  if (queues == WBH_FLUSH_RX)
+    tcflush(s->fd, TCIFLUSH);
+  else if (queues == WBH_FLUSH_TX)
+    tcflush(s->fd, TCOFLUSH);
+  else
+    tcflush(s->fd, TCIOFLUSH);
+}
+
+static void serial_close(void *priv)
+{
+  serial_t *s = priv;
+  close(s->fd);
+  free(s);
+}
+
+static const wbh_transport_t serial_transport = {
+  .read = serial_read,
+  .write = serial_write,
+  .flush = serial_flush,
+  .close = serial_close,
+};
+
+/** Translate a baud rate into a termios speed.
+    @return speed or B0 if the rate is not supported */
+static speed_t baud_speed(int baud)
+{
+  switch (baud) {
+    case 1200: return B1200;
+    case 2400: return B2400;
+    case 4800: return B4800;
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+#ifdef B460800
+    case 460800: return B460800;
+#endif
+#ifdef B921600
+    case 921600: return B921600;
+#endif
+  }
+  return B0;
+}
+
+/** Ask the driver to pass received data on without delay.  USB serial
+    converters otherwise hold it back for several milliseconds.
+    @return zero or -1 if the driver does not support it */
+static int serial_low_latency(int fd)
+{
+#ifdef __linux__
+  struct serial_struct ss;
+  if (ioctl(fd, TIOCGSERIAL, &ss) < 0)
+    return -1;
+  ss.flags |= ASYNC_LOW_LATENCY;
+  return ioctl(fd, TIOCSSERIAL, &ss);
+#else
+  return -1;
+#endif
+}
+
+wbh_interface_t *wbh_init(const char *tty)
+{
+  return wbh_init_opts(tty, NULL);
+}
+
+wbh_interface_t *wbh_init_opts(const char *tty, const wbh_init_opts_t *opts)
+{
+  static const wbh_init_opts_t defaults;
+  wbh_interface_t *iface;
+  struct termios tio;
+  speed_t speed = B0;
+  int flush;
+
+  if (!opts)
+    opts = &defaults;
+  flush = opts->flush ? opts->flush : WBH_FLUSH_ON_OPEN | WBH_FLUSH_ON_HANGUP;
+  if (opts->baud && (speed = baud_speed(opts->baud)) == B0) {
+    iface_set_error(NULL, ERR_INVAL, "wbh_init: unsupported baud rate");
+    return NULL;
+  }
+
+  serial_t *s = malloc(sizeof(serial_t));
+  if (!s) {
+    iface_set_error(NULL, ERR_INVAL, "wbh_init: malloc() failed");
+    return NULL;
+  }
+
+  s->fd = open(tty, O_RDWR|O_NOCTTY|O_NDELAY);
+  if (s->fd < 0) {
+    iface_set_error(NULL, ERR_SERIAL, "failed to open TTY");
+    free(s);
+    return NULL;
+  }
+
+  fcntl(s->fd, F_SETFL, O_NONBLOCK);	/* all waiting is done in poll() */
+
+  /* put TTY in raw mode */
+  tcgetattr(s->fd, &tio);
+  cfmakeraw(&tio);
+  if (speed != B0)
+    cfsetspeed(&tio, speed);
+  tio.c_cflag |= CLOCAL | CREAD;
+  tio.c_cflag &= ~CRTSCTS;
+  tio.c_iflag &= ~(IXON | IXOFF);
+  if (opts->flow == WBH_FLOW_RTSCTS)
+    tio.c_cflag |= CRTSCTS;
+  else if (opts->flow == WBH_FLOW_XONXOFF)
+    tio.c_iflag |= IXON | IXOFF;
+  /* VMIN and VTIME both zero make read() return 0 rather than fail with
+     EAGAIN when there is no data, which looks like a hang-up; VMIN above 1
+     keeps poll() from reporting input until that many bytes are waiting,
+     and most answers are shorter than that */
+  tio.c_cc[VMIN] = opts->vmin || !opts->vtime ? 1 : 0;
+  tio.c_cc[VTIME] = opts->vtime;
+  if (tcsetattr(s->fd, TCSANOW, &tio) < 0 && (opts->baud || opts->flow)) {
+    iface_set_error(NULL, ERR_SERIAL, "wbh_init: cannot configure TTY");
+    serial_close(s);
+    return NULL;
+  }
+
+  if (opts->low_latency && serial_low_latency(s->fd) < 0 &&
+      opts->low_latency == WBH_LOW_LATENCY_REQUIRE) {
+    iface_set_error(NULL, ERR_SERIAL, "wbh_init: low latency mode not supported");
+    serial_close(s);
+    return NULL;
+  }
+
+  if (flush & WBH_FLUSH_ON_OPEN)
+    tcflush(s->fd, TCIOFLUSH);	/* flush stale serial buffers */
+
+  iface = wbh_init_transport(&serial_transport, s, s->fd, tty);
+  if (iface)
+    IFACE(iface)->hangup_flush = !!(flush & WBH_FLUSH_ON_HANGUP);
+  return iface;
+}
+
+/** scripted exchange */
+typedef struct {
+  char *cmd;			/**< command, without the carriage return */
+  char *response;		/**< response as sent by the adapter */
+  size_t len;			/**< length of response */
+} script_entry_t;
+
+struct wbh_memory {
+  script_entry_t *script;
+  int count;			/**< entries in script */
+  int size;			/**< entries allocated */
+  int next;			/**< entry to try first for the next command */
+  char cmd[BUFSIZE];		/**< command being written */
+  size_t cmd_len;
+  const char *out;		/**< response still to be read */
+  size_t out_len;
+  unsigned long unmatched;	/**< commands not found in the script */
+};
+
+/** answer to commands that are not in the script */
+static const char unknown_response[] = "?\r>";
+/** answer to ATI if the script has none; traces captured after wbh_init()
+    do not include the identification */
+static const char ident_response[] = "WBH-Diag Pro (replay)\r>";
+
+wbh_memory_t *wbh_memory_new(void)
+{
+  wbh_memory_t *mem = calloc(1, sizeof(wbh_memory_t));
+  if (!mem)
+    iface_set_error(NULL, ERR_INVAL, "wbh_memory_new: calloc() failed");
+  return mem;
+}
+
+void wbh_memory_free(wbh_memory_t *mem)
+{
+  int i;
+  if (!mem)
+    return;
+  for (i = 0; i < mem->count; i++) {
+    free(mem->script[i].cmd);
+    free(mem->script[i].response);
+  }
+  free(mem->script);
+  free(mem);
+}
+
+/** Append an exchange to the script.
+    @param cmd command, cmd_len bytes without the carriage return
+    @param response response, len bytes
+    @return zero or negative error code
+ */
+static int script_add(wbh_memory_t *mem, const char *cmd, size_t cmd_len,
+                      const char *response, size_t len)
+{
+  script_entry_t *e;
+
+  if (mem->count == mem->size) {
+    int size = mem->size ? mem->size * 2 : 16;
+    script_entry_t *script = realloc(mem->script, size * sizeof(script_entry_t));
+    if (!script)
+      goto nomem;
+    mem->script = script;
+    mem->size = size;
+  }
+  e = &mem->script[mem->count];
+  e->cmd = strndup(cmd, cmd_len);
+  e->response = malloc(len ? len : 1);
+  if (!e->cmd || !e->response) {
+    free(e->cmd);
+    free(e->response);
+    goto nomem;
+  }
+  memcpy(e->response, response, len);
+  e->len = len;
+  mem->count++;
+  return 0;
+
+nomem:
+  iface_set_error(NULL, ERR_INVAL, "wbh_memory_add: malloc() failed");
+  return -ERR_INVAL;
+}
+
+int wbh_memory_add(wbh_memory_t *mem, const char *cmd, const char *response)
+{
+  return script_add(mem, cmd, strlen(cmd), response, strlen(response));
+}
+
+int wbh_memory_load_trace(wbh_memory_t *mem, const char *path)
+{
+  wbh_trace_t *trace = wbh_trace_open(path);
+  wbh_trace_record_t rec;
+  char cmd[BUFSIZE], *response = NULL;
+  size_t cmd_len = 0, len = 0, size = 0, i;
+  int cmd_done = 0, added = 0, rc;
+
+  if (!trace)
+    return -ERR_INVAL;
+  /* every command is answered by what was received until the next one */
+  while ((rc = wbh_trace_next(trace, &rec)) > 0) {
+    if (rec.direction == WBH_TRACE_TX) {
+      if (cmd_done) {
+        if ((rc = script_add(mem, cmd, cmd_len, response, len)) < 0)
+          break;
+        added++;
+        cmd_done = 0;
+        cmd_len = len = 0;
+      }
+      for (i = 0; i < rec.len && !cmd_done; i++) {
+        if (rec.data[i] == '\r')
+          cmd_done = 1;
+        else if (cmd_len < sizeof(cmd))
+          cmd[cmd_len++] = rec.data[i];
+      }
+    }
+    else if (cmd_done) {
+      if (len + rec.len > size) {
+        char *p;
+        size = (len + rec.len) * 2;
+        if (!(p = realloc(response, size))) {
+          iface_set_error(NULL, ERR_INVAL, "wbh_memory_load_trace: malloc() failed");
+          rc = -ERR_INVAL;
+          break;
+        }
+        response = p;
+      }
+      memcpy(response + len, rec.data, rec.len);
+      len += rec.len;
+    }
+  }
+  if (rc == 0 && cmd_done && (rc = script_add(mem, cmd, cmd_len, response, len)) == 0)
+    added++;
+  free(response);
+  wbh_trace_close(trace);
+  return rc < 0 ? rc : added;
+}
+
+unsigned long wbh_memory_unmatched(wbh_memory_t *mem)
+{
+  return mem->unmatched;
+}
+
+/** Find the response to a command.  The script is searched from the entry
+    after the last match, wrapping around, so a captured session replays in
+    order and a script of single exchanges answers the same command over
+    and over. */
+static void memory_respond(wbh_memory_t *mem)
+{
+  int i, k;
+
+  for (k = 0; k < mem->count; k++) {
+    i = (mem->next + k) % mem->count;
+    if (strlen(mem->script[i].cmd) == mem->cmd_len &&
+        !memcmp(mem->script[i].cmd, mem->cmd, mem->cmd_len)) {
+      mem->next = (i + 1) % mem->count;
+      mem->out = mem->script[i].response;
+      mem->out_len = mem->script[i].len;
+      return;
+    }
+  }
+  if (mem->cmd_len == 3 && !memcmp(mem->cmd, "ATI", 3)) {
+    mem->out = ident_response;
+    mem->out_len = sizeof(ident_response) - 1;
+    return;
+  }
+  if (mem->cmd_len)
+    mem->unmatched++;
+  mem->out = unknown_response;
+  mem->out_len = sizeof(unknown_response) - 1;
+}
+
+static ssize_t memory_read(void *priv, void *buf, size_t size)
+{
+  wbh_memory_t *mem = priv;
+  if (!mem->out_len) {
+    errno = EAGAIN;
+    return -1;
+  }
+  if (size > mem->out_len)
+    size = mem->out_len;
+  memcpy(buf, mem->out, size);
+  mem->out += size;
+  mem->out_len -= size;
+  return size;
+}
+
+static ssize_t memory_write(void *priv, const void *buf, size_t size)
+{
+  wbh_memory_t *mem = priv;
+  const char *p = buf;
+  size_t i;
+
+  for (i = 0; i < size; i++) {
+    if (p[i] == '\r') {
+      memory_respond(mem);
+      mem->cmd_len = 0;
+    }
+    else if (mem->cmd_len < sizeof(mem->cmd))
+      mem->cmd[mem->cmd_len++] = p[i];
+  }
+  return size;
+}
+
+static void memory_flush(void *priv, int queues)
+{
+  wbh_memory_t *mem = priv;
+  if (queues & WBH_FLUSH_RX)
+    mem->out_len = 0;
+  if (queues & WBH_FLUSH_TX)
+    mem->cmd_len = 0;
+}
+
+static void memory_close(void *priv)
+{
+  /* the script belongs to the caller */
+}
+
+const wbh_transport_t wbh_memory_transport = {
+  .read = memory_read,
+  .write = memory_write,
+  .flush = memory_flush,
+  .close = memory_close,
+};
+
+wbh_interface_t *wbh_init_memory(wbh_memory_t *mem)
+{
+  mem->next = 0;
+  mem->cmd_len = 0;
+  mem->out_len = 0;
+  return wbh_init_transport(&wbh_memory_transport, mem, -1, "memory");
+}
@@ -0,0 +1,223 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "wbh.h"
+#include "wbh_priv.h"
+
+/* K-line timing tuner.
+   The block delay time (BDT) and inter-byte time (IBT) the adapter uses
+   towards the ECU are pure waiting time on every exchange, but an ECU that
+   is not given enough of it stops answering.  The tuner reads a
+   measurement group a few times at each candidate setting and looks for
+   the shortest times at which every read succeeds, BDT first, then IBT.
+   A read that times out or is answered with an error marks a setting as
+   unstable; only losing the adapter ends the search.  The current
+   settings are taken to be safe; the search never goes above them.
+   Results are remembered per ECU identity in a key file. */
+
+/** default number of reads per setting */
+#define TUNE_SAMPLES 5
+/** time to wait for a group at the initial setting (ms) */
+#define TUNE_TIMEOUT 5000
+/** time allowed beyond twice the read time at the initial setting before
+    a read at a shorter one counts as lost (ms) */
+#define TUNE_SLACK 200
+/** time the adapter gets to come back after a lost read (ms) */
+#define TUNE_RECOVER_TIMEOUT 1000
+
+/** tuning session */
+typedef struct {
+  wbh_device_t *dev;
+  uint8_t group;		/**< measurement group read */
+  int samples;			/**< reads per setting */
+  int timeout_ms;		/**< time to wait for a read */
+  wbh_tune_result_t *result;
+} tune_t;
+
+static double now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec * 1e-3;
+}
+
+/** Read the measurement group once.
+    @return number of measurements or negative error code */
+static int tune_read(tune_t *t)
+{
+  wbh_measurement_t data[WBH_MAX_MEASUREMENTS];
+  char cmd[5], buf[BUFSIZE];
+  int rc;
+
+  sprintf(cmd, "08%02X", t->group);
+  if ((rc = wbh_send_command_ms(t->dev, cmd, buf, BUFSIZE, t->timeout_ms)) < 0)
+    return rc;
+  return parse_measurements(t->dev->iface, t->group, buf, strlen(buf), data, WBH_MAX_MEASUREMENTS);
+}
+
+/** Get the line back after a read went unanswered.  Any character aborts
+    whatever the adapter is still busy with; what it sends after that is
+    discarded.
+    @return zero, or negative error code if the adapter is gone */
+static int tune_recover(tune_t *t)
+{
+  wbh_interface_t *iface = t->dev->iface;
+  char buf[BUFSIZE];
+
+  if (wbh_send_command_ms(t->dev, "", buf, BUFSIZE, TUNE_RECOVER_TIMEOUT) == -ERR_SERIAL)
+    return -ERR_SERIAL;
+  IFACE(iface)->transport->flush(IFACE(iface)->transport_priv, WBH_FLUSH_RX);
+  return 0;
+}
+
+/** Apply a setting and read the group a few times.
+    @param latency receives the mean time per read (ms)
+    @return 1 if every read succeeded, 0 if the ECU did not cope, negative
+            error code if the adapter failed */
+static int tune_try(tune_t *t, uint8_t bdt, uint8_t ibt, double *latency)
+{
+  wbh_interface_t *iface = t->dev->iface;
+  double start;
+  int i, rc;
+
+  if ((rc = wbh_set_bdt(iface, bdt)) < 0 || (rc = wbh_set_ibt(iface, ibt)) < 0)
+    return rc;
+  start = now_us();
+  for (i = 0; i < t->samples; i++) {
+    t->result->reads++;
+    if ((rc = tune_read(t)) == -ERR_SERIAL)
+      return rc;
+    if (rc < 0) {
+      t->result->errors++;
+      /* an ECU given too little time mostly just stops answering */
+      if (rc == -ERR_TIMEOUT && (rc = tune_recover(t)) < 0)
+        return rc;
+      return 0;
+    }
+  }
+  if (latency)
+    *latency = (now_us() - start) / t->samples / 1000;
+  return 1;
+}
+
+/** Find the shortest stable value of one of the times, the other one
+    fixed.  Values at or above hi are known to be stable.
+    @return shortest stable value or negative error code */
+static int tune_search(tune_t *t, int hi, int other, int is_bdt)
+{
+  int lo = -1, mid, rc;
+
+  /* binary search for the boundary between lo (unstable, or -1) and hi
+     (stable) */
+  while (hi - lo > 1) {
+    mid = (lo + hi) / 2;
+    rc = is_bdt ? tune_try(t, mid, other, NULL) : tune_try(t, other, mid, NULL);
+    if (rc < 0)
+      return rc;
+    if (rc)
+      hi = mid;
+    else
+      lo = mid;
+  }
+  return hi;
+}
+
+/** Apply a setting, measure it and report it in the result.
+    @return 1 if stable, 0 if not, negative error code on failure */
+static int tune_finish(tune_t *t, uint8_t bdt, uint8_t ibt)
+{
+  int rc = tune_try(t, bdt, ibt, &t->result->latency_ms);
+  if (rc > 0) {
+    t->result->bdt = bdt;
+    t->result->ibt = ibt;
+  }
+  return rc;
+}
+
+int wbh_autotune(wbh_device_t *dev, const wbh_tune_opts_t *opts,
+                 wbh_tune_result_t *result)
+{
+  wbh_interface_t *iface = dev->iface;
+  tune_t t = { dev, 1, TUNE_SAMPLES, TUNE_TIMEOUT, result };
+  char ident[256], value[64];
+  unsigned cached_bdt, cached_ibt;
+  int bdt0, ibt0, bdt, ibt, margin = 0, rc;
+
+  memset(result, 0, sizeof(*result));
+  if (opts) {
+    if (opts->group)
+      t.group = opts->group;
+    if (opts->samples > 0)
+      t.samples = opts->samples;
+    margin = opts->margin;
+  }
+  device_identity(dev, ident, sizeof(ident));
+
+  if ((bdt0 = wbh_get_bdt(iface)) < 0)
+    return bdt0;
+  if ((ibt0 = wbh_get_ibt(iface)) < 0)
+    return ibt0;
+  result->initial_bdt = bdt0;
+  result->initial_ibt = ibt0;
+
+  /* a setting found before only needs to be confirmed */
+  if (opts && opts->cache_path && ident[0] &&
+      !keyfile_lookup(opts->cache_path, ident, value, sizeof(value)) &&
+      sscanf(value, "%x %x", &cached_bdt, &cached_ibt) == 2 &&
+      cached_bdt < 256 && cached_ibt < 256) {
+    if ((rc = tune_finish(&t, cached_bdt, cached_ibt)) < 0)
+      goto fail;
+    if (rc) {
+      result->cached = 1;
+      return 0;
+    }
+  }
+
+  if ((rc = tune_try(&t, bdt0, ibt0, &result->initial_latency_ms)) < 0)
+    goto fail;
+  if (!rc) {
+    iface_set_error(iface, ERR_DATA, "wbh_autotune: device unstable at the current timing");
+    rc = -ERR_DATA;
+    goto fail;
+  }
+  /* shorter times only make reads faster; one taking much longer than
+     at the initial setting is not coming */
+  if (result->initial_latency_ms * 2 + TUNE_SLACK < TUNE_TIMEOUT)
+    t.timeout_ms = result->initial_latency_ms * 2 + TUNE_SLACK;
+
+  if ((bdt = tune_search(&t, bdt0, ibt0, 1)) < 0 ||
+      (ibt = tune_search(&t, ibt0, bdt, 0)) < 0) {
+    rc = bdt < 0 ? bdt : ibt;
+    goto fail;
+  }
+  bdt = bdt + margin < bdt0 ? bdt + margin : bdt0;
+  ibt = ibt + margin < ibt0 ? ibt + margin : ibt0;
+
+  /* the two times were searched one at a time; should the combination not
+     hold, fall back towards the initial times */
+  if ((rc = tune_finish(&t, bdt, ibt)) == 0 &&
+      (rc = tune_finish(&t, bdt, ibt0)) == 0)
+    rc = tune_finish(&t, bdt0, ibt0);
+  if (rc < 0)
+    goto fail;
+  if (!rc) {
+    iface_set_error(iface, ERR_DATA, "wbh_autotune: device unstable at the current timing");
+    rc = -ERR_DATA;
+    goto fail;
+  }
+
+  if (opts && opts->cache_path && ident[0]) {
+    snprintf(value, sizeof(value), "%02X %02X", result->bdt, result->ibt);
+    keyfile_store(opts->cache_path, ident, value);
+  }
+  return 0;
+
+fail:
+  /* leave the adapter as we found it */
+  wbh_set_bdt(iface, bdt0);
+  wbh_set_ibt(iface, ibt0);
+  result->bdt = bdt0;
+  result->ibt = ibt0;
+  return rc;
+}
@@ -0,0 +1,528 @@
+#include "wbh.h"
+#include "wbh_client.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+/* Adapter daemon.
+   Owns the adapters given on the command line and serves requests from
+   clients (see wbh_client.h) over a Unix-domain socket.  Every adapter
+   has a worker thread that runs the requests for it one after the other
+   through a session pool, so a device is dialed when it is first asked
+   for, kept connected while requests for it keep coming and hung up once
+   the adapter has been idle for a while.  The main thread only moves
+   messages: it reads requests from the clients and queues them; the
+   workers send the replies.
+
+   A read that is asked for while the same read (same request type,
+   device and parameters) is waiting in the queue or running is not
+   queued again; the client is added to the waiting read and gets a copy
+   of its reply.  Commands and settings are always run on their own. */
+
+#define INFO(x, y...) fprintf(stderr, "INFO " x "\n", y)
+
+/** most clients connected at once */
+#define MAX_CLIENTS 64
+/** time to wait for a device to answer when dialing (ms) */
+#define CONNECT_TIMEOUT 5000
+/** time to wait for the response to a custom command (ms) */
+#define COMMAND_TIMEOUT 10000
+/** time a client may take to accept a reply before it is dropped (ms) */
+#define SEND_TIMEOUT 1000
+
+/** client connection */
+typedef struct {
+  int fd;
+  int refs;			/**< held by the main loop and by every
+                                     request waiting for a reply */
+  int dead;			/**< sending to the client failed */
+  pthread_mutex_t send_lock;
+  size_t len;			/**< bytes in buf */
+  uint8_t buf[sizeof(wbhd_msg_t) + WBHD_MAX_PAYLOAD];	/**< partial request */
+} client_t;
+
+/** client waiting for the reply to an operation */
+typedef struct waiter {
+  struct waiter *next;
+  client_t *client;
+  uint32_t id;			/**< its request number */
+} waiter_t;
+
+/** operation queued on an adapter */
+typedef struct op {
+  struct op *next;
+  uint8_t type, device, arg, arg2;
+  char cmd[WBHD_MAX_PAYLOAD + 1];	/**< WBHD_COMMAND */
+  waiter_t *waiters;
+} op_t;
+
+typedef struct {
+  wbh_interface_t *iface;
+  wbh_pool_t *pool;
+  pthread_t thread;
+  pthread_mutex_t lock;		/**< protects everything below */
+  pthread_cond_t wake;		/**< signals the worker that there is work */
+  op_t *queue;			/**< head is the operation running */
+  op_t **queue_tail;
+  int stop;
+  wbhd_stats_t stats;
+} adapter_t;
+
+static adapter_t *adapters;
+static int adapter_count;
+/** time without requests after which a device is hung up on (ms) */
+static int idle_ms = 10000;
+/** protects the client reference counts */
+static pthread_mutex_t refs_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t stopping;
+
+static void client_get(client_t *c)
+{
+  pthread_mutex_lock(&refs_lock);
+  c->refs++;
+  pthread_mutex_unlock(&refs_lock);
+}
+
+static void client_put(client_t *c)
+{
+  int refs;
+  pthread_mutex_lock(&refs_lock);
+  refs = --c->refs;
+  pthread_mutex_unlock(&refs_lock);
+  if (refs)
+    return;
+  close(c->fd);
+  pthread_mutex_destroy(&c->send_lock);
+  free(c);
+}
+
+static void client_send(client_t *c, uint32_t id, uint8_t type, int status,
+                        const void *data, size_t len)
+{
+  wbhd_msg_t msg = { .len = len, .id = id, .type = type, .status = status };
+  struct iovec iov[2] = { { &msg, sizeof(msg) }, { (void *)data, len } };
+  struct msghdr mh = { .msg_iov = iov, .msg_iovlen = len ? 2 : 1 };
+  ssize_t rc;
+
+  pthread_mutex_lock(&c->send_lock);
+  if (!c->dead) {
+    do
+      rc = sendmsg(c->fd, &mh, MSG_NOSIGNAL);
+    while (rc < 0 && errno == EINTR);
+    /* a client that does not take its replies is not waited for; the
+       main loop notices the shut-down socket and drops it */
+    if (rc != sizeof(msg) + len) {
+      c->dead = 1;
+      shutdown(c->fd, SHUT_RDWR);
+    }
+  }
+  pthread_mutex_unlock(&c->send_lock);
+}
+
+/** Run an operation on the adapter.
+    @param out buffer of WBHD_MAX_PAYLOAD bytes receiving the reply payload
+    @param len receives the bytes in out
+    @return reply status */
+static int adapter_run(adapter_t *a, op_t *op, uint8_t *out, size_t *len)
+{
+  wbh_measurement_t data[WBH_MAX_MEASUREMENTS];
+  wbh_dtc_t dtc[WBH_MAX_DTC];
+  wbh_device_t *dev = NULL;
+  const char *error;
+  int rc, i;
+
+  *len = 0;
+  wbh_iface_clear_error(a->iface);
+  switch (op->type) {
+    case WBHD_MEASUREMENTS:
+    case WBHD_DTC:
+    case WBHD_SPECS:
+    case WBHD_COMMAND:
+      if (!(dev = wbh_pool_get(a->pool, op->device, CONNECT_TIMEOUT))) {
+        rc = wbh_iface_errcode(a->iface) ? -wbh_iface_errcode(a->iface) : -ERR_TIMEOUT;
+        goto fail;
+      }
+      break;
+  }
+
+  switch (op->type) {
+    case WBHD_MEASUREMENTS:
+      rc = wbh_read_measurements_into(dev, op->arg, data, WBH_MAX_MEASUREMENTS);
+      for (i = 0; i < rc && i < WBH_MAX_MEASUREMENTS; i++)
+        memcpy(&out[3 * i], data[i].raw, 3);
+      *len = 3 * i;
+      break;
+    case WBHD_DTC:
+      rc = wbh_get_dtc_into(dev, dtc, WBH_MAX_DTC);
+      for (i = 0; i < rc && i < WBH_MAX_DTC; i++) {
+        memcpy(&out[3 * i], &dtc[i].error_code, sizeof(uint16_t));
+        out[3 * i + 2] = dtc[i].status_code;
+      }
+      *len = 3 * i;
+      break;
+    case WBHD_SPECS:
+      rc = *len = dev->specs ? strnlen(dev->specs, WBHD_MAX_PAYLOAD) : 0;
+      memcpy(out, dev->specs, *len);
+      break;
+    case WBHD_COMMAND:
+      rc = wbh_send_command_ms(dev, op->cmd, (char *)out, WBHD_MAX_PAYLOAD, COMMAND_TIMEOUT);
+      if (rc >= 0)
+        *len = strnlen((char *)out, WBHD_MAX_PAYLOAD);
+      break;
+    case WBHD_SCAN:
+      /* scanning dials every address; hang up properly first */
+      wbh_pool_close(a->pool);
+      rc = wbh_scan_devices_into(a->iface, op->arg, op->arg2, NULL, out, WBHD_MAX_PAYLOAD);
+      *len = rc < 0 ? 0 : rc < WBHD_MAX_PAYLOAD ? rc : WBHD_MAX_PAYLOAD;
+      break;
+    case WBHD_ANALOG: rc = wbh_get_analog(a->iface, op->arg); break;
+    case WBHD_GET_BDT: rc = wbh_get_bdt(a->iface); break;
+    case WBHD_SET_BDT: rc = wbh_set_bdt(a->iface, op->arg); break;
+    case WBHD_GET_IBT: rc = wbh_get_ibt(a->iface); break;
+    case WBHD_SET_IBT: rc = wbh_set_ibt(a->iface, op->arg); break;
+    default: rc = -ERR_INVAL;
+  }
+  if (rc >= 0)
+    return rc;
+
+fail:
+  error = wbh_iface_error(a->iface) ? wbh_iface_error(a->iface) : "failed";
+  *len = strnlen(error, WBHD_MAX_PAYLOAD);
+  memcpy(out, error, *len);
+  /* after a timeout or I/O error, the session is likely gone; dial again
+     next time */
+  if (dev && (rc == -ERR_TIMEOUT || rc == -ERR_SERIAL))
+    wbh_pool_close(a->pool);
+  return rc;
+}
+
+static void *adapter_worker(void *arg)
+{
+  adapter_t *a = arg;
+  uint8_t out[WBHD_MAX_PAYLOAD];
+  waiter_t *w, *next;
+  struct timespec ts;
+  size_t len;
+  op_t *op;
+  int rc;
+
+  pthread_mutex_lock(&a->lock);
+  while (!a->stop) {
+    if (!a->queue) {
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += idle_ms / 1000;
+      ts.tv_nsec += idle_ms % 1000 * 1000000;
+      if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+      }
+      if (pthread_cond_timedwait(&a->wake, &a->lock, &ts) == ETIMEDOUT && !a->queue) {
+        /* nobody has asked for anything for a while */
+        pthread_mutex_unlock(&a->lock);
+        wbh_pool_close(a->pool);
+        pthread_mutex_lock(&a->lock);
+      }
+      continue;
+    }
+
+    /* the operation stays at the head of the queue while it runs, so
+       that the same read asked for meanwhile can join it */
+    op = a->queue;
+    pthread_mutex_unlock(&a->lock);
+    rc = adapter_run(a, op, out, &len);
+    pthread_mutex_lock(&a->lock);
+    if (!(a->queue = op->next))
+      a->queue_tail = &a->queue;
+    a->stats.operations++;
+    if (rc < 0)
+      a->stats.errors++;
+    pthread_mutex_unlock(&a->lock);
+
+    for (w = op->waiters; w; w = next) {
+      next = w->next;
+      client_send(w->client, w->id, op->type, rc, out, len);
+      client_put(w->client);
+      free(w);
+    }
+    free(op);
+    pthread_mutex_lock(&a->lock);
+  }
+  pthread_mutex_unlock(&a->lock);
+  return NULL;
+}
+
+/** Check whether requests of a type can share one operation. */
+static int coalescable(int type)
+{
+  return type != WBHD_COMMAND && type != WBHD_SET_BDT && type != WBHD_SET_IBT;
+}
+
+/** Queue a request on its adapter, or add it to the same one queued.
+    @return zero or negative error code */
+static int adapter_queue(client_t *c, const wbhd_msg_t *msg, const uint8_t *payload)
+{
+  adapter_t *a = &adapters[msg->iface];
+  waiter_t *w = malloc(sizeof(waiter_t));
+  op_t *op, *same = NULL;
+
+  if (!w)
+    return -ERR_INVAL;
+  w->client = c;
+  w->id = msg->id;
+  client_get(c);
+
+  pthread_mutex_lock(&a->lock);
+  a->stats.requests++;
+  if (coalescable(msg->type)) {
+    /* a read queued before a write would answer with what the write is
+       about to change; only the reads since the last write will do */
+    for (op = a->queue; op; op = op->next) {
+      if (!coalescable(op->type))
+        same = NULL;
+      else if (!same && op->type == msg->type && op->device == msg->device &&
+               op->arg == msg->arg && op->arg2 == msg->arg2)
+        same = op;
+    }
+    if (same) {
+      w->next = same->waiters;
+      same->waiters = w;
+      a->stats.coalesced++;
+      pthread_mutex_unlock(&a->lock);
+      return 0;
+    }
+  }
+  if (!(op = calloc(1, sizeof(op_t)))) {
+    pthread_mutex_unlock(&a->lock);
+    client_put(c);
+    free(w);
+    return -ERR_INVAL;
+  }
+  op->type = msg->type;
+  op->device = msg->device;
+  op->arg = msg->arg;
+  op->arg2 = msg->arg2;
+  memcpy(op->cmd, payload, msg->len);
+  w->next = NULL;
+  op->waiters = w;
+  *a->queue_tail = op;
+  a->queue_tail = &op->next;
+  pthread_cond_signal(&a->wake);
+  pthread_mutex_unlock(&a->lock);
+  return 0;
+}
+
+/** Handle a complete request. */
+static void client_request(client_t *c, const wbhd_msg_t *msg, const uint8_t *payload)
+{
+  const char *error = NULL;
+  wbh_pool_stats_t pool;
+  wbhd_stats_t stats;
+  adapter_t *a;
+
+  if (msg->iface >= adapter_count)
+    error = "no such adapter";
+  else if (!msg->type || msg->type >= WBHD_TYPES)
+    error = "unknown request";
+  else if (msg->type == WBHD_COMMAND && !msg->len)
+    error = "empty command";
+  else if (msg->type == WBHD_STATS) {
+    a = &adapters[msg->iface];
+    pthread_mutex_lock(&a->lock);
+    stats = a->stats;
+    pthread_mutex_unlock(&a->lock);
+    /* only the worker uses the pool; the counter may be a little stale */
+    wbh_pool_get_stats(a->pool, &pool);
+    stats.connects = pool.connects;
+    client_send(c, msg->id, msg->type, 0, &stats, sizeof(stats));
+    return;
+  }
+  else if (adapter_queue(c, msg, payload) < 0)
+    error = "out of memory";
+  if (error)
+    client_send(c, msg->id, msg->type, -ERR_INVAL, error, strlen(error));
+}
+
+/** Read what a client has sent and handle the complete requests.
+    @return zero, or -1 if the client is gone or broke the protocol */
+static int client_input(client_t *c)
+{
+  wbhd_msg_t msg;
+  size_t used;
+  ssize_t rc;
+
+  rc = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len);
+  if (rc < 0 && (errno == EINTR || errno == EAGAIN))
+    return 0;
+  if (rc <= 0 || c->dead)
+    return -1;
+  c->len += rc;
+
+  for (;;) {
+    if (c->len < sizeof(msg))
+      return 0;
+    memcpy(&msg, c->buf, sizeof(msg));
+    if (msg.len > WBHD_MAX_PAYLOAD)
+      return -1;
+    used = sizeof(msg) + msg.len;
+    if (c->len < used)
+      return 0;
+    client_request(c, &msg, c->buf + sizeof(msg));
+    memmove(c->buf, c->buf + used, c->len - used);
+    c->len -= used;
+  }
+}
+
+static int listen_socket(const char *path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: socket path too long\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+      bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+    perror(path);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void stop(int sig)
+{
+  stopping = 1;
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+          "usage: %s [options] TTY...\n"
+          "  -s PATH   socket to listen on (default: " WBHD_SOCKET ")\n"
+          "  -i MS     hang up on a device after this long without requests\n"
+          "            (default: 10000)\n"
+          "  -k MS     check a quiet session before using it again after\n"
+          "            this long (default: %d)\n"
+          "  -c        answer repeated DTC, timing and analog reads from\n"
+          "            memory for a while (see wbh_result_cache_enable())\n",
+          prog, WBH_POOL_KEEPALIVE);
+}
+
+int main(int argc, char **argv)
+{
+  const char *path = WBHD_SOCKET;
+  struct pollfd pfd[MAX_CLIENTS + 1];
+  client_t *clients[MAX_CLIENTS];
+  struct timeval tv = { SEND_TIMEOUT / 1000, SEND_TIMEOUT % 1000 * 1000 };
+  struct sigaction sa = { .sa_handler = stop };
+  int keepalive_ms = 0, cache = 0, count = 0, lfd, fd, c, i;
+
+  while ((c = getopt(argc, argv, "s:i:k:ch")) != -1) {
+    switch (c) {
+      case 's': path = optarg; break;
+      case 'i': idle_ms = atoi(optarg); break;
+      case 'k': keepalive_ms = atoi(optarg); break;
+      case 'c': cache = 1; break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+  if (optind == argc || idle_ms <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  adapter_count = argc - optind;
+  if (adapter_count > 256 || !(adapters = calloc(adapter_count, sizeof(adapter_t)))) {
+    usage(argv[0]);
+    return 1;
+  }
+  for (i = 0; i < adapter_count; i++) {
+    adapter_t *a = &adapters[i];
+    if (!(a->iface = wbh_init(argv[optind + i])) ||
+        !(a->pool = wbh_pool_new(a->iface, keepalive_ms)) ||
+        (cache && wbh_result_cache_enable(a->iface, NULL) < 0)) {
+      fprintf(stderr, "%s: %s\n", argv[optind + i], wbh_get_error());
+      return 1;
+    }
+    a->queue_tail = &a->queue;
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->wake, NULL);
+    if (pthread_create(&a->thread, NULL, adapter_worker, a)) {
+      fprintf(stderr, "%s: cannot start worker thread\n", argv[optind + i]);
+      return 1;
+    }
+    INFO("adapter %d: %s", i, argv[optind + i]);
+  }
+  if ((lfd = listen_socket(path)) < 0)
+    return 1;
+
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  INFO("listening on %s", path);
+
+  while (!stopping) {
+    pfd[0].fd = count < MAX_CLIENTS ? lfd : -1;
+    pfd[0].events = POLLIN;
+    for (i = 0; i < count; i++) {
+      pfd[i + 1].fd = clients[i]->fd;
+      pfd[i + 1].events = POLLIN;
+    }
+    if (poll(pfd, count + 1, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("poll");
+      break;
+    }
+
+    /* drop the clients that are gone first, so there is room for new ones */
+    for (i = count - 1; i >= 0; i--) {
+      if (pfd[i + 1].revents && client_input(clients[i]) < 0) {
+        client_put(clients[i]);
+        clients[i] = clients[--count];
+      }
+    }
+    if (pfd[0].revents & POLLIN) {
+      if ((fd = accept(lfd, NULL, NULL)) < 0)
+        continue;
+      client_t *cl = calloc(1, sizeof(client_t));
+      if (!cl) {
+        close(fd);
+        continue;
+      }
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+      cl->fd = fd;
+      cl->refs = 1;
+      pthread_mutex_init(&cl->send_lock, NULL);
+      clients[count++] = cl;
+    }
+  }
+
+  INFO("shutting down, %d clients connected", count);
+  close(lfd);
+  unlink(path);
+  for (i = 0; i < adapter_count; i++) {
+    adapter_t *a = &adapters[i];
+    pthread_mutex_lock(&a->lock);
+    a->stop = 1;
+    pthread_cond_signal(&a->wake);
+    pthread_mutex_unlock(&a->lock);
+    pthread_join(a->thread, NULL);
+    wbh_pool_free(a->pool);
+    wbh_shutdown(a->iface);
+  }
+  return 0;
+}
@@ -0,0 +1,600 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <termios.h>
+#include <pthread.h>
+#include "wemu.h"
+
+#define ERROR(f, p...) fprintf(stderr, "%s: " f, __FUNCTION__, p)
+
+/** size of command line and response buffers */
+#define BUFSIZE 255
+
+/** identification string returned for ATI and ATZ */
+#define IDENT "WBH-Diag Pro (wemu)"
+
+struct wemu {
+  wemu_opts_t opts;		/**< timing and fault settings */
+  wemu_ecu_t *ecus;		/**< emulated control units */
+  wemu_ecu_t *connected;	/**< ECU we are talking to, NULL if none */
+  int actuator_pos;		/**< next step of the actuator test */
+  uint8_t bdt;			/**< block delay time */
+  uint8_t ibt;			/**< inter-byte time */
+  uint8_t baudrate;		/**< forced baud rate (ATN) */
+  int analog[6];		/**< analog pin values */
+  int master;			/**< pty master file descriptor */
+  int slave;			/**< pty slave file descriptor, kept open so
+                                     the master survives client restarts */
+  char *slave_name;		/**< pty slave device name */
+  int stop_pipe[2];		/**< wakes up the serving loop on stop */
+  volatile int running;
+  int threaded;
+  pthread_t thread;
+  unsigned seed;
+  unsigned long commands;	/**< number of commands answered */
+  char line[BUFSIZE];		/**< command being received */
+  int line_len;
+};
+
+wemu_t *wemu_new(const wemu_opts_t *opts)
+{
+  wemu_t *emu = calloc(1, sizeof(wemu_t));
+  if (!emu)
+    return NULL;
+  if (opts)
+    emu->opts = *opts;
+  emu->seed = emu->opts.seed;
+  emu->master = emu->slave = -1;
+  emu->stop_pipe[0] = emu->stop_pipe[1] = -1;
+  emu->bdt = 0x0a;
+  emu->ibt = 0x01;
+  return emu;
+}
+
+void wemu_free(wemu_t *emu)
+{
+  wemu_ecu_t *ecu, *next_ecu;
+  wemu_group_t *grp, *next_grp;
+  if (!emu)
+    return;
+  wemu_stop(emu);
+  for (ecu = emu->ecus; ecu; ecu = next_ecu) {
+    next_ecu = ecu->next;
+    for (grp = ecu->groups; grp; grp = next_grp) {
+      next_grp = grp->next;
+      free(grp);
+    }
+    free(ecu);
+  }
+  if (emu->master >= 0)
+    close(emu->master);
+  if (emu->slave >= 0)
+    close(emu->slave);
+  free(emu->slave_name);
+  free(emu);
+}
+
+wemu_ecu_t *wemu_find_ecu(wemu_t *emu, uint8_t id)
+{
+  wemu_ecu_t *ecu;
+  for (ecu = emu->ecus; ecu; ecu = ecu->next) {
+    if (ecu->id == id)
+      return ecu;
+  }
+  return NULL;
+}
+
+wemu_ecu_t *wemu_add_ecu(wemu_t *emu, uint8_t id, const char *specs)
+{
+  wemu_ecu_t *ecu = wemu_find_ecu(emu, id);
+  if (!ecu) {
+    ecu = calloc(1, sizeof(wemu_ecu_t));
+    if (!ecu)
+      return NULL;
+    ecu->id = id;
+    ecu->baudrate = 4;
+    ecu->protocol = 1;
+    ecu->next = emu->ecus;
+    emu->ecus = ecu;
+  }
+  snprintf(ecu->specs, sizeof(ecu->specs), "%s", specs);
+  return ecu;
+}
+
+/** find or create a measurement group of an ECU */
+static wemu_group_t *ecu_group(wemu_ecu_t *ecu, uint8_t group, int create)
+{
+  wemu_group_t *grp;
+  for (grp = ecu->groups; grp; grp = grp->next) {
+    if (grp->group == group)
+      return grp;
+  }
+  if (!create)
+    return NULL;
+  grp = calloc(1, sizeof(wemu_group_t));
+  if (!grp)
+    return NULL;
+  grp->group = group;
+  grp->next = ecu->groups;
+  ecu->groups = grp;
+  return grp;
+}
+
+/** look up the ECU a script line refers to */
+static wemu_ecu_t *script_ecu(wemu_t *emu, const char *arg)
+{
+  wemu_ecu_t *ecu = wemu_find_ecu(emu, strtoul(arg, NULL, 16));
+  if (!ecu)
+    ERROR("unknown ECU %s\n", arg);
+  return ecu;
+}
+
+int wemu_parse_line(wemu_t *emu, const char *line)
+{
+  char buf[BUFSIZE];
+  char *tok[3 + 3 * WEMU_MAX_CHANNELS];
+  char *save = NULL;
+  int ntok = 0;
+  wemu_ecu_t *ecu;
+
+  while (isspace((unsigned char)*line))
+    line++;
+  if (!*line || *line == '#')
+    return 0;
+
+  /* the ecu directive keeps the remainder of the line verbatim */
+  if (!strncmp(line, "ecu ", 4)) {
+    unsigned id, baud, proto;
+    int n = 0;
+    if (sscanf(line, "ecu %x %u %u %n", &id, &baud, &proto, &n) != 3 || !n)
+      goto syntax;
+    snprintf(buf, sizeof(buf), "%s", line + n);
+    buf[strcspn(buf, "\r\n")] = 0;
+    if (!(ecu = wemu_add_ecu(emu, id, buf)))
+      return -1;
+    ecu->baudrate = baud;
+    ecu->protocol = proto;
+    return 0;
+  }
+
+  snprintf(buf, sizeof(buf), "%s", line);
+  for (char *t = strtok_r(buf, " \t\r\n", &save); t && ntok < sizeof(tok) / sizeof(tok[0]);
+       t = strtok_r(NULL, " \t\r\n", &save))
+    tok[ntok++] = t;
+  if (!ntok)
+    return 0;
+
+  if (!strcmp(tok[0], "dtc") && ntok == 4) {
+    if (!(ecu = script_ecu(emu, tok[1])))
+      return -1;
+    if (ecu->dtc_count == WEMU_MAX_DTC)
+      goto syntax;
+    ecu->dtc[ecu->dtc_count].error_code = strtoul(tok[2], NULL, 16);
+    ecu->dtc[ecu->dtc_count].status_code = strtoul(tok[3], NULL, 16);
+    ecu->dtc_count++;
+  }
+  else if (!strcmp(tok[0], "group") && ntok >= 6 && (ntok - 3) % 3 == 0) {
+    wemu_group_t *grp;
+    int i;
+    if (!(ecu = script_ecu(emu, tok[1])))
+      return -1;
+    if (!(grp = ecu_group(ecu, strtoul(tok[2], NULL, 16), 1)))
+      return -1;
+    grp->count = (ntok - 3) / 3;
+    for (i = 0; i < grp->count * 3; i++)
+      grp->raw[i / 3][i % 3] = strtoul(tok[3 + i], NULL, 16);
+  }
+  else if (!strcmp(tok[0], "actuator") && ntok >= 3) {
+    int i;
+    if (!(ecu = script_ecu(emu, tok[1])))
+      return -1;
+    for (i = 2; i < ntok && ecu->actuator_count < WEMU_MAX_ACTUATORS; i++)
+      ecu->actuator[ecu->actuator_count++] = strtoul(tok[i], NULL, 16);
+  }
+  else if (!strcmp(tok[0], "timing") && ntok == 4) {
+    if (!(ecu = script_ecu(emu, tok[1])))
+      return -1;
+    ecu->kline = 1;
+    ecu->min_bdt = strtoul(tok[2], NULL, 16);
+    ecu->min_ibt = strtoul(tok[3], NULL, 16);
+  }
+  else if (!strcmp(tok[0], "analog") && ntok == 3) {
+    unsigned pin = strtoul(tok[1], NULL, 10);
+    if (pin > 5)
+      goto syntax;
+    emu->analog[pin] = atoi(tok[2]);
+  }
+  else if (!strcmp(tok[0], "bdt") && ntok == 2)
+    emu->bdt = strtoul(tok[1], NULL, 16);
+  else if (!strcmp(tok[0], "ibt") && ntok == 2)
+    emu->ibt = strtoul(tok[1], NULL, 16);
+  else if (!strcmp(tok[0], "latency") && ntok == 3) {
+    unsigned v = strtoul(tok[2], NULL, 10);
+    if (!strcmp(tok[1], "byte"))
+      emu->opts.byte_latency_us = v;
+    else if (!strcmp(tok[1], "response"))
+      emu->opts.response_latency_ms = v;
+    else if (!strcmp(tok[1], "connect"))
+      emu->opts.connect_latency_ms = v;
+    else if (!strcmp(tok[1], "absent"))
+      emu->opts.absent_latency_ms = v;
+    else
+      goto syntax;
+  }
+  else if (!strcmp(tok[0], "drop") && ntok == 2)
+    emu->opts.drop_rate = atof(tok[1]);
+  else if (!strcmp(tok[0], "garbage") && ntok == 2)
+    emu->opts.garbage_rate = atof(tok[1]);
+  else if (!strcmp(tok[0], "jitter") && ntok == 2)
+    emu->opts.jitter_rate = atof(tok[1]);
+  else
+    goto syntax;
+  return 0;
+
+syntax:
+  ERROR("syntax error: %s\n", line);
+  return -1;
+}
+
+int wemu_load_script(wemu_t *emu, const char *path)
+{
+  char line[BUFSIZE];
+  int lineno = 0;
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    ERROR("cannot open %s\n", path);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), fp)) {
+    lineno++;
+    if (wemu_parse_line(emu, line) < 0) {
+      ERROR("%s:%d: invalid line\n", path, lineno);
+      fclose(fp);
+      return -1;
+    }
+  }
+  fclose(fp);
+  return 0;
+}
+
+/** a car with an engine, an instrument cluster and central locking */
+static const char *default_script[] = {
+  "ecu 01 4 1 038906018AB  1,9l R4 EDC  G000SG  D02",
+  "dtc 01 4052 23",
+  "dtc 01 0203 1D",
+  "group 01 01 01 C8 23 05 0A 8C 13 96 64 10 01 55",
+  "group 01 02 01 C8 23 21 64 00 0F 0A 32 05 0A 88",
+  "group 01 03 01 C8 23 12 FA 56 14 32 80 17 64 80",
+  "ecu 17 4 1 1J0920826C  KOMBI+WEGFAHRSP VDO V03",
+  "group 17 01 07 0A 00 01 C8 00 15 0A 8C 24 00 32",
+  "ecu 35 4 1 1J0959799AH Zentralverriegelung D01",
+  "actuator 35 03E8 03E9 03EB",
+  "analog 0 512",
+};
+
+void wemu_load_default(wemu_t *emu)
+{
+  int i;
+  for (i = 0; i < sizeof(default_script) / sizeof(default_script[0]); i++)
+    wemu_parse_line(emu, default_script[i]);
+}
+
+const char *wemu_open_pty(wemu_t *emu)
+{
+  struct termios tio;
+  char *name;
+
+  emu->master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (emu->master < 0 || grantpt(emu->master) < 0 || unlockpt(emu->master) < 0) {
+    ERROR("cannot allocate pty: %s\n", strerror(errno));
+    return NULL;
+  }
+  name = ptsname(emu->master);
+  if (!name || !(emu->slave_name = strdup(name)))
+    return NULL;
+
+  /* raw slave, or the line discipline would echo our input back to us */
+  emu->slave = open(emu->slave_name, O_RDWR | O_NOCTTY);
+  if (emu->slave < 0) {
+    ERROR("cannot open %s: %s\n", emu->slave_name, strerror(errno));
+    return NULL;
+  }
+  tcgetattr(emu->slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(emu->slave, TCSANOW, &tio);
+  return emu->slave_name;
+}
+
+/** uniformly distributed random number in [0, 1) */
+static double rnd(wemu_t *emu)
+{
+  return rand_r(&emu->seed) / (RAND_MAX + 1.0);
+}
+
+static void sleep_us(unsigned long us)
+{
+  struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+  while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+    ;
+}
+
+static void write_all(int fd, const char *buf, size_t size)
+{
+  while (size > 0) {
+    ssize_t rc = write(fd, buf, size);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc <= 0)
+      return;
+    buf += rc;
+    size -= rc;
+  }
+}
+
+/** Wait for a K-line operation to finish.
+    Like the real chip, any character received in the meantime aborts the
+    operation; that character is consumed.
+    @return zero if the full time elapsed, 1 if aborted
+ */
+static int emu_delay(wemu_t *emu, unsigned ms)
+{
+  struct pollfd pfd = { .fd = emu->master, .events = POLLIN };
+  char c;
+  if (!ms)
+    return 0;
+  if (poll(&pfd, 1, ms) <= 0)
+    return 0;
+  return read(emu->master, &c, 1) == 1;
+}
+
+/** send a response, applying latency and fault injection */
+static void emu_send(wemu_t *emu, const char *resp)
+{
+  char out[BUFSIZE * 2];
+  size_t len = 0;
+  const char *p;
+
+  for (p = resp; *p && len < sizeof(out) - 1; p++) {
+    if (emu->opts.garbage_rate > 0 && rnd(emu) < emu->opts.garbage_rate)
+      out[len++] = rand_r(&emu->seed) & 0xff;
+    if (emu->opts.drop_rate > 0 && rnd(emu) < emu->opts.drop_rate)
+      continue;
+    out[len++] = *p;
+  }
+
+  if (emu->opts.response_latency_ms)
+    sleep_us(emu->opts.response_latency_ms * 1000UL);
+  if (!emu->opts.byte_latency_us) {
+    write_all(emu->master, out, len);
+    return;
+  }
+  for (p = out; p < out + len; p++) {
+    write_all(emu->master, p, 1);
+    sleep_us(emu->opts.byte_latency_us);
+  }
+}
+
+/** append formatted text to a response buffer */
+#define APPEND(buf, f, p...) \
+  snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), f, ## p)
+
+/** answer a command addressed to the connected ECU */
+static void emu_ecu_command(wemu_t *emu, const char *cmd, char *resp, size_t size)
+{
+  wemu_ecu_t *ecu = emu->connected;
+  char out[BUFSIZE] = "";
+  int i;
+
+  if (!ecu) {
+    snprintf(resp, size, "ERROR\r>");
+    return;
+  }
+  if (!strcmp(cmd, "00")) {
+    APPEND(out, "%s\r", ecu->specs);
+  }
+  else if (!strcmp(cmd, "02")) {
+    for (i = 0; i < ecu->dtc_count; i++)
+      APPEND(out, "%04X %02X\r", ecu->dtc[i].error_code, ecu->dtc[i].status_code);
+  }
+  else if (!strcmp(cmd, "03")) {
+    if (emu->actuator_pos < ecu->actuator_count)
+      APPEND(out, "%04X\r", ecu->actuator[emu->actuator_pos++]);
+    else
+      APPEND(out, "END\r");
+  }
+  else if (!strcmp(cmd, "05")) {
+    ecu->dtc_count = 0;
+    APPEND(out, "OK\r");
+  }
+  else if (!strncmp(cmd, "08", 2) && strlen(cmd) == 4 && isxdigit(cmd[2]) && isxdigit(cmd[3])) {
+    wemu_group_t *grp = ecu_group(ecu, strtoul(cmd + 2, NULL, 16), 0);
+    if (!grp) {
+      snprintf(resp, size, "DATA ERROR\r>");
+      return;
+    }
+    for (i = 0; i < grp->count; i++) {
+      if (emu->opts.jitter_rate > 0 && rnd(emu) < emu->opts.jitter_rate)
+        grp->raw[i][2] += (rand_r(&emu->seed) & 1) ? 1 : -1;
+      APPEND(out, "%02X %02X %02X\r", grp->raw[i][0], grp->raw[i][1], grp->raw[i][2]);
+    }
+  }
+  else {
+    snprintf(resp, size, "?\r>");
+    return;
+  }
+
+  if (ecu->kline) {
+    /* a block exchange per command, the answer sent byte by byte; any
+       character received meanwhile aborts it, as with the real chip */
+    unsigned ms = emu->bdt + emu->ibt * strlen(out) / 10;
+    if (emu_delay(emu, ms)) {
+      snprintf(resp, size, "ERROR\r>");
+      return;
+    }
+    if (emu->bdt < ecu->min_bdt || emu->ibt < ecu->min_ibt) {
+      /* rushed, the ECU loses track and never answers */
+      resp[0] = 0;
+      return;
+    }
+  }
+  snprintf(resp, size, "%s>", out);
+}
+
+/** answer a complete command line */
+static void emu_command(wemu_t *emu, char *cmd)
+{
+  char resp[BUFSIZE * 2];
+  char *p;
+
+  for (p = cmd; *p; p++)
+    *p = toupper((unsigned char)*p);
+  emu->commands++;
+
+  if (!*cmd)
+    snprintf(resp, sizeof(resp), ">");
+  else if (!strcmp(cmd, "ATI"))
+    snprintf(resp, sizeof(resp), IDENT "\r>");
+  else if (!strcmp(cmd, "ATZ")) {
+    emu->connected = NULL;
+    emu->baudrate = 0;
+    snprintf(resp, sizeof(resp), IDENT "\r>");
+  }
+  else if (!strcmp(cmd, "ATH")) {
+    emu->connected = NULL;
+    snprintf(resp, sizeof(resp), "OK\r>");
+  }
+  else if (!strncmp(cmd, "ATD", 3) && strlen(cmd) == 5) {
+    wemu_ecu_t *ecu = wemu_find_ecu(emu, strtoul(cmd + 3, NULL, 16));
+    emu->connected = NULL;
+    if (ecu && !emu_delay(emu, emu->opts.connect_latency_ms)) {
+      emu->connected = ecu;
+      emu->actuator_pos = 0;
+      snprintf(resp, sizeof(resp), "CONNECT: %d %d %s\r>",
+               emu->baudrate ? emu->baudrate : ecu->baudrate, ecu->protocol, ecu->specs);
+    }
+    else {
+      if (!ecu)
+        emu_delay(emu, emu->opts.absent_latency_ms);
+      snprintf(resp, sizeof(resp), "ERROR\r>");
+    }
+  }
+  else if (!strncmp(cmd, "ATN", 3) && strlen(cmd) == 4 && cmd[3] >= '0' && cmd[3] <= '5') {
+    emu->baudrate = cmd[3] - '0';
+    snprintf(resp, sizeof(resp), "OK\r>");
+  }
+  else if (!strncmp(cmd, "ATBDT", 5) || !strncmp(cmd, "ATIBT", 5)) {
+    uint8_t *xxt = cmd[2] == 'B' ? &emu->bdt : &emu->ibt;
+    if (!strcmp(cmd + 5, "?"))
+      snprintf(resp, sizeof(resp), "%02X\r>", *xxt);
+    else if (strlen(cmd + 5) == 2 && isxdigit(cmd[5]) && isxdigit(cmd[6])) {
+      *xxt = strtoul(cmd + 5, NULL, 16);
+      snprintf(resp, sizeof(resp), "OK\r>");
+    }
+    else
+      snprintf(resp, sizeof(resp), "?\r>");
+  }
+  else if (!strncmp(cmd, "ATA", 3) && strlen(cmd) == 4 && cmd[3] >= '0' && cmd[3] <= '5')
+    snprintf(resp, sizeof(resp), "%d\r>", emu->analog[cmd[3] - '0']);
+  else if (!strncmp(cmd, "AT", 2))
+    snprintf(resp, sizeof(resp), "?\r>");
+  else
+    emu_ecu_command(emu, cmd, resp, sizeof(resp));
+
+  if (resp[0])
+    emu_send(emu, resp);
+}
+
+int wemu_run(wemu_t *emu)
+{
+  char buf[BUFSIZE];
+  int i, rc;
+
+  if (emu->master < 0 && !wemu_open_pty(emu))
+    return -1;
+  if (emu->stop_pipe[0] < 0 && pipe(emu->stop_pipe) < 0)
+    return -1;
+  emu->running = 1;
+
+  while (emu->running) {
+    struct pollfd pfd[2] = {
+      { .fd = emu->master, .events = POLLIN },
+      { .fd = emu->stop_pipe[0], .events = POLLIN },
+    };
+    rc = poll(pfd, 2, -1);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc < 0)
+      return -1;
+    if (pfd[1].revents)
+      break;
+    rc = read(emu->master, buf, sizeof(buf));
+    if (rc < 0 && (errno == EINTR || errno == EAGAIN))
+      continue;
+    if (rc <= 0)
+      return -1;
+    for (i = 0; i < rc; i++) {
+      if (buf[i] == '\r') {
+        emu->line[emu->line_len] = 0;
+        emu_command(emu, emu->line);
+        emu->line_len = 0;
+      }
+      else if (buf[i] != '\n' && emu->line_len < sizeof(emu->line) - 1)
+        emu->line[emu->line_len++] = buf[i];
+    }
+  }
+  return 0;
+}
+
+static void *emu_thread(void *arg)
+{
+  wemu_run(arg);
+  return NULL;
+}
+
+int wemu_start(wemu_t *emu)
+{
+  if (emu->master < 0 && !wemu_open_pty(emu))
+    return -1;
+  if (emu->stop_pipe[0] < 0 && pipe(emu->stop_pipe) < 0)
+    return -1;
+  emu->running = 1;
+  if (pthread_create(&emu->thread, NULL, emu_thread, emu) != 0)
+    return -1;
+  emu->threaded = 1;
+  return 0;
+}
+
+void wemu_stop(wemu_t *emu)
+{
+  emu->running = 0;
+  if (emu->stop_pipe[1] >= 0)
+    write_all(emu->stop_pipe[1], "", 1);
+  if (emu->threaded) {
+    pthread_join(emu->thread, NULL);
+    emu->threaded = 0;
+  }
+  if (emu->stop_pipe[0] >= 0) {
+    close(emu->stop_pipe[0]);
+    close(emu->stop_pipe[1]);
+    emu->stop_pipe[0] = emu->stop_pipe[1] = -1;
+  }
+}
+
+int wemu_stop_fd(wemu_t *emu)
+{
+  if (emu->stop_pipe[0] < 0 && pipe(emu->stop_pipe) < 0)
+    return -1;
+  return emu->stop_pipe[1];
+}
+
+unsigned long wemu_command_count(wemu_t *emu)
+{
+  return emu->commands;
+}
@@ -0,0 +1,167 @@
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** WBH-Diag Pro chip emulator.
+    Speaks the AT dialect used by libwbh on the master side of a
+    pseudo-terminal, with scriptable ECUs and configurable latency and
+    fault injection, so the library can be exercised without a car.
+ */
+
+/** maximum number of DTCs per emulated ECU */
+#define WEMU_MAX_DTC 16
+/** maximum number of measurement channels per group */
+#define WEMU_MAX_CHANNELS 4
+/** maximum number of actuator codes per emulated ECU */
+#define WEMU_MAX_ACTUATORS 16
+
+/** emulated measurement group */
+typedef struct wemu_group {
+  uint8_t group;			/**< group number */
+  uint8_t count;			/**< number of channels */
+  uint8_t raw[WEMU_MAX_CHANNELS][3];	/**< formula, a, b per channel */
+  struct wemu_group *next;
+} wemu_group_t;
+
+/** emulated control unit */
+typedef struct wemu_ecu {
+  uint8_t id;				/**< device ID (address) */
+  uint8_t baudrate;			/**< baud rate code reported on connect */
+  uint8_t protocol;			/**< protocol code reported on connect */
+  char specs[128];			/**< identification sent after
+                                             "CONNECT: b p " */
+  int dtc_count;
+  struct {
+    uint16_t error_code;
+    uint8_t status_code;
+  } dtc[WEMU_MAX_DTC];			/**< stored trouble codes */
+  int actuator_count;
+  uint16_t actuator[WEMU_MAX_ACTUATORS];	/**< actuator test sequence */
+  wemu_group_t *groups;			/**< measurement groups */
+  int kline;				/**< K-line timing is emulated */
+  uint8_t min_bdt, min_ibt;		/**< shortest block delay and
+                                             inter-byte times the ECU copes
+                                             with */
+  struct wemu_ecu *next;
+} wemu_ecu_t;
+
+/** emulator timing and fault injection settings */
+typedef struct {
+  unsigned byte_latency_us;	/**< delay between two response bytes (µs) */
+  unsigned response_latency_ms;	/**< delay before each response (ms) */
+  unsigned connect_latency_ms;	/**< time to establish an ECU connection (ms) */
+  unsigned absent_latency_ms;	/**< time until ATD of an absent ECU fails (ms);
+                                     like on the real chip, any character
+                                     received while dialing aborts */
+  double drop_rate;		/**< probability of losing a response byte */
+  double garbage_rate;		/**< probability of inserting a random byte */
+  double jitter_rate;		/**< probability of a measurement "b" byte
+                                     moving by one on each read */
+  unsigned seed;		/**< random seed for fault injection */
+} wemu_opts_t;
+
+/** emulator instance (opaque) */
+typedef struct wemu wemu_t;
+
+/** create an emulator
+    @param opts timing and fault settings, NULL for no latency and no faults
+    @return emulator handle or NULL on error
+ */
+wemu_t *wemu_new(const wemu_opts_t *opts);
+
+/** destroy an emulator, stopping it first if it is running
+    @param emu emulator handle
+ */
+void wemu_free(wemu_t *emu);
+
+/** add (or replace) an emulated ECU
+    @param emu emulator handle
+    @param id device ID
+    @param specs identification string
+    @return ECU handle or NULL on error
+ */
+wemu_ecu_t *wemu_add_ecu(wemu_t *emu, uint8_t id, const char *specs);
+
+/** look up an emulated ECU
+    @param emu emulator handle
+    @param id device ID
+    @return ECU handle or NULL if there is no ECU with that ID
+ */
+wemu_ecu_t *wemu_find_ecu(wemu_t *emu, uint8_t id);
+
+/** execute one line of emulator script
+    Recognized directives (numbers in hex unless noted):
+    - ecu ID BAUD PROTO SPECS...
+    - dtc ID CODE STATUS
+    - group ID GROUP F A B [F A B ...]
+    - actuator ID CODE [CODE ...]
+    - analog PIN VALUE (decimal)
+    - bdt VALUE, ibt VALUE
+    - timing ID MIN_BDT MIN_IBT: answers of the ECU take as long as the
+      block delay and inter-byte times make them, and never come if those
+      are shorter than the ECU copes with
+    - latency byte|response|connect|absent VALUE (decimal, µs for byte,
+      ms otherwise)
+    - drop RATE, garbage RATE, jitter RATE (decimal fractions)
+
+    Empty lines and lines starting with '#' are ignored.
+    @param emu emulator handle
+    @param line script line
+    @return zero or -1 on syntax error
+ */
+int wemu_parse_line(wemu_t *emu, const char *line);
+
+/** load emulator script from a file
+    @param emu emulator handle
+    @param path script file name
+    @return zero or -1 on error
+ */
+int wemu_load_script(wemu_t *emu, const char *path);
+
+/** load the built-in demonstration vehicle
+    @param emu emulator handle
+ */
+void wemu_load_default(wemu_t *emu);
+
+/** allocate a pseudo-terminal for the emulator
+    @param emu emulator handle
+    @return name of the slave device to pass to wbh_init(), NULL on error
+ */
+const char *wemu_open_pty(wemu_t *emu);
+
+/** serve requests until wemu_stop() is called
+    @param emu emulator handle
+    @return zero or -1 on error
+ */
+int wemu_run(wemu_t *emu);
+
+/** serve requests on a background thread
+    @param emu emulator handle
+    @return zero or -1 on error
+ */
+int wemu_start(wemu_t *emu);
+
+/** stop serving requests, joins the background thread if there is one
+    @param emu emulator handle
+ */
+void wemu_stop(wemu_t *emu);
+
+/** file descriptor that makes wemu_run() return when written to
+    Unlike wemu_stop(), writing a byte to it is safe in a signal handler;
+    call wemu_stop() once wemu_run() has returned.
+    @param emu emulator handle
+    @return file descriptor or -1 on error
+ */
+int wemu_stop_fd(wemu_t *emu);
+
+/** number of commands the emulator has answered
+    @param emu emulator handle
+    @return command count
+ */
+unsigned long wemu_command_count(wemu_t *emu);
+
+#ifdef __cplusplus
+}
+#endif
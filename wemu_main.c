@@ -0,0 +1,87 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include "wemu.h"
+
+static int stop_fd = -1;
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  -s FILE   load ECU script (default: built-in demo car)\n"
+          "  -l PATH   create a symlink PATH to the pty slave\n"
+          "  -b US     delay between response bytes (µs)\n"
+          "  -r MS     delay before each response (ms)\n"
+          "  -c MS     time to connect to an ECU (ms)\n"
+          "  -a MS     time until connecting to an absent ECU fails (ms)\n"
+          "  -d RATE   probability of dropping a response byte\n"
+          "  -g RATE   probability of inserting a garbage byte\n"
+          "  -j RATE   probability of a measurement value changing\n"
+          "  -S SEED   random seed\n", prog);
+}
+
+/** Make wemu_run() return; wemu_stop() itself is not async-signal-safe. */
+static void stop(int sig)
+{
+  int saved = errno;
+  ssize_t rc = write(stop_fd, "", 1);
+  (void)rc;
+  errno = saved;
+}
+
+int main(int argc, char **argv)
+{
+  wemu_opts_t opts = { 0 };
+  wemu_t *emu;
+  const char *script = NULL, *link = NULL, *slave;
+  int c;
+
+  while ((c = getopt(argc, argv, "s:l:b:r:c:a:d:g:j:S:h")) != -1) {
+    switch (c) {
+      case 's': script = optarg; break;
+      case 'l': link = optarg; break;
+      case 'b': opts.byte_latency_us = atoi(optarg); break;
+      case 'r': opts.response_latency_ms = atoi(optarg); break;
+      case 'c': opts.connect_latency_ms = atoi(optarg); break;
+      case 'a': opts.absent_latency_ms = atoi(optarg); break;
+      case 'd': opts.drop_rate = atof(optarg); break;
+      case 'g': opts.garbage_rate = atof(optarg); break;
+      case 'j': opts.jitter_rate = atof(optarg); break;
+      case 'S': opts.seed = atoi(optarg); break;
+      default: usage(argv[0]); return 1;
+    }
+  }
+
+  emu = wemu_new(&opts);
+  if (!emu)
+    return 1;
+  if (script ? wemu_load_script(emu, script) < 0 : (wemu_load_default(emu), 0))
+    return 1;
+  if (!(slave = wemu_open_pty(emu)))
+    return 1;
+  if (link) {
+    unlink(link);
+    if (symlink(slave, link) < 0) {
+      perror(link);
+      return 1;
+    }
+  }
+  printf("%s\n", slave);
+  fflush(stdout);
+
+  if ((stop_fd = wemu_stop_fd(emu)) < 0)
+    return 1;
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+  wemu_run(emu);
+  wemu_stop(emu);
+
+  if (link)
+    unlink(link);
+  wemu_free(emu);
+  return 0;
+}
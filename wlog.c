@@ -0,0 +1,86 @@
+#include "wbh.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/* Prints a measurement log written by wbh_logger_create(), one sample per
+   line: time (seconds), device, group, channel, value, unit and raw
+   bytes.  The samples can be limited to a device, group, channel and
+   time range; with -s, the channels in the log are listed instead. */
+
+#define INFO(x, y...) fprintf(stderr, "INFO " x "\n", y)
+
+static int print_sample(const wbh_log_sample_t *s, void *ctx)
+{
+  printf("%llu.%09llu %02X %3d %2d %12g %-8s %02X %02X %02X\n",
+         (unsigned long long)(s->timestamp_ns / 1000000000),
+         (unsigned long long)(s->timestamp_ns % 1000000000),
+         s->device, s->group, s->channel, s->data.value,
+         wbh_unit_name(s->data.unit), s->data.raw[0], s->data.raw[1], s->data.raw[2]);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  wbh_log_t *log;
+  wbh_log_series_t *series;
+  int device = -1, group = -1, channel = -1, list = 0, count, c, i;
+  uint64_t from = 0, to = UINT64_MAX;
+  long rc;
+
+  while ((c = getopt(argc, argv, "sd:g:c:f:u:")) != -1) {
+    switch (c) {
+      case 's': list = 1; break;
+      case 'd': device = strtol(optarg, NULL, 16); break;
+      case 'g': group = atoi(optarg); break;
+      case 'c': channel = atoi(optarg); break;
+      case 'f': from = atof(optarg) * 1e9; break;
+      case 'u': to = atof(optarg) * 1e9; break;
+      default:
+        goto usage;
+    }
+  }
+  if (optind != argc - 1)
+    goto usage;
+
+  if (!(log = wbh_log_open(argv[optind]))) {
+    fprintf(stderr, "%s: %s: %s\n", argv[0], argv[optind], wbh_get_error());
+    return 1;
+  }
+
+  if (list) {
+    count = wbh_log_series(log, NULL, 0);
+    if (!(series = malloc((count ? count : 1) * sizeof(wbh_log_series_t)))) {
+      wbh_log_close(log);
+      return 1;
+    }
+    wbh_log_series(log, series, count);
+    for (i = 0; i < count; i++)
+      printf("%02X %3d %2d %8lu samples %6lu blocks %llu.%09llu - %llu.%09llu\n",
+             series[i].device, series[i].group, series[i].channel,
+             series[i].samples, series[i].blocks,
+             (unsigned long long)(series[i].first_ns / 1000000000),
+             (unsigned long long)(series[i].first_ns % 1000000000),
+             (unsigned long long)(series[i].last_ns / 1000000000),
+             (unsigned long long)(series[i].last_ns % 1000000000));
+    free(series);
+    wbh_log_close(log);
+    INFO("%d channels", count);
+    return 0;
+  }
+
+  rc = wbh_log_query(log, device, group, channel, from, to, print_sample, NULL);
+  wbh_log_close(log);
+  if (rc < 0) {
+    fprintf(stderr, "%s: %s: %s\n", argv[0], argv[optind], wbh_get_error());
+    return 1;
+  }
+  INFO("%ld samples", rc);
+  return 0;
+
+usage:
+  fprintf(stderr, "usage: %s [-s] [-d device (hex)] [-g group] [-c channel] "
+          "[-f from] [-u until (seconds)] log-file\n", argv[0]);
+  return 1;
+}
@@ -0,0 +1,868 @@
+#include "wbh.h"
+#include "wemu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Microbenchmarks for the CPU-bound parts of libwbh, run on synthetic
+   data so the numbers do not depend on an adapter or a car.  Every
+   benchmark compares the library code against the implementation it
+   replaced (or the simple path it speeds up) and checks that both agree;
+   the exit status is non-zero if they do not.
+
+   With -l, measures command round trips through the serial code instead,
+   against the emulator on a pseudo-terminal, once for each set of host
+   serial port settings. */
+
+#define INFO(x, y...) fprintf(stderr, "INFO " x "\n", y)
+
+/** keeps the compiler from optimizing benchmark loops away */
+static volatile unsigned long sink;
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/** print one result line
+    @param name benchmark name
+    @param bytes input processed per iteration
+    @param items records processed per iteration
+    @param iterations number of iterations
+    @param secs time taken
+ */
+static void report(const char *name, size_t bytes, int items, long iterations,
+                   double secs)
+{
+  printf("%-28s %9.1f MB/s %10.1f Mrec/s %8.1f ns/iter\n", name,
+         bytes * iterations / secs / 1e6, items * iterations / secs / 1e6,
+         secs / iterations * 1e9);
+}
+
+/** previous DTC parser: sscanf() with a fixed stride of 8 characters */
+static int sscanf_dtc(const char *buf, wbh_dtc_t *dtc, int max)
+{
+  int count = 0;
+  uint16_t error;
+  uint8_t status;
+  while (count < max && sscanf(buf, "%04hX %02hhX\n", &error, &status) == 2) {
+    dtc[count].error_code = error;
+    dtc[count].status_code = status;
+    count++;
+    buf += 8;
+  }
+  return count;
+}
+
+/** previous measurement parser: sscanf() with a fixed stride of 9 characters */
+static int sscanf_measurements(const char *buf, wbh_raw_measurement_t *raw, int max)
+{
+  int count = 0;
+  uint8_t formula, a, b;
+  while (count < max && sscanf(buf, "%02hhX %02hhX %02hhX\n", &formula, &a, &b) == 3) {
+    raw[count].formula = formula;
+    raw[count].a = a;
+    raw[count].b = b;
+    count++;
+    buf += 9;
+  }
+  return count;
+}
+
+/** build a synthetic DTC response of count lines, terminated by '>' */
+static char *make_dtc_text(int count, size_t *len)
+{
+  char *text = malloc(count * 8 + 2);
+  int i;
+  for (i = 0; i < count; i++)
+    sprintf(text + i * 8, "%04X %02X\n", (i * 7919 + 1) & 0xffff, (i * 31) & 0xff);
+  strcpy(text + count * 8, ">");
+  *len = count * 8 + 1;
+  return text;
+}
+
+/** build a synthetic measurement response of count lines, terminated by '>' */
+static char *make_measurement_text(int count, size_t *len)
+{
+  char *text = malloc(count * 9 + 2);
+  int i;
+  for (i = 0; i < count; i++)
+    sprintf(text + i * 9, "%02X %02X %02X\n", i % 71, (i * 13) & 0xff, (i * 101) & 0xff);
+  strcpy(text + count * 9, ">");
+  *len = count * 9 + 1;
+  return text;
+}
+
+/** benchmark loop body */
+typedef void (*bench_fn_t)(void *arg);
+
+/** Run fn in growing batches until at least secs have passed, then
+    report the result. */
+static void run(const char *name, bench_fn_t fn, void *arg, size_t bytes,
+                int items, double secs)
+{
+  long n = 0, batch = 1, i;
+  double start = now(), elapsed;
+  do {
+    for (i = 0; i < batch; i++)
+      fn(arg);
+    n += batch;
+    batch *= 2;
+  } while ((elapsed = now() - start) < secs);
+  report(name, bytes, items, n, elapsed);
+}
+
+/** input and output of the parser benchmarks */
+typedef struct {
+  const char *text;
+  size_t len;
+  int lines;
+  void *out;
+} parse_arg_t;
+
+static void run_sscanf_dtc(void *arg)
+{
+  parse_arg_t *p = arg;
+  sink += sscanf_dtc(p->text, p->out, p->lines);
+}
+
+static void run_parse_dtc(void *arg)
+{
+  parse_arg_t *p = arg;
+  sink += wbh_parse_dtc(p->text, p->len, p->out, p->lines, NULL);
+}
+
+static void run_sscanf_measurements(void *arg)
+{
+  parse_arg_t *p = arg;
+  sink += sscanf_measurements(p->text, p->out, p->lines);
+}
+
+static void run_parse_measurements(void *arg)
+{
+  parse_arg_t *p = arg;
+  sink += wbh_parse_measurements(p->text, p->len, p->out, p->lines, NULL);
+}
+
+static int bench_dtc(int lines, double secs)
+{
+  size_t len;
+  char *text = make_dtc_text(lines, &len);
+  wbh_dtc_t *a = malloc(lines * sizeof(wbh_dtc_t));
+  wbh_dtc_t *b = malloc(lines * sizeof(wbh_dtc_t));
+  parse_arg_t arg = { text, len, lines, a };
+  char name[64];
+  int na, nb, failed = 0;
+
+  na = sscanf_dtc(text, a, lines);
+  nb = wbh_parse_dtc(text, len, b, lines, NULL);
+  if (na != nb || memcmp(a, b, na * sizeof(wbh_dtc_t))) {
+    fprintf(stderr, "DTC parsers disagree on %d lines (%d vs %d)\n", lines, na, nb);
+    failed = 1;
+  }
+
+  snprintf(name, sizeof(name), "dtc sscanf %d", lines);
+  run(name, run_sscanf_dtc, &arg, len, lines, secs);
+  snprintf(name, sizeof(name), "dtc tokenizer %d", lines);
+  run(name, run_parse_dtc, &arg, len, lines, secs);
+
+  free(text);
+  free(a);
+  free(b);
+  return failed;
+}
+
+static int bench_measurements(int lines, double secs)
+{
+  size_t len;
+  char *text = make_measurement_text(lines, &len);
+  wbh_raw_measurement_t *a = malloc(lines * sizeof(wbh_raw_measurement_t));
+  wbh_raw_measurement_t *b = malloc(lines * sizeof(wbh_raw_measurement_t));
+  parse_arg_t arg = { text, len, lines, a };
+  char name[64];
+  int na, nb, failed = 0;
+
+  na = sscanf_measurements(text, a, lines);
+  nb = wbh_parse_measurements(text, len, b, lines, NULL);
+  if (na != nb || memcmp(a, b, na * sizeof(wbh_raw_measurement_t))) {
+    fprintf(stderr, "measurement parsers disagree on %d lines (%d vs %d)\n", lines, na, nb);
+    failed = 1;
+  }
+
+  snprintf(name, sizeof(name), "measurement sscanf %d", lines);
+  run(name, run_sscanf_measurements, &arg, len, lines, secs);
+  snprintf(name, sizeof(name), "measurement tokenizer %d", lines);
+  run(name, run_parse_measurements, &arg, len, lines, secs);
+
+  free(text);
+  free(a);
+  free(b);
+  return failed;
+}
+
+/** input and output of the decoder benchmarks */
+typedef struct {
+  const wbh_raw_measurement_t *raw;
+  size_t count;
+  wbh_measurement_t *data;
+  float *values;
+  wbh_unit_t *units;
+} decode_arg_t;
+
+static void run_decode_single(void *arg)
+{
+  decode_arg_t *d = arg;
+  size_t i;
+  for (i = 0; i < d->count; i++)
+    wbh_decode_measurement(&d->raw[i], &d->data[i]);
+  sink += d->data[d->count - 1].unit;
+}
+
+static void run_decode_batch(void *arg)
+{
+  decode_arg_t *d = arg;
+  wbh_decode_batch(d->raw, d->count, d->values, d->units);
+  sink += d->units[d->count - 1];
+}
+
+/** Check that the batch decoder agrees with the scalar one on every
+    possible triplet. */
+static int check_decode_exhaustive(void)
+{
+  size_t count = 1 << 16, i;
+  wbh_raw_measurement_t *raw = malloc(count * sizeof(wbh_raw_measurement_t));
+  float *values = malloc(count * sizeof(float));
+  wbh_unit_t *units = malloc(count * sizeof(wbh_unit_t));
+  wbh_measurement_t data;
+  int formula, failed = 0;
+
+  for (formula = 0; formula < 256; formula++) {
+    for (i = 0; i < count; i++) {
+      raw[i].formula = formula;
+      raw[i].a = i >> 8;
+      raw[i].b = i & 0xff;
+    }
+    wbh_decode_batch(raw, count, values, units);
+    for (i = 0; i < count; i++) {
+      wbh_decode_measurement(&raw[i], &data);
+      if (memcmp(&values[i], &data.value, sizeof(float)) || units[i] != data.unit) {
+        fprintf(stderr, "decoders disagree on %02X %02X %02X: %a vs %a\n",
+                formula, raw[i].a, raw[i].b, values[i], data.value);
+        failed = 1;
+        break;
+      }
+    }
+  }
+  free(raw);
+  free(values);
+  free(units);
+  return failed;
+}
+
+/** formula mixes for the decoder benchmarks */
+enum {
+  MIX_SINGLE,		/**< one formula throughout */
+  MIX_GROUPS,		/**< the same measurement groups over and over */
+  MIX_RANDOM,		/**< formulas in no particular order */
+};
+
+/** Decode a synthetic log of raw measurements. */
+static int bench_decode(int mix, size_t count, double secs)
+{
+  static const char *mix_names[] = { "single", "groups", "random" };
+  static const uint8_t groups[] = { 1, 5, 19, 16, 7, 2, 6, 21, 35, 9, 3, 4 };
+  decode_arg_t d;
+  char name[64];
+  size_t i;
+  unsigned seed = 1;
+  int failed = 0;
+
+  wbh_raw_measurement_t *raw = malloc(count * sizeof(wbh_raw_measurement_t));
+  d.raw = raw;
+  d.count = count;
+  d.data = malloc(count * sizeof(wbh_measurement_t));
+  d.values = malloc(count * sizeof(float));
+  d.units = malloc(count * sizeof(wbh_unit_t));
+  for (i = 0; i < count; i++) {
+    switch (mix) {
+      case MIX_SINGLE: raw[i].formula = 1; break;
+      case MIX_GROUPS: raw[i].formula = groups[i % sizeof(groups)]; break;
+      default: raw[i].formula = rand_r(&seed) % 71; break;
+    }
+    raw[i].a = i * 13;
+    raw[i].b = i * 101 >> 3;
+  }
+
+  snprintf(name, sizeof(name), "decode single %s", mix_names[mix]);
+  run(name, run_decode_single, &d, count * sizeof(wbh_raw_measurement_t), count, secs);
+  snprintf(name, sizeof(name), "decode batch %s", mix_names[mix]);
+  run(name, run_decode_batch, &d, count * sizeof(wbh_raw_measurement_t), count, secs);
+
+  for (i = 0; i < count; i++) {
+    if (memcmp(&d.values[i], &d.data[i].value, sizeof(float)) ||
+        d.units[i] != d.data[i].unit) {
+      fprintf(stderr, "decoders disagree on triplet %zu of the %s mix\n", i, mix_names[mix]);
+      failed = 1;
+      break;
+    }
+  }
+
+  free(raw);
+  free(d.data);
+  free(d.values);
+  free(d.units);
+  return failed;
+}
+
+/** input and output of the decode cache benchmark */
+typedef struct {
+  const wbh_raw_measurement_t *raw;
+  size_t count;
+  wbh_measurement_t *data;
+  wbh_decode_cache_t *cache;
+  int channels;			/**< channels per group, 0 to decode one at a time */
+  int groups;			/**< groups the channels are split into */
+} cached_arg_t;
+
+static void run_decode_uncached(void *arg)
+{
+  cached_arg_t *d = arg;
+  size_t i;
+  for (i = 0; i < d->count; i++)
+    wbh_decode_measurement(&d->raw[i], &d->data[i]);
+  sink += d->data[d->count - 1].unit;
+}
+
+static void run_decode_cached(void *arg)
+{
+  cached_arg_t *d = arg;
+  size_t i;
+  if (!d->channels) {
+    for (i = 0; i < d->count; i++)
+      wbh_decode_cached(d->cache, &d->raw[i], &d->data[i]);
+  }
+  else {
+    for (i = 0; i + d->channels <= d->count; i += d->channels)
+      wbh_decode_cached_group(d->cache, i / d->channels % d->groups, &d->raw[i],
+                              d->channels, &d->data[i]);
+  }
+  sink += d->data[d->count - 1].unit;
+}
+
+/** Decode a stream of measurement groups the way a reader does it, one
+    triplet at a time, with and without a decode cache.  Each channel keeps
+    its formula and its first byte; the second byte is what changes.  In
+    fixed order, the channels are read as groups of 16 and decoded a group
+    at a time.
+    @param channels distinct (formula, a) pairs in the stream
+    @param tables size of the cache
+    @param shuffle visit the channels in random order
+ */
+static int bench_decode_cache(int channels, int tables, int shuffle, double secs)
+{
+  size_t count = 1 << 16, i;
+  cached_arg_t d;
+  wbh_measurement_t *ref;
+  wbh_decode_cache_stats_t stats;
+  wbh_raw_measurement_t *raw = malloc(count * sizeof(wbh_raw_measurement_t));
+  char name[64];
+  int failed = 0;
+
+  d.raw = raw;
+  d.count = count;
+  d.data = malloc(count * sizeof(wbh_measurement_t));
+  ref = malloc(count * sizeof(wbh_measurement_t));
+  d.cache = wbh_decode_cache_new(tables);
+  d.channels = shuffle ? 0 : 16;
+  d.groups = (channels + 15) / 16;
+  unsigned seed = 1;
+  for (i = 0; i < count; i++) {
+    /* channels in a fixed rotation like a group stream, or in random order */
+    int ch = shuffle ? rand_r(&seed) % channels : i % channels;
+    raw[i].formula = ch % 70 + 1;
+    raw[i].a = ch * 37 + 11;
+    raw[i].b = i * 101 >> 3;
+  }
+
+  snprintf(name, sizeof(name), "decode uncached %d%s", channels, shuffle ? " random" : "");
+  run(name, run_decode_uncached, &d, count * sizeof(wbh_raw_measurement_t), count, secs);
+  memcpy(ref, d.data, count * sizeof(wbh_measurement_t));
+  snprintf(name, sizeof(name), "decode cached %d/%d%s", channels, tables, shuffle ? " random" : "");
+  run(name, run_decode_cached, &d, count * sizeof(wbh_raw_measurement_t), count, secs);
+
+  for (i = 0; i < count; i++) {
+    if (memcmp(&d.data[i], &ref[i], sizeof(wbh_measurement_t))) {
+      fprintf(stderr, "cached decoder disagrees on triplet %zu\n", i);
+      failed = 1;
+      break;
+    }
+  }
+  wbh_decode_cache_get_stats(d.cache, &stats);
+  INFO("cache %d/%d: %lu hits, %lu misses, %lu evictions", channels, tables,
+       stats.hits, stats.misses, stats.evictions);
+
+  wbh_decode_cache_free(d.cache);
+  free(raw);
+  free(d.data);
+  free(ref);
+  return failed;
+}
+
+/** input and output of the change detection benchmark */
+typedef struct {
+  const wbh_raw_measurement_t *raw;	/**< samples of CHANNELS each */
+  int samples;
+  wbh_measurement_t *data;
+  wbh_change_t changes[WBH_MAX_MEASUREMENTS];
+  unsigned long emitted;
+} delta_arg_t;
+
+#define DELTA_CHANNELS 4
+
+static void run_decode_group(void *arg)
+{
+  delta_arg_t *d = arg;
+  int i;
+  for (i = 0; i < d->samples * DELTA_CHANNELS; i++)
+    wbh_decode_measurement(&d->raw[i], &d->data[i]);
+  sink += d->data[0].unit;
+}
+
+static void run_delta(void *arg)
+{
+  delta_arg_t *d = arg;
+  wbh_delta_t *delta = wbh_delta_new(0);
+  int i;
+  d->emitted = 0;
+  for (i = 0; i < d->samples; i++)
+    d->emitted += wbh_delta_apply(delta, 1, &d->raw[i * DELTA_CHANNELS], DELTA_CHANNELS,
+                                  d->changes, NULL);
+  wbh_delta_free(delta);
+  sink += d->emitted;
+}
+
+/** Feed a log of samples in which each channel changes now and then
+    through the change detector, against decoding every sample, and check
+    that replaying the changes gives the fully decoded values.
+    @param change_pct chance of a channel changing from one sample to the
+                      next (%)
+ */
+static int bench_delta(int change_pct, double secs)
+{
+  int samples = 1 << 14, i, ch, n, failed = 0;
+  size_t count = samples * DELTA_CHANNELS;
+  wbh_raw_measurement_t *raw = malloc(count * sizeof(wbh_raw_measurement_t));
+  wbh_measurement_t cur[DELTA_CHANNELS];
+  wbh_delta_t *delta;
+  delta_arg_t d = { raw, samples };
+  unsigned seed = 1;
+  char name[64];
+
+  d.data = malloc(count * sizeof(wbh_measurement_t));
+  for (i = 0; i < samples; i++) {
+    for (ch = 0; ch < DELTA_CHANNELS; ch++) {
+      wbh_raw_measurement_t *r = &raw[i * DELTA_CHANNELS + ch];
+      r->formula = ch * 5 + 1;
+      r->a = ch * 37 + 11;
+      r->b = i && rand_r(&seed) % 100 >= change_pct ? r[-DELTA_CHANNELS].b : rand_r(&seed);
+    }
+  }
+
+  snprintf(name, sizeof(name), "decode every sample");
+  run(name, run_decode_group, &d, count * sizeof(wbh_raw_measurement_t), count, secs);
+  snprintf(name, sizeof(name), "delta %d%% changing", change_pct);
+  run(name, run_delta, &d, count * sizeof(wbh_raw_measurement_t), count, secs);
+  INFO("delta %d%%: %lu of %zu channels passed on", change_pct, d.emitted, count);
+
+  /* replay */
+  delta = wbh_delta_new(0);
+  for (i = 0; i < samples && !failed; i++) {
+    n = wbh_delta_apply(delta, 1, &raw[i * DELTA_CHANNELS], DELTA_CHANNELS, d.changes, NULL);
+    while (n--)
+      cur[d.changes[n].channel] = d.changes[n].data;
+    for (ch = 0; ch < DELTA_CHANNELS; ch++) {
+      if (memcmp(&cur[ch].value, &d.data[i * DELTA_CHANNELS + ch].value, sizeof(float)) ||
+          cur[ch].unit != d.data[i * DELTA_CHANNELS + ch].unit) {
+        fprintf(stderr, "replayed changes disagree at sample %d channel %d\n", i, ch);
+        failed = 1;
+        break;
+      }
+    }
+  }
+  wbh_delta_free(delta);
+  free(raw);
+  free(d.data);
+  return failed;
+}
+
+/** input and output of the measurement log benchmarks */
+typedef struct {
+  const wbh_raw_measurement_t *raw;	/**< samples of DELTA_CHANNELS each */
+  const uint64_t *ts;		/**< timestamp of each sample */
+  int samples;
+  const char *path;		/**< log file */
+  FILE *text;			/**< text log */
+  size_t text_bytes;
+  uint64_t log_bytes;
+  long queried;
+  int failed;
+} log_arg_t;
+
+/** the text log wtest prints */
+static void run_log_text(void *arg)
+{
+  log_arg_t *l = arg;
+  wbh_measurement_t m;
+  int i, ch, rc;
+
+  l->text_bytes = 0;
+  for (i = 0; i < l->samples; i++) {
+    for (ch = 0; ch < DELTA_CHANNELS; ch++) {
+      const wbh_raw_measurement_t *r = &l->raw[i * DELTA_CHANNELS + ch];
+      wbh_decode_measurement(r, &m);
+      rc = fprintf(l->text, "%llu value %d: %f %s [raw %02X/%02X/%02X]\n",
+                   (unsigned long long)l->ts[i], ch, m.value, wbh_unit_name(m.unit),
+                   r->formula, r->a, r->b);
+      if (rc > 0)
+        l->text_bytes += rc;
+    }
+  }
+}
+
+static void run_log_append(void *arg)
+{
+  log_arg_t *l = arg;
+  wbh_logger_t *log = wbh_logger_create(l->path);
+  wbh_logger_stats_t stats;
+  int i;
+
+  if (!log) {
+    l->failed = 1;
+    return;
+  }
+  for (i = 0; i < l->samples; i++)
+    l->failed |= wbh_logger_append(log, 0x01, i & 3, l->ts[i],
+                                   &l->raw[i * DELTA_CHANNELS], DELTA_CHANNELS) < 0;
+  wbh_logger_flush(log);
+  wbh_logger_get_stats(log, &stats);
+  l->failed |= wbh_logger_close(log) != 0;
+  l->log_bytes = stats.bytes;
+}
+
+static int count_sample(const wbh_log_sample_t *sample, void *ctx)
+{
+  sink += sample->data.unit;
+  return 0;
+}
+
+static void run_log_query(void *arg)
+{
+  log_arg_t *l = arg;
+  wbh_log_t *log = wbh_log_open(l->path);
+
+  if (!log) {
+    l->failed = 1;
+    return;
+  }
+  l->queried = wbh_log_query(log, -1, -1, -1, 0, UINT64_MAX, count_sample, NULL);
+  wbh_log_close(log);
+}
+
+/** check a logged sample against the input */
+static int check_sample(const wbh_log_sample_t *sample, void *ctx)
+{
+  log_arg_t *l = ctx;
+  wbh_measurement_t m;
+  int i;
+
+  /* group n holds samples n, n + 4, ... */
+  for (i = sample->group; i < l->samples && l->ts[i] != sample->timestamp_ns; i += 4)
+    ;
+  if (i >= l->samples) {
+    l->failed = 1;
+    return 1;
+  }
+  wbh_decode_measurement(&l->raw[i * DELTA_CHANNELS + sample->channel], &m);
+  if (memcmp(&m, &sample->data, sizeof(m))) {
+    l->failed = 1;
+    return 1;
+  }
+  return 0;
+}
+
+/** Write the samples of four measurement groups to a log, against
+    printing them as text, read them back and compare. */
+static int bench_log(double secs)
+{
+  int samples = 1 << 14, i, ch;
+  size_t count = samples * DELTA_CHANNELS;
+  wbh_raw_measurement_t *raw = malloc(count * sizeof(wbh_raw_measurement_t));
+  uint64_t *ts = malloc(samples * sizeof(uint64_t)), t = 1700000000000000000ull;
+  char path[] = "/tmp/wmicrobench-XXXXXX";
+  log_arg_t l = { raw, ts, samples, path };
+  unsigned seed = 1;
+  wbh_log_t *log;
+  long n;
+  int fd;
+
+  /* a group every 10 ms, give or take; values drifting slowly */
+  for (i = 0; i < samples; i++) {
+    ts[i] = t += 10000000 + rand_r(&seed) % 100000;
+    for (ch = 0; ch < DELTA_CHANNELS; ch++) {
+      wbh_raw_measurement_t *r = &raw[i * DELTA_CHANNELS + ch];
+      r->formula = ch * 5 + 1;
+      r->a = ch * 37 + 11;
+      r->b = i >= 4 && rand_r(&seed) % 100 >= 10 ? r[-4 * DELTA_CHANNELS].b :
+             i >= 4 ? r[-4 * DELTA_CHANNELS].b + rand_r(&seed) % 3 - 1 : rand_r(&seed);
+    }
+  }
+  if ((fd = mkstemp(path)) < 0 || !(l.text = fopen("/dev/null", "w"))) {
+    perror("bench_log");
+    return 1;
+  }
+  close(fd);
+
+  run("text log", run_log_text, &l, count * sizeof(wbh_raw_measurement_t), count, secs);
+  run("columnar log append", run_log_append, &l, count * sizeof(wbh_raw_measurement_t), count, secs);
+  run("columnar log query", run_log_query, &l, count * sizeof(wbh_raw_measurement_t), count, secs);
+  INFO("log of %zu channel samples: %zu bytes as text, %llu bytes columnar", count,
+       l.text_bytes, (unsigned long long)l.log_bytes);
+  if (l.queried != count) {
+    fprintf(stderr, "log query found %ld of %zu samples\n", l.queried, count);
+    l.failed = 1;
+  }
+
+  /* every sample, and a short time range of one channel */
+  if (!(log = wbh_log_open(path)) ||
+      wbh_log_query(log, -1, -1, -1, 0, UINT64_MAX, check_sample, &l) != count ||
+      (n = wbh_log_query(log, 0x01, 2, 3, ts[1002], ts[1402], check_sample, &l)) != 101) {
+    fprintf(stderr, "log read back wrong: %s\n", wbh_get_error() ? wbh_get_error() : "mismatch");
+    l.failed = 1;
+  }
+  wbh_log_close(log);
+  fclose(l.text);
+  unlink(path);
+  free(raw);
+  free(ts);
+  return l.failed;
+}
+
+/** state of the session benchmark */
+typedef struct {
+  wbh_device_t *dev;
+  wbh_measurement_t data[WBH_MAX_MEASUREMENTS];
+  wbh_dtc_t dtc[WBH_MAX_DTC];
+  int failed;
+} session_arg_t;
+
+static void run_session_measurements(void *arg)
+{
+  session_arg_t *s = arg;
+  if (wbh_read_measurements_into(s->dev, 1, s->data, WBH_MAX_MEASUREMENTS) != 4 ||
+      s->data[0].value != 1400.0)
+    s->failed = 1;
+}
+
+static void run_session_dtc(void *arg)
+{
+  session_arg_t *s = arg;
+  if (wbh_get_dtc_into(s->dev, s->dtc, WBH_MAX_DTC) != 2 || s->dtc[0].error_code != 0x4052)
+    s->failed = 1;
+}
+
+/** commands of the batch benchmark */
+static const char *batch_cmds[] = { "0801", "0801", "0801", "02" };
+#define BATCH_COUNT (sizeof(batch_cmds) / sizeof(batch_cmds[0]))
+
+static void run_session_commands(void *arg)
+{
+  session_arg_t *s = arg;
+  char buf[BATCH_COUNT][256];
+  int i;
+  for (i = 0; i < BATCH_COUNT; i++) {
+    if (wbh_send_command_ms(s->dev, (char *)batch_cmds[i], buf[i], sizeof(buf[i]), 1000) <= 0)
+      s->failed = 1;
+  }
+}
+
+static void run_session_batch(void *arg)
+{
+  session_arg_t *s = arg;
+  char buf[BATCH_COUNT][256];
+  wbh_batch_cmd_t cmds[BATCH_COUNT];
+  int i;
+  for (i = 0; i < BATCH_COUNT; i++) {
+    cmds[i].cmd = batch_cmds[i];
+    cmds[i].response = buf[i];
+    cmds[i].size = sizeof(buf[i]);
+    cmds[i].timeout_ms = 1000;
+  }
+  if (wbh_send_batch(s->dev, cmds, BATCH_COUNT) != BATCH_COUNT)
+    s->failed = 1;
+}
+
+/** Run commands through the whole library, from the request queue down to
+    the transport and back up through the parsers, against the in-memory
+    transport; this is the library's own overhead per exchange. */
+static int bench_session(double secs)
+{
+  static const char measurements[] = "01 C8 23\r05 0A 8C\r13 96 64\r10 01 55\r>";
+  static const char dtc[] = "4052 23\r0203 1D\r>";
+  wbh_memory_t *mem = wbh_memory_new();
+  wbh_interface_t *iface;
+  session_arg_t s = { NULL };
+
+  wbh_memory_add(mem, "ATD01", "CONNECT: 4 1 038906018AB  1,9l R4 EDC  G000SG  D02\r>");
+  wbh_memory_add(mem, "0801", measurements);
+  wbh_memory_add(mem, "02", dtc);
+  wbh_memory_add(mem, "ATH", "OK\r>");
+  if (!(iface = wbh_init_memory(mem)) || !(s.dev = wbh_connect_ms(iface, 0x01, 1000))) {
+    fprintf(stderr, "cannot set up in-memory session: %s\n", wbh_get_error());
+    return 1;
+  }
+
+  run("session measurements", run_session_measurements, &s,
+      sizeof(measurements) - 1, 4, secs);
+  run("session dtc", run_session_dtc, &s, sizeof(dtc) - 1, 2, secs);
+  run("session 4 commands", run_session_commands, &s, 0, BATCH_COUNT, secs);
+  run("session batch of 4", run_session_batch, &s, 0, BATCH_COUNT, secs);
+  if (s.failed)
+    fprintf(stderr, "in-memory session returned wrong data\n");
+  if (wbh_memory_unmatched(mem)) {
+    fprintf(stderr, "in-memory session sent unexpected commands\n");
+    s.failed = 1;
+  }
+
+  wbh_disconnect(s.dev);
+  wbh_shutdown(iface);
+  wbh_memory_free(mem);
+  return s.failed;
+}
+
+/** host serial port settings compared by the latency benchmark */
+static const struct {
+  const char *name;
+  wbh_init_opts_t opts;
+} serial_configs[] = {
+  { "defaults", { 0 } },
+  { "115200 baud", { .baud = 115200 } },
+  { "9600 baud", { .baud = 9600 } },
+  { "VMIN 1", { .vmin = 1 } },
+  { "VMIN 30", { .vmin = 30 } },
+  { "VMIN 0 VTIME 1", { .vtime = 1 } },
+  { "low latency", { .low_latency = WBH_LOW_LATENCY_TRY } },
+  { "RTS/CTS", { .flow = WBH_FLOW_RTSCTS } },
+  { "XON/XOFF", { .flow = WBH_FLOW_XONXOFF } },
+  { "no flushing", { .flush = WBH_FLUSH_NEVER } },
+};
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+/** Measure measurement group reads through one serial configuration.
+    @return zero or 1 if the session failed */
+static int bench_serial(const char *name, const wbh_init_opts_t *opts,
+                        int count)
+{
+  wbh_measurement_t data[WBH_MAX_MEASUREMENTS];
+  wemu_t *emu = wemu_new(NULL);
+  wbh_interface_t *iface = NULL;
+  wbh_device_t *dev = NULL;
+  const char *tty;
+  double *rtt = malloc(count * sizeof(double)), sum = 0, start;
+  int i, failed = 1;
+
+  wemu_load_default(emu);
+  if (!rtt || !(tty = wemu_open_pty(emu)) || wemu_start(emu) < 0 ||
+      !(iface = wbh_init_opts(tty, opts)) ||
+      !(dev = wbh_connect_ms(iface, 0x01, 5000))) {
+    fprintf(stderr, "%s: cannot set up session: %s\n", name,
+            wbh_get_error() ? wbh_get_error() : "emulator failed");
+    goto out;
+  }
+
+  for (i = 0; i < count; i++) {
+    start = now();
+    if (wbh_read_measurements_into(dev, 1, data, WBH_MAX_MEASUREMENTS) != 4) {
+      fprintf(stderr, "%s: read failed: %s\n", name, wbh_get_error());
+      goto out;
+    }
+    rtt[i] = (now() - start) * 1e6;
+    sum += rtt[i];
+  }
+  qsort(rtt, count, sizeof(double), compare_double);
+  printf("%-28s %8.1f us mean %8.1f us p50 %8.1f us p99 %8.1f us max\n",
+         name, sum / count, rtt[count / 2], rtt[count * 99 / 100], rtt[count - 1]);
+  failed = 0;
+
+out:
+  if (dev)
+    wbh_disconnect(dev);
+  if (iface)
+    wbh_shutdown(iface);
+  wemu_free(emu);
+  free(rtt);
+  return failed;
+}
+
+int main(int argc, char **argv)
+{
+  double secs = 0.5;
+  int failed = 0, latency = 0, count = 1000, c, i;
+
+  while ((c = getopt(argc, argv, "t:ln:")) != -1) {
+    switch (c) {
+      case 't': secs = atof(optarg); break;
+      case 'l': latency = 1; break;
+      case 'n': count = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-t seconds per benchmark] | -l [-n round trips]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if (latency) {
+    if (count < 1)
+      count = 1;
+    INFO("reading a measurement group %d times through each serial configuration", count);
+    for (i = 0; i < sizeof(serial_configs) / sizeof(serial_configs[0]); i++)
+      failed |= bench_serial(serial_configs[i].name, &serial_configs[i].opts, count);
+    return failed;
+  }
+
+  INFO("parsing synthetic responses, about %.1f s each", secs);
+  /* a full response buffer, and a large one to show throughput without
+     per-call overhead; sscanf() measures the length of its input on every
+     call, which makes the old parsers quadratic on long input */
+  failed |= bench_dtc(WBH_MAX_DTC, secs);
+  failed |= bench_dtc(4096, secs);
+  failed |= bench_measurements(WBH_MAX_MEASUREMENTS, secs);
+  failed |= bench_measurements(4096, secs);
+
+  INFO("decoding synthetic measurement logs, about %.1f s each", secs);
+  failed |= check_decode_exhaustive();
+  failed |= bench_decode(MIX_SINGLE, 1 << 20, secs);
+  failed |= bench_decode(MIX_GROUPS, 1 << 20, secs);
+  failed |= bench_decode(MIX_RANDOM, 1 << 20, secs);
+  /* sixteen channels, then more channels than tables, of which the
+     cache can only keep part */
+  failed |= bench_decode_cache(16, WBH_DECODE_CACHE_DEFAULT, 0, secs);
+  failed |= bench_decode_cache(16, WBH_DECODE_CACHE_DEFAULT, 1, secs);
+  failed |= bench_decode_cache(WBH_DECODE_CACHE_DEFAULT * 2, WBH_DECODE_CACHE_DEFAULT, 0, secs);
+  failed |= bench_decode_cache(WBH_DECODE_CACHE_DEFAULT * 2, WBH_DECODE_CACHE_DEFAULT, 1, secs);
+
+  failed |= bench_delta(5, secs);
+  failed |= bench_delta(50, secs);
+  failed |= bench_log(secs);
+
+  INFO("running sessions on the in-memory transport, about %.1f s each", secs);
+  failed |= bench_session(secs);
+  return failed;
+}
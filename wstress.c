@@ -0,0 +1,593 @@
+#include "wbh.h"
+#include "wbh_client.h"
+#include "wemu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+/* Drives many emulated adapters concurrently, one thread per adapter,
+   and checks that results and errors stay with the interface they belong
+   to. Every other adapter injects garbage bytes; errors are expected on
+   those, but never on the clean ones.  With -m, the interface metrics are
+   printed at the end in the Prometheus text format.
+
+   Then a few checks of features that need a scripted emulator run, each
+   on an adapter of its own, and compare what they report with what the
+   script makes the emulator do. */
+
+#define ADAPTERS 16
+#define ITERATIONS 200
+
+#define INFO(x, y...) fprintf(stderr, "INFO " x "\n", y)
+
+typedef struct {
+  int faulty;			/**< adapter injects faults */
+  int iterations;		/**< successful rounds */
+  int errors;			/**< failed rounds */
+  int misattributed;		/**< errors reported on the wrong handle */
+  int wrong;			/**< rounds that returned wrong data */
+} stats_t;
+
+typedef struct {
+  stats_t *stats;
+  int iterations;
+} stress_t;
+
+static int stream_cb(wbh_device_t *dev, uint8_t group,
+                     const wbh_measurement_t *data, int count, void *ctx)
+{
+  int *samples = ctx;
+  return ++*samples >= 10;
+}
+
+/** one round of the usual diagnostic session
+    @return 0 on success, 1 on error, 2 on wrong data */
+static int round_trip(wbh_interface_t *iface)
+{
+  static const uint8_t groups[] = { 1, 2, 3 };
+  wbh_device_t *dev;
+  wbh_dtc_t *dtc;
+  wbh_measurement_t *data;
+  int samples = 0, rc = 0;
+
+  if (!(dev = wbh_connect_ms(iface, 0x01, 2000)))
+    return 1;
+  if (!(dtc = wbh_get_dtc(dev)))
+    rc = 1;
+  else if (dtc[0].error_code != 0x4052 || dtc[0].status_code != 0x23 ||
+           dtc[1].error_code != 0x0203 || dtc[2].error_code != 0)
+    rc = 2;
+  wbh_free_dtc(dtc);
+  if (!rc) {
+    if (!(data = wbh_read_measurements(dev, 1)))
+      rc = 1;
+    else if (data[0].unit != UNIT_RPM || data[0].value != 1400.0)
+      rc = 2;
+    wbh_free_measurements(data);
+  }
+  if (!rc && wbh_stream_measurements(dev, groups, 3, stream_cb, &samples) < 0)
+    rc = 1;
+  if (wbh_disconnect(dev) < 0 && !rc)
+    rc = 1;
+  return rc;
+}
+
+/** Start an emulator running the demo car and open an interface to it.
+    @param opts emulator settings, NULL for none
+    @param script extra script lines, NULL-terminated; may be NULL
+    @param emu receives the emulator handle, to be freed by the caller
+    @return interface handle or NULL on error */
+static wbh_interface_t *check_setup(const wemu_opts_t *opts, const char **script,
+                                    wemu_t **emu)
+{
+  wbh_interface_t *iface;
+  const char *tty;
+
+  if (!(*emu = wemu_new(opts)))
+    return NULL;
+  wemu_load_default(*emu);
+  for (; script && *script; script++) {
+    if (wemu_parse_line(*emu, *script) < 0)
+      goto fail;
+  }
+  if (!(tty = wemu_open_pty(*emu)) || wemu_start(*emu) < 0 || !(iface = wbh_init(tty)))
+    goto fail;
+  return iface;
+
+fail:
+  wemu_free(*emu);
+  *emu = NULL;
+  return NULL;
+}
+
+/** Report the outcome of a check.
+    @return non-zero if it failed */
+static int check_report(const char *name, int failed, const char *details)
+{
+  printf("check %s: %s (%s)\n", name, failed ? "FAILED" : "ok", details);
+  return failed;
+}
+
+/** The ECU stops answering below BDT 0A, IBT 01; tuning down from 20/05
+    must find exactly that, having run into timeouts on the way. */
+static int check_tune(void)
+{
+  static const char *script[] = { "timing 01 0A 01", "bdt 20", "ibt 05", NULL };
+  wbh_tune_opts_t opts = { .samples = 2 };
+  wbh_tune_result_t result;
+  wbh_measurement_t data[WBH_MAX_MEASUREMENTS];
+  wbh_interface_t *iface;
+  wbh_device_t *dev;
+  wemu_t *emu;
+  char details[128];
+  int rc, failed;
+
+  if (!(iface = check_setup(NULL, script, &emu)))
+    return check_report("tune", 1, "cannot set up adapter");
+  if (!(dev = wbh_connect_ms(iface, 0x01, 2000))) {
+    wbh_shutdown(iface);
+    wemu_free(emu);
+    return check_report("tune", 1, "cannot connect");
+  }
+  rc = wbh_autotune(dev, &opts, &result);
+  failed = rc < 0 || result.bdt != 0x0a || result.ibt != 0x01 || !result.errors ||
+           wbh_get_bdt(iface) != 0x0a || wbh_get_ibt(iface) != 0x01 ||
+           wbh_read_measurements_into(dev, 1, data, WBH_MAX_MEASUREMENTS) <= 0;
+  snprintf(details, sizeof(details), "rc %d, BDT %02X IBT %02X from %02X/%02X, %d of %d reads lost",
+           rc, result.bdt, result.ibt, result.initial_bdt, result.initial_ibt,
+           result.errors, result.reads);
+  wbh_disconnect(dev);
+  wbh_shutdown(iface);
+  wemu_free(emu);
+  return check_report("tune", failed, details);
+}
+
+static double check_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/** Stop a run after a while. */
+static int sched_sample(wbh_device_t *dev, uint8_t group, const wbh_measurement_t *data,
+                        int count, void *ctx)
+{
+  return check_now() >= *(double *)ctx;
+}
+
+/** A fast and a slow group on a line with room for both must each get
+    their rate, within a sample at either end of the run, and hardly ever
+    be late (a busy host may hold things up now and then); the rates must
+    not drop once the run is over. */
+static int check_sched(void)
+{
+  static const struct { uint8_t group; double rate; } groups[] = { { 1, 40 }, { 2, 4 } };
+  wemu_opts_t opts = { .response_latency_ms = 5 };
+  wbh_sched_stats_t stats[2], after[2];
+  wbh_interface_t *iface;
+  wbh_device_t *dev;
+  wbh_sched_t *sched;
+  wemu_t *emu;
+  char details[256];
+  double start, deadline, elapsed;
+  int i, rc, failed = 0, len = 0;
+
+  if (!(iface = check_setup(&opts, NULL, &emu)))
+    return check_report("sched", 1, "cannot set up adapter");
+  if (!(dev = wbh_connect_ms(iface, 0x01, 2000)) || !(sched = wbh_sched_new(dev))) {
+    wbh_shutdown(iface);
+    wemu_free(emu);
+    return check_report("sched", 1, "cannot connect");
+  }
+  for (i = 0; i < 2; i++)
+    wbh_sched_add(sched, groups[i].group, groups[i].rate, 1);
+
+  start = check_now();
+  deadline = start + 2;
+  rc = wbh_sched_run(sched, sched_sample, &deadline);
+  elapsed = check_now() - start;
+  wbh_sched_get_stats(sched, stats, 2);
+  usleep(300000);
+  wbh_sched_get_stats(sched, after, 2);
+
+  failed = rc <= 0;
+  for (i = 0; i < 2; i++) {
+    /* one sample more or less than the run had room for */
+    double slack = 1.5 / elapsed;
+    failed |= stats[i].achieved_hz < groups[i].rate - slack ||
+              stats[i].achieved_hz > groups[i].rate + slack ||
+              stats[i].late > stats[i].samples / 20 ||
+              after[i].achieved_hz != stats[i].achieved_hz;
+    len += snprintf(details + len, sizeof(details) - len, "%sgroup %d %.2f/%.0f Hz, %lu late",
+                    i ? ", " : "", stats[i].group, stats[i].achieved_hz, groups[i].rate,
+                    stats[i].late);
+  }
+  if (after[0].achieved_hz != stats[0].achieved_hz)
+    snprintf(details + len, sizeof(details) - len, ", %.2f Hz after the run",
+             after[0].achieved_hz);
+  wbh_sched_free(sched);
+  wbh_disconnect(dev);
+  wbh_shutdown(iface);
+  wemu_free(emu);
+  return check_report("sched", failed, details);
+}
+
+/** clients reading the same group through wbhd at the same time */
+#define WBHD_CLIENTS 4
+/** times they do so */
+#define WBHD_ROUNDS 3
+
+/** state of the wbhd check */
+typedef struct {
+  const char *path;		/**< daemon socket */
+  pthread_barrier_t start;	/**< lines the clients up for each round */
+  int rc[WBHD_CLIENTS][WBHD_ROUNDS];
+  wbh_measurement_t data[WBHD_CLIENTS][WBHD_ROUNDS][WBH_MAX_MEASUREMENTS];
+} wbhd_check_t;
+
+typedef struct {
+  wbhd_check_t *check;
+  int idx;
+} wbhd_client_t;
+
+static void *wbhd_client(void *arg)
+{
+  wbhd_client_t *c = arg;
+  wbhd_check_t *w = c->check;
+  wbh_client_t *client = wbh_client_open(w->path);
+  int r;
+
+  for (r = 0; r < WBHD_ROUNDS; r++) {
+    pthread_barrier_wait(&w->start);
+    w->rc[c->idx][r] = client ?
+      wbh_client_read_measurements_into(client, 0, 0x01, 1, w->data[c->idx][r],
+                                        WBH_MAX_MEASUREMENTS) : -ERR_INVAL;
+  }
+  wbh_client_close(client);
+  return NULL;
+}
+
+/** Start wbhd, from next to this program, on an adapter.
+    @return process ID or -1 */
+static pid_t wbhd_spawn(const char *prog, const char *path, const char *tty)
+{
+  char daemon[4096];
+  const char *slash = strrchr(prog, '/');
+  pid_t pid;
+
+  snprintf(daemon, sizeof(daemon), "%.*swbhd", slash ? (int)(slash - prog + 1) : 0, prog);
+  if ((pid = fork()) == 0) {
+    execl(daemon, daemon, "-s", path, tty, (char *)NULL);
+    _exit(127);
+  }
+  return pid;
+}
+
+/** Clients that ask wbhd for the same group at the same time must share
+    one exchange, and all get its reply.  The emulator moves the values on
+    every read and takes its time answering, so a client served by an
+    exchange of its own would see different values. */
+static int check_wbhd(const char *prog)
+{
+  wemu_opts_t opts = { .response_latency_ms = 100, .jitter_rate = 1 };
+  pthread_t threads[WBHD_CLIENTS];
+  wbhd_client_t clients[WBHD_CLIENTS];
+  wbhd_check_t *w = calloc(1, sizeof(wbhd_check_t));
+  wbhd_stats_t stats = { 0 };
+  wbh_client_t *client = NULL;
+  char path[64], details[128];
+  const char *tty;
+  wemu_t *emu;
+  pid_t pid = -1;
+  int i, r, tries, failed = 0;
+
+  snprintf(path, sizeof(path), "/tmp/wstress-%d.sock", (int)getpid());
+  w->path = path;
+  if (!(emu = wemu_new(&opts)))
+    return check_report("wbhd", 1, "cannot set up adapter");
+  wemu_load_default(emu);
+  if (!(tty = wemu_open_pty(emu)) || wemu_start(emu) < 0 ||
+      (pid = wbhd_spawn(prog, path, tty)) < 0) {
+    wemu_free(emu);
+    free(w);
+    return check_report("wbhd", 1, "cannot start wbhd");
+  }
+  for (tries = 0; tries < 100 && !(client = wbh_client_open(path)); tries++)
+    usleep(50000);
+
+  if (client) {
+    pthread_barrier_init(&w->start, NULL, WBHD_CLIENTS);
+    for (i = 0; i < WBHD_CLIENTS; i++) {
+      clients[i].check = w;
+      clients[i].idx = i;
+      pthread_create(&threads[i], NULL, wbhd_client, &clients[i]);
+    }
+    for (i = 0; i < WBHD_CLIENTS; i++)
+      pthread_join(threads[i], NULL);
+    pthread_barrier_destroy(&w->start);
+    failed = wbh_client_get_stats(client, 0, &stats) < 0 || !stats.coalesced;
+    for (i = 0; i < WBHD_CLIENTS; i++) {
+      for (r = 0; r < WBHD_ROUNDS; r++) {
+        failed |= w->rc[i][r] <= 0 || w->rc[i][r] != w->rc[0][r] ||
+                  memcmp(w->data[i][r], w->data[0][r], w->rc[0][r] * sizeof(wbh_measurement_t));
+      }
+    }
+    snprintf(details, sizeof(details), "%d clients, %d rounds: %llu requests, %llu coalesced, %llu operations",
+             WBHD_CLIENTS, WBHD_ROUNDS, (unsigned long long)stats.requests,
+             (unsigned long long)stats.coalesced, (unsigned long long)stats.operations);
+    wbh_client_close(client);
+  }
+  else
+    failed = snprintf(details, sizeof(details), "cannot connect to wbhd");
+
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+  wemu_free(emu);
+  free(w);
+  return check_report("wbhd", failed, details);
+}
+
+/** Read exactly len bytes from a socket.
+    @return zero or -1 on error or end of file */
+static int wbhd_read(int fd, void *buf, size_t len)
+{
+  ssize_t rc;
+  while (len) {
+    if ((rc = read(fd, buf, len)) <= 0)
+      return -1;
+    buf = (char *)buf + rc;
+    len -= rc;
+  }
+  return 0;
+}
+
+/** A read that a client pipelines behind a write must see what the write
+    did, even if the same read is already queued ahead of the write.  A
+    slow group read holds the adapter while the rest queue up behind it. */
+static int check_wbhd_order(const char *prog)
+{
+  static const struct { uint8_t type, device, arg; const char *cmd; } reqs[] = {
+    { WBHD_MEASUREMENTS, 0x01, 1 },
+    { WBHD_GET_BDT },
+    { WBHD_DTC, 0x01 },
+    { WBHD_SET_BDT, 0, 0x20 },
+    { WBHD_COMMAND, 0x01, 0, "05" },
+    { WBHD_GET_BDT },		/* must not join the first GET_BDT */
+    { WBHD_DTC, 0x01 },		/* must not join the first DTC */
+  };
+#define WBHD_REQS (sizeof(reqs) / sizeof(reqs[0]))
+  wemu_opts_t opts = { .response_latency_ms = 100 };
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  uint8_t buf[WBHD_REQS * (sizeof(wbhd_msg_t) + 2)], payload[WBHD_MAX_PAYLOAD];
+  int status[WBHD_REQS], len[WBHD_REQS];
+  char path[64], details[128];
+  wbhd_msg_t msg;
+  const char *tty;
+  wemu_t *emu;
+  size_t used = 0;
+  pid_t pid = -1;
+  int i, fd = -1, tries, failed = 0;
+
+  snprintf(path, sizeof(path), "/tmp/wstress-order-%d.sock", (int)getpid());
+  strcpy(addr.sun_path, path);
+  if (!(emu = wemu_new(&opts)))
+    return check_report("wbhd order", 1, "cannot set up adapter");
+  wemu_load_default(emu);
+  if (!(tty = wemu_open_pty(emu)) || wemu_start(emu) < 0 ||
+      (pid = wbhd_spawn(prog, path, tty)) < 0) {
+    wemu_free(emu);
+    return check_report("wbhd order", 1, "cannot start wbhd");
+  }
+  for (tries = 0; tries < 100; tries++) {
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0 &&
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+      break;
+    if (fd >= 0)
+      close(fd);
+    fd = -1;
+    usleep(50000);
+  }
+
+  /* all in one go, so that they are queued before the first is done */
+  for (i = 0; i < WBHD_REQS; i++) {
+    memset(&msg, 0, sizeof(msg));
+    msg.len = reqs[i].cmd ? strlen(reqs[i].cmd) : 0;
+    msg.id = i;
+    msg.type = reqs[i].type;
+    msg.device = reqs[i].device;
+    msg.arg = reqs[i].arg;
+    memcpy(buf + used, &msg, sizeof(msg));
+    memcpy(buf + used + sizeof(msg), reqs[i].cmd, msg.len);
+    used += sizeof(msg) + msg.len;
+    status[i] = len[i] = -1;
+  }
+  if (fd < 0 || write(fd, buf, used) != used)
+    failed = snprintf(details, sizeof(details), "cannot talk to wbhd");
+  for (i = 0; !failed && i < WBHD_REQS; i++) {
+    if (wbhd_read(fd, &msg, sizeof(msg)) < 0 || msg.len > WBHD_MAX_PAYLOAD ||
+        msg.id >= WBHD_REQS || wbhd_read(fd, payload, msg.len) < 0)
+      failed = snprintf(details, sizeof(details), "connection to wbhd lost");
+    else {
+      status[msg.id] = msg.status;
+      len[msg.id] = msg.len;
+    }
+  }
+  if (!failed) {
+    for (i = 0; i < WBHD_REQS; i++)
+      failed |= status[i] < 0;
+    failed |= status[1] != 0x0a || status[5] != 0x20 || len[2] != 6 || len[6] != 0;
+    snprintf(details, sizeof(details), "BDT %02X then %02X, %d then %d DTCs",
+             status[1], status[5], len[2] / 3, len[6] / 3);
+  }
+
+  if (fd >= 0)
+    close(fd);
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+  wemu_free(emu);
+  return check_report("wbhd order", failed, details);
+#undef WBHD_REQS
+}
+
+/** Asking for the open controller again must reuse its session, asking
+    for another one must switch; a session that has gone quiet must be
+    checked before it is handed out, and redialed if the adapter has
+    dropped it meanwhile. */
+static int check_pool(void)
+{
+  static const struct { uint8_t device; int idle_ms; int drop; } steps[] = {
+    { 0x01, 0, 0 },		/* connect */
+    { 0x01, 0, 0 },		/* reuse */
+    { 0x17, 0, 0 },		/* switch, connect */
+    { 0x01, 0, 0 },		/* switch, connect */
+    { 0x01, 300, 0 },		/* keep-alive, reuse */
+    { 0x01, 300, 1 },		/* keep-alive, lost, connect */
+  };
+  wbh_measurement_t data[WBH_MAX_MEASUREMENTS];
+  wbh_pool_stats_t stats;
+  wbh_interface_t *iface;
+  wbh_device_t *dev = NULL;
+  wbh_pool_t *pool;
+  wemu_t *emu;
+  char details[128];
+  int i, failed = 0;
+
+  if (!(iface = check_setup(NULL, NULL, &emu)))
+    return check_report("pool", 1, "cannot set up adapter");
+  if (!(pool = wbh_pool_new(iface, 200))) {
+    wbh_shutdown(iface);
+    wemu_free(emu);
+    return check_report("pool", 1, "cannot create pool");
+  }
+  for (i = 0; i < sizeof(steps) / sizeof(steps[0]) && !failed; i++) {
+    /* the reset ends the session behind the pool's back */
+    if (steps[i].drop && wbh_reset(iface) < 0)
+      failed = 1;
+    usleep(steps[i].idle_ms * 1000);
+    if (!(dev = wbh_pool_get(pool, steps[i].device, 2000)) ||
+        wbh_read_measurements_into(dev, 1, data, WBH_MAX_MEASUREMENTS) <= 0)
+      failed = 1;
+  }
+  wbh_pool_get_stats(pool, &stats);
+  failed |= stats.connects != 4 || stats.reused != 2 || stats.switches != 2 ||
+            stats.keepalives != 2 || stats.lost != 1;
+  snprintf(details, sizeof(details), "%d gets: %lu connects, %lu reused, %lu switches, %lu keep-alives, %lu lost",
+           i, stats.connects, stats.reused, stats.switches, stats.keepalives, stats.lost);
+  wbh_pool_free(pool);
+  wbh_shutdown(iface);
+  wemu_free(emu);
+  return check_report("pool", failed, details);
+}
+
+static void stress_job(wbh_interface_t *iface, int idx, void *ctx)
+{
+  stress_t *s = ctx;
+  stats_t *st = &s->stats[idx];
+  int i, rc;
+
+  for (i = 0; i < s->iterations; i++) {
+    wbh_iface_clear_error(iface);
+    rc = round_trip(iface);
+    if (rc == 0) {
+      st->iterations++;
+      continue;
+    }
+    if (rc == 2 && !st->faulty)
+      st->wrong++;
+    if (rc == 1) {
+      st->errors++;
+      if (!wbh_iface_error(iface) || wbh_get_error_iface() != iface)
+        st->misattributed++;
+    }
+    /* get back into a known state after a garbled exchange */
+    wbh_reset(iface);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int adapters = ADAPTERS, iterations = ITERATIONS;
+  wbh_interface_t *ifaces[256];
+  wemu_t *emus[256];
+  stats_t stats[256];
+  stress_t s = { stats };
+  int i, c, failed = 0, metrics = 0;
+
+  while ((c = getopt(argc, argv, "n:i:m")) != -1) {
+    switch (c) {
+      case 'n': adapters = atoi(optarg); break;
+      case 'i': iterations = atoi(optarg); break;
+      case 'm': metrics = 1; break;
+      default:
+        fprintf(stderr, "usage: %s [-n adapters] [-i iterations] [-m]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (adapters < 1 || adapters > 256) {
+    fprintf(stderr, "%s: 1 to 256 adapters, please\n", argv[0]);
+    return 1;
+  }
+  s.iterations = iterations;
+  memset(stats, 0, sizeof(stats));
+
+  INFO("starting %d emulated adapters", adapters);
+  for (i = 0; i < adapters; i++) {
+    wemu_opts_t opts = { .seed = i + 1 };
+    const char *tty;
+    stats[i].faulty = i & 1;
+    if (stats[i].faulty)
+      opts.garbage_rate = 0.002;
+    emus[i] = wemu_new(&opts);
+    wemu_load_default(emus[i]);
+    if (!(tty = wemu_open_pty(emus[i])) || wemu_start(emus[i]) < 0 ||
+        !(ifaces[i] = wbh_init(tty))) {
+      fprintf(stderr, "%s: cannot set up adapter %d: %s\n", argv[0], i,
+              wbh_get_error() ? wbh_get_error() : "emulator failed");
+      return 1;
+    }
+  }
+
+  INFO("running %d rounds on each adapter", iterations);
+  wbh_group_t *group = wbh_group_new(ifaces, adapters, 0);
+  if (!group)
+    return 1;
+  wbh_group_run(group, stress_job, &s);
+  wbh_group_free(group);
+
+  if (metrics) {
+    size_t len = wbh_metrics_export(ifaces, adapters, NULL, 0);
+    char *text = malloc(len + 1);
+    if (text) {
+      wbh_metrics_export(ifaces, adapters, text, len + 1);
+      fputs(text, stdout);
+      free(text);
+    }
+  }
+
+  for (i = 0; i < adapters; i++) {
+    printf("adapter %2d%s: %d ok, %d errors, %d misattributed, %d wrong\n", i,
+           stats[i].faulty ? " (faulty)" : "", stats[i].iterations,
+           stats[i].errors, stats[i].misattributed, stats[i].wrong);
+    if (stats[i].misattributed || stats[i].wrong ||
+        (!stats[i].faulty && stats[i].errors))
+      failed++;
+    wbh_shutdown(ifaces[i]);
+    wemu_free(emus[i]);
+  }
+
+  failed += check_tune();
+  failed += check_sched();
+  failed += check_wbhd(argv[0]);
+  failed += check_wbhd_order(argv[0]);
+  failed += check_pool();
+  printf("%s\n", failed ? "FAILED" : "PASSED");
+  return failed ? 2 : 0;
+}
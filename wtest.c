@@ -19,9 +19,10 @@ int main(int argc, char **argv)
   wbh_device_t *dev;
   char buf[255];
   
-  INFO("connecting to %s", DEVICE);
-  iface = wbh_init(DEVICE);
-  //iface = wbh_init("./pipe");
+  /* pass the pty name printed by wemu to run against the emulator */
+  const char *device = argc > 1 ? argv[1] : DEVICE;
+  INFO("connecting to %s", device);
+  iface = wbh_init(device);
   if (!iface) {
     PRINT_ERROR
     return 1;
@@ -62,6 +63,7 @@ int main(int argc, char **argv)
     for (i = 0; data[i].unit != UNIT_ENDOFLIST; i++) {
       printf("value %d: %f %s [raw %02X/%02X/%02X]\n", i, data[i].value, wbh_unit_name(data[i].unit), data[i].raw[0], data[i].raw[1], data[i].raw[2]);
     }
+    wbh_free_measurements(data);
   }
   else {
     PRINT_ERROR
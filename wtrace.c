@@ -0,0 +1,83 @@
+#include "wbh.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* Prints a trace written by wbh_capture_start(), one record per line:
+   time since the first record, direction, length and data.  Printable
+   characters are shown as they are, everything else escaped; with -x,
+   the data is shown in hex. */
+
+#define INFO(x, y...) fprintf(stderr, "INFO " x "\n", y)
+
+static void print_text(const uint8_t *data, size_t len)
+{
+  size_t i;
+  for (i = 0; i < len; i++) {
+    switch (data[i]) {
+      case '\r': fputs("\\r", stdout); break;
+      case '\n': fputs("\\n", stdout); break;
+      case '\\': fputs("\\\\", stdout); break;
+      default:
+        if (data[i] >= 0x20 && data[i] < 0x7f)
+          putchar(data[i]);
+        else
+          printf("\\x%02x", data[i]);
+    }
+  }
+}
+
+static void print_hex(const uint8_t *data, size_t len)
+{
+  size_t i;
+  for (i = 0; i < len; i++)
+    printf("%s%02x", i ? " " : "", data[i]);
+}
+
+int main(int argc, char **argv)
+{
+  wbh_trace_t *trace;
+  wbh_trace_record_t rec;
+  uint64_t start = 0;
+  unsigned long records = 0, bytes[2] = { 0, 0 };
+  int hex = 0, c, rc;
+
+  while ((c = getopt(argc, argv, "x")) != -1) {
+    switch (c) {
+      case 'x': hex = 1; break;
+      default:
+        goto usage;
+    }
+  }
+  if (optind != argc - 1)
+    goto usage;
+
+  if (!(trace = wbh_trace_open(argv[optind]))) {
+    fprintf(stderr, "%s: %s: %s\n", argv[0], argv[optind], wbh_get_error());
+    return 1;
+  }
+  while ((rc = wbh_trace_next(trace, &rec)) > 0) {
+    if (!records++)
+      start = rec.timestamp_ns;
+    printf("%12.6f %s %4zu ", (rec.timestamp_ns - start) * 1e-9,
+           rec.direction == WBH_TRACE_TX ? "TX" : "RX", rec.len);
+    if (hex)
+      print_hex(rec.data, rec.len);
+    else
+      print_text(rec.data, rec.len);
+    putchar('\n');
+    bytes[rec.direction] += rec.len;
+  }
+  wbh_trace_close(trace);
+  if (rc < 0) {
+    fprintf(stderr, "%s: %s: %s\n", argv[0], argv[optind], wbh_get_error());
+    return 1;
+  }
+  INFO("%lu records, %lu bytes sent, %lu bytes received", records,
+       bytes[WBH_TRACE_TX], bytes[WBH_TRACE_RX]);
+  return 0;
+
+usage:
+  fprintf(stderr, "usage: %s [-x] trace-file\n", argv[0]);
+  return 1;
+}